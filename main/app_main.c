@@ -7,6 +7,7 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +16,9 @@
 #include "esp_log.h"
 #include "esp_peripherals.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
@@ -35,6 +38,7 @@
 #include "http_stream.h"
 #include "i2s_stream.h"
 #include "raw_stream.h"
+#include "ringbuf.h"
 #include "spiffs_stream.h"
 
 #include "mp3_decoder.h"
@@ -53,8 +57,26 @@
 #include "periph_wifi.h"
 #include "recorder_engine.h"
 
+#include "m_assets.h"
+#include "m_ctrl.h"
+#include "m_decode_bench.h"
+#include "m_dlog.h"
 #include "m_includes.h"
+#include "m_metrics.h"
+#include "m_mixer.h"
+#include "m_mp3_index.h"
+#include "m_nsagc.h"
+#include "m_ota.h"
+#include "m_power.h"
+#include "m_profile.h"
+#include "m_reply_cache.h"
+#include "m_session_rec.h"
 #include "m_smartconfig.h"
+#include "m_sync.h"
+#include "m_sync_play.h"
+#include "m_tasks.h"
+#include "m_tls.h"
+#include "m_wake_eval.h"
 
 static const char* TAG = "< app >";
 
@@ -72,11 +94,104 @@ static audio_element_handle_t i2s_stream_writer_play, mp3_decoder_play,
     spiffs_stream_reader_play;
 static audio_element_handle_t fatfs_stream_reader_sdcard,
     i2s_stream_writer_sdcard, mp3_decoder_sdcard;
+// Microphone noise suppression and AGC, NULL unless CONFIG_NSAGC_ENABLE
+static audio_element_handle_t nsagc_asr, nsagc_rec;
+// Output resamplers, NULL unless CONFIG_AUDIO_FIXED_OUTPUT_RATE
+static audio_element_handle_t filter_http_mp3, filter_play, filter_sdcard;
+// Group playback stage of the reply pipeline, NULL unless CONFIG_SYNC_ENABLE
+static audio_element_handle_t sync_http_mp3;
+
+#if CONFIG_AUDIO_MIXER_ENABLE
+// All play pipelines end at their decoder and share one i2s_stream writer
+static audio_pipeline_handle_t pipeline_mix;
+static audio_element_handle_t mixer_mix, i2s_stream_writer_mix;
+// Element whose stop event ends a playback task
+#define PLAY_SINK(i2s, mp3) (mp3)
+#else
+#define PLAY_SINK(i2s, mp3) (i2s)
+#endif
+
+// Buffering profile each mode is built with
+static const audio_profile_id_t play_profile[] = {
+    [OUTPUT_STREAM_HTTP] = AUDIO_PROFILE_STREAMING,
+    [OUTPUT_STREAM_SPIFFS] = AUDIO_PROFILE_LOW_LATENCY,
+    [OUTPUT_STREAM_SDCARD] = AUDIO_PROFILE_STREAMING,
+};
+static const audio_profile_id_t rec_profile[] = {
+    [INPUT_STREAM_REC] = AUDIO_PROFILE_STREAMING,
+    [INPUT_STREAM_ASR] = AUDIO_PROFILE_LOW_LATENCY,
+};
+// Decode and upload run at full speed, wake-word listening is scaled by load.
+// CHOOSE_STREAM_IDLE is never entered.
+static const power_mode_t state_power_mode[] = {
+    [CHOOSE_STREAM_SDCAED] = POWER_MODE_BOOST,
+    [CHOOSE_STREAM_ASR] = POWER_MODE_LISTEN,
+    [CHOOSE_STREAM_REC] = POWER_MODE_BOOST,
+    [CHOOSE_STREAM_PLAY] = POWER_MODE_BOOST,
+    [CHOOSE_STREAM_HTTP_PLAY] = POWER_MODE_BOOST,
+};
+static int64_t asr_chunk_us;
+static char reply_url[sizeof(SERVER_URL_REPLY) + REPLY_ID_MAX] =
+    SERVER_URL_PLAY_MP3;
+static const char* play_pipeline_name[] = {
+    [OUTPUT_STREAM_HTTP] = "http_mp3",
+    [OUTPUT_STREAM_SPIFFS] = "prompt",
+    [OUTPUT_STREAM_SDCARD] = "sdcard",
+};
+#if CONFIG_CTRL_ENABLE
+// Playback pushed by the server, started once the device listens again
+typedef struct {
+    char url[sizeof(reply_url)];
+    int64_t start_us; /* On the shared timeline, 0 plays at once */
+    uint16_t group;
+} ctrl_play_t;
+static QueueHandle_t ctrl_play_queue;
+static ctrl_status_t _ctrl_event_handle(const ctrl_msg_t* msg);
+// Given when the server has the final result of the upload in progress
+static SemaphoreHandle_t rec_final;
+#endif
+// Longest recording uploaded after a wake
+#define REC_WINDOW_MS 3000
+// Upload response buffer, one byte is kept for the terminator
+#define UPLOAD_RESPONSE_MAX 2048
+#if CONFIG_SYNC_ENABLE
+// Group the next reply plays in, armed by HTTPMp3_Task
+static int64_t sync_start_us;
+static uint16_t sync_group;
+#endif
+#if CONFIG_SD_RESUME_ENABLE
+// Played again on resume, the decoded audio in flight at a stop is lost
+#define SD_RESUME_BACKUP_MS 2000
+// Position saved while playing, for a reboot or a pulled card
+#define SD_RESUME_SAVE_MS 30000
+#define SD_LISTEN_TICKS (1000 / portTICK_RATE_MS)
+// SD playback was interrupted, back to it after the reply
+static bool sd_resume;
+static int64_t sd_saved_us;
+// The Mode button was held for Airkiss, its release is no interruption
+static bool sd_long_press;
+#if CONFIG_AUDIO_MIXER_ENABLE
+// The interrupted music still plays under the wake prompt
+static bool sd_ducked;
+#endif
+#else
+#define SD_LISTEN_TICKS portMAX_DELAY
+#endif
+static const char* rec_pipeline_name[] = {
+    [INPUT_STREAM_REC] = "rec",
+    [INPUT_STREAM_ASR] = "asr",
+};
 
 static input_stream_t input_type_flag;
 static output_stream_t output_type_flag;
 static choose_stream_t choose_type_flag;
 
+#if CONFIG_WAKENET_DET_MODE_95
+#define WAKENET_DET_MODE DET_MODE_95
+#else
+#define WAKENET_DET_MODE DET_MODE_90
+#endif
+
 esp_wn_iface_t* wakenet;
 model_coeff_getter_t* model_coeff_getter;
 model_iface_data_t* model_data;
@@ -93,11 +208,26 @@ void app_main(void) {
 
     esp_log_level_set("*", ESP_LOG_WARN);
     esp_log_level_set(TAG, ESP_LOG_INFO);
+    esp_log_level_set("profile", ESP_LOG_INFO);
+    esp_log_level_set("power", ESP_LOG_INFO);
+    esp_log_level_set("tasks", ESP_LOG_INFO);
+    esp_log_level_set("metrics", ESP_LOG_INFO);
+    dlog_start();
+#if CONFIG_DLOG_BENCHMARK
+    esp_log_level_set("dlog", ESP_LOG_INFO);
+    dlog_benchmark();
+#endif
+#if CONFIG_TASK_STATS_ENABLE
+    task_stats_start(CONFIG_TASK_STATS_PERIOD_MS);
+#endif
+#if CONFIG_AUDIO_MIXER_ENABLE
+    esp_log_level_set("mixer", ESP_LOG_INFO);
+#endif
 
     ESP_LOGI(TAG, "[ 1 ] Create asr model");
     get_wakenet_iface(&wakenet);
     get_wakenet_coeff(&model_coeff_getter);
-    model_data = wakenet->create(model_coeff_getter, DET_MODE_90);
+    model_data = wakenet->create(model_coeff_getter, WAKENET_DET_MODE);
     int num = wakenet->get_word_num(model_data);
     for (int i = 1; i <= num; i++) {
         char* name = wakenet->get_word_name(model_data, i);
@@ -111,6 +241,7 @@ void app_main(void) {
              "%d, sizeof_uint16 = %d",
              num, threshold, sample_rate, audio_chunksize, sizeof(int16_t));
     int16_t* buff = (int16_t*)malloc(audio_chunksize * sizeof(short));
+    asr_chunk_us = (int64_t)audio_chunksize * 1000000 / sample_rate;
     if (NULL == buff) {
         ESP_LOGE(TAG, "Memory allocation failed!");
         wakenet->destroy(model_data);
@@ -134,7 +265,11 @@ void app_main(void) {
     ESP_LOGI(TAG, "[ wifi ] wait Airkiss");
     Wifi_Init_Airkiss();
     ESP_LOGI(TAG, "[ wifi ] Airkiss  SUCCESS ");
+#if CONFIG_METRICS_ENABLE
+    metrics_start(CONFIG_METRICS_PORT);
+#endif
 
+#if CONFIG_PROMPT_SOURCE_SPIFFS
     // Initialize Spiffs peripheral
     periph_spiffs_cfg_t spiffs_cfg = {.root = "/spiffs",
                                       .partition_label = NULL,
@@ -147,9 +282,43 @@ void app_main(void) {
     while (!periph_spiffs_is_mounted(spiffs_handle)) {
         vTaskDelay(500 / portTICK_PERIOD_MS);
     }
+#else
+    ESP_LOGI(TAG, "[ 2.3 ] Map prompt asset pack");
+    if (assets_init(NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Flash tools/adf_assets.bin to the storage partition");
+    }
+#endif
+#if CONFIG_ASSETS_BENCHMARK
+    esp_log_level_set("assets", ESP_LOG_INFO);
+    // The pack next to the SPIFFS image, both timed in this run
+    assets_init("assets");
+    assets_benchmark();
+#endif
 
     ESP_LOGI(TAG, "[ 2.3 ] Start SDCard peripheral");
     audio_board_sdcard_init(set);
+#if CONFIG_REPLY_CACHE_ENABLE
+    esp_log_level_set("reply_cache", ESP_LOG_INFO);
+    reply_cache_init("/sdcard/REPLY", CONFIG_REPLY_CACHE_ENTRIES,
+                     CONFIG_REPLY_CACHE_SIZE_KB * 1024);
+#endif
+#if CONFIG_SESSION_REC_ENABLE
+    esp_log_level_set("session_rec", ESP_LOG_INFO);
+    session_rec_cfg_t rec_cfg = SESSION_REC_CFG_DEFAULT();
+    rec_cfg.block_size = CONFIG_SESSION_REC_BLOCK_KB * 1024;
+    rec_cfg.block_num = CONFIG_SESSION_REC_BLOCKS;
+    rec_cfg.file_size = CONFIG_SESSION_REC_FILE_KB * 1024;
+    rec_cfg.file_num = CONFIG_SESSION_REC_FILES;
+    session_rec_start("/sdcard/SESSION", &rec_cfg);
+#endif
+#if CONFIG_WAKE_EVAL_ENABLE
+    esp_log_level_set("wake_eval", ESP_LOG_INFO);
+    wake_eval_run(wakenet, model_coeff_getter, "/sdcard/WAKEEVAL");
+#endif
+#if CONFIG_DECODE_BENCH_ENABLE
+    esp_log_level_set("decode_bench", ESP_LOG_INFO);
+    decode_bench_run("/sdcard/BENCH", CONFIG_DECODE_BENCH_REPEAT);
+#endif
 
     ESP_LOGI(TAG, "[ 3 ] Start codec chip");
     audio_board_handle_t board_handle = audio_board_init();
@@ -157,6 +326,9 @@ void app_main(void) {
                          AUDIO_HAL_CTRL_START);
 
     ESP_LOGI(TAG, "[ 4 ] Create pipeline for play");
+#if CONFIG_AUDIO_MIXER_ENABLE
+    pipeline_mix = create_mix_pipeline();
+#endif
     pipeline_http_mp3 = create_play_pipeline(OUTPUT_STREAM_HTTP);
     pipeline_play = create_play_pipeline(OUTPUT_STREAM_SPIFFS);
     pipeline_sdcard = create_play_pipeline(OUTPUT_STREAM_SDCARD);
@@ -178,11 +350,62 @@ void app_main(void) {
 
     ESP_LOGI(TAG, "[ 8 ] Start audio_pipeline asr");
     // audio_pipeline_run(pipeline_asr);
+#if CONFIG_CTRL_ENABLE
+    ESP_LOGI(TAG, "[ 9 ] Connect the control channel");
+    esp_log_level_set("ctrl", ESP_LOG_INFO);
+    ctrl_play_queue = xQueueCreate(1, sizeof(ctrl_play_t));
+    rec_final = xSemaphoreCreateBinary();
+    ctrl_cfg_t ctrl_cfg = CTRL_CFG_DEFAULT();
+    ctrl_cfg.uri = SERVER_URL_CTRL;
+    ctrl_cfg.heartbeat_s = CONFIG_CTRL_HEARTBEAT_S;
+    ctrl_cfg.handle = _ctrl_event_handle;
+    ctrl_start(&ctrl_cfg);
+#endif
+#if CONFIG_SYNC_ENABLE
+    ESP_LOGI(TAG, "[ 10 ] Follow the group clock");
+    esp_log_level_set("sync", ESP_LOG_INFO);
+    esp_log_level_set("sync_play", ESP_LOG_INFO);
+    sync_cfg_t sync_cfg = SYNC_CFG_DEFAULT();
+    sync_cfg.host = SERVER_SYNC_HOST;
+    sync_cfg.port = SERVER_SYNC_PORT;
+    sync_cfg.period_s = CONFIG_SYNC_PERIOD_S;
+    sync_start(&sync_cfg);
+#endif
+#if CONFIG_OTA_ENABLE
+    ESP_LOGI(TAG, "[ 11 ] Check for updates in the background");
+    esp_log_level_set("ota", ESP_LOG_INFO);
+    ota_cfg_t ota_cfg = OTA_CFG_DEFAULT();
+    ota_cfg.manifest_url = SERVER_URL_OTA;
+    ota_cfg.period_s = CONFIG_OTA_PERIOD_S;
+    ota_cfg.rate_kb_s = CONFIG_OTA_RATE_KB_S;
+    ota_cfg.duty_pct = CONFIG_OTA_DUTY_PCT;
+#if !CONFIG_OTA_RESTART
+    ota_cfg.restart = false;
+#endif
+    ota_start(&ota_cfg);
+#endif
+#if CONFIG_TLS_ENABLE
+    ESP_LOGI(TAG, "[ 12 ] Start the TLS tunnel for the streams");
+    esp_log_level_set("tls", ESP_LOG_INFO);
+    tls_cfg_t tls_cfg = TLS_CFG_DEFAULT();
+    tls_cfg.host = SERVER_TLS_HOST;
+    tls_cfg.port = SERVER_TLS_PORT;
+    tls_start(&tls_cfg);
+#endif
     ESP_LOGI(
         TAG,
         "[ Start ] PLease speek Chinese the 'nihaoxiaozhi' to wake up ...");
     choose_type_flag = CHOOSE_STREAM_SDCAED;
+    power_init();
     while (1) {
+        power_enter_state(choose_type_flag,
+                          state_power_mode[choose_type_flag]);
+#if CONFIG_OTA_ENABLE
+        // Every state but listening records or plays and stops the update.
+        // While listening it writes flash between detect chunks only.
+        ota_set_audio_active(state_power_mode[choose_type_flag] !=
+                             POWER_MODE_LISTEN);
+#endif
         BUTTON_WIFI_Config(evt);
         switch (choose_type_flag) {
             case CHOOSE_STREAM_SDCAED:
@@ -233,46 +456,186 @@ void BUTTON_WIFI_Config(audio_event_iface_handle_t evt_t) {
     }
 }
 
+#if CONFIG_SD_RESUME_ENABLE
+/*
+ * Save the position of the SD playback: what the reader read less what
+ * still waits for the decoder. Read before the pipeline stops, closing the
+ * reader rewinds it.
+ */
+static void sd_resume_save(bool now) {
+    int64_t t = esp_timer_get_time();
+    if (!now && t - sd_saved_us < SD_RESUME_SAVE_MS * 1000LL) {
+        return;
+    }
+    sd_saved_us = t;
+    audio_element_info_t info = {0};
+    audio_element_getinfo(fatfs_stream_reader_sdcard, &info);
+    ringbuf_handle_t rb =
+        audio_element_get_output_ringbuf(fatfs_stream_reader_sdcard);
+    int64_t offset = info.byte_pos - (rb ? rb_bytes_filled(rb) : 0);
+    if (offset <= 0) {
+        return;
+    }
+    // Without an index yet the time is found on resume
+    uint32_t ms = 0;
+    mp3_index_locate(SERVER_URL_SDCARD, offset, &ms);
+    mp3_resume_save(SERVER_URL_SDCARD, ms, offset);
+    DLOGI(TAG, "[ sd ] Position %u ms, byte %u", ms, (uint32_t)offset);
+}
+
+// Start the reader at the indexed frame a little before the saved position
+static void sd_resume_seek(void) {
+    uint32_t ms, offset, frame_ms;
+    if (mp3_resume_load(SERVER_URL_SDCARD, &ms, &offset) != ESP_OK) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    if (ms == 0) {
+        mp3_index_locate(SERVER_URL_SDCARD, offset, &ms);
+    }
+    uint32_t target = ms > SD_RESUME_BACKUP_MS ? ms - SD_RESUME_BACKUP_MS : 0;
+    if (mp3_index_seek(SERVER_URL_SDCARD, target, &offset, &frame_ms) !=
+        ESP_OK) {
+        // No index yet, the decoder syncs to the next frame
+        frame_ms = ms;
+    }
+    audio_element_set_byte_pos(fatfs_stream_reader_sdcard, offset);
+    ESP_LOGI(TAG, "[ sd ] Resume at %u ms, byte %u, seek took %d us",
+             frame_ms, offset, (int)(esp_timer_get_time() - start));
+}
+
+#if CONFIG_AUDIO_MIXER_ENABLE
+// Stop the music left playing under the wake prompt, before the mic records
+static void sd_stop_ducked(void) {
+    if (!sd_ducked) {
+        return;
+    }
+    sd_ducked = false;
+    sd_resume_save(true);
+    stop_pipeline_element(pipeline_sdcard, fatfs_stream_reader_sdcard,
+                          mp3_decoder_sdcard, mp3_decoder_sdcard);
+    audio_profile_report(play_profile[OUTPUT_STREAM_SDCARD]);
+}
+#endif
+#endif
+
 void SDcard_Task(audio_event_iface_handle_t evt_t) {
     ESP_LOGI(TAG, "[ Task ]start task SDcard_Task.");
     audio_element_set_uri(fatfs_stream_reader_sdcard, SERVER_URL_SDCARD);
+#if CONFIG_SD_RESUME_ENABLE
+    mp3_index_prepare(SERVER_URL_SDCARD);
+    sd_resume = false;
+    sd_long_press = false;
+    sd_resume_seek();
+    sd_saved_us = esp_timer_get_time();
+#endif
+    play_output_start();
+    audio_profile_mark_start(play_profile[OUTPUT_STREAM_SDCARD]);
     audio_pipeline_run(pipeline_sdcard);
     while (1) {
         audio_event_iface_msg_t msg;
-        esp_err_t ret = audio_event_iface_listen(evt_t, &msg, portMAX_DELAY);
+        esp_err_t ret = audio_event_iface_listen(evt_t, &msg, SD_LISTEN_TICKS);
+#if CONFIG_SD_RESUME_ENABLE
+        sd_resume_save(false);
+        if (ret != ESP_OK) {
+            continue; // Listen timeout
+        }
+#endif
         if (ret != ESP_OK) {
             ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
             continue;
         }
+        audio_profile_track_event(play_profile[OUTPUT_STREAM_SDCARD], &msg);
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
             msg.source == (void*)mp3_decoder_sdcard &&
             msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
             audio_element_info_t music_info = {0};
             audio_element_getinfo(mp3_decoder_sdcard, &music_info);
 
-            ESP_LOGI(TAG,
-                     "[ * ] Receive music info from mp3 decoder, "
-                     "sample_rates=%d, bits=%d, ch=%d",
-                     music_info.sample_rates, music_info.bits,
-                     music_info.channels);
-
-            audio_element_setinfo(i2s_stream_writer_sdcard, &music_info);
-            i2s_stream_set_clk(i2s_stream_writer_sdcard,
-                               music_info.sample_rates, music_info.bits,
-                               music_info.channels);
+            DLOGI(TAG,
+                  "[ * ] Receive music info from mp3 decoder, "
+                  "sample_rates=%d, bits=%d, ch=%d",
+                  music_info.sample_rates, music_info.bits,
+                  music_info.channels);
+
+            play_output_set_info(i2s_stream_writer_sdcard, filter_sdcard,
+                                 &music_info);
+            continue;
+        }
+#if CONFIG_SD_RESUME_ENABLE
+        // A long press is Airkiss, as in BUTTON_WIFI_Config, which does not
+        // see the events while the card plays
+        if (msg.source_type == PERIPH_ID_BUTTON &&
+            msg.cmd == PERIPH_BUTTON_LONG_PRESSED &&
+            (int)msg.data == GPIO_NUM_39) {
+            ESP_LOGI(TAG, "[ sd ] long button pressed ...");
+            sd_long_press = true;
+            Break_Wifi_Connect();
+            ESP_LOGI(TAG, "[ sd ] Start Airkiss...");
+            continue;
+        }
+        // WakeNet does not run while the card plays, a click of the Mode
+        // button stands in for the wake word. The button reports
+        // LONG_RELEASE after a long press; a RELEASE that still follows
+        // one is not a click.
+        if (msg.source_type == PERIPH_ID_BUTTON &&
+            msg.cmd == PERIPH_BUTTON_RELEASE &&
+            (int)msg.data == GPIO_NUM_39 && sd_long_press) {
+            sd_long_press = false;
             continue;
         }
+        if (msg.source_type == PERIPH_ID_BUTTON &&
+            msg.cmd == PERIPH_BUTTON_LONG_RELEASE &&
+            (int)msg.data == GPIO_NUM_39) {
+            sd_long_press = false;
+            continue;
+        }
+        if (msg.source_type == PERIPH_ID_BUTTON &&
+            msg.cmd == PERIPH_BUTTON_RELEASE &&
+            (int)msg.data == GPIO_NUM_39) {
+            ESP_LOGI(TAG, "[ sd ] Interrupted, resume after the reply");
+            session_rec_event("sd_interrupt");
+            sd_resume_save(true);
+            sd_resume = true;
+#if CONFIG_AUDIO_MIXER_ENABLE
+            // The prompt ducks the music, SpiffsMp3_Task stops it after
+            sd_ducked = true;
+#else
+            stop_pipeline_element(pipeline_sdcard, fatfs_stream_reader_sdcard,
+                                  mp3_decoder_sdcard, i2s_stream_writer_sdcard);
+            audio_profile_report(play_profile[OUTPUT_STREAM_SDCARD]);
+#endif
+            set_spiffs_play_mp3_url(3);
+            play_output_start();
+            audio_profile_mark_start(play_profile[OUTPUT_STREAM_SPIFFS]);
+            audio_pipeline_run(pipeline_play);
+            choose_type_flag = CHOOSE_STREAM_PLAY;
+            break;
+        }
+#endif
 
         /* Stop when the last pipeline element (i2s_stream_writer in this case)
          * receives stop event */
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
-            msg.source == (void*)i2s_stream_writer_sdcard &&
+            msg.source == (void*)PLAY_SINK(i2s_stream_writer_sdcard,
+                                            mp3_decoder_sdcard) &&
             msg.cmd == AEL_MSG_CMD_REPORT_STATUS &&
             (((int)msg.data == AEL_STATUS_STATE_STOPPED) ||
              ((int)msg.data == AEL_STATUS_STATE_FINISHED))) {
             ESP_LOGW(TAG, "[ * ] Stop event received");
-            stop_pipeline_element(pipeline_sdcard, fatfs_stream_reader_sdcard,
-                                  mp3_decoder_sdcard, i2s_stream_writer_sdcard);
+#if CONFIG_SD_RESUME_ENABLE
+            if ((int)msg.data == AEL_STATUS_STATE_FINISHED) {
+                mp3_resume_clear(SERVER_URL_SDCARD);
+            } else {
+                sd_resume_save(true);
+            }
+#endif
+            play_output_drain(MIX_INPUT_MUSIC);
+            stop_pipeline_element(
+                pipeline_sdcard, fatfs_stream_reader_sdcard, mp3_decoder_sdcard,
+                PLAY_SINK(i2s_stream_writer_sdcard, mp3_decoder_sdcard));
+            audio_profile_report(play_profile[OUTPUT_STREAM_SDCARD]);
+            audio_profile_mark_start(rec_profile[INPUT_STREAM_ASR]);
             audio_pipeline_run(pipeline_asr);
             choose_type_flag = CHOOSE_STREAM_ASR;
             break;
@@ -281,20 +644,69 @@ void SDcard_Task(audio_event_iface_handle_t evt_t) {
 }
 
 void ASR_Task(int16_t* buff_t, int audio_size_t) {
+#if CONFIG_CTRL_ENABLE
+    ctrl_play_t ctrl_play;
+#endif
+    int64_t read_start = esp_timer_get_time();
     raw_stream_read(raw_read_asr, (char*)buff_t, audio_size_t * sizeof(short));
+    audio_profile_mark_read(rec_profile[INPUT_STREAM_ASR], asr_chunk_us,
+                            esp_timer_get_time() - read_start);
+    session_rec_write(SESSION_REC_MIC, buff_t, audio_size_t * sizeof(short));
+    audio_profile_mark_first_audio(rec_profile[INPUT_STREAM_ASR]);
+    power_work_begin();
+    int64_t start = esp_timer_get_time();
     int keyword = wakenet->detect(model_data, (int16_t*)buff_t);
+    int64_t detect_us = esp_timer_get_time() - start;
+    power_add_work(detect_us, asr_chunk_us);
+    metrics_observe(METRIC_HIST_DETECT_CHUNK_US, detect_us);
+#if CONFIG_OTA_ENABLE
+    ota_detect_done();
+#endif
     if (keyword == 1) {
         ESP_LOGI(TAG, "Wake up");
+        metrics_add(METRIC_WAKES, 1);
+        session_rec_event("wake");
         stop_pipeline_element(pipeline_asr, i2s_stream_reader_asr, raw_read_asr,
                               filter_asr);
+        audio_profile_report(rec_profile[INPUT_STREAM_ASR]);
         set_spiffs_play_mp3_url(3);
+        play_output_start();
+        audio_profile_mark_start(play_profile[OUTPUT_STREAM_SPIFFS]);
         audio_pipeline_run(pipeline_play);
         choose_type_flag = CHOOSE_STREAM_PLAY;
     }
+#if CONFIG_CTRL_ENABLE
+    // Server-initiated playback takes the path of a reply
+    else if (xQueueReceive(ctrl_play_queue, &ctrl_play, 0) == pdTRUE) {
+        snprintf(reply_url, sizeof(reply_url), "%s", ctrl_play.url);
+#if CONFIG_SYNC_ENABLE
+        sync_start_us = ctrl_play.start_us;
+        sync_group = ctrl_play.group;
+#endif
+        ESP_LOGI(TAG, "[ ctrl ] Play %s, group %d", reply_url, ctrl_play.group);
+        session_rec_event("ctrl_play %s group=%d", reply_url, ctrl_play.group);
+        stop_pipeline_element(pipeline_asr, i2s_stream_reader_asr, raw_read_asr,
+                              filter_asr);
+        audio_profile_report(rec_profile[INPUT_STREAM_ASR]);
+        choose_type_flag = CHOOSE_STREAM_HTTP_PLAY;
+    }
+#endif
 }
 void HTTPMp3_Task(audio_event_iface_handle_t evt_t) {
     ESP_LOGI(TAG, "[ Task ]start task Play_SpiffsMp3_Task.");
-    audio_element_set_uri(http_stream_reader_http_mp3, SERVER_URL_PLAY_MP3);
+    char tunnel[sizeof(reply_url) + 16];
+    const char* url = tls_url(reply_url, tunnel, sizeof(tunnel));
+    bool grouped = false;
+#if CONFIG_SYNC_ENABLE
+    grouped = sync_start_us != 0;
+    sync_play_arm(sync_http_mp3, sync_start_us, sync_group);
+    sync_start_us = 0;
+#endif
+    audio_element_set_uri(http_stream_reader_http_mp3, url);
+    session_rec_event("reply %s %s", reply_url,
+                      grouped ? "group" : "single");
+    play_output_start();
+    audio_profile_mark_start(play_profile[OUTPUT_STREAM_HTTP]);
     audio_pipeline_run(pipeline_http_mp3);
     while (1) {
         audio_event_iface_msg_t msg;
@@ -303,36 +715,54 @@ void HTTPMp3_Task(audio_event_iface_handle_t evt_t) {
             ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
             continue;
         }
+        audio_profile_track_event(play_profile[OUTPUT_STREAM_HTTP], &msg);
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
             msg.source == (void*)mp3_decoder_http_mp3 &&
             msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
             audio_element_info_t music_info = {0};
             audio_element_getinfo(mp3_decoder_http_mp3, &music_info);
 
-            ESP_LOGI(TAG,
-                     "[ * ] Receive music info from mp3 decoder, "
-                     "sample_rates=%d, bits=%d, ch=%d",
-                     music_info.sample_rates, music_info.bits,
-                     music_info.channels);
-
-            audio_element_setinfo(i2s_stream_writer_http_mp3, &music_info);
-            i2s_stream_set_clk(i2s_stream_writer_http_mp3,
-                               music_info.sample_rates, music_info.bits,
+            DLOGI(TAG,
+                  "[ * ] Receive music info from mp3 decoder, "
+                  "sample_rates=%d, bits=%d, ch=%d",
+                  music_info.sample_rates, music_info.bits,
+                  music_info.channels);
+            session_rec_event("reply_info rate=%d bits=%d ch=%d",
+                              music_info.sample_rates, music_info.bits,
+                              music_info.channels);
+
+#if CONFIG_SYNC_ENABLE
+            sync_play_set_info(sync_http_mp3, music_info.sample_rates,
                                music_info.channels);
+#endif
+            play_output_set_info(i2s_stream_writer_http_mp3, filter_http_mp3,
+                                 &music_info);
             continue;
         }
 
         /* Stop when the last pipeline element (i2s_stream_writer_http_mp3 in
          * this case) receives stop event */
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
-            msg.source == (void*)i2s_stream_writer_http_mp3 &&
+            msg.source == (void*)PLAY_SINK(i2s_stream_writer_http_mp3,
+                                            mp3_decoder_http_mp3) &&
             msg.cmd == AEL_MSG_CMD_REPORT_STATUS &&
             (((int)msg.data == AEL_STATUS_STATE_STOPPED) ||
              ((int)msg.data == AEL_STATUS_STATE_FINISHED))) {
             ESP_LOGW(TAG, "[ * ] Stop HTTPMp3_Task ...");
+            session_rec_event("reply_end");
+            play_output_drain(MIX_INPUT_REPLY);
             stop_pipeline_element(
                 pipeline_http_mp3, http_stream_reader_http_mp3,
-                mp3_decoder_http_mp3, i2s_stream_writer_http_mp3);
+                mp3_decoder_http_mp3,
+                PLAY_SINK(i2s_stream_writer_http_mp3, mp3_decoder_http_mp3));
+            audio_profile_report(play_profile[OUTPUT_STREAM_HTTP]);
+#if CONFIG_SD_RESUME_ENABLE
+            if (sd_resume) {
+                choose_type_flag = CHOOSE_STREAM_SDCAED;
+                break;
+            }
+#endif
+            audio_profile_mark_start(rec_profile[INPUT_STREAM_ASR]);
             audio_pipeline_run(pipeline_asr);
             choose_type_flag = CHOOSE_STREAM_ASR;
             break;
@@ -342,15 +772,52 @@ void HTTPMp3_Task(audio_event_iface_handle_t evt_t) {
 
 void RecHttp_Task(audio_event_iface_handle_t evt_t) {
     ESP_LOGI(TAG, "[ Task ]start task Play_SpiffsMp3_Task.");
+    // The mixer writer shares the port, it must be done writing
+    play_output_idle();
     i2s_stream_set_clk(i2s_stream_reader_rec, 16000, 16, 1);
-    audio_element_set_uri(http_stream_writer_rec, SERVER_URL_REC_HTTP);
+    char tunnel[sizeof(SERVER_URL_REC_HTTP) + 16];
+    audio_element_set_uri(
+        http_stream_writer_rec,
+        tls_url(SERVER_URL_REC_HTTP, tunnel, sizeof(tunnel)));
+    session_rec_event("upload_start");
+#if CONFIG_CTRL_ENABLE
+    // A final that arrived after its upload ended
+    xSemaphoreTake(rec_final, 0);
+#endif
     audio_pipeline_run(pipeline_rec);
     Led_Display(DISPLAY_PATTERN_TURN_ON);
-    vTaskDelay(3000 / portTICK_RATE_MS);
+#if CONFIG_CTRL_ENABLE
+    // The server may know the utterance is over before the window is
+    if (xSemaphoreTake(rec_final, REC_WINDOW_MS / portTICK_RATE_MS) ==
+        pdTRUE) {
+        ESP_LOGI(TAG, "[ ctrl ] Final result, upload ends early");
+        metrics_add(METRIC_UPLOAD_EARLY_ENDS, 1);
+        session_rec_event("upload_final");
+    }
+#else
+    vTaskDelay(REC_WINDOW_MS / portTICK_RATE_MS);
+#endif
     Led_Display(DISPLAY_PATTERN_TURN_OFF);
     stop_pipeline_element(pipeline_rec, i2s_stream_reader_rec, wav_encoder_rec,
                           http_stream_writer_rec);
     http_stream_restart(http_stream_writer_rec);
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    // Playback shares the port, put back the clock it was set to at boot
+    i2s_stream_set_clk(i2s_stream_reader_rec, CONFIG_AUDIO_OUTPUT_SAMPLE_RATE,
+                       16, 2);
+#endif
+#if CONFIG_SD_RESUME_ENABLE
+    // No reply to play: the interaction ends here and the position stays
+    // saved for the next SD playback, not for some later reply
+    if (sd_resume && choose_type_flag == CHOOSE_STREAM_REC) {
+        ESP_LOGW(TAG, "[ sd ] Upload failed, back to listening");
+        session_rec_event("sd_resume_cancel");
+        sd_resume = false;
+        audio_profile_mark_start(rec_profile[INPUT_STREAM_ASR]);
+        audio_pipeline_run(pipeline_asr);
+        choose_type_flag = CHOOSE_STREAM_ASR;
+    }
+#endif
 }
 
 void SpiffsMp3_Task(audio_event_iface_handle_t evt_t) {
@@ -362,32 +829,38 @@ void SpiffsMp3_Task(audio_event_iface_handle_t evt_t) {
             ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
             continue;
         }
+        audio_profile_track_event(play_profile[OUTPUT_STREAM_SPIFFS], &msg);
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
             msg.source == (void*)mp3_decoder_play &&
             msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
             audio_element_info_t music_info_s = {0};
             audio_element_getinfo(mp3_decoder_play, &music_info_s);
-            ESP_LOGI(TAG,
-                     "[ * ] Receive music info from mp3 decoder, "
-                     "sample_rates=%d, bits=%d, ch=%d",
-                     music_info_s.sample_rates, music_info_s.bits,
-                     music_info_s.channels);
-
-            audio_element_setinfo(i2s_stream_writer_play, &music_info_s);
-            i2s_stream_set_clk(i2s_stream_writer_play,
-                               music_info_s.sample_rates, music_info_s.bits,
-                               music_info_s.channels);
+            DLOGI(TAG,
+                  "[ * ] Receive music info from mp3 decoder, "
+                  "sample_rates=%d, bits=%d, ch=%d",
+                  music_info_s.sample_rates, music_info_s.bits,
+                  music_info_s.channels);
+
+            play_output_set_info(i2s_stream_writer_play, filter_play,
+                                 &music_info_s);
             continue;
         }
         // Stop when the last pipeline element receives stop event
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
-            msg.source == (void*)i2s_stream_writer_play &&
+            msg.source ==
+                (void*)PLAY_SINK(i2s_stream_writer_play, mp3_decoder_play) &&
             msg.cmd == AEL_MSG_CMD_REPORT_STATUS &&
             (((int)msg.data == AEL_STATUS_STATE_STOPPED) ||
              ((int)msg.data == AEL_STATUS_STATE_FINISHED))) {
             ESP_LOGW(TAG, "[ * ] Stop SpiffsMp3_Task......");
-            stop_pipeline_element(pipeline_play, spiffs_stream_reader_play,
-                                  mp3_decoder_play, i2s_stream_writer_play);
+            play_output_drain(MIX_INPUT_PROMPT);
+            stop_pipeline_element(
+                pipeline_play, spiffs_stream_reader_play, mp3_decoder_play,
+                PLAY_SINK(i2s_stream_writer_play, mp3_decoder_play));
+            audio_profile_report(play_profile[OUTPUT_STREAM_SPIFFS]);
+#if CONFIG_SD_RESUME_ENABLE && CONFIG_AUDIO_MIXER_ENABLE
+            sd_stop_ducked();
+#endif
             choose_type_flag = CHOOSE_STREAM_REC;
             break;
         }
@@ -396,10 +869,33 @@ void SpiffsMp3_Task(audio_event_iface_handle_t evt_t) {
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Fetch the reply named by the upload response, so overlapping
+// interactions never share one file. Old servers fall back to output.mp3.
+static void set_reply_url(const char* body) {
+    const char* id = strstr(body, "reply_id: ");
+    int len = 0;
+    if (id) {
+        id += strlen("reply_id: ");
+        while (len < REPLY_ID_MAX - 1 &&
+               (isalnum((unsigned char)id[len]) || id[len] == '-' ||
+                id[len] == '_')) {
+            len++;
+        }
+    }
+    if (len == 0) {
+        snprintf(reply_url, sizeof(reply_url), "%s", SERVER_URL_PLAY_MP3);
+        return;
+    }
+    snprintf(reply_url, sizeof(reply_url), "%s%.*s", SERVER_URL_REPLY, len,
+             id);
+    ESP_LOGI(TAG, "[ + ] Reply %s", reply_url);
+}
+
 esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
     esp_http_client_handle_t http = (esp_http_client_handle_t)msg->http_client;
     char len_buf[16];
     static int total_write = 0;
+    static int64_t upload_start_us;
 
     if (msg->event_id == HTTP_STREAM_PRE_REQUEST) {
         // set header
@@ -409,6 +905,7 @@ esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
         esp_http_client_set_header(http, "x-audio-bits", "16");
         esp_http_client_set_header(http, "x-audio-channel", "1");
         total_write = 0;
+        upload_start_us = esp_timer_get_time();
         return ESP_OK;
     }
 
@@ -425,7 +922,9 @@ esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
             return ESP_FAIL;
         }
         total_write += msg->buffer_len;
-        printf("\033[A\33[2K\rTotal bytes written: %d\n", total_write);
+        metrics_add(METRIC_UPLOAD_BYTES, msg->buffer_len);
+        session_rec_write(SESSION_REC_UPLOAD, msg->buffer, msg->buffer_len);
+        DLOGD(TAG, "Total bytes written: %d", total_write);
         return msg->buffer_len;
     }
 
@@ -441,9 +940,13 @@ esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
 
     if (msg->event_id == HTTP_STREAM_FINISH_REQUEST) {
         ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_FINISH_REQUEST");
-        char* buf = calloc(1, 2048);
+        metrics_add(METRIC_UPLOADS, 1);
+        metrics_observe(METRIC_HIST_UPLOAD_MS,
+                        (esp_timer_get_time() - upload_start_us) / 1000);
+        char* buf = calloc(1, UPLOAD_RESPONSE_MAX);
         assert(buf);
-        int read_len = esp_http_client_read(http, buf, 2048);
+        int read_len =
+            esp_http_client_read(http, buf, UPLOAD_RESPONSE_MAX - 1);
         if (read_len <= 0) {
             free(buf);
             return ESP_FAIL;
@@ -451,6 +954,8 @@ esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
         buf[read_len] = 0;
         ESP_LOGI(TAG, "Got HTTP length = %d", strlen((char*)buf));
         ESP_LOGI(TAG, "Got HTTP Response = %s", (char*)buf);
+        set_reply_url(buf);
+        session_rec_event("upload_end bytes=%d", total_write);
         free(buf);
         choose_type_flag = CHOOSE_STREAM_HTTP_PLAY;
         return ESP_OK;
@@ -458,6 +963,69 @@ esp_err_t _http_stream_event_handle(http_stream_event_msg_t* msg) {
     return ESP_OK;
 }
 
+#if CONFIG_CTRL_ENABLE
+// Runs on the control channel task: volume applies at once, playback is
+// queued for ASR_Task so it never interrupts an interaction
+static ctrl_status_t _ctrl_event_handle(const ctrl_msg_t* msg) {
+    switch (msg->type) {
+        case CTRL_MSG_VOLUME:
+            if (msg->len != 1 || msg->payload[0] > 100) {
+                return CTRL_STATUS_INVALID;
+            }
+            ESP_LOGI(TAG, "[ ctrl ] Volume %d", msg->payload[0]);
+            return audio_hal_set_volume(audio_board_get_handle()->audio_hal,
+                                        msg->payload[0]) == ESP_OK
+                       ? CTRL_STATUS_OK
+                       : CTRL_STATUS_FAILED;
+        case CTRL_MSG_PLAY:
+        case CTRL_MSG_PLAY_AT: {
+            ctrl_play_t play = {0};
+            const uint8_t* url = msg->payload;
+            int len = msg->len;
+            if (msg->type == CTRL_MSG_PLAY_AT) {
+#if CONFIG_SYNC_ENABLE
+                // u64 start_us, u16 group, little endian like the ESP32
+                if (len <= 10) {
+                    return CTRL_STATUS_INVALID;
+                }
+                memcpy(&play.start_us, url, 8);
+                memcpy(&play.group, url + 8, 2);
+                url += 10;
+                len -= 10;
+                int64_t now;
+                if (!sync_now(&now)) {
+                    ESP_LOGW(TAG, "[ ctrl ] No group clock yet, play at once");
+                    play.start_us = 0;
+                }
+#else
+                return CTRL_STATUS_UNSUPPORTED;
+#endif
+            }
+            if (len == 0 || len >= sizeof(play.url)) {
+                return CTRL_STATUS_INVALID;
+            }
+            memcpy(play.url, url, len);
+            play.url[len] = '\0';
+            xQueueOverwrite(ctrl_play_queue, &play);
+            return CTRL_STATUS_OK;
+        }
+        case CTRL_MSG_END_OF_UTTERANCE: {
+            uint32_t audio_ms;
+            if (msg->len != sizeof(audio_ms)) {
+                return CTRL_STATUS_INVALID;
+            }
+            memcpy(&audio_ms, msg->payload, sizeof(audio_ms));
+            ESP_LOGI(TAG, "[ ctrl ] End of utterance after %u ms of audio",
+                     audio_ms);
+            xSemaphoreGive(rec_final);
+            return CTRL_STATUS_OK;
+        }
+        default:
+            return CTRL_STATUS_UNSUPPORTED;
+    }
+}
+#endif
+
 // sspmu_num  3
 esp_err_t set_spiffs_play_mp3_url(char sspmu_num) {
     char _temp = 0;
@@ -509,88 +1077,270 @@ esp_err_t stop_pipeline_element(audio_pipeline_handle_t pe_handle,
     return ESP_OK;
 }
 
+static audio_element_handle_t create_i2s_writer(const audio_profile_t* prof) {
+    i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
+    i2s_cfg.type = AUDIO_STREAM_WRITER;
+    TASK_PLACE(i2s_cfg, TASK_SLOT_I2S_WRITER);
+    i2s_cfg.i2s_config.dma_buf_count = prof->dma_buf_count;
+    i2s_cfg.i2s_config.dma_buf_len = prof->dma_buf_len;
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    i2s_cfg.i2s_config.sample_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+#endif
+#if CONFIG_AUDIO_MIXER_ENABLE
+    // The idle mixer writes nothing, the DMA must play zeros then and not
+    // the last buffer again
+    i2s_cfg.i2s_config.tx_desc_auto_clear = true;
+#endif
+    return i2s_stream_init(&i2s_cfg);
+}
+
+#if CONFIG_AUDIO_MIXER_ENABLE
+audio_pipeline_handle_t create_mix_pipeline(void) {
+    // Prompts overlay through the mixer, keep its output short
+    const audio_profile_t* prof = audio_profile_get(AUDIO_PROFILE_LOW_LATENCY);
+    int heap = esp_get_free_heap_size();
+    audio_pipeline_handle_t pipeline;
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    pipeline_cfg.rb_size = prof->pipeline_rb_size;
+    pipeline = audio_pipeline_init(&pipeline_cfg);
+    mem_assert(pipeline);
+
+    mixer_cfg_t mix_cfg = MIXER_CFG_DEFAULT();
+    mix_cfg.input_num = MIX_INPUT_NUM;
+    mix_cfg.duck_gain = MIXER_GAIN_UNITY * CONFIG_AUDIO_MIXER_DUCK_PERCENT / 100;
+    mix_cfg.ramp_ms = CONFIG_AUDIO_MIXER_RAMP_MS;
+    mix_cfg.out_rb_size = prof->codec_rb_size;
+    TASK_PLACE(mix_cfg, TASK_SLOT_MIXER);
+    // Every input comes through a resampler to this rate
+    mix_cfg.sample_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    mixer_mix = mixer_init(&mix_cfg);
+    i2s_stream_writer_mix = create_i2s_writer(prof);
+
+    audio_pipeline_register(pipeline, mixer_mix, "mixer");
+    audio_pipeline_register(pipeline, i2s_stream_writer_mix, "i2s");
+    ESP_LOGI(TAG, "[ out ] Link it together mixer-->i2s_stream-->[codec_chip]");
+    audio_pipeline_link(pipeline, (const char* []){"mixer", "i2s"}, 2);
+    metrics_watch_element("mixer", mixer_mix);
+    metrics_set_pipeline_heap("mix", heap - esp_get_free_heap_size());
+    return pipeline;
+}
+#endif
+
+// Register and link the output half of a play pipeline: the optional
+// resampler, then either its own i2s_stream writer or a mixer input (the
+// input index is also its priority). Returns the i2s writer it plays on.
+static audio_element_handle_t link_play_output(
+    audio_pipeline_handle_t pipeline, const char* reader,
+    audio_element_handle_t mp3, int mix_input, const audio_profile_t* prof,
+    audio_element_handle_t* filter) {
+    const char* link_tag[6] = {reader, "mp3"};
+    int link_num = 2;
+    audio_element_handle_t last = mp3;
+    *filter = NULL;
+#if CONFIG_SESSION_REC_ENABLE
+    // Record the decoded reply as it leaves the decoder
+    if (mix_input == MIX_INPUT_REPLY) {
+        last = session_rec_tap_init(SESSION_REC_REPLY, prof->codec_rb_size);
+        audio_pipeline_register(pipeline, last, "rec_tap");
+        link_tag[link_num++] = "rec_tap";
+    }
+#endif
+#if CONFIG_SYNC_ENABLE
+    // Timed against the buffers it feeds, so it sits behind everything that
+    // may stall: the network reader, the decoder and the recorder tap
+    if (mix_input == MIX_INPUT_REPLY) {
+        sync_play_cfg_t sync_cfg = SYNC_PLAY_CFG_DEFAULT();
+        // The DMA ring is half full on average when the writer blocks
+        sync_cfg.dma_frames = prof->dma_buf_count * prof->dma_buf_len -
+                              prof->dma_buf_len / 2;
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+        // Counted at the output rate, ahead of the resampler
+        sync_cfg.dma_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+#endif
+        sync_cfg.out_rb_size = prof->codec_rb_size;
+        TASK_PLACE(sync_cfg, TASK_SLOT_SYNC_PLAY);
+        sync_http_mp3 = sync_play_init(&sync_cfg);
+        audio_pipeline_register(pipeline, sync_http_mp3, "sync");
+        link_tag[link_num++] = "sync";
+        last = sync_http_mp3;
+    }
+#endif
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    rsp_filter_cfg_t rsp_cfg = DEFAULT_RESAMPLE_FILTER_CONFIG();
+    rsp_cfg.src_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    rsp_cfg.src_ch = 2;
+    rsp_cfg.dest_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    rsp_cfg.dest_ch = 2;
+    rsp_cfg.complexity = CONFIG_AUDIO_RESAMPLE_COMPLEXITY;
+    rsp_cfg.out_rb_size = prof->codec_rb_size;
+    TASK_PLACE(rsp_cfg, TASK_SLOT_PLAY_FILTER);
+    *filter = rsp_filter_init(&rsp_cfg);
+    audio_pipeline_register(pipeline, *filter, "filter");
+    link_tag[link_num++] = "filter";
+    last = *filter;
+#endif
+#if CONFIG_AUDIO_MIXER_ENABLE
+    ringbuf_handle_t rb = rb_create(prof->pipeline_rb_size, 1);
+    mem_assert(rb);
+    audio_element_set_output_ringbuf(last, rb);
+    mixer_set_input(mixer_mix, mix_input, rb, mix_input);
+    audio_element_handle_t i2s = i2s_stream_writer_mix;
+#else
+    (void)last;
+    audio_element_handle_t i2s = create_i2s_writer(prof);
+    audio_pipeline_register(pipeline, i2s, "i2s");
+    link_tag[link_num++] = "i2s";
+#endif
+    audio_pipeline_link(pipeline, link_tag, link_num);
+    return i2s;
+}
+
+// The mixer is started by the first playback and then left running across
+// state changes, the mic pipelines read the same full-duplex I2S port.
+// Between playbacks it is idle and writes nothing.
+void play_output_start(void) {
+#if CONFIG_AUDIO_MIXER_ENABLE
+    if (audio_element_get_state(i2s_stream_writer_mix) != AEL_STATE_RUNNING) {
+        audio_pipeline_run(pipeline_mix);
+    } else {
+        mixer_wake(mixer_mix);
+    }
+#endif
+}
+
+// Nothing is written to the port from here until the next playback
+void play_output_idle(void) {
+#if CONFIG_AUDIO_MIXER_ENABLE
+    if (audio_element_get_state(i2s_stream_writer_mix) == AEL_STATE_RUNNING) {
+        mixer_wait_for_idle(mixer_mix, 1000 / portTICK_PERIOD_MS);
+    }
+#endif
+}
+
+void play_output_set_info(audio_element_handle_t i2s,
+                          audio_element_handle_t filter,
+                          audio_element_info_t* info) {
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    // I2S keeps the clock set at boot, only the resampler input changes.
+    // With the mixer every input is stereo at the output rate from here on.
+    rsp_filter_set_src_info(filter, info->sample_rates, info->channels);
+#else
+    audio_element_setinfo(i2s, info);
+    i2s_stream_set_clk(i2s, info->sample_rates, info->bits, info->channels);
+#endif
+}
+
+void play_output_drain(int mix_input) {
+#if CONFIG_AUDIO_MIXER_ENABLE
+    mixer_wait_for_drain(mixer_mix, mix_input, 1000 / portTICK_PERIOD_MS);
+#endif
+}
+
 audio_pipeline_handle_t create_play_pipeline(output_stream_t output_type) {
+    const audio_profile_t* prof = audio_profile_get(play_profile[output_type]);
+    ESP_LOGI(TAG, "[ * ] Buffering profile %s", prof->name);
+    int heap = esp_get_free_heap_size();
     audio_pipeline_handle_t pipeline;
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    pipeline_cfg.rb_size = prof->pipeline_rb_size;
     pipeline = audio_pipeline_init(&pipeline_cfg);
     mem_assert(pipeline);
 
     output_type_flag = output_type;
     switch (output_type) {
-        case OUTPUT_STREAM_HTTP:
+        case OUTPUT_STREAM_HTTP: {
             ESP_LOGI(TAG, "[ * ] Play from HTTP");
+#if CONFIG_REPLY_CACHE_ENABLE
+            // Sends one conditional GET and plays a current card copy itself
+            reply_stream_cfg_t http_cfg_p = REPLY_STREAM_CFG_DEFAULT();
+            http_cfg_p.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(http_cfg_p, TASK_SLOT_HTTP_READER);
+            http_stream_reader_http_mp3 = reply_stream_init(&http_cfg_p);
+#else
             http_stream_cfg_t http_cfg_p = HTTP_STREAM_CFG_DEFAULT();
+            http_cfg_p.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(http_cfg_p, TASK_SLOT_HTTP_READER);
             http_stream_reader_http_mp3 = http_stream_init(&http_cfg_p);
-
-            i2s_stream_cfg_t i2s_cfg_p = I2S_STREAM_CFG_DEFAULT();
-            i2s_cfg_p.type = AUDIO_STREAM_WRITER;
-            i2s_stream_writer_http_mp3 = i2s_stream_init(&i2s_cfg_p);
+#endif
 
             mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+            mp3_cfg.out_rb_size = prof->codec_rb_size;
+            TASK_PLACE(mp3_cfg, TASK_SLOT_MP3_DECODER);
             mp3_decoder_http_mp3 = mp3_decoder_init(&mp3_cfg);
 
             audio_pipeline_register(pipeline, http_stream_reader_http_mp3,
                                     "http");
             audio_pipeline_register(pipeline, mp3_decoder_http_mp3, "mp3");
-            audio_pipeline_register(pipeline, i2s_stream_writer_http_mp3,
-                                    "i2s");
             ESP_LOGI(TAG,
                      "[ out ] Link it together "
                      "http_stream-->mp3_decoder_http_mp3-->i2s_stream-->[codec_"
                      "chip]");
-            audio_pipeline_link(pipeline,
-                                (const char* []){"http", "mp3", "i2s"}, 3);
+            metrics_watch_element("http_reader", http_stream_reader_http_mp3);
+            metrics_watch_element("http_mp3", mp3_decoder_http_mp3);
+            i2s_stream_writer_http_mp3 =
+                link_play_output(pipeline, "http", mp3_decoder_http_mp3,
+                                 MIX_INPUT_REPLY, prof, &filter_http_mp3);
             break;
+        }
         case OUTPUT_STREAM_SPIFFS: {
+#if CONFIG_PROMPT_SOURCE_SPIFFS
             ESP_LOGI(TAG, "[ * ] Play from spiffs");
             spiffs_stream_cfg_t flash_cfg = SPIFFS_STREAM_CFG_DEFAULT();
             flash_cfg.type = AUDIO_STREAM_READER;
+            flash_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(flash_cfg, TASK_SLOT_FILE_READER);
             spiffs_stream_reader_play = spiffs_stream_init(&flash_cfg);
+#else
+            ESP_LOGI(TAG, "[ * ] Play from asset pack");
+            asset_stream_cfg_t asset_cfg = ASSET_STREAM_CFG_DEFAULT();
+            asset_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(asset_cfg, TASK_SLOT_FILE_READER);
+            spiffs_stream_reader_play = asset_stream_init(&asset_cfg);
+#endif
 
             mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+            mp3_cfg.out_rb_size = prof->codec_rb_size;
+            TASK_PLACE(mp3_cfg, TASK_SLOT_MP3_DECODER);
             mp3_decoder_play = mp3_decoder_init(&mp3_cfg);
 
-            i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
-            i2s_cfg.type = AUDIO_STREAM_WRITER;
-            i2s_stream_writer_play = i2s_stream_init(&i2s_cfg);
-
             audio_pipeline_register(pipeline, spiffs_stream_reader_play,
                                     "spiffs");
             audio_pipeline_register(pipeline, mp3_decoder_play, "mp3");
-            audio_pipeline_register(pipeline, i2s_stream_writer_play, "i2s");
 
             ESP_LOGI(TAG,
                      "[ out ] Link it together "
                      "[flash]-->spiffs-->mp3_decoder-->i2s_stream-->[codec_"
                      "chip]");
-            audio_pipeline_link(pipeline,
-                                (const char* []){"spiffs", "mp3", "i2s"}, 3);
+            i2s_stream_writer_play =
+                link_play_output(pipeline, "spiffs", mp3_decoder_play,
+                                 MIX_INPUT_PROMPT, prof, &filter_play);
             break;
         }
         case OUTPUT_STREAM_SDCARD: {
             ESP_LOGI(TAG, "[ * ] Play from sdcard");
             fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
             fatfs_cfg.type = AUDIO_STREAM_READER;
+            fatfs_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(fatfs_cfg, TASK_SLOT_FILE_READER);
             fatfs_stream_reader_sdcard = fatfs_stream_init(&fatfs_cfg);
 
-            i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
-            i2s_cfg.type = AUDIO_STREAM_WRITER;
-            i2s_stream_writer_sdcard = i2s_stream_init(&i2s_cfg);
-
             mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+            mp3_cfg.out_rb_size = prof->codec_rb_size;
+            TASK_PLACE(mp3_cfg, TASK_SLOT_MP3_DECODER);
             mp3_decoder_sdcard = mp3_decoder_init(&mp3_cfg);
 
             audio_pipeline_register(pipeline, fatfs_stream_reader_sdcard,
                                     "file");
             audio_pipeline_register(pipeline, mp3_decoder_sdcard, "mp3");
-            audio_pipeline_register(pipeline, i2s_stream_writer_sdcard, "i2s");
 
             ESP_LOGI(TAG,
                      "[3.5] Link it together "
                      "[sdcard]-->fatfs_stream-->mp3_decoder-->i2s_stream-->["
                      "codec_chip]");
-            audio_pipeline_link(pipeline,
-                                (const char* []){"file", "mp3", "i2s"}, 3);
+            metrics_watch_element("sdcard_mp3", mp3_decoder_sdcard);
+            i2s_stream_writer_sdcard =
+                link_play_output(pipeline, "file", mp3_decoder_sdcard,
+                                 MIX_INPUT_MUSIC, prof, &filter_sdcard);
             break;
         }
 
@@ -598,29 +1348,60 @@ audio_pipeline_handle_t create_play_pipeline(output_stream_t output_type) {
             ESP_LOGE(TAG, "The %d type is not supported!", output_type);
             break;
     }
+    metrics_set_pipeline_heap(play_pipeline_name[output_type],
+                              heap - esp_get_free_heap_size());
     return pipeline;
 }
 
+#if CONFIG_NSAGC_ENABLE
+static audio_element_handle_t create_nsagc(const audio_profile_t* prof) {
+    nsagc_cfg_t nsagc_cfg = NSAGC_CFG_DEFAULT();
+    nsagc_cfg.floor_db = CONFIG_NSAGC_FLOOR_DB;
+    nsagc_cfg.target_dbfs = CONFIG_NSAGC_TARGET_DBFS;
+    nsagc_cfg.budget_cycles = CONFIG_NSAGC_BUDGET_KCYCLES * 1000;
+#if CONFIG_NSAGC_BYPASS
+    nsagc_cfg.bypass = true;
+#endif
+    nsagc_cfg.out_rb_size = prof->stream_rb_size;
+    TASK_PLACE(nsagc_cfg, TASK_SLOT_MIC_NSAGC);
+    return nsagc_init(&nsagc_cfg);
+}
+#endif
+
 audio_pipeline_handle_t create_rec_pipeline(input_stream_t input_type) {
+    const audio_profile_t* prof = audio_profile_get(rec_profile[input_type]);
+    ESP_LOGI(TAG, "[ * ] Buffering profile %s", prof->name);
+    int heap = esp_get_free_heap_size();
     audio_pipeline_handle_t pipeline;
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    pipeline_cfg.rb_size = prof->pipeline_rb_size;
     pipeline = audio_pipeline_init(&pipeline_cfg);
     mem_assert(pipeline);
     input_type_flag = input_type;
     switch (input_type) {
         case INPUT_STREAM_ASR: {
             ESP_LOGI(TAG, "[ input ] Create INPUT_STREAM_ASR");
+            // The port is shared with playback, in the fixed rate mode the
+            // mic runs at the output rate
+            int mic_rate = 48000;
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+            mic_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+#endif
             i2s_stream_cfg_t i2s_asr_cfg = I2S_STREAM_CFG_DEFAULT();
-            i2s_asr_cfg.i2s_config.sample_rate = 48000;
+            i2s_asr_cfg.i2s_config.sample_rate = mic_rate;
             i2s_asr_cfg.type = AUDIO_STREAM_READER;
+            // The DMA and the ringbuffers stay at the sizes of the original
+            // chain until the low-latency ones are measured against WakeNet
+            TASK_PLACE(i2s_asr_cfg, TASK_SLOT_I2S_READER);
             i2s_stream_reader_asr = i2s_stream_init(&i2s_asr_cfg);
 
             rsp_filter_cfg_t rsp_asr_cfg = DEFAULT_RESAMPLE_FILTER_CONFIG();
-            rsp_asr_cfg.src_rate = 48000;
+            rsp_asr_cfg.src_rate = mic_rate;
             rsp_asr_cfg.src_ch = 2;
             rsp_asr_cfg.dest_rate = 16000;
             rsp_asr_cfg.dest_ch = 1;
             rsp_asr_cfg.type = AUDIO_CODEC_TYPE_ENCODER;
+            TASK_PLACE(rsp_asr_cfg, TASK_SLOT_MIC_FILTER);
             filter_asr = rsp_filter_init(&rsp_asr_cfg);
 
             raw_stream_cfg_t raw_asr_cfg = {
@@ -633,11 +1414,24 @@ audio_pipeline_handle_t create_rec_pipeline(input_stream_t input_type) {
             audio_pipeline_register(pipeline, filter_asr, "filter");
             audio_pipeline_register(pipeline, raw_read_asr, "raw_read");
 
+#if CONFIG_NSAGC_ENABLE
+            nsagc_asr = create_nsagc(prof);
+            audio_pipeline_register(pipeline, nsagc_asr, "nsagc");
+            ESP_LOGI(TAG,
+                     "[ input ] Link elements together "
+                     "[codec_chip]-->i2s_stream-->filter_asr-->nsagc-->raw-->"
+                     "[SR]");
+            audio_pipeline_link(
+                pipeline,
+                (const char* []){"i2s", "filter", "nsagc", "raw_read"}, 4);
+#else
             ESP_LOGI(TAG,
                      "[ input ] Link elements together "
                      "[codec_chip]-->i2s_stream-->filter_asr-->raw-->[SR]");
             audio_pipeline_link(
                 pipeline, (const char* []){"i2s", "filter", "raw_read"}, 3);
+#endif
+            metrics_watch_element("asr_filter", filter_asr);
             break;
         }
         case INPUT_STREAM_REC:
@@ -645,27 +1439,48 @@ audio_pipeline_handle_t create_rec_pipeline(input_stream_t input_type) {
             http_stream_cfg_t http_cfg = HTTP_STREAM_CFG_DEFAULT();
             http_cfg.type = AUDIO_STREAM_WRITER;
             http_cfg.event_handle = _http_stream_event_handle;
+            http_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(http_cfg, TASK_SLOT_HTTP_WRITER);
             http_stream_writer_rec = http_stream_init(&http_cfg);
 
             wav_encoder_cfg_t wav_cfg = DEFAULT_WAV_ENCODER_CONFIG();
+            wav_cfg.out_rb_size = prof->codec_rb_size;
+            TASK_PLACE(wav_cfg, TASK_SLOT_WAV_ENCODER);
             wav_encoder_rec = wav_encoder_init(&wav_cfg);
 
             i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
             i2s_cfg.type = AUDIO_STREAM_READER;
+            i2s_cfg.i2s_config.dma_buf_count = prof->dma_buf_count;
+            i2s_cfg.i2s_config.dma_buf_len = prof->dma_buf_len;
+            TASK_PLACE(i2s_cfg, TASK_SLOT_I2S_READER);
             i2s_stream_reader_rec = i2s_stream_init(&i2s_cfg);
 
             audio_pipeline_register(pipeline, i2s_stream_reader_rec, "i2s");
             audio_pipeline_register(pipeline, wav_encoder_rec, "wav");
             audio_pipeline_register(pipeline, http_stream_writer_rec, "http");
 
+#if CONFIG_NSAGC_ENABLE
+            // RecHttp_Task sets the reader to 16 kHz mono
+            nsagc_rec = create_nsagc(prof);
+            audio_pipeline_register(pipeline, nsagc_rec, "nsagc");
+            ESP_LOGI(TAG,
+                     "[ input ] Link it together "
+                     "[codec_chip]-->i2s_stream->nsagc->wav_encoder_rec->"
+                     "http_stream-->[http_server]");
+            audio_pipeline_link(
+                pipeline, (const char* []){"i2s", "nsagc", "wav", "http"}, 4);
+#else
             ESP_LOGI(TAG,
                      "[ input ] Link it together "
                      "[codec_chip]-->i2s_stream->wav_encoder_rec->http_stream--"
                      ">[http_server]");
             audio_pipeline_link(pipeline,
                                 (const char* []){"i2s", "wav", "http"}, 3);
+#endif
             break;
     }
+    metrics_set_pipeline_heap(rec_pipeline_name[input_type],
+                              heap - esp_get_free_heap_size());
     return pipeline;
 }
 
@@ -680,16 +1495,26 @@ void stop_all_pipelines(void) {
     audio_free_pipline(pipeline_http_mp3);
     audio_free_pipline(pipeline_asr);
     audio_free_pipline(pipeline_sdcard);
+#if CONFIG_AUDIO_MIXER_ENABLE
+    audio_free_pipline(pipeline_mix);
+#endif
     switch (input_type_flag) {
         case INPUT_STREAM_ASR:
             audio_pipeline_unregister(pipeline_asr, i2s_stream_reader_asr);
             audio_pipeline_unregister(pipeline_asr, raw_read_asr);
             audio_pipeline_unregister(pipeline_asr, filter_asr);
+            if (nsagc_asr) {
+                audio_pipeline_unregister(pipeline_asr, nsagc_asr);
+            }
             audio_pipeline_remove_listener(pipeline_asr);
             audio_pipeline_deinit(pipeline_asr);
             audio_element_deinit(i2s_stream_reader_asr);
             audio_element_deinit(raw_read_asr);
             audio_element_deinit(filter_asr);
+            if (nsagc_asr) {
+                audio_element_deinit(nsagc_asr);
+                nsagc_asr = NULL;
+            }
             wakenet->destroy(model_data);
             model_data = NULL;
             break;
@@ -4,3 +4,19 @@
 COMPONENT_ADD_INCLUDEDIRS := .
 
 COMPONENT_SRCDIRS :=  .
+
+# CA of the server behind the TLS streams, see m_tls.h. Made locally by
+# tools/tls/mkcerts.sh and not committed.
+ifdef CONFIG_TLS_ENABLE
+ifeq ($(wildcard $(COMPONENT_PATH)/certs/server_ca.pem),)
+$(error TLS_ENABLE embeds main/certs/server_ca.pem, run tools/tls/mkcerts.sh)
+endif
+COMPONENT_EMBED_TXTFILES := certs/server_ca.pem
+endif
+
+# Updates need the two app slots of partitions_ota.csv, see m_ota.h
+ifdef CONFIG_OTA_ENABLE
+ifneq ($(call dequote,$(CONFIG_PARTITION_TABLE_FILENAME)),partitions_ota.csv)
+$(error OTA_ENABLE needs the custom partition table partitions_ota.csv)
+endif
+endif
@@ -0,0 +1,261 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp_timer.h"
+
+#include "audio_common.h"
+#include "audio_element.h"
+#include "audio_error.h"
+#include "audio_mem.h"
+
+#include "m_assets.h"
+
+static const char* TAG = "assets";
+
+#define ASSET_STREAM_CHUNK_SIZE (2 * 1024)
+
+static const asset_pack_header_t* s_pack = NULL;
+static const asset_pack_entry_t* s_entries = NULL;
+static spi_flash_mmap_handle_t s_mmap_handle;
+static const esp_partition_t* s_part = NULL;
+static uint32_t s_offset; /* Of the mapped pack in s_part */
+
+typedef struct {
+    asset_t asset;
+    uint32_t pos;
+} asset_stream_t;
+
+// A pack in [offset, offset + room) whose header and entries fit in it
+static bool assets_read_header(const esp_partition_t* part, uint32_t offset,
+                               uint32_t room, asset_pack_header_t* header) {
+    return esp_partition_read(part, offset, header, sizeof(*header)) ==
+               ESP_OK &&
+           header->magic == ASSET_PACK_MAGIC &&
+           header->version == ASSET_PACK_VERSION &&
+           header->image_size <= room &&
+           sizeof(*header) + header->count * sizeof(asset_pack_entry_t) <=
+               header->image_size;
+}
+
+esp_err_t assets_init(const char* partition_label) {
+    if (s_pack) {
+        return ESP_OK;
+    }
+    const esp_partition_t* part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+        partition_label ? partition_label : "storage");
+    if (part == NULL) {
+        ESP_LOGE(TAG, "[ assets ] partition not found");
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_part = part;
+
+    asset_pack_header_t header;
+    bool found = false;
+    uint32_t half = part->size / 2;
+    if (assets_read_header(part, 0, part->size, &header)) {
+        found = true;
+        s_offset = 0;
+    }
+    // The second half only holds a pack when the first one leaves it free
+    asset_pack_header_t second;
+    if ((!found || header.image_size <= half) &&
+        assets_read_header(part, half, half, &second) &&
+        (!found || second.generation > header.generation)) {
+        header = second;
+        found = true;
+        s_offset = half;
+    }
+    if (!found) {
+        ESP_LOGE(TAG, "[ assets ] no asset pack in partition %s",
+                 part->label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void* ptr = NULL;
+    esp_err_t err = esp_partition_mmap(part, s_offset, header.image_size,
+                                       SPI_FLASH_MMAP_DATA, &ptr,
+                                       &s_mmap_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[ assets ] mmap failed: %d", err);
+        return err;
+    }
+    s_pack = (const asset_pack_header_t*)ptr;
+    s_entries = (const asset_pack_entry_t*)(s_pack + 1);
+    for (int i = 0; i < s_pack->count; i++) {
+        if (s_entries[i].offset + s_entries[i].size > s_pack->image_size) {
+            ESP_LOGE(TAG, "[ assets ] entry %d out of range", i);
+            spi_flash_munmap(s_mmap_handle);
+            s_pack = NULL;
+            s_entries = NULL;
+            return ESP_ERR_NOT_FOUND;
+        }
+    }
+    ESP_LOGI(TAG,
+             "[ assets ] %d assets mapped, %d bytes, generation %u at 0x%x",
+             s_pack->count, s_pack->image_size, s_pack->generation,
+             s_offset);
+    return ESP_OK;
+}
+
+esp_err_t assets_update_slot(const esp_partition_t** part, uint32_t* offset,
+                             uint32_t* size, uint32_t* generation) {
+    if (s_part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint32_t half = s_part->size / 2;
+    if (s_pack && s_offset == 0 && s_pack->image_size > half) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *part = s_part;
+    *offset = s_pack && s_offset == 0 ? half : 0;
+    *size = half;
+    *generation = s_pack ? s_pack->generation + 1 : 1;
+    return ESP_OK;
+}
+
+esp_err_t assets_find(const char* name, asset_t* asset) {
+    if (s_pack == NULL || name == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const char* base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    // Entries are sorted by name in tools/mkassets.py
+    int lo = 0, hi = s_pack->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strncmp(base, s_entries[mid].name, ASSET_NAME_LEN);
+        if (cmp == 0) {
+            asset->name = s_entries[mid].name;
+            asset->data = (const uint8_t*)s_pack + s_entries[mid].offset;
+            asset->size = s_entries[mid].size;
+            return ESP_OK;
+        }
+        if (cmp < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t _asset_open(audio_element_handle_t self) {
+    asset_stream_t* stream = (asset_stream_t*)audio_element_getdata(self);
+    char* uri = audio_element_get_uri(self);
+    if (assets_find(uri, &stream->asset) != ESP_OK) {
+        ESP_LOGE(TAG, "[ assets ] %s not found", uri ? uri : "(null)");
+        return ESP_FAIL;
+    }
+    stream->pos = 0;
+    audio_element_set_total_bytes(self, stream->asset.size);
+    return ESP_OK;
+}
+
+// The mapped flash is handed to the output ringbuffer directly, there is no
+// intermediate read buffer and no filesystem in between.
+static int _asset_process(audio_element_handle_t self, char* in_buffer,
+                          int in_len) {
+    asset_stream_t* stream = (asset_stream_t*)audio_element_getdata(self);
+    if (stream->pos >= stream->asset.size) {
+        return AEL_IO_DONE;
+    }
+    int len = stream->asset.size - stream->pos;
+    if (len > in_len) {
+        len = in_len;
+    }
+    int w_size = audio_element_output(
+        self, (char*)stream->asset.data + stream->pos, len);
+    if (w_size > 0) {
+        stream->pos += w_size;
+        audio_element_update_byte_pos(self, w_size);
+    }
+    return w_size;
+}
+
+static esp_err_t _asset_close(audio_element_handle_t self) {
+    asset_stream_t* stream = (asset_stream_t*)audio_element_getdata(self);
+    stream->pos = 0;
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_report_pos(self);
+        audio_element_set_byte_pos(self, 0);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _asset_destroy(audio_element_handle_t self) {
+    asset_stream_t* stream = (asset_stream_t*)audio_element_getdata(self);
+    audio_free(stream);
+    return ESP_OK;
+}
+
+audio_element_handle_t asset_stream_init(asset_stream_cfg_t* config) {
+    asset_stream_t* stream = audio_calloc(1, sizeof(asset_stream_t));
+    AUDIO_MEM_CHECK(TAG, stream, return NULL);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _asset_open;
+    cfg.process = _asset_process;
+    cfg.close = _asset_close;
+    cfg.destroy = _asset_destroy;
+    cfg.buffer_len = ASSET_STREAM_CHUNK_SIZE;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.tag = "asset";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(stream);
+        return NULL;
+    });
+    audio_element_setdata(el, stream);
+    return el;
+}
+
+void assets_benchmark(void) {
+#if CONFIG_ASSETS_BENCHMARK
+    for (int i = 0; s_pack && i < s_pack->count; i++) {
+        asset_t asset;
+        int64_t start = esp_timer_get_time();
+        if (assets_find(s_entries[i].name, &asset) != ESP_OK) {
+            continue;
+        }
+        volatile uint8_t first = asset.data[0];
+        int64_t cost = esp_timer_get_time() - start;
+        (void)first;
+        ESP_LOGI(TAG, "[ bench ] asset  %-20s open-to-first-byte %lld us",
+                 asset.name, cost);
+    }
+    DIR* dir = opendir("/spiffs");
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* ent;
+    char path[64];
+    while ((ent = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/spiffs/%s", ent->d_name);
+        uint8_t first;
+        int64_t start = esp_timer_get_time();
+        FILE* f = fopen(path, "rb");
+        if (f == NULL) {
+            continue;
+        }
+        fread(&first, 1, 1, f);
+        int64_t cost = esp_timer_get_time() - start;
+        fclose(f);
+        ESP_LOGI(TAG, "[ bench ] spiffs %-20s open-to-first-byte %lld us",
+                 ent->d_name, cost);
+    }
+    closedir(dir);
+#endif
+}
@@ -0,0 +1,109 @@
+#ifndef _M_ASSETS_H_
+#define _M_ASSETS_H_
+
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/*
+ * Read-only prompt asset pack, built on the host by tools/mkassets.py and
+ * flashed to the `storage` partition. The whole image is mapped with
+ * esp_partition_mmap so prompts are streamed straight out of flash.
+ *
+ * A pack sits at the start of either half of the partition. Updates
+ * (m_ota.h) are written to the half that is not mapped with a higher
+ * generation, the valid pack with the highest generation is mapped at
+ * boot. A pack that spans both halves cannot be updated in place.
+ */
+#define ASSET_PACK_MAGIC 0x314B5041 /* "APK1" */
+#define ASSET_PACK_VERSION 1
+#define ASSET_NAME_LEN 32
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t image_size;
+    uint32_t generation; /* 0 from mkassets.py, set by the updater */
+} asset_pack_header_t;
+
+typedef struct {
+    char name[ASSET_NAME_LEN];
+    uint32_t offset;
+    uint32_t size;
+    uint32_t crc32;
+    uint32_t reserved;
+} asset_pack_entry_t;
+
+typedef struct {
+    const char* name;
+    const uint8_t* data;
+    uint32_t size;
+} asset_t;
+
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+} asset_stream_cfg_t;
+
+#define ASSET_STREAM_TASK_STACK (2 * 1024)
+#define ASSET_STREAM_TASK_CORE (0)
+#define ASSET_STREAM_TASK_PRIO (4)
+#define ASSET_STREAM_RINGBUFFER_SIZE (8 * 1024)
+
+#define ASSET_STREAM_CFG_DEFAULT()                     \
+    {                                                  \
+        .out_rb_size = ASSET_STREAM_RINGBUFFER_SIZE,   \
+        .task_stack = ASSET_STREAM_TASK_STACK,         \
+        .task_core = ASSET_STREAM_TASK_CORE,           \
+        .task_prio = ASSET_STREAM_TASK_PRIO,           \
+    }
+
+/*
+ * @brief Map the asset partition and validate the pack header
+ *
+ * @param partition_label  Partition label, NULL selects "storage"
+ *
+ * @return
+ *     - ESP_OK, Success
+ *     - ESP_ERR_NOT_FOUND, No partition or no asset pack in it
+ */
+esp_err_t assets_init(const char* partition_label);
+
+/*
+ * @brief Where an update of the pack is written: the half of the partition
+ *        that is not mapped, and the generation the new pack has to carry
+ *
+ * @return
+ *     - ESP_OK, Success
+ *     - ESP_ERR_NOT_FOUND, No asset partition
+ *     - ESP_ERR_INVALID_SIZE, The mapped pack spans both halves
+ */
+esp_err_t assets_update_slot(const esp_partition_t** part, uint32_t* offset,
+                             uint32_t* size, uint32_t* generation);
+
+/*
+ * @brief Look up an asset by name, a leading directory ("/spiffs/x.mp3") is
+ *        ignored so the old prompt paths keep working
+ *
+ * @return ESP_OK or ESP_ERR_NOT_FOUND
+ */
+esp_err_t assets_find(const char* name, asset_t* asset);
+
+/*
+ * @brief Create a reader element that plays the asset named by its uri
+ *
+ * @return The audio element handle
+ */
+audio_element_handle_t asset_stream_init(asset_stream_cfg_t* config);
+
+/*
+ * @brief Log the open-to-first-byte latency of every prompt in the mapped
+ *        pack and in /spiffs, those of the two that are there
+ */
+void assets_benchmark(void);
+
+#endif
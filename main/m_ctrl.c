@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_transport.h"
+#include "esp_transport_tcp.h"
+#include "esp_wifi.h"
+#include "mbedtls/base64.h"
+
+#include "m_ctrl.h"
+#include "m_metrics.h"
+#include "m_tasks.h"
+
+static const char* TAG = "ctrl";
+
+#define CTRL_HOST_MAX 48
+#define CTRL_PATH_MAX 48
+#define CTRL_HANDSHAKE_MAX 512
+#define CTRL_FRAME_MAX 256 /* Largest payload accepted from the server */
+#define CTRL_SEND_MAX 125  /* Largest payload sent, fits a short header */
+#define CTRL_CONNECT_MS 5000
+#define CTRL_IO_MS 5000 /* Rest of a frame after its first byte, writes */
+#define CTRL_BACKOFF_MIN_MS 1000
+#define CTRL_BACKOFF_MAX_MS 60000
+
+#define WS_FIN 0x80
+#define WS_MASK 0x80
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+#define WS_CONTROL_MAX 125 /* Close, ping and pong payloads, RFC 6455 5.5 */
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+
+static ctrl_cfg_t s_cfg;
+static char s_host[CTRL_HOST_MAX];
+static char s_path[CTRL_PATH_MAX];
+static int s_port;
+static esp_transport_handle_t s_tcp;
+static SemaphoreHandle_t s_write_lock; /* Frames are written whole */
+static volatile bool s_connected;
+static uint8_t s_seq; /* Device messages, from the ctrl task and posters */
+static uint8_t s_frame[CTRL_FRAME_MAX];
+// The handshake response, followed by any frame bytes read with it
+static uint8_t s_rx[CTRL_HANDSHAKE_MAX];
+static int s_rx_pos;
+static int s_rx_len;
+
+static esp_err_t ctrl_parse_uri(const char* uri) {
+    if (strncmp(uri, "ws://", 5) != 0) {
+        ESP_LOGE(TAG, "[ ctrl ] Only ws:// is supported: %s", uri);
+        return ESP_ERR_INVALID_ARG;
+    }
+    const char* host = uri + 5;
+    int host_len = strcspn(host, ":/");
+    const char* rest = host + host_len;
+    s_port = 80;
+    if (*rest == ':') {
+        s_port = atoi(rest + 1);
+        rest += 1 + strspn(rest + 1, "0123456789");
+    }
+    if (host_len == 0 || host_len >= sizeof(s_host) ||
+        strlen(rest) >= sizeof(s_path) || s_port <= 0 || s_port > 65535) {
+        ESP_LOGE(TAG, "[ ctrl ] Bad URI %s", uri);
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(s_host, host, host_len);
+    s_host[host_len] = '\0';
+    snprintf(s_path, sizeof(s_path), "%s", *rest ? rest : "/");
+    return ESP_OK;
+}
+
+// Exactly len bytes, the handshake leftovers first
+static esp_err_t ctrl_read(uint8_t* buf, int len, int timeout_ms) {
+    int got = 0;
+    if (s_rx_len) {
+        got = len < s_rx_len ? len : s_rx_len;
+        memcpy(buf, s_rx + s_rx_pos, got);
+        s_rx_pos += got;
+        s_rx_len -= got;
+    }
+    while (got < len) {
+        int r = esp_transport_read(s_tcp, (char*)buf + got, len - got,
+                                   timeout_ms);
+        if (r <= 0) {
+            return ESP_FAIL;
+        }
+        got += r;
+    }
+    return ESP_OK;
+}
+
+// Client frames are masked, RFC 6455 5.3
+static esp_err_t ctrl_write_frame(int opcode, const uint8_t* data, int len) {
+    uint8_t frame[6 + CTRL_SEND_MAX];
+    if (len > CTRL_SEND_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t mask = esp_random();
+    frame[0] = WS_FIN | opcode;
+    frame[1] = WS_MASK | len;
+    memcpy(frame + 2, &mask, 4);
+    for (int i = 0; i < len; i++) {
+        frame[6 + i] = data[i] ^ frame[2 + (i & 3)];
+    }
+    xSemaphoreTake(s_write_lock, portMAX_DELAY);
+    int r = esp_transport_write(s_tcp, (char*)frame, 6 + len, CTRL_IO_MS);
+    xSemaphoreGive(s_write_lock);
+    return r == 6 + len ? ESP_OK : ESP_FAIL;
+}
+
+// ctrl_post runs on other tasks, so seq is taken atomically
+static uint8_t ctrl_next_seq(void) {
+    return __atomic_fetch_add(&s_seq, 1, __ATOMIC_RELAXED);
+}
+
+static esp_err_t ctrl_send(ctrl_msg_type_t type, uint8_t seq,
+                           const void* payload, int len) {
+    uint8_t msg[CTRL_SEND_MAX];
+    if (len > CTRL_SEND_MAX - 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    msg[0] = type;
+    msg[1] = seq;
+    if (len) {
+        memcpy(msg + 2, payload, len);
+    }
+    return ctrl_write_frame(WS_OP_BINARY, msg, len + 2);
+}
+
+static esp_err_t ctrl_handshake(void) {
+    uint8_t nonce[16];
+    unsigned char key[32];
+    size_t key_len;
+    char host[CTRL_HOST_MAX + 8];
+
+    for (int i = 0; i < sizeof(nonce); i += 4) {
+        uint32_t r = esp_random();
+        memcpy(nonce + i, &r, 4);
+    }
+    mbedtls_base64_encode(key, sizeof(key), &key_len, nonce, sizeof(nonce));
+    if (s_port == 80) {
+        snprintf(host, sizeof(host), "%s", s_host);
+    } else {
+        snprintf(host, sizeof(host), "%s:%d", s_host, s_port);
+    }
+    char* buf = (char*)s_rx;
+    int len = snprintf(buf, sizeof(s_rx),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: %s\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\n",
+                       s_path, host, key);
+    if (esp_transport_write(s_tcp, buf, len, CTRL_IO_MS) != len) {
+        return ESP_FAIL;
+    }
+
+    // A command pushed right after the upgrade can share a segment with it
+    int got = 0;
+    char* end = NULL;
+    while (end == NULL) {
+        if (got == sizeof(s_rx) - 1) {
+            ESP_LOGW(TAG, "[ ctrl ] Upgrade response too long");
+            return ESP_FAIL;
+        }
+        int r = esp_transport_read(s_tcp, buf + got, sizeof(s_rx) - 1 - got,
+                                   CTRL_IO_MS);
+        if (r <= 0) {
+            ESP_LOGW(TAG, "[ ctrl ] No upgrade response");
+            return ESP_FAIL;
+        }
+        got += r;
+        buf[got] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    int status = 0;
+    if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1 || status != 101) {
+        ESP_LOGW(TAG, "[ ctrl ] Upgrade refused: %.*s",
+                 (int)strcspn(buf, "\r\n"), buf);
+        return ESP_FAIL;
+    }
+    s_rx_pos = end + 4 - buf;
+    s_rx_len = got - s_rx_pos;
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_connect(void) {
+    uint8_t mac[6];
+    s_rx_len = 0;
+    if (esp_transport_connect(s_tcp, s_host, s_port, CTRL_CONNECT_MS) < 0) {
+        ESP_LOGW(TAG, "[ ctrl ] Cannot connect to %s:%d", s_host, s_port);
+        return ESP_FAIL;
+    }
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
+    if (ctrl_handshake() != ESP_OK ||
+        ctrl_send(CTRL_MSG_HELLO, ctrl_next_seq(), mac, sizeof(mac)) !=
+            ESP_OK) {
+        esp_transport_close(s_tcp);
+        return ESP_FAIL;
+    }
+    s_connected = true;
+    ESP_LOGI(TAG, "[ ctrl ] Connected to %s", s_cfg.uri);
+    return ESP_OK;
+}
+
+/*
+ * @return Payload length of the next frame in s_frame, -1 when the link
+ *         is broken. Servers do not mask and our messages are never
+ *         fragmented, either is treated as a protocol error. A control
+ *         frame over 125 bytes is closed with 1002.
+ */
+static int ctrl_read_frame(int* opcode) {
+    uint8_t hdr[2];
+    uint8_t ext[2];
+    if (ctrl_read(hdr, 2, CTRL_IO_MS) != ESP_OK) {
+        return -1;
+    }
+    *opcode = hdr[0] & 0x0f;
+    int len = hdr[1] & 0x7f;
+    if (!(hdr[0] & WS_FIN) || (hdr[1] & WS_MASK) || len == 127) {
+        ESP_LOGW(TAG, "[ ctrl ] Unsupported frame %02x %02x", hdr[0],
+                 hdr[1]);
+        return -1;
+    }
+    if (len == 126) {
+        if (ctrl_read(ext, 2, CTRL_IO_MS) != ESP_OK) {
+            return -1;
+        }
+        len = (ext[0] << 8) | ext[1];
+    }
+    if ((*opcode & WS_OP_CLOSE) && len > WS_CONTROL_MAX) {
+        static const uint8_t code[2] = {WS_CLOSE_PROTOCOL_ERROR >> 8,
+                                        WS_CLOSE_PROTOCOL_ERROR & 0xff};
+        ESP_LOGW(TAG, "[ ctrl ] %d byte control frame %x", len, *opcode);
+        ctrl_write_frame(WS_OP_CLOSE, code, sizeof(code));
+        return -1;
+    }
+    if (len > sizeof(s_frame)) {
+        ESP_LOGW(TAG, "[ ctrl ] %d byte frame too large", len);
+        return -1;
+    }
+    if (len && ctrl_read(s_frame, len, CTRL_IO_MS) != ESP_OK) {
+        return -1;
+    }
+    return len;
+}
+
+static esp_err_t ctrl_handle_frame(int opcode, int len) {
+    switch (opcode) {
+        case WS_OP_PING:
+            return ctrl_write_frame(WS_OP_PONG, s_frame, len);
+        case WS_OP_CLOSE:
+            ESP_LOGI(TAG, "[ ctrl ] Closed by the server");
+            ctrl_write_frame(WS_OP_CLOSE, s_frame, len < 2 ? 0 : 2);
+            return ESP_FAIL;
+        case WS_OP_BINARY:
+            break;
+        default:
+            // Text and pong frames carry nothing for us
+            return ESP_OK;
+    }
+    if (len < 2 || s_frame[0] == CTRL_MSG_HEARTBEAT) {
+        return ESP_OK;
+    }
+    ctrl_msg_t msg = {
+        .type = s_frame[0],
+        .seq = s_frame[1],
+        .payload = s_frame + 2,
+        .len = len - 2,
+    };
+    metrics_add(METRIC_CTRL_COMMANDS, 1);
+    ctrl_status_t status =
+        s_cfg.handle ? s_cfg.handle(&msg) : CTRL_STATUS_UNSUPPORTED;
+    ESP_LOGI(TAG, "[ ctrl ] Command %d seq %d, status %d", msg.type, msg.seq,
+             status);
+    uint8_t ack = status;
+    return ctrl_send(CTRL_MSG_ACK, msg.seq, &ack, 1);
+}
+
+// Sleeps in select() until a frame arrives or the next heartbeat is due
+static void ctrl_session(void) {
+    int64_t interval = (int64_t)s_cfg.heartbeat_s * 1000000;
+    int64_t now = esp_timer_get_time();
+    int64_t last_rx = now;
+    int64_t next_heartbeat = now + interval;
+    while (1) {
+        int wait_ms = (next_heartbeat - now) / 1000;
+        int r = s_rx_len ? 1
+                         : esp_transport_poll_read(s_tcp,
+                                                   wait_ms > 0 ? wait_ms : 0);
+        if (r < 0) {
+            return;
+        }
+        if (r > 0) {
+            int opcode;
+            int len = ctrl_read_frame(&opcode);
+            if (len < 0 || ctrl_handle_frame(opcode, len) != ESP_OK) {
+                return;
+            }
+            last_rx = esp_timer_get_time();
+        }
+        now = esp_timer_get_time();
+        if (now < next_heartbeat) {
+            continue;
+        }
+        if (now - last_rx > 2 * interval) {
+            ESP_LOGW(TAG, "[ ctrl ] Nothing heard for %d s",
+                     (int)((now - last_rx) / 1000000));
+            return;
+        }
+        if (ctrl_send(CTRL_MSG_HEARTBEAT, ctrl_next_seq(), NULL, 0) !=
+            ESP_OK) {
+            return;
+        }
+        next_heartbeat = now + interval;
+    }
+}
+
+static void ctrl_task(void* arg) {
+    int backoff_ms = CTRL_BACKOFF_MIN_MS;
+    while (1) {
+        if (ctrl_connect() == ESP_OK) {
+            metrics_add(METRIC_CTRL_CONNECTS, 1);
+            backoff_ms = CTRL_BACKOFF_MIN_MS;
+            ctrl_session();
+            xSemaphoreTake(s_write_lock, portMAX_DELAY);
+            s_connected = false;
+            esp_transport_close(s_tcp);
+            xSemaphoreGive(s_write_lock);
+            ESP_LOGW(TAG, "[ ctrl ] Disconnected");
+        }
+        vTaskDelay(backoff_ms / portTICK_PERIOD_MS);
+        backoff_ms *= 2;
+        if (backoff_ms > CTRL_BACKOFF_MAX_MS) {
+            backoff_ms = CTRL_BACKOFF_MAX_MS;
+        }
+    }
+}
+
+esp_err_t ctrl_start(const ctrl_cfg_t* cfg) {
+    if (s_tcp) {
+        return ESP_OK;
+    }
+    if (cfg->uri == NULL || cfg->heartbeat_s <= 0 ||
+        ctrl_parse_uri(cfg->uri) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cfg = *cfg;
+    s_write_lock = xSemaphoreCreateMutex();
+    s_tcp = esp_transport_tcp_init();
+    if (s_tcp == NULL || s_write_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const task_placement_t* p = task_placement_get(TASK_SLOT_CTRL);
+    if (xTaskCreatePinnedToCore(ctrl_task, p->name, p->stack, NULL, p->prio,
+                                NULL, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ ctrl ] Error create task");
+        esp_transport_destroy(s_tcp);
+        s_tcp = NULL;
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ ctrl ] %s, heartbeat %d s", s_cfg.uri,
+             s_cfg.heartbeat_s);
+    return ESP_OK;
+}
+
+esp_err_t ctrl_post(ctrl_msg_type_t type, const void* payload, int len) {
+    if (!s_connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ctrl_send(type, ctrl_next_seq(), payload, len);
+}
@@ -0,0 +1,78 @@
+#ifndef _M_CTRL_H_
+#define _M_CTRL_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Server-push control channel: one persistent WebSocket to the server
+ * carrying small binary messages, one per WebSocket frame:
+ *
+ *   u8 type, u8 seq, payload (the rest of the frame)
+ *
+ * The device says HELLO after connecting and sends a HEARTBEAT every
+ * heartbeat_s, which the server echoes. Every server command is answered
+ * with an ACK carrying its seq and a status byte. Between heartbeats the
+ * task sleeps in select(), so an idle channel costs one round trip per
+ * interval. A link silent for two intervals is dropped and reconnected
+ * with exponential backoff.
+ *
+ * END_OF_UTTERANCE is sent while the device uploads a recording, once the
+ * server's recognizer has its final result: the device stops recording
+ * and goes on to the reply without waiting for the end of its window.
+ */
+typedef enum {
+    CTRL_MSG_HELLO = 1,   /* Device: station MAC */
+    CTRL_MSG_HEARTBEAT,   /* Both ways, empty */
+    CTRL_MSG_ACK,         /* Device: seq of the command, u8 ctrl_status_t */
+    CTRL_MSG_PLAY,        /* Server: URL of an MP3 to play, not terminated */
+    CTRL_MSG_VOLUME,      /* Server: u8 volume, 0..100 */
+    CTRL_MSG_PLAY_AT,     /* Server: u64 start_us, u16 group, URL */
+    CTRL_MSG_SYNC_REPORT, /* Device: sync_report_t, see m_sync.h */
+    CTRL_MSG_END_OF_UTTERANCE, /* Server: u32 ms of audio recognized */
+} ctrl_msg_type_t;
+
+typedef enum {
+    CTRL_STATUS_OK,
+    CTRL_STATUS_INVALID, /* Bad payload */
+    CTRL_STATUS_UNSUPPORTED,
+    CTRL_STATUS_FAILED,
+} ctrl_status_t;
+
+typedef struct {
+    ctrl_msg_type_t type;
+    uint8_t seq;
+    const uint8_t* payload;
+    int len;
+} ctrl_msg_t;
+
+/*
+ * Called on the control task for every server command, the returned
+ * status is sent back in the ACK. Do not block in it.
+ */
+typedef ctrl_status_t (*ctrl_handler_t)(const ctrl_msg_t* msg);
+
+typedef struct {
+    const char* uri; /* ws://host[:port]/path */
+    int heartbeat_s;
+    ctrl_handler_t handle;
+} ctrl_cfg_t;
+
+#define CTRL_CFG_DEFAULT()        \
+    {                             \
+        .uri = NULL,              \
+        .heartbeat_s = 30,        \
+        .handle = NULL,           \
+    }
+
+/*
+ * @brief Start the task that keeps the channel connected
+ */
+esp_err_t ctrl_start(const ctrl_cfg_t* cfg);
+
+/*
+ * @brief Send a device message from any task, fails when not connected
+ */
+esp_err_t ctrl_post(ctrl_msg_type_t type, const void* payload, int len);
+
+#endif
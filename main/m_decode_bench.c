@@ -0,0 +1,620 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "rom/crc.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "audio_mem.h"
+#include "audio_pipeline.h"
+#include "fatfs_stream.h"
+#include "filter_resample.h"
+#include "http_stream.h"
+#include "mp3_decoder.h"
+#include "ringbuf.h"
+#include "spiffs_stream.h"
+
+#include "m_assets.h"
+#include "m_decode_bench.h"
+#include "m_includes.h"
+#include "m_profile.h"
+#include "m_tasks.h"
+
+static const char* TAG = "decode_bench";
+
+#define DECODE_BENCH_LINE_MAX 128
+#define DECODE_BENCH_PATH_MAX 128
+#define DECODE_BENCH_RB_MAX 3
+#define DECODE_BENCH_SINK_BUF 4096
+#define DECODE_BENCH_TIMEOUT_MS 60000
+// Resampler pass: a tone at every source rate through each complexity
+#define DECODE_BENCH_RSP_MS 2000
+#define DECODE_BENCH_RSP_SKIP_MS 100 /* Filter delay and start up */
+#define DECODE_BENCH_RSP_AMPLITUDE 16384.0
+#define DECODE_BENCH_RSP_COMPLEXITY_MAX 5
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+#define DECODE_BENCH_RSP_OUT_RATE CONFIG_AUDIO_OUTPUT_SAMPLE_RATE
+#else
+#define DECODE_BENCH_RSP_OUT_RATE 48000
+#endif
+
+typedef enum {
+    DECODE_BENCH_SD,
+    DECODE_BENCH_PROMPT,
+    DECODE_BENCH_HTTP,
+    DECODE_BENCH_CHAIN_NUM
+} decode_bench_chain_id_t;
+
+static const char* s_chain_name[] = {
+    [DECODE_BENCH_SD] = "sd",
+    [DECODE_BENCH_PROMPT] = "prompt",
+    [DECODE_BENCH_HTTP] = "http",
+};
+// Same as play_profile in app_main.c
+static const audio_profile_id_t s_chain_profile[] = {
+    [DECODE_BENCH_SD] = AUDIO_PROFILE_STREAMING,
+    [DECODE_BENCH_PROMPT] = AUDIO_PROFILE_LOW_LATENCY,
+    [DECODE_BENCH_HTTP] = AUDIO_PROFILE_STREAMING,
+};
+
+typedef struct {
+    uint32_t crc;
+    uint32_t bytes;
+    int64_t first_us; /* First PCM, 0 until then */
+    int rb_num;
+    ringbuf_handle_t rb[DECODE_BENCH_RB_MAX];
+    int rb_peak[DECODE_BENCH_RB_MAX];
+} decode_bench_sink_t;
+
+typedef struct {
+    audio_pipeline_handle_t pipeline;
+    audio_element_handle_t reader;
+    audio_element_handle_t mp3;
+    audio_element_handle_t filter; /* NULL unless fixed output rate */
+    audio_element_handle_t sink;
+    decode_bench_sink_t out;
+} decode_bench_chain_t;
+
+// A sine oscillator by rotation, cheaper than sin() per sample
+typedef struct {
+    double s, c;
+    double ds, dc;
+} decode_bench_osc_t;
+
+typedef struct {
+    int rate;
+    int channels;
+    int in_left; /* Source frames still to generate */
+    decode_bench_osc_t gen;
+    uint32_t out_samples; /* Interleaved stereo samples seen */
+    uint32_t skip;        /* Samples not fitted at the start */
+    decode_bench_osc_t ref;
+    // Least squares fit of the left channel to sin and cos of the tone
+    double xx, xs, xc, ss, cc, sc;
+    int64_t cb_us;  /* Spent in the callbacks, not in the resampler */
+    int64_t end_us; /* Last output */
+} decode_bench_rsp_t;
+
+typedef struct {
+    bool ok;
+    bool stable; /* Same PCM on every run */
+    audio_element_info_t info;
+    uint32_t crc;
+    uint32_t bytes;
+    int64_t run_us_min;
+    int64_t run_us_max;
+    int64_t first_us_min;
+    int rb_peak[DECODE_BENCH_RB_MAX];
+} decode_bench_result_t;
+
+// Stands in for the I2S writer: checksums the PCM and samples how full
+// every ringbuffer of the chain is
+static int _sink_process(audio_element_handle_t self, char* in_buffer,
+                         int in_len) {
+    decode_bench_sink_t* s = (decode_bench_sink_t*)audio_element_getdata(self);
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0) {
+        return r;
+    }
+    if (s->first_us == 0) {
+        s->first_us = esp_timer_get_time();
+    }
+    s->crc = crc32_le(s->crc, (const uint8_t*)in_buffer, r);
+    s->bytes += r;
+    for (int i = 0; i < s->rb_num; i++) {
+        int fill = rb_bytes_filled(s->rb[i]);
+        if (fill > s->rb_peak[i]) {
+            s->rb_peak[i] = fill;
+        }
+    }
+    return r;
+}
+
+static audio_element_handle_t decode_bench_sink_init(decode_bench_sink_t* s) {
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.process = _sink_process;
+    cfg.buffer_len = DECODE_BENCH_SINK_BUF;
+    TASK_PLACE(cfg, TASK_SLOT_BENCH_SINK);
+    cfg.tag = "bench_sink";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, return NULL);
+    audio_element_setdata(el, s);
+    return el;
+}
+
+// The play pipeline of `chain` with the I2S writer replaced by the sink
+static esp_err_t decode_bench_chain_init(decode_bench_chain_t* c,
+                                         decode_bench_chain_id_t chain) {
+    const audio_profile_t* prof = audio_profile_get(s_chain_profile[chain]);
+    memset(c, 0, sizeof(*c));
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    pipeline_cfg.rb_size = prof->pipeline_rb_size;
+    c->pipeline = audio_pipeline_init(&pipeline_cfg);
+    AUDIO_MEM_CHECK(TAG, c->pipeline, return ESP_ERR_NO_MEM);
+
+    switch (chain) {
+        case DECODE_BENCH_SD: {
+            fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
+            fatfs_cfg.type = AUDIO_STREAM_READER;
+            fatfs_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(fatfs_cfg, TASK_SLOT_FILE_READER);
+            c->reader = fatfs_stream_init(&fatfs_cfg);
+            break;
+        }
+        case DECODE_BENCH_PROMPT: {
+#if CONFIG_PROMPT_SOURCE_SPIFFS
+            spiffs_stream_cfg_t flash_cfg = SPIFFS_STREAM_CFG_DEFAULT();
+            flash_cfg.type = AUDIO_STREAM_READER;
+            flash_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(flash_cfg, TASK_SLOT_FILE_READER);
+            c->reader = spiffs_stream_init(&flash_cfg);
+#else
+            asset_stream_cfg_t asset_cfg = ASSET_STREAM_CFG_DEFAULT();
+            asset_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(asset_cfg, TASK_SLOT_FILE_READER);
+            c->reader = asset_stream_init(&asset_cfg);
+#endif
+            break;
+        }
+        default: {
+            http_stream_cfg_t http_cfg = HTTP_STREAM_CFG_DEFAULT();
+            http_cfg.out_rb_size = prof->stream_rb_size;
+            TASK_PLACE(http_cfg, TASK_SLOT_HTTP_READER);
+            c->reader = http_stream_init(&http_cfg);
+            break;
+        }
+    }
+    mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    mp3_cfg.out_rb_size = prof->codec_rb_size;
+    TASK_PLACE(mp3_cfg, TASK_SLOT_MP3_DECODER);
+    c->mp3 = mp3_decoder_init(&mp3_cfg);
+    c->sink = decode_bench_sink_init(&c->out);
+    if (c->reader == NULL || c->mp3 == NULL || c->sink == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const char* link_tag[4] = {"reader", "mp3"};
+    int link_num = 2;
+    audio_pipeline_register(c->pipeline, c->reader, "reader");
+    audio_pipeline_register(c->pipeline, c->mp3, "mp3");
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    rsp_filter_cfg_t rsp_cfg = DEFAULT_RESAMPLE_FILTER_CONFIG();
+    rsp_cfg.src_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    rsp_cfg.src_ch = 2;
+    rsp_cfg.dest_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    rsp_cfg.dest_ch = 2;
+    rsp_cfg.complexity = CONFIG_AUDIO_RESAMPLE_COMPLEXITY;
+    rsp_cfg.out_rb_size = prof->codec_rb_size;
+    TASK_PLACE(rsp_cfg, TASK_SLOT_PLAY_FILTER);
+    c->filter = rsp_filter_init(&rsp_cfg);
+    AUDIO_MEM_CHECK(TAG, c->filter, return ESP_ERR_NO_MEM);
+    audio_pipeline_register(c->pipeline, c->filter, "filter");
+    link_tag[link_num++] = "filter";
+#endif
+    audio_pipeline_register(c->pipeline, c->sink, "sink");
+    link_tag[link_num++] = "sink";
+    audio_pipeline_link(c->pipeline, link_tag, link_num);
+
+    c->out.rb[c->out.rb_num++] = audio_element_get_output_ringbuf(c->reader);
+    c->out.rb[c->out.rb_num++] = audio_element_get_output_ringbuf(c->mp3);
+    if (c->filter) {
+        c->out.rb[c->out.rb_num++] =
+            audio_element_get_output_ringbuf(c->filter);
+    }
+    return ESP_OK;
+}
+
+static void decode_bench_chain_deinit(decode_bench_chain_t* c) {
+    audio_element_handle_t el[] = {c->reader, c->mp3, c->filter, c->sink};
+    if (c->pipeline) {
+        audio_pipeline_terminate(c->pipeline);
+        for (int i = 0; i < sizeof(el) / sizeof(el[0]); i++) {
+            if (el[i]) {
+                audio_pipeline_unregister(c->pipeline, el[i]);
+            }
+        }
+        audio_pipeline_deinit(c->pipeline);
+    }
+    for (int i = 0; i < sizeof(el) / sizeof(el[0]); i++) {
+        if (el[i]) {
+            audio_element_deinit(el[i]);
+        }
+    }
+}
+
+// One pass of `uri` through the chain, false on an element error or when
+// the chain does not finish in time
+static bool decode_bench_pass(decode_bench_chain_t* c,
+                              audio_event_iface_handle_t evt, const char* uri,
+                              audio_element_info_t* info, int64_t* run_us,
+                              int64_t* first_us) {
+    memset(c->out.rb_peak, 0, sizeof(c->out.rb_peak));
+    c->out.crc = 0;
+    c->out.bytes = 0;
+    c->out.first_us = 0;
+    audio_element_set_uri(c->reader, uri);
+    int64_t start = esp_timer_get_time();
+    audio_pipeline_run(c->pipeline);
+    bool ok = false;
+    while (1) {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(evt, &msg, DECODE_BENCH_TIMEOUT_MS /
+                                                    portTICK_PERIOD_MS) !=
+            ESP_OK) {
+            ESP_LOGE(TAG, "[ bench ] %s timed out", uri);
+            break;
+        }
+        if (msg.source_type != AUDIO_ELEMENT_TYPE_ELEMENT) {
+            continue;
+        }
+        if (msg.source == (void*)c->mp3 &&
+            msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
+            audio_element_getinfo(c->mp3, info);
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+            rsp_filter_set_src_info(c->filter, info->sample_rates,
+                                    info->channels);
+#endif
+            continue;
+        }
+        if (msg.cmd != AEL_MSG_CMD_REPORT_STATUS) {
+            continue;
+        }
+        int status = (int)msg.data;
+        if (status >= AEL_STATUS_ERROR_OPEN &&
+            status <= AEL_STATUS_ERROR_UNKNOWN) {
+            ESP_LOGE(TAG, "[ bench ] %s failed, status %d", uri, status);
+            break;
+        }
+        if (msg.source == (void*)c->sink &&
+            (status == AEL_STATUS_STATE_STOPPED ||
+             status == AEL_STATUS_STATE_FINISHED)) {
+            ok = c->out.bytes > 0 && info->sample_rates > 0;
+            break;
+        }
+    }
+    *run_us = esp_timer_get_time() - start;
+    *first_us = c->out.first_us - start;
+    stop_pipeline_element(c->pipeline, c->reader, c->mp3, c->sink);
+    return ok;
+}
+
+static void decode_bench_source(decode_bench_chain_t* c,
+                                audio_event_iface_handle_t evt,
+                                const char* uri, int repeat,
+                                decode_bench_result_t* res) {
+    memset(res, 0, sizeof(*res));
+    res->stable = true;
+    for (int i = 0; i < repeat; i++) {
+        audio_element_info_t info = {0};
+        int64_t run_us, first_us;
+        res->ok = decode_bench_pass(c, evt, uri, &info, &run_us, &first_us);
+        if (!res->ok) {
+            return;
+        }
+        if (i == 0) {
+            res->info = info;
+            res->crc = c->out.crc;
+            res->bytes = c->out.bytes;
+            res->run_us_min = run_us;
+            res->first_us_min = first_us;
+        } else if (c->out.crc != res->crc || c->out.bytes != res->bytes) {
+            res->stable = false;
+        }
+        if (run_us < res->run_us_min) {
+            res->run_us_min = run_us;
+        }
+        if (run_us > res->run_us_max) {
+            res->run_us_max = run_us;
+        }
+        if (first_us < res->first_us_min) {
+            res->first_us_min = first_us;
+        }
+        for (int j = 0; j < c->out.rb_num; j++) {
+            if (c->out.rb_peak[j] > res->rb_peak[j]) {
+                res->rb_peak[j] = c->out.rb_peak[j];
+            }
+        }
+    }
+}
+
+static void decode_bench_print(decode_bench_chain_t* c,
+                               decode_bench_chain_id_t chain,
+                               const char* source,
+                               const decode_bench_result_t* res) {
+    printf("DECODE_BENCH {\"type\":\"source\",\"chain\":\"%s\","
+           "\"source\":\"%s\",\"ok\":%s",
+           s_chain_name[chain], source, res->ok ? "true" : "false");
+    if (!res->ok) {
+        printf("}\n");
+        return;
+    }
+#if CONFIG_AUDIO_FIXED_OUTPUT_RATE
+    int out_rate = CONFIG_AUDIO_OUTPUT_SAMPLE_RATE;
+    int out_ch = 2;
+#else
+    int out_rate = res->info.sample_rates;
+    int out_ch = res->info.channels;
+#endif
+    // MPEG-1 layer III frames carry 1152 samples, MPEG-2 and 2.5 576
+    int frame_samples = res->info.sample_rates >= 32000 ? 1152 : 576;
+    uint64_t out_samples = res->bytes / (out_ch * sizeof(int16_t));
+    uint64_t duration_us = out_samples * 1000000 / out_rate;
+    uint32_t frames =
+        out_samples * res->info.sample_rates / out_rate / frame_samples;
+    printf(",\"stable\":%s,\"rate\":%d,\"channels\":%d,\"out_rate\":%d,"
+           "\"out_channels\":%d,\"bytes\":%u,\"crc32\":\"%08x\","
+           "\"frames\":%u,\"duration_us\":%llu,\"run_us_min\":%lld,"
+           "\"run_us_max\":%lld,\"first_pcm_us\":%lld,"
+           "\"chain_us_per_frame\":%.1f,\"rtf\":%.4f,\"rb_peak\":[",
+           res->stable ? "true" : "false", res->info.sample_rates,
+           res->info.channels, out_rate, out_ch, res->bytes, res->crc, frames,
+           duration_us, res->run_us_min, res->run_us_max, res->first_us_min,
+           frames ? (double)res->run_us_min / frames : 0.0,
+           duration_us ? (double)res->run_us_min / duration_us : 0.0);
+    for (int i = 0; i < c->out.rb_num; i++) {
+        printf("%s%d", i ? "," : "", res->rb_peak[i]);
+    }
+    printf("],\"rb_size\":[");
+    for (int i = 0; i < c->out.rb_num; i++) {
+        printf("%s%d", i ? "," : "", rb_get_size(c->out.rb[i]));
+    }
+    printf("]}\n");
+}
+
+static void decode_bench_osc_init(decode_bench_osc_t* o, double hz,
+                                  int rate) {
+    double w = 2 * M_PI * hz / rate;
+    o->s = 0;
+    o->c = 1;
+    o->ds = sin(w);
+    o->dc = cos(w);
+}
+
+static void decode_bench_osc_step(decode_bench_osc_t* o) {
+    double s = o->s * o->dc + o->c * o->ds;
+    o->c = o->c * o->dc - o->s * o->ds;
+    o->s = s;
+}
+
+// Source of the resampler: the tone at the source rate
+static int _rsp_read(audio_element_handle_t self, char* buffer, int len,
+                     TickType_t ticks_to_wait, void* context) {
+    decode_bench_rsp_t* t = (decode_bench_rsp_t*)context;
+    int64_t start = esp_timer_get_time();
+    int16_t* pcm = (int16_t*)buffer;
+    int frames = len / (t->channels * sizeof(int16_t));
+    if (frames > t->in_left) {
+        frames = t->in_left;
+    }
+    if (frames == 0) {
+        return AEL_IO_DONE;
+    }
+    for (int i = 0; i < frames; i++) {
+        int16_t v = lrint(t->gen.s * DECODE_BENCH_RSP_AMPLITUDE);
+        for (int ch = 0; ch < t->channels; ch++) {
+            *pcm++ = v;
+        }
+        decode_bench_osc_step(&t->gen);
+    }
+    t->in_left -= frames;
+    t->cb_us += esp_timer_get_time() - start;
+    return frames * t->channels * sizeof(int16_t);
+}
+
+// Sink of the resampler: fits the left channel to the tone at the output
+// rate, whatever does not fit is noise and distortion
+static int _rsp_write(audio_element_handle_t self, char* buffer, int len,
+                      TickType_t ticks_to_wait, void* context) {
+    decode_bench_rsp_t* t = (decode_bench_rsp_t*)context;
+    int64_t start = esp_timer_get_time();
+    const int16_t* pcm = (const int16_t*)buffer;
+    for (int i = 0; i < len / (int)sizeof(int16_t); i++, t->out_samples++) {
+        if (t->out_samples & 1) {
+            continue;
+        }
+        if (t->out_samples >= t->skip) {
+            double x = pcm[i];
+            t->xx += x * x;
+            t->xs += x * t->ref.s;
+            t->xc += x * t->ref.c;
+            t->ss += t->ref.s * t->ref.s;
+            t->cc += t->ref.c * t->ref.c;
+            t->sc += t->ref.s * t->ref.c;
+        }
+        decode_bench_osc_step(&t->ref);
+    }
+    t->end_us = esp_timer_get_time();
+    t->cb_us += t->end_us - start;
+    return len;
+}
+
+// One tone through the resampler at `complexity`, false when it failed.
+// Prints the SNR (noise and distortion) and resampler time per second of
+// output.
+static bool decode_bench_resample(audio_event_iface_handle_t evt, int rate,
+                                  int channels, int complexity, int tone_hz) {
+    decode_bench_rsp_t t = {
+        .rate = rate,
+        .channels = channels,
+        .in_left = rate * DECODE_BENCH_RSP_MS / 1000,
+        .skip = 2 * DECODE_BENCH_RSP_OUT_RATE * DECODE_BENCH_RSP_SKIP_MS / 1000,
+    };
+    decode_bench_osc_init(&t.gen, tone_hz, rate);
+    decode_bench_osc_init(&t.ref, tone_hz, DECODE_BENCH_RSP_OUT_RATE);
+
+    rsp_filter_cfg_t rsp_cfg = DEFAULT_RESAMPLE_FILTER_CONFIG();
+    rsp_cfg.src_rate = rate;
+    rsp_cfg.src_ch = channels;
+    rsp_cfg.dest_rate = DECODE_BENCH_RSP_OUT_RATE;
+    rsp_cfg.dest_ch = 2;
+    rsp_cfg.complexity = complexity;
+    TASK_PLACE(rsp_cfg, TASK_SLOT_PLAY_FILTER);
+    audio_element_handle_t filter = rsp_filter_init(&rsp_cfg);
+    AUDIO_MEM_CHECK(TAG, filter, return false);
+    audio_element_set_read_cb(filter, _rsp_read, &t);
+    audio_element_set_write_cb(filter, _rsp_write, &t);
+    audio_element_msg_set_listener(filter, evt);
+
+    int64_t start = esp_timer_get_time();
+    audio_element_run(filter);
+    audio_element_resume(filter, 0, 0);
+    bool ok = false;
+    while (1) {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(evt, &msg, DECODE_BENCH_TIMEOUT_MS /
+                                                    portTICK_PERIOD_MS) !=
+            ESP_OK) {
+            ESP_LOGE(TAG, "[ bench ] Resampler timed out");
+            break;
+        }
+        if (msg.source != (void*)filter ||
+            msg.cmd != AEL_MSG_CMD_REPORT_STATUS) {
+            continue;
+        }
+        int status = (int)msg.data;
+        if (status == AEL_STATUS_STATE_FINISHED) {
+            ok = t.out_samples > t.skip;
+            break;
+        }
+        if (status >= AEL_STATUS_ERROR_OPEN &&
+            status <= AEL_STATUS_ERROR_UNKNOWN) {
+            ESP_LOGE(TAG, "[ bench ] Resampler failed, status %d", status);
+            break;
+        }
+    }
+    audio_element_terminate(filter);
+    audio_element_msg_remove_listener(filter, evt);
+    audio_element_deinit(filter);
+
+    printf("DECODE_BENCH {\"type\":\"resample\",\"rate\":%d,\"channels\":%d,"
+           "\"out_rate\":%d,\"complexity\":%d,\"tone_hz\":%d,\"ok\":%s",
+           rate, channels, DECODE_BENCH_RSP_OUT_RATE, complexity, tone_hz,
+           ok ? "true" : "false");
+    if (!ok) {
+        printf("}\n");
+        return false;
+    }
+    double det = t.ss * t.cc - t.sc * t.sc;
+    double a = (t.xs * t.cc - t.xc * t.sc) / det;
+    double b = (t.xc * t.ss - t.xs * t.sc) / det;
+    double signal = a * t.xs + b * t.xc;
+    double noise = t.xx - signal;
+    double out_s = (double)t.out_samples / 2 / DECODE_BENCH_RSP_OUT_RATE;
+    int64_t rsp_us = t.end_us - start - t.cb_us;
+    printf(",\"snr_db\":%.1f,\"gain_db\":%.2f,\"us_per_s\":%.0f}\n",
+           noise > 0 ? 10 * log10(signal / noise) : 200.0,
+           20 * log10(sqrt(a * a + b * b) / DECODE_BENCH_RSP_AMPLITUDE),
+           rsp_us / out_s);
+    return true;
+}
+
+esp_err_t decode_bench_run(const char* dir, int repeat) {
+    char path[DECODE_BENCH_PATH_MAX];
+    char line[DECODE_BENCH_LINE_MAX];
+
+    snprintf(path, sizeof(path), "%s/INDEX.TXT", dir);
+    FILE* index = fopen(path, "r");
+    if (index == NULL) {
+        ESP_LOGE(TAG, "[ bench ] Cannot open %s", path);
+        return ESP_FAIL;
+    }
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    if (evt == NULL) {
+        fclose(index);
+        return ESP_ERR_NO_MEM;
+    }
+    printf("DECODE_BENCH {\"type\":\"start\",\"cpu_mhz\":%d,\"repeat\":%d}\n",
+           CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ, repeat);
+
+    // One chain at a time, the heap does not hold all three
+    for (int chain = 0; chain < DECODE_BENCH_CHAIN_NUM; chain++) {
+        decode_bench_chain_t c;
+        bool built = false;
+        rewind(index);
+        while (fgets(line, sizeof(line), index)) {
+            char name[8];
+            char source[DECODE_BENCH_LINE_MAX];
+            if (line[0] == '#' ||
+                sscanf(line, "%7s %127s", name, source) != 2 ||
+                strcmp(name, s_chain_name[chain]) != 0) {
+                continue;
+            }
+            if (!built) {
+                if (decode_bench_chain_init(&c, chain) != ESP_OK) {
+                    ESP_LOGE(TAG, "[ bench ] Cannot build the %s chain",
+                             s_chain_name[chain]);
+                    decode_bench_chain_deinit(&c);
+                    break;
+                }
+                audio_pipeline_set_listener(c.pipeline, evt);
+                built = true;
+            }
+            if (chain == DECODE_BENCH_SD) {
+                snprintf(path, sizeof(path), "%s/%s", dir, source);
+            } else {
+                snprintf(path, sizeof(path), "%s", source);
+            }
+            ESP_LOGI(TAG, "[ bench ] %s %s", s_chain_name[chain], path);
+            decode_bench_result_t res;
+            decode_bench_source(&c, evt, path, repeat, &res);
+            decode_bench_print(&c, chain, source, &res);
+        }
+        if (built) {
+            audio_pipeline_remove_listener(c.pipeline);
+            decode_bench_chain_deinit(&c);
+        }
+    }
+
+    // Every source rate listed through every resampler complexity, with a
+    // tone in the middle of the band and one near its top
+    rewind(index);
+    while (fgets(line, sizeof(line), index)) {
+        char name[8];
+        int rate, channels;
+        if (line[0] == '#' ||
+            sscanf(line, "%7s %d %d", name, &rate, &channels) != 3 ||
+            strcmp(name, "rsp") != 0 || rate <= 0 || channels < 1 ||
+            channels > 2) {
+            continue;
+        }
+        int band = rate < DECODE_BENCH_RSP_OUT_RATE ? rate
+                                                    : DECODE_BENCH_RSP_OUT_RATE;
+        int tones[] = {1000, band * 4 / 10};
+        for (int c = 1; c <= DECODE_BENCH_RSP_COMPLEXITY_MAX; c++) {
+            for (int i = 0; i < sizeof(tones) / sizeof(tones[0]); i++) {
+                decode_bench_resample(evt, rate, channels, c, tones[i]);
+            }
+        }
+    }
+    printf("DECODE_BENCH {\"type\":\"end\"}\n");
+
+    audio_event_iface_destroy(evt);
+    fclose(index);
+    return ESP_OK;
+}
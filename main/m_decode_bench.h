@@ -0,0 +1,36 @@
+#ifndef _M_DECODE_BENCH_H_
+#define _M_DECODE_BENCH_H_
+
+#include "esp_err.h"
+
+/*
+ * Headless benchmark and golden-output check of the playback chains. Each
+ * line of <dir>/INDEX.TXT names a chain and a source, written by
+ * tools/decode_bench.py:
+ *
+ *   sd      ZALE.MP3                        file in <dir>
+ *   prompt  /spiffs/enwozai.mp3             prompt storage
+ *   http    http://host/ai/bench/r1.mp3     canned reply on the server
+ *   rsp     16000 1                         source rate and channels
+ *
+ * A chain is built like its play pipeline (reader, mp3 decoder, the
+ * resampler with CONFIG_AUDIO_FIXED_OUTPUT_RATE, same buffering profile)
+ * but ends in a sink that takes PCM as fast as it comes, so a run lasts
+ * as long as reading and decoding. Each source runs `repeat` times and
+ * one DECODE_BENCH JSON line carries the fastest run: wall time of the
+ * whole chain per MP3 frame (reading, decoding, resampling and the sink
+ * together, the decoder is a prebuilt element and is not timed alone),
+ * real-time factor, peak fill of every ringbuffer and the
+ * CRC32 of the PCM, which has to match across runs.
+ *
+ * The rsp lines check the output resampler on its own, fed by callbacks
+ * instead of a decoder: a tone at 1 kHz and one at 40% of the narrower
+ * band goes through every complexity, from the source rate to the output
+ * rate (CONFIG_AUDIO_OUTPUT_SAMPLE_RATE, 48 kHz without the fixed rate
+ * mode). Each line carries the SNR, noise and distortion together, found
+ * by a least squares fit of the tone, and the resampler's time per second
+ * of output, callbacks excluded.
+ */
+esp_err_t decode_bench_run(const char* dir, int repeat);
+
+#endif
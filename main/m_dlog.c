@@ -0,0 +1,167 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "m_dlog.h"
+#include "m_tasks.h"
+
+static const char* TAG = "dlog";
+
+#define DLOG_RING_SIZE CONFIG_DLOG_RING_SIZE
+#define DLOG_RING_MASK (DLOG_RING_SIZE - 1)
+#define DLOG_FLUSH_MS 50
+// One printed record, longer ones are cut
+#define DLOG_LINE_MAX 192
+
+_Static_assert((DLOG_RING_SIZE & DLOG_RING_MASK) == 0,
+               "DLOG_RING_SIZE must be a power of two");
+
+typedef struct {
+    uint32_t seq;
+    const char* tag;
+    const char* fmt;
+    uint32_t time_ms;
+    uint8_t level;
+    uint8_t arg_num;
+    uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+/*
+ * Bounded multi-producer ring. Slot i is free for the producer that
+ * reserved position pos when seq + i == pos, and holds a record for the
+ * consumer at position pos when seq + i == pos + 1. Storing seq relative
+ * to the slot index lets the zeroed ring be used before dlog_start().
+ */
+static dlog_record_t s_ring[DLOG_RING_SIZE];
+static uint32_t s_head;
+static uint32_t s_tail;
+static uint32_t s_dropped;
+
+void dlog_write(esp_log_level_t level, const char* tag, const char* fmt,
+                int arg_num, ...) {
+    uint32_t pos = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+    uint32_t idx;
+    dlog_record_t* r;
+    while (1) {
+        idx = pos & DLOG_RING_MASK;
+        r = &s_ring[idx];
+        int32_t diff =
+            (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + idx - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&s_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full, never block the caller
+            __atomic_fetch_add(&s_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    r->tag = tag;
+    r->fmt = fmt;
+    r->time_ms = esp_log_timestamp();
+    r->level = level;
+    r->arg_num = arg_num;
+    va_list ap;
+    va_start(ap, arg_num);
+    for (int i = 0; i < arg_num; i++) {
+        r->args[i] = va_arg(ap, uint32_t);
+    }
+    va_end(ap);
+    __atomic_store_n(&r->seq, pos + 1 - idx, __ATOMIC_RELEASE);
+}
+
+static bool dlog_pop(dlog_record_t* out) {
+    uint32_t idx = s_tail & DLOG_RING_MASK;
+    dlog_record_t* r = &s_ring[idx];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + idx != s_tail + 1) {
+        return false;
+    }
+    *out = *r;
+    __atomic_store_n(&r->seq, s_tail + DLOG_RING_SIZE - idx, __ATOMIC_RELEASE);
+    s_tail++;
+    return true;
+}
+
+// Formatted first and written once, so the ESP_LOGx lines of other tasks
+// cannot land inside a record. Only the dlog task prints.
+static void dlog_print(const dlog_record_t* r) {
+    static const char level_char[] = "NEWIDV";
+    static char line[DLOG_LINE_MAX];
+    uint32_t a[DLOG_MAX_ARGS] = {0};
+    for (int i = 0; i < r->arg_num; i++) {
+        a[i] = r->args[i];
+    }
+    int len = snprintf(line, sizeof(line), "%c (%u) %s: ",
+                       level_char[r->level], r->time_ms, r->tag);
+    if (len < sizeof(line)) {
+        snprintf(line + len, sizeof(line) - len, r->fmt, a[0], a[1], a[2],
+                 a[3]);
+    }
+    esp_log_write(r->level, r->tag, "%s\n", line);
+}
+
+static void dlog_task(void* arg) {
+    dlog_record_t r;
+    uint32_t reported = 0;
+    while (1) {
+        while (dlog_pop(&r)) {
+            dlog_print(&r);
+        }
+        uint32_t dropped = dlog_dropped();
+        if (dropped != reported) {
+            ESP_LOGW(TAG, "[ dlog ] %u records dropped", dropped - reported);
+            reported = dropped;
+        }
+        vTaskDelay(DLOG_FLUSH_MS / portTICK_PERIOD_MS);
+    }
+}
+
+esp_err_t dlog_start(void) {
+    const task_placement_t* p = task_placement_get(TASK_SLOT_DLOG);
+    if (xTaskCreatePinnedToCore(dlog_task, p->name, p->stack, NULL, p->prio,
+                                NULL, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ dlog ] Error create dlog task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+uint32_t dlog_dropped(void) {
+    return __atomic_load_n(&s_dropped, __ATOMIC_RELAXED);
+}
+
+#if CONFIG_DLOG_BENCHMARK
+#define DLOG_BENCH_CALLS 64
+
+void dlog_benchmark(void) {
+    static const char* BENCH_TAG = "dlog_bench";
+    esp_log_level_set(BENCH_TAG, ESP_LOG_INFO);
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < DLOG_BENCH_CALLS; i++) {
+        ESP_LOGI(BENCH_TAG, "chunk %d, total %d", i, i * 1024);
+    }
+    int64_t sync_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < DLOG_BENCH_CALLS; i++) {
+        DLOGI(BENCH_TAG, "chunk %d, total %d", i, i * 1024);
+    }
+    int64_t dlog_us = esp_timer_get_time() - start;
+
+    ESP_LOGI(TAG, "[ dlog ] %d calls: ESP_LOGI %lld ns/call, DLOGI %lld ns/call",
+             DLOG_BENCH_CALLS, sync_us * 1000 / DLOG_BENCH_CALLS,
+             dlog_us * 1000 / DLOG_BENCH_CALLS);
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef _M_DLOG_H_
+#define _M_DLOG_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+/*
+ * Deferred logging for streaming paths. A call stores the tag and format
+ * pointers and up to four 32 bit arguments in a lock-free ring; a low
+ * priority task formats and prints them later. Levels above
+ * CONFIG_DLOG_LEVEL compile to nothing.
+ *
+ * Arguments are stored by value: %d, %u, %x, %p and %c only, %s only for
+ * strings that outlive the call (literals).
+ */
+#define DLOG_LEVEL CONFIG_DLOG_LEVEL
+#define DLOG_MAX_ARGS 4
+
+void dlog_write(esp_log_level_t level, const char* tag, const char* fmt,
+                int arg_num, ...);
+
+#define DLOG_NARGS_(_0, _1, _2, _3, _4, _5, N, ...) N
+#define DLOG_NARGS(...) \
+    DLOG_NARGS_(_0, ##__VA_ARGS__, DLOG_TOO_MANY_ARGS, 4, 3, 2, 1, 0)
+
+#define DLOG_AT(level, tag, fmt, ...)                                   \
+    do {                                                                \
+        if (DLOG_LEVEL >= (level)) {                                    \
+            dlog_write((level), (tag), (fmt), DLOG_NARGS(__VA_ARGS__),  \
+                       ##__VA_ARGS__);                                  \
+        }                                                               \
+    } while (0)
+
+#define DLOGE(tag, fmt, ...) DLOG_AT(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define DLOGW(tag, fmt, ...) DLOG_AT(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define DLOGI(tag, fmt, ...) DLOG_AT(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define DLOGD(tag, fmt, ...) DLOG_AT(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define DLOGV(tag, fmt, ...) DLOG_AT(ESP_LOG_VERBOSE, tag, fmt, ##__VA_ARGS__)
+
+/*
+ * @brief Start the task that formats the ring, records written before
+ *        are kept until then
+ */
+esp_err_t dlog_start(void);
+
+/*
+ * @brief Records lost because the ring was full
+ */
+uint32_t dlog_dropped(void);
+
+/*
+ * @brief Log the per-call cost of DLOGI against ESP_LOGI
+ */
+void dlog_benchmark(void);
+
+#endif
@@ -6,10 +6,30 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
-#define SERVER_URL_PLAY_MP3 "http://192.168.0.174/ai/tts/output.mp3"
-#define SERVER_URL_REC_HTTP "http://192.168.0.174/ai/speech/test2"
+#if CONFIG_TLS_ENABLE
+// Upload and reply streams, through the TLS tunnel, see m_tls.h. The port
+// is server.py's TLS_PORT and has to match SERVER_TLS_PORT.
+#define SERVER_ORIGIN "https://192.168.0.174:8443"
+#else
+#define SERVER_ORIGIN "http://192.168.0.174"
+#endif
+#define SERVER_TLS_HOST "192.168.0.174"
+#define SERVER_TLS_PORT 8443
+#define SERVER_URL_PLAY_MP3 SERVER_ORIGIN "/ai/tts/output.mp3"
+// Per-request replies: the upload response names "reply_id: <id>"
+#define SERVER_URL_REPLY SERVER_ORIGIN "/ai/reply/"
+#define REPLY_ID_MAX 32
+#define SERVER_URL_REC_HTTP SERVER_ORIGIN "/ai/speech/test2"
 #define SERVER_URL_SDCARD "/sdcard/test.mp3"
+// Control channel, see m_ctrl.h
+#define SERVER_URL_CTRL "ws://192.168.0.174/ai/ctrl"
+// Group clock, see m_sync.h
+#define SERVER_SYNC_HOST "192.168.0.174"
+#define SERVER_SYNC_PORT 8001
+// Update manifest, see m_ota.h, on server.py's TLS port
+#define SERVER_URL_OTA SERVER_ORIGIN "/ai/ota/manifest.txt"
 
 typedef enum { INPUT_STREAM_REC, INPUT_STREAM_ASR } input_stream_t;
 
@@ -19,6 +39,14 @@ typedef enum {
     OUTPUT_STREAM_SDCARD
 } output_stream_t;
 
+// Mixer inputs, a higher index ducks the lower ones
+typedef enum {
+    MIX_INPUT_MUSIC,
+    MIX_INPUT_REPLY,
+    MIX_INPUT_PROMPT,
+    MIX_INPUT_NUM
+} mix_input_t;
+
 typedef enum {
     CHOOSE_STREAM_IDLE,
     CHOOSE_STREAM_SDCAED,
@@ -44,6 +72,13 @@ esp_err_t stop_pipeline_element(audio_pipeline_handle_t pe_handle,
                                 audio_element_handle_t eh2,
                                 audio_element_handle_t eh3);
 audio_pipeline_handle_t create_play_pipeline(output_stream_t output_type);
+audio_pipeline_handle_t create_mix_pipeline(void);
+void play_output_start(void);
+void play_output_drain(int mix_input);
+void play_output_idle(void);
+void play_output_set_info(audio_element_handle_t i2s,
+                          audio_element_handle_t filter,
+                          audio_element_info_t* info);
 audio_pipeline_handle_t create_rec_pipeline(input_stream_t input_type);
 
 #endif
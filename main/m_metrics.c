@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+
+#include "audio_element.h"
+#include "ringbuf.h"
+
+#include "m_metrics.h"
+#include "m_metrics_text.h"
+#include "m_profile.h"
+#include "m_tasks.h"
+
+static const char* TAG = "metrics";
+
+#define METRICS_BUF_SIZE (4 * 1024)
+#define METRICS_WATCH_MAX 12
+#define METRICS_PIPELINE_MAX 8
+#define METRICS_BUCKET_MAX 8
+
+static const char* s_counter_name[METRIC_COUNTER_NUM] = {
+    [METRIC_WAKES] = "wake_total",
+    [METRIC_UPLOADS] = "upload_total",
+    [METRIC_UPLOAD_BYTES] = "upload_bytes_total",
+    [METRIC_UPLOAD_EARLY_ENDS] = "upload_early_end_total",
+    [METRIC_REPLY_CACHE_HITS] = "reply_cache_hit_total",
+    [METRIC_REPLY_CACHE_MISSES] = "reply_cache_miss_total",
+    [METRIC_REPLY_CACHE_SAVED_BYTES] = "reply_cache_saved_bytes_total",
+    [METRIC_NSAGC_OVER_BUDGET] = "nsagc_over_budget_total",
+    [METRIC_SESSION_REC_BYTES] = "session_rec_bytes_total",
+    [METRIC_SESSION_REC_DROPPED_BYTES] = "session_rec_dropped_bytes_total",
+    [METRIC_CTRL_CONNECTS] = "ctrl_connect_total",
+    [METRIC_CTRL_COMMANDS] = "ctrl_command_total",
+    [METRIC_SYNC_INSERTED_FRAMES] = "sync_inserted_frames_total",
+    [METRIC_SYNC_DROPPED_FRAMES] = "sync_dropped_frames_total",
+    [METRIC_OTA_BYTES] = "ota_bytes_total",
+    [METRIC_OTA_UPDATES] = "ota_update_total",
+    [METRIC_OTA_FAILURES] = "ota_failure_total",
+    [METRIC_OTA_PAUSED_MS] = "ota_paused_ms_total",
+    [METRIC_TLS_FAILURES] = "tls_handshake_failure_total",
+};
+
+typedef struct {
+    const char* name;
+    uint32_t bounds[METRICS_BUCKET_MAX];
+    int bucket_num;
+} metrics_hist_def_t;
+
+static const metrics_hist_def_t s_hist_def[METRIC_HIST_NUM] = {
+    [METRIC_HIST_DETECT_CHUNK_US] = {"wake_detect_chunk_us",
+                                     {1000, 2000, 5000, 10000, 20000, 30000,
+                                      50000},
+                                     7},
+    [METRIC_HIST_UPLOAD_MS] = {"upload_duration_ms",
+                               {250, 500, 1000, 2000, 4000, 8000},
+                               6},
+    [METRIC_HIST_SESSION_REC_US] = {"session_rec_write_us",
+                                    {5, 10, 20, 50, 100, 200, 500, 1000},
+                                    8},
+    [METRIC_HIST_SYNC_RTT_US] = {"sync_rtt_us",
+                                 {1000, 2000, 5000, 10000, 20000, 50000,
+                                  100000},
+                                 7},
+    [METRIC_HIST_SYNC_ERROR_US] = {"sync_error_us",
+                                   {100, 250, 500, 1000, 2500, 5000, 10000,
+                                    50000},
+                                   8},
+    [METRIC_HIST_START_MS] = {"pipeline_start_ms",
+                              {50, 100, 200, 300, 500, 1000, 2000, 5000},
+                              8},
+    [METRIC_HIST_OTA_CHUNK_US] = {"ota_chunk_us",
+                                  {10000, 20000, 50000, 100000, 200000,
+                                   500000},
+                                  6},
+    [METRIC_HIST_TLS_FULL_MS] = {"tls_full_handshake_ms",
+                                 {50, 100, 200, 500, 1000, 2000, 5000},
+                                 7},
+    [METRIC_HIST_TLS_RESUMED_MS] = {"tls_resumed_handshake_ms",
+                                    {10, 20, 50, 100, 200, 500, 1000},
+                                    7},
+};
+
+typedef struct {
+    uint32_t counts[METRICS_BUCKET_MAX + 1];
+    uint64_t sum;
+} metrics_hist_t;
+
+typedef struct {
+    const char* name;
+    audio_element_handle_t el;
+} metrics_watch_t;
+
+typedef struct {
+    const char* name;
+    int bytes;
+} metrics_heap_t;
+
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_counter[METRIC_COUNTER_NUM];
+static metrics_hist_t s_hist[METRIC_HIST_NUM];
+static metrics_watch_t s_watch[METRICS_WATCH_MAX];
+static int s_watch_num;
+static metrics_heap_t s_heap[METRICS_PIPELINE_MAX];
+static int s_heap_num;
+
+void metrics_add(metric_counter_t counter, uint32_t n) {
+    portENTER_CRITICAL(&s_mux);
+    s_counter[counter] += n;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+void metrics_observe(metric_hist_t hist, uint32_t value) {
+    const metrics_hist_def_t* def = &s_hist_def[hist];
+    int i = 0;
+    while (i < def->bucket_num && value > def->bounds[i]) {
+        i++;
+    }
+    portENTER_CRITICAL(&s_mux);
+    s_hist[hist].counts[i]++;
+    s_hist[hist].sum += value;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+void metrics_watch_element(const char* name, audio_element_handle_t el) {
+    if (s_watch_num < METRICS_WATCH_MAX) {
+        s_watch[s_watch_num].name = name;
+        s_watch[s_watch_num].el = el;
+        s_watch_num++;
+    }
+}
+
+void metrics_set_pipeline_heap(const char* name, int bytes) {
+    if (s_heap_num < METRICS_PIPELINE_MAX) {
+        s_heap[s_heap_num].name = name;
+        s_heap[s_heap_num].bytes = bytes;
+        s_heap_num++;
+    }
+}
+
+static void metrics_render(metrics_text_t* t) {
+    char label[48];
+    uint32_t counter[METRIC_COUNTER_NUM];
+    metrics_hist_t hist[METRIC_HIST_NUM];
+    portENTER_CRITICAL(&s_mux);
+    memcpy(counter, s_counter, sizeof(counter));
+    memcpy(hist, s_hist, sizeof(hist));
+    portEXIT_CRITICAL(&s_mux);
+
+    for (int i = 0; i < METRIC_COUNTER_NUM; i++) {
+        metrics_text_type(t, s_counter_name[i], "counter");
+        metrics_text_value(t, s_counter_name[i], NULL, counter[i]);
+    }
+    for (int i = 0; i < METRIC_HIST_NUM; i++) {
+        metrics_text_hist(t, s_hist_def[i].name, s_hist_def[i].bounds,
+                          hist[i].counts, s_hist_def[i].bucket_num,
+                          hist[i].sum);
+    }
+
+    metrics_text_type(t, "underrun_total", "counter");
+    for (int i = 0; i < AUDIO_PROFILE_NUM; i++) {
+        snprintf(label, sizeof(label), "profile=\"%s\"",
+                 audio_profile_get(i)->name);
+        metrics_text_value(t, "underrun_total", label,
+                           audio_profile_underruns(i));
+    }
+
+    metrics_text_type(t, "overrun_ms_total", "counter");
+    for (int i = 0; i < AUDIO_PROFILE_NUM; i++) {
+        snprintf(label, sizeof(label), "profile=\"%s\"",
+                 audio_profile_get(i)->name);
+        metrics_text_value(t, "overrun_ms_total", label,
+                           audio_profile_overrun_ms(i));
+    }
+
+    metrics_text_type(t, "ringbuf_filled_bytes", "gauge");
+    metrics_text_type(t, "ringbuf_size_bytes", "gauge");
+    for (int i = 0; i < s_watch_num; i++) {
+        ringbuf_handle_t rb = audio_element_get_output_ringbuf(s_watch[i].el);
+        if (rb == NULL) {
+            continue;
+        }
+        snprintf(label, sizeof(label), "element=\"%s\"", s_watch[i].name);
+        metrics_text_value(t, "ringbuf_filled_bytes", label,
+                           rb_bytes_filled(rb));
+        metrics_text_value(t, "ringbuf_size_bytes", label, rb_get_size(rb));
+    }
+
+    metrics_text_type(t, "pipeline_heap_bytes", "gauge");
+    for (int i = 0; i < s_heap_num; i++) {
+        snprintf(label, sizeof(label), "pipeline=\"%s\"", s_heap[i].name);
+        metrics_text_value(t, "pipeline_heap_bytes", label, s_heap[i].bytes);
+    }
+    metrics_text_type(t, "heap_free_bytes", "gauge");
+    metrics_text_value(t, "heap_free_bytes", NULL, esp_get_free_heap_size());
+    metrics_text_type(t, "heap_min_free_bytes", "gauge");
+    metrics_text_value(t, "heap_min_free_bytes", NULL,
+                       esp_get_minimum_free_heap_size());
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        metrics_text_type(t, "wifi_rssi_dbm", "gauge");
+        metrics_text_value(t, "wifi_rssi_dbm", NULL, ap.rssi);
+    }
+
+    task_stat_t* tasks = malloc(TASK_STATS_MAX * sizeof(task_stat_t));
+    int task_num = tasks ? task_stats_get(tasks, TASK_STATS_MAX) : 0;
+    if (task_num) {
+        metrics_text_type(t, "task_cpu_permille", "gauge");
+        metrics_text_type(t, "task_stack_min_bytes", "gauge");
+    }
+    for (int i = 0; i < task_num; i++) {
+        snprintf(label, sizeof(label), "task=\"%s\"", tasks[i].name);
+        metrics_text_value(t, "task_cpu_permille", label,
+                           tasks[i].cpu_permille);
+        metrics_text_value(t, "task_stack_min_bytes", label,
+                           tasks[i].stack_min);
+    }
+    free(tasks);
+}
+
+static esp_err_t metrics_get_handler(httpd_req_t* req) {
+    char* buf = malloc(METRICS_BUF_SIZE);
+    if (buf == NULL) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    metrics_text_t t;
+    metrics_text_init(&t, buf, METRICS_BUF_SIZE);
+    metrics_render(&t);
+    if (!metrics_text_ok(&t)) {
+        ESP_LOGW(TAG, "[ metrics ] snapshot truncated, %d bytes needed",
+                 (int)t.len);
+        // Drop the partial last line
+        char* end = strrchr(buf, '\n');
+        t.len = end ? end - buf + 1 : 0;
+    }
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    esp_err_t err = httpd_resp_send(req, buf, t.len);
+    free(buf);
+    return err;
+}
+
+esp_err_t metrics_start(int port) {
+    const task_placement_t* p = task_placement_get(TASK_SLOT_METRICS);
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = port;
+    config.ctrl_port = port + 1;
+    config.max_open_sockets = 2;
+    config.task_priority = p->prio;
+    config.stack_size = p->stack;
+
+    httpd_handle_t server = NULL;
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[ metrics ] httpd_start failed: %d", err);
+        return err;
+    }
+    httpd_uri_t uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_get_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(server, &uri);
+    ESP_LOGI(TAG, "[ metrics ] Serving /metrics on port %d", port);
+    return ESP_OK;
+}
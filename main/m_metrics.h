@@ -0,0 +1,68 @@
+#ifndef _M_METRICS_H_
+#define _M_METRICS_H_
+
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+
+/*
+ * Device metrics served as Prometheus text on http://<device>:<port>/metrics.
+ * Updates are a counter increment under a spinlock; ringbuffer levels, heap,
+ * RSSI and task statistics are only read when the endpoint is scraped.
+ */
+typedef enum {
+    METRIC_WAKES,
+    METRIC_UPLOADS,
+    METRIC_UPLOAD_BYTES,
+    METRIC_UPLOAD_EARLY_ENDS, /* Uploads ended by the server's final */
+    METRIC_REPLY_CACHE_HITS,
+    METRIC_REPLY_CACHE_MISSES,
+    METRIC_REPLY_CACHE_SAVED_BYTES,
+    METRIC_NSAGC_OVER_BUDGET, /* Noise suppression hops over budget */
+    METRIC_SESSION_REC_BYTES,
+    METRIC_SESSION_REC_DROPPED_BYTES,
+    METRIC_CTRL_CONNECTS,
+    METRIC_CTRL_COMMANDS, /* Commands pushed over the control channel */
+    METRIC_SYNC_INSERTED_FRAMES, /* Group playback waiting for the timeline */
+    METRIC_SYNC_DROPPED_FRAMES,
+    METRIC_OTA_BYTES,
+    METRIC_OTA_UPDATES,
+    METRIC_OTA_FAILURES,
+    METRIC_OTA_PAUSED_MS, /* Downloads waiting for the audio */
+    METRIC_TLS_FAILURES,
+    METRIC_COUNTER_NUM
+} metric_counter_t;
+
+typedef enum {
+    METRIC_HIST_DETECT_CHUNK_US, /* WakeNet time per chunk, not a latency */
+    METRIC_HIST_UPLOAD_MS, /* Recording upload duration */
+    METRIC_HIST_SESSION_REC_US, /* Session recorder cost per call */
+    METRIC_HIST_SYNC_RTT_US, /* Best round trip of a clock burst */
+    METRIC_HIST_SYNC_ERROR_US, /* Group playback error, absolute */
+    METRIC_HIST_START_MS, /* Pipeline run to first decoded audio */
+    METRIC_HIST_OTA_CHUNK_US, /* Update flash work per 4 KB */
+    METRIC_HIST_TLS_FULL_MS,
+    METRIC_HIST_TLS_RESUMED_MS,
+    METRIC_HIST_NUM
+} metric_hist_t;
+
+void metrics_add(metric_counter_t counter, uint32_t n);
+
+void metrics_observe(metric_hist_t hist, uint32_t value);
+
+/*
+ * @brief Report the output ringbuffer fill level of an element
+ */
+void metrics_watch_element(const char* name, audio_element_handle_t el);
+
+/*
+ * @brief Record the heap a pipeline took when it was built
+ */
+void metrics_set_pipeline_heap(const char* name, int bytes);
+
+/*
+ * @brief Start the HTTP endpoint
+ */
+esp_err_t metrics_start(int port);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "m_metrics_text.h"
+
+void metrics_text_init(metrics_text_t* t, char* buf, size_t size) {
+    t->buf = buf;
+    t->size = size;
+    t->len = 0;
+    if (size) {
+        buf[0] = '\0';
+    }
+}
+
+static void metrics_text_printf(metrics_text_t* t, const char* fmt, ...) {
+    if (t->len >= t->size) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+    va_end(ap);
+    // On overflow len ends past the buffer and metrics_text_ok() fails
+    t->len += n > 0 ? n : 0;
+}
+
+void metrics_text_type(metrics_text_t* t, const char* name, const char* type) {
+    metrics_text_printf(t, "# TYPE %s %s\n", name, type);
+}
+
+void metrics_text_value(metrics_text_t* t, const char* name,
+                        const char* label, int64_t value) {
+    if (label) {
+        metrics_text_printf(t, "%s{%s} %lld\n", name, label, (long long)value);
+    } else {
+        metrics_text_printf(t, "%s %lld\n", name, (long long)value);
+    }
+}
+
+void metrics_text_hist(metrics_text_t* t, const char* name,
+                       const uint32_t* bounds, const uint32_t* counts,
+                       int bucket_num, uint64_t sum) {
+    uint64_t total = 0;
+    metrics_text_type(t, name, "histogram");
+    for (int i = 0; i < bucket_num; i++) {
+        total += counts[i];
+        metrics_text_printf(t, "%s_bucket{le=\"%u\"} %llu\n", name,
+                            (unsigned)bounds[i], (unsigned long long)total);
+    }
+    total += counts[bucket_num];
+    metrics_text_printf(t, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                        (unsigned long long)total);
+    metrics_text_printf(t, "%s_sum %llu\n", name, (unsigned long long)sum);
+    metrics_text_printf(t, "%s_count %llu\n", name, (unsigned long long)total);
+}
+
+int metrics_text_ok(const metrics_text_t* t) {
+    return t->len < t->size;
+}
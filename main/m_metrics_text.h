@@ -0,0 +1,45 @@
+#ifndef _M_METRICS_TEXT_H_
+#define _M_METRICS_TEXT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Prometheus text exposition writer. Plain C without any ESP-IDF
+ * dependency so the output format can be built and checked on the host.
+ */
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t len; /* Bytes written, stops growing once the buffer is full */
+} metrics_text_t;
+
+void metrics_text_init(metrics_text_t* t, char* buf, size_t size);
+
+/*
+ * @brief Write "# TYPE name type", type is "counter" or "gauge"
+ */
+void metrics_text_type(metrics_text_t* t, const char* name, const char* type);
+
+/*
+ * @brief Write one sample, `label` is "key=\"value\"" or NULL
+ */
+void metrics_text_value(metrics_text_t* t, const char* name,
+                        const char* label, int64_t value);
+
+/*
+ * @brief Write a histogram from per-bucket (non cumulative) counts
+ *
+ * @param bounds  Upper bounds, ascending, `bucket_num` entries
+ * @param counts  `bucket_num + 1` counts, the last one is above all bounds
+ */
+void metrics_text_hist(metrics_text_t* t, const char* name,
+                       const uint32_t* bounds, const uint32_t* counts,
+                       int bucket_num, uint64_t sum);
+
+/*
+ * @return True when everything fitted into the buffer
+ */
+int metrics_text_ok(const metrics_text_t* t);
+
+#endif
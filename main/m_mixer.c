@@ -0,0 +1,318 @@
+#include <limits.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_common.h"
+#include "audio_element.h"
+#include "audio_error.h"
+#include "audio_mem.h"
+
+#include "m_mixer.h"
+
+static const char* TAG = "mixer";
+
+// An idle mixer looks at its inputs this often without a mixer_wake
+#define MIXER_IDLE_POLL_MS 100
+
+typedef struct {
+    ringbuf_handle_t rb;
+    int priority;
+    int channels;
+    int32_t gain;     /* Requested gain, Q15 */
+    int32_t cur_gain; /* Ramped gain, Q15 */
+    int hold;         /* Blocks left before the input counts as idle */
+    int frames;       /* Frames read in the current block */
+    uint8_t part[4];  /* Bytes of a frame not complete by the deadline */
+    int part_len;
+    uint32_t late;    /* Blocks padded with silence while playing */
+} mixer_input_t;
+
+typedef struct {
+    mixer_cfg_t cfg;
+    mixer_input_t in[MIXER_MAX_INPUTS];
+    int16_t* in_buf;
+    int32_t* acc;
+    int32_t ramp_step; /* Max gain change per block, Q15 */
+    int hold_blocks;
+    TickType_t block_ticks;
+    uint32_t blocks;
+    int64_t mix_us;
+    SemaphoreHandle_t wake;
+    volatile bool idle;
+} mixer_t;
+
+static esp_err_t _mixer_open(audio_element_handle_t self) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(self);
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        mix->in[i].hold = 0;
+        mix->in[i].cur_gain = 0;
+        mix->in[i].part_len = 0;
+        mix->in[i].late = 0;
+    }
+    mix->blocks = 0;
+    mix->mix_us = 0;
+    mix->idle = false;
+    return ESP_OK;
+}
+
+// Nothing playing and every gain ramped down to silence
+static bool mixer_silent(mixer_t* mix) {
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        if (mix->in[i].hold > 0 || mix->in[i].cur_gain != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool mixer_has_input(mixer_t* mix) {
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        if (mix->in[i].rb && rb_bytes_filled(mix->in[i].rb) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int _mixer_process(audio_element_handle_t self, char* in_buffer,
+                          int in_len) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(self);
+    int frames = mix->cfg.frame_samples;
+    int out_ch = mix->cfg.channels;
+    int stride = frames * out_ch;
+    int top = INT_MIN;
+
+    if (mixer_silent(mix) && !mixer_has_input(mix)) {
+        // Idle: no silence for the I2S writer, it waits for the next block
+        mix->idle = true;
+        xSemaphoreTake(mix->wake, MIXER_IDLE_POLL_MS / portTICK_PERIOD_MS);
+        if (!mixer_has_input(mix)) {
+            return AEL_IO_TIMEOUT;
+        }
+    }
+    mix->idle = false;
+
+    // One deadline for all inputs, so a late input delays the block by one
+    // block period at most and never holds up the inputs after it
+    TickType_t deadline = xTaskGetTickCount() + mix->block_ticks;
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        mixer_input_t* in = &mix->in[i];
+        in->frames = 0;
+        if (in->rb == NULL) {
+            continue;
+        }
+        char* buf = (char*)(mix->in_buf + i * stride);
+        int frame_bytes = in->channels * sizeof(int16_t);
+        int want = frames * frame_bytes;
+        TickType_t wait = 0;
+        if (in->hold > 0) {
+            TickType_t now = xTaskGetTickCount();
+            wait = (int32_t)(deadline - now) > 0 ? deadline - now : 0;
+        }
+        int have = in->part_len;
+        memcpy(buf, in->part, have);
+        int r = rb_read(in->rb, buf + have, want - have, wait);
+        if (r > 0) {
+            have += r;
+        }
+        // Whole frames play now, a split one waits for its other bytes
+        int whole = have - have % frame_bytes;
+        in->part_len = have - whole;
+        memcpy(in->part, buf + whole, in->part_len);
+        if (whole > 0) {
+            in->frames = frames;
+            if (whole < want) {
+                memset(buf + whole, 0, want - whole);
+                in->late++;
+            }
+            in->hold = mix->hold_blocks;
+        } else if (in->hold > 0) {
+            in->hold--;
+        }
+        if (in->hold > 0 && in->priority > top) {
+            top = in->priority;
+        }
+    }
+    if (top == INT_MIN) {
+        // Ramping down after the last input, at the output rate
+        vTaskDelay(mix->block_ticks);
+    }
+
+    int64_t start = esp_timer_get_time();
+    memset(mix->acc, 0, stride * sizeof(int32_t));
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        mixer_input_t* in = &mix->in[i];
+        int32_t target = in->hold > 0 ? in->gain : 0;
+        if (in->priority < top) {
+            target = (target * mix->cfg.duck_gain) >> 15;
+        }
+        int32_t delta = target - in->cur_gain;
+        if (delta > mix->ramp_step) {
+            delta = mix->ramp_step;
+        } else if (delta < -mix->ramp_step) {
+            delta = -mix->ramp_step;
+        }
+        int32_t step = delta / frames;
+        if (in->frames > 0) {
+            mixer_accumulate_q15(mix->acc, mix->in_buf + i * stride,
+                                 in->frames, in->channels, out_ch,
+                                 in->cur_gain, step);
+        }
+        in->cur_gain = step ? in->cur_gain + step * frames : target;
+    }
+    mixer_saturate_q15((int16_t*)in_buffer, mix->acc, stride);
+    mix->mix_us += esp_timer_get_time() - start;
+    mix->blocks++;
+
+    return audio_element_output(self, in_buffer,
+                                stride * sizeof(int16_t));
+}
+
+static esp_err_t _mixer_close(audio_element_handle_t self) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(self);
+    if (mix->blocks) {
+        ESP_LOGI(TAG, "[ mixer ] %u blocks of %d frames, %lld us/block",
+                 mix->blocks, mix->cfg.frame_samples,
+                 mix->mix_us / mix->blocks);
+    }
+    for (int i = 0; i < mix->cfg.input_num; i++) {
+        if (mix->in[i].late) {
+            ESP_LOGI(TAG, "[ mixer ] Input %d padded %u blocks with silence",
+                     i, mix->in[i].late);
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _mixer_destroy(audio_element_handle_t self) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(self);
+    audio_free(mix->in_buf);
+    audio_free(mix->acc);
+    vSemaphoreDelete(mix->wake);
+    audio_free(mix);
+    return ESP_OK;
+}
+
+audio_element_handle_t mixer_init(mixer_cfg_t* config) {
+    if (config->input_num <= 0 || config->input_num > MIXER_MAX_INPUTS) {
+        ESP_LOGE(TAG, "[ mixer ] %d inputs not supported", config->input_num);
+        return NULL;
+    }
+    mixer_t* mix = audio_calloc(1, sizeof(mixer_t));
+    AUDIO_MEM_CHECK(TAG, mix, return NULL);
+    mix->cfg = *config;
+    int stride = config->frame_samples * config->channels;
+    mix->in_buf = audio_calloc(config->input_num * stride, sizeof(int16_t));
+    mix->acc = audio_calloc(stride, sizeof(int32_t));
+    mix->wake = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, mix->in_buf && mix->acc && mix->wake, {
+        audio_free(mix->in_buf);
+        audio_free(mix->acc);
+        if (mix->wake) {
+            vSemaphoreDelete(mix->wake);
+        }
+        audio_free(mix);
+        return NULL;
+    });
+
+    int block_ms = config->frame_samples * 1000 / config->sample_rate;
+    mix->block_ticks = block_ms / portTICK_PERIOD_MS;
+    if (mix->block_ticks == 0) {
+        mix->block_ticks = 1;
+    }
+    mix->ramp_step = config->ramp_ms > block_ms
+                         ? MIXER_GAIN_UNITY * block_ms / config->ramp_ms
+                         : MIXER_GAIN_UNITY;
+    if (mix->ramp_step == 0) {
+        mix->ramp_step = 1;
+    }
+    mix->hold_blocks = block_ms ? config->hold_ms / block_ms + 1 : 1;
+    for (int i = 0; i < config->input_num; i++) {
+        mix->in[i].channels = config->channels;
+        mix->in[i].gain = MIXER_GAIN_UNITY;
+    }
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _mixer_open;
+    cfg.process = _mixer_process;
+    cfg.close = _mixer_close;
+    cfg.destroy = _mixer_destroy;
+    cfg.buffer_len = stride * sizeof(int16_t);
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.multi_in_rb_num = config->input_num;
+    cfg.tag = "mixer";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(mix->in_buf);
+        audio_free(mix->acc);
+        vSemaphoreDelete(mix->wake);
+        audio_free(mix);
+        return NULL;
+    });
+    audio_element_setdata(el, mix);
+    return el;
+}
+
+esp_err_t mixer_set_input(audio_element_handle_t mixer, int index,
+                          ringbuf_handle_t rb, int priority) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(mixer);
+    if (index < 0 || index >= mix->cfg.input_num) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mix->in[index].rb = rb;
+    mix->in[index].priority = priority;
+    return audio_element_set_multi_input_ringbuf(mixer, rb, index);
+}
+
+esp_err_t mixer_set_gain(audio_element_handle_t mixer, int index, int gain) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(mixer);
+    if (index < 0 || index >= mix->cfg.input_num || gain < 0 ||
+        gain > MIXER_GAIN_UNITY) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mix->in[index].gain = gain;
+    return ESP_OK;
+}
+
+esp_err_t mixer_wait_for_drain(audio_element_handle_t mixer, int index,
+                               TickType_t ticks_to_wait) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(mixer);
+    if (index < 0 || index >= mix->cfg.input_num || !mix->in[index].rb) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    TickType_t start = xTaskGetTickCount();
+    while (rb_bytes_filled(mix->in[index].rb) > 0) {
+        if (xTaskGetTickCount() - start >= ticks_to_wait) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(mix->block_ticks);
+    }
+    return ESP_OK;
+}
+
+void mixer_wake(audio_element_handle_t mixer) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(mixer);
+    xSemaphoreGive(mix->wake);
+}
+
+esp_err_t mixer_wait_for_idle(audio_element_handle_t mixer,
+                              TickType_t ticks_to_wait) {
+    mixer_t* mix = (mixer_t*)audio_element_getdata(mixer);
+    TickType_t start = xTaskGetTickCount();
+    while (!mix->idle) {
+        if (xTaskGetTickCount() - start >= ticks_to_wait) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(mix->block_ticks);
+    }
+    return ESP_OK;
+}
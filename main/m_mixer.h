@@ -0,0 +1,100 @@
+#ifndef _M_MIXER_H_
+#define _M_MIXER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+#include "m_mixer_dsp.h"
+#include "ringbuf.h"
+
+/*
+ * PCM mixer element: several decoded 16 bit inputs, one output for a single
+ * i2s_stream writer. Every input has a priority; while a higher priority
+ * input is playing, the lower ones are ducked. Gain changes are ramped so
+ * ducking does not click. There is no resampling here: every input must
+ * already run at the output rate.
+ *
+ * An input that falls behind does not hold up the others. Each block waits
+ * at most one block period for all inputs together, and whatever an input
+ * has not delivered by then is played as silence.
+ *
+ * Once no input is playing and the gains have ramped down, the mixer goes
+ * idle and writes nothing: the I2S writer behind it blocks and the DMA
+ * plays zeros without the CPU. mixer_wake starts it again.
+ */
+#define MIXER_MAX_INPUTS 4
+
+typedef struct {
+    int input_num;
+    int channels;      /* Output channels, mono inputs are upmixed */
+    int sample_rate;   /* Of the output and every input */
+    int frame_samples; /* Samples per channel mixed per process call */
+    int duck_gain;     /* Q15 gain applied to ducked inputs */
+    int ramp_ms;
+    int hold_ms; /* An input stays active this long after its last data */
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+} mixer_cfg_t;
+
+#define MIXER_TASK_STACK (3 * 1024)
+#define MIXER_TASK_CORE (0)
+#define MIXER_TASK_PRIO (6)
+#define MIXER_RINGBUFFER_SIZE (8 * 1024)
+
+#define MIXER_CFG_DEFAULT()                            \
+    {                                                  \
+        .input_num = 3,                                \
+        .channels = 2,                                 \
+        .sample_rate = 44100,                          \
+        .frame_samples = 256,                          \
+        .duck_gain = MIXER_GAIN_UNITY / 4,             \
+        .ramp_ms = 50,                                 \
+        .hold_ms = 200,                                \
+        .out_rb_size = MIXER_RINGBUFFER_SIZE,          \
+        .task_stack = MIXER_TASK_STACK,                \
+        .task_core = MIXER_TASK_CORE,                  \
+        .task_prio = MIXER_TASK_PRIO,                  \
+    }
+
+/*
+ * @brief Create the mixer element
+ *
+ * @return The audio element handle
+ */
+audio_element_handle_t mixer_init(mixer_cfg_t* config);
+
+/*
+ * @brief Attach a ringbuffer (usually a decoder's output) as mixer input
+ *
+ * @param index     Input index, 0 .. input_num - 1
+ * @param priority  Higher value wins, lower priority inputs are ducked
+ */
+esp_err_t mixer_set_input(audio_element_handle_t mixer, int index,
+                          ringbuf_handle_t rb, int priority);
+
+/*
+ * @brief Set the input gain (Q15), the change is ramped
+ */
+esp_err_t mixer_set_gain(audio_element_handle_t mixer, int index, int gain);
+
+/*
+ * @brief Wait until an input ringbuffer has been drained by the mixer
+ */
+esp_err_t mixer_wait_for_drain(audio_element_handle_t mixer, int index,
+                               TickType_t ticks_to_wait);
+
+/*
+ * @brief Leave idle, call before an input starts to play
+ */
+void mixer_wake(audio_element_handle_t mixer);
+
+/*
+ * @brief Wait until the mixer is idle and writes nothing to I2S
+ */
+esp_err_t mixer_wait_for_idle(audio_element_handle_t mixer,
+                              TickType_t ticks_to_wait);
+
+#endif
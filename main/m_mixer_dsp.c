@@ -0,0 +1,57 @@
+#include "m_mixer_dsp.h"
+
+void mixer_accumulate_q15(int32_t* acc, const int16_t* in, int frames,
+                          int in_ch, int out_ch, int32_t gain, int32_t step) {
+    if (step == 0 && in_ch == out_ch) {
+        int n = frames * out_ch;
+        int i = 0;
+        if (gain == MIXER_GAIN_UNITY) {
+            for (; i + 4 <= n; i += 4) {
+                acc[i] += in[i];
+                acc[i + 1] += in[i + 1];
+                acc[i + 2] += in[i + 2];
+                acc[i + 3] += in[i + 3];
+            }
+            for (; i < n; i++) {
+                acc[i] += in[i];
+            }
+            return;
+        }
+        for (; i + 4 <= n; i += 4) {
+            acc[i] += (in[i] * gain) >> 15;
+            acc[i + 1] += (in[i + 1] * gain) >> 15;
+            acc[i + 2] += (in[i + 2] * gain) >> 15;
+            acc[i + 3] += (in[i + 3] * gain) >> 15;
+        }
+        for (; i < n; i++) {
+            acc[i] += (in[i] * gain) >> 15;
+        }
+        return;
+    }
+    for (int f = 0; f < frames; f++, gain += step) {
+        if (in_ch == out_ch) {
+            for (int c = 0; c < out_ch; c++) {
+                acc[c] += (in[c] * gain) >> 15;
+            }
+        } else {
+            int32_t s = (in[0] * gain) >> 15;
+            for (int c = 0; c < out_ch; c++) {
+                acc[c] += s;
+            }
+        }
+        acc += out_ch;
+        in += in_ch;
+    }
+}
+
+void mixer_saturate_q15(int16_t* out, const int32_t* acc, int samples) {
+    for (int i = 0; i < samples; i++) {
+        int32_t s = acc[i];
+        if (s > INT16_MAX) {
+            s = INT16_MAX;
+        } else if (s < INT16_MIN) {
+            s = INT16_MIN;
+        }
+        out[i] = (int16_t)s;
+    }
+}
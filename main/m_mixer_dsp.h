@@ -0,0 +1,28 @@
+#ifndef _M_MIXER_DSP_H_
+#define _M_MIXER_DSP_H_
+
+#include <stdint.h>
+
+/*
+ * Mixing kernels of the mixer element. Plain C without any ESP-IDF
+ * dependency so the mix can be checked and timed on the host.
+ */
+#define MIXER_GAIN_UNITY 32768 /* Q15 */
+
+/*
+ * @brief Mixing kernel: acc[i] += in[i] * gain, gain moves by step per frame
+ *
+ * @param acc     Interleaved int32 accumulator, frames * out_ch
+ * @param in      Interleaved int16 input, frames * in_ch (1 or out_ch)
+ * @param gain    Start gain, Q15
+ * @param step    Gain increment per frame, Q15
+ */
+void mixer_accumulate_q15(int32_t* acc, const int16_t* in, int frames,
+                          int in_ch, int out_ch, int32_t gain, int32_t step);
+
+/*
+ * @brief Saturate the accumulator down to int16
+ */
+void mixer_saturate_q15(int16_t* out, const int32_t* acc, int samples);
+
+#endif
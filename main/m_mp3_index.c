@@ -0,0 +1,421 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "rom/crc.h"
+
+#include "audio_mem.h"
+
+#include "m_mp3_index.h"
+#include "m_tasks.h"
+
+static const char* TAG = "mp3_index";
+
+#define MP3_INDEX_PATH_MAX 64
+#define MP3_INDEX_BUF 4096        /* File window while scanning, and the */
+#define MP3_INDEX_PRINT_LEN 4096  /* fingerprinted head and tail */
+#define MP3_INDEX_RESYNC_MAX 65536 /* Garbage skipped before giving up */
+#define MP3_RESUME_NVS_NAMESPACE "mp3_pos"
+
+typedef struct {
+    uint32_t ms;
+    uint32_t offset;
+    uint32_t file_size;
+} mp3_resume_t;
+
+static TaskHandle_t s_task;
+static char s_build_path[MP3_INDEX_PATH_MAX];
+
+static const uint16_t s_bitrate_v1[16] = {0,   32,  40,  48,  56,  64,
+                                          80,  96,  112, 128, 160, 192,
+                                          224, 256, 320, 0};
+static const uint16_t s_bitrate_v2[16] = {0,  8,  16, 24,  32,  40,
+                                          48, 56, 64, 80,  96,  112,
+                                          128, 144, 160, 0};
+static const uint16_t s_rate[4][3] = {
+    {11025, 12000, 8000},  // MPEG 2.5
+    {0, 0, 0},             // Reserved
+    {22050, 24000, 16000}, // MPEG 2
+    {44100, 48000, 32000}, // MPEG 1
+};
+
+/*
+ * Layer III frame header: length in bytes and samples, 0 for anything
+ * else. Free format streams are not indexed.
+ */
+static int mp3_frame(const uint8_t* h, int* samples, int* rate) {
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) {
+        return 0;
+    }
+    int version = (h[1] >> 3) & 3;
+    int layer = (h[1] >> 1) & 3;
+    int bitrate = h[2] >> 4;
+    int rate_index = (h[2] >> 2) & 3;
+    if (version == 1 || layer != 1 || bitrate == 0 || bitrate == 15 ||
+        rate_index == 3) {
+        return 0;
+    }
+    int kbps = version == 3 ? s_bitrate_v1[bitrate] : s_bitrate_v2[bitrate];
+    *rate = s_rate[version][rate_index];
+    *samples = version == 3 ? 1152 : 576;
+    return (version == 3 ? 144000 : 72000) * kbps / *rate + ((h[2] >> 1) & 1);
+}
+
+static void mp3_index_path(const char* path, char* out, int out_len) {
+    snprintf(out, out_len, "%s", path);
+    char* dot = strrchr(out, '.');
+    char* slash = strrchr(out, '/');
+    if (dot == NULL || (slash && dot < slash)) {
+        dot = out + strlen(out);
+    }
+    snprintf(dot, out_len - (dot - out), ".IDX");
+}
+
+static esp_err_t mp3_fingerprint(FILE* fp, uint32_t size, uint8_t* buf,
+                                 uint32_t* print) {
+    uint32_t crc = 0;
+    uint32_t tail = size > MP3_INDEX_PRINT_LEN ? size - MP3_INDEX_PRINT_LEN : 0;
+    uint32_t at[2] = {0, tail};
+    for (int i = 0; i < 2; i++) {
+        int len = size - at[i] < MP3_INDEX_PRINT_LEN ? size - at[i]
+                                                     : MP3_INDEX_PRINT_LEN;
+        if (fseek(fp, at[i], SEEK_SET) != 0 ||
+            fread(buf, 1, len, fp) != len) {
+            return ESP_FAIL;
+        }
+        crc = crc32_le(crc, buf, len);
+    }
+    *print = crc;
+    return ESP_OK;
+}
+
+/*
+ * Open the index of `path` and check it against the file, the index is
+ * left positioned at its first entry
+ */
+static FILE* mp3_index_open(const char* path, mp3_index_header_t* hdr) {
+    char idx_path[MP3_INDEX_PATH_MAX];
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    mp3_index_path(path, idx_path, sizeof(idx_path));
+    FILE* idx = fopen(idx_path, "rb");
+    if (idx == NULL) {
+        return NULL;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, idx) != 1 ||
+        hdr->magic != MP3_INDEX_MAGIC || hdr->version != MP3_INDEX_VERSION ||
+        hdr->file_size != st.st_size || hdr->count == 0) {
+        fclose(idx);
+        return NULL;
+    }
+    // The fingerprint costs two small reads, a stale index a wrong seek
+    uint8_t* buf = audio_malloc(MP3_INDEX_PRINT_LEN);
+    FILE* fp = fopen(path, "rb");
+    uint32_t print = 0;
+    bool ok = buf && fp &&
+              mp3_fingerprint(fp, st.st_size, buf, &print) == ESP_OK &&
+              print == hdr->fingerprint;
+    if (fp) {
+        fclose(fp);
+    }
+    audio_free(buf);
+    if (!ok) {
+        fclose(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static int mp3_index_read(FILE* idx, uint32_t i, mp3_index_entry_t* e) {
+    if (fseek(idx, sizeof(mp3_index_header_t) + i * sizeof(*e), SEEK_SET) !=
+            0 ||
+        fread(e, sizeof(*e), 1, idx) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Last entry whose time, or offset, is not above `value`. Both grow with
+ * the entry number.
+ */
+static int mp3_index_search(FILE* idx, const mp3_index_header_t* hdr,
+                            bool by_offset, uint32_t value,
+                            mp3_index_entry_t* found, uint32_t* found_i) {
+    uint32_t lo = 0, hi = hdr->count; // Answer in [lo, hi)
+    mp3_index_entry_t e;
+    if (mp3_index_read(idx, 0, found) != 0) {
+        return -1;
+    }
+    *found_i = 0;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (mp3_index_read(idx, mid, &e) != 0) {
+            return -1;
+        }
+        if ((by_offset ? e.offset : e.ms) <= value) {
+            lo = mid;
+            *found = e;
+            *found_i = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+esp_err_t mp3_index_seek(const char* path, uint32_t ms, uint32_t* offset,
+                         uint32_t* frame_ms) {
+    mp3_index_header_t hdr;
+    FILE* idx = mp3_index_open(path, &hdr);
+    if (idx == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    mp3_index_entry_t e;
+    uint32_t i;
+    int ret = mp3_index_search(idx, &hdr, false, ms, &e, &i);
+    fclose(idx);
+    if (ret != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *offset = e.offset;
+    *frame_ms = e.ms;
+    return ESP_OK;
+}
+
+esp_err_t mp3_index_locate(const char* path, uint32_t offset, uint32_t* ms) {
+    mp3_index_header_t hdr;
+    FILE* idx = mp3_index_open(path, &hdr);
+    if (idx == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    mp3_index_entry_t e, next;
+    uint32_t i;
+    int ret = mp3_index_search(idx, &hdr, true, offset, &e, &i);
+    if (ret == 0 && i + 1 < hdr.count &&
+        mp3_index_read(idx, i + 1, &next) == 0 && next.offset > e.offset &&
+        offset > e.offset) {
+        uint32_t span = offset < next.offset ? offset - e.offset
+                                             : next.offset - e.offset;
+        *ms = e.ms + (uint64_t)(next.ms - e.ms) * span /
+                         (next.offset - e.offset);
+    } else if (ret == 0) {
+        *ms = e.ms;
+    }
+    fclose(idx);
+    return ret == 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static uint32_t mp3_id3_size(const uint8_t* h) {
+    if (memcmp(h, "ID3", 3) != 0) {
+        return 0;
+    }
+    // Syncsafe size, plus the header and the footer when flagged
+    return 10 + ((h[6] & 0x7F) << 21 | (h[7] & 0x7F) << 14 |
+                 (h[8] & 0x7F) << 7 | (h[9] & 0x7F)) +
+           ((h[5] & 0x10) ? 10 : 0);
+}
+
+esp_err_t mp3_index_build(const char* path) {
+    char idx_path[MP3_INDEX_PATH_MAX];
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    mp3_index_path(path, idx_path, sizeof(idx_path));
+    uint8_t* buf = audio_malloc(MP3_INDEX_BUF);
+    FILE* fp = fopen(path, "rb");
+    FILE* idx = fopen(idx_path, "wb");
+    esp_err_t err = ESP_FAIL;
+    if (buf == NULL || fp == NULL || idx == NULL) {
+        ESP_LOGE(TAG, "[ mp3_index ] Cannot build %s", idx_path);
+        goto done;
+    }
+    int64_t start = esp_timer_get_time();
+    mp3_index_header_t hdr = {
+        .version = MP3_INDEX_VERSION,
+        .step_ms = MP3_INDEX_STEP_MS,
+        .file_size = st.st_size,
+    };
+    // Magic last: an interrupted build leaves an index nobody uses
+    if (mp3_fingerprint(fp, st.st_size, buf, &hdr.fingerprint) != ESP_OK ||
+        fwrite(&hdr, sizeof(hdr), 1, idx) != 1) {
+        goto done;
+    }
+
+    uint32_t base = 0; // File offset of buf[0]
+    int len = 0;
+    uint32_t pos = 0;
+    uint32_t skipped = 0;
+    uint64_t us = 0;
+    uint32_t next_ms = 0;
+    bool first = true;
+    for (;;) {
+        if (pos + 10 > base + len) {
+            if (fseek(fp, pos, SEEK_SET) != 0) {
+                break;
+            }
+            base = pos;
+            len = fread(buf, 1, MP3_INDEX_BUF, fp);
+            if (len < 4) {
+                break;
+            }
+        }
+        const uint8_t* h = buf + (pos - base);
+        if (first && pos + 10 <= base + len && mp3_id3_size(h)) {
+            pos += mp3_id3_size(h);
+            continue;
+        }
+        int samples, rate;
+        int frame = mp3_frame(h, &samples, &rate);
+        // Out of sync, a header has to be followed by another to count
+        if (frame && skipped && pos + frame + 4 <= base + len) {
+            int s2, r2;
+            frame = mp3_frame(h + frame, &s2, &r2) ? frame : 0;
+        }
+        if (frame == 0) {
+            if (++skipped > MP3_INDEX_RESYNC_MAX) {
+                break;
+            }
+            pos++;
+            continue;
+        }
+        skipped = 0;
+        first = false;
+        uint32_t ms = us / 1000;
+        if (ms >= next_ms) {
+            mp3_index_entry_t e = {ms, pos};
+            if (fwrite(&e, sizeof(e), 1, idx) != 1) {
+                goto done;
+            }
+            hdr.count++;
+            next_ms = (ms / MP3_INDEX_STEP_MS + 1) * MP3_INDEX_STEP_MS;
+        }
+        us += (uint64_t)samples * 1000000 / rate;
+        pos += frame;
+    }
+    hdr.duration_ms = us / 1000;
+    hdr.magic = hdr.count ? MP3_INDEX_MAGIC : 0;
+    if (fseek(idx, 0, SEEK_SET) == 0 &&
+        fwrite(&hdr, sizeof(hdr), 1, idx) == 1 && hdr.count) {
+        err = ESP_OK;
+        ESP_LOGI(TAG,
+                 "[ mp3_index ] %s: %u entries, %u s of audio, built in %d ms",
+                 idx_path, hdr.count, hdr.duration_ms / 1000,
+                 (int)((esp_timer_get_time() - start) / 1000));
+    }
+
+done:
+    if (idx) {
+        fclose(idx);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    audio_free(buf);
+    if (err != ESP_OK) {
+        unlink(idx_path);
+    }
+    return err;
+}
+
+static void mp3_index_task(void* arg) {
+    mp3_index_build(s_build_path);
+    s_task = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t mp3_index_prepare(const char* path) {
+    mp3_index_header_t hdr;
+    FILE* idx = mp3_index_open(path, &hdr);
+    if (idx) {
+        fclose(idx);
+        return ESP_OK;
+    }
+    if (s_task || strlen(path) >= sizeof(s_build_path)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    snprintf(s_build_path, sizeof(s_build_path), "%s", path);
+    const task_placement_t* p = task_placement_get(TASK_SLOT_MP3_INDEX);
+    if (xTaskCreatePinnedToCore(mp3_index_task, p->name, p->stack, NULL,
+                                p->prio, &s_task, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ mp3_index ] Error create task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ mp3_index ] Building the index of %s", path);
+    return ESP_OK;
+}
+
+// NVS keys are 15 characters at most: "p" and the FNV-1a of the path
+static void mp3_resume_key(const char* path, char* key) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h = (h ^ (uint8_t)*path) * 16777619u;
+    }
+    sprintf(key, "p%08x", h);
+}
+
+esp_err_t mp3_resume_save(const char* path, uint32_t ms, uint32_t offset) {
+    struct stat st;
+    char key[16];
+    mp3_resume_t pos = {ms, offset, 0};
+    if (stat(path, &st) == 0) {
+        pos.file_size = st.st_size;
+    }
+    mp3_resume_key(path, key);
+    nvs_handle nvs;
+    esp_err_t err = nvs_open(MP3_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, key, &pos, sizeof(pos));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+esp_err_t mp3_resume_load(const char* path, uint32_t* ms, uint32_t* offset) {
+    struct stat st;
+    char key[16];
+    mp3_resume_t pos;
+    size_t size = sizeof(pos);
+    mp3_resume_key(path, key);
+    nvs_handle nvs;
+    if (nvs_open(MP3_RESUME_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t err = nvs_get_blob(nvs, key, &pos, &size);
+    nvs_close(nvs);
+    // A position in a file that was replaced since means nothing
+    if (err != ESP_OK || size != sizeof(pos) || stat(path, &st) != 0 ||
+        pos.file_size != st.st_size || pos.offset >= st.st_size) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *ms = pos.ms;
+    *offset = pos.offset;
+    return ESP_OK;
+}
+
+void mp3_resume_clear(const char* path) {
+    char key[16];
+    mp3_resume_key(path, key);
+    nvs_handle nvs;
+    if (nvs_open(MP3_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        if (nvs_erase_key(nvs, key) == ESP_OK) {
+            nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+}
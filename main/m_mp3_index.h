@@ -0,0 +1,93 @@
+#ifndef _M_MP3_INDEX_H_
+#define _M_MP3_INDEX_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Frame index for long MP3 files on the SD card, so playback can start at
+ * any time without decoding from the beginning. The index sits next to
+ * the file (BOOK.MP3 -> BOOK.IDX) and holds one entry per second of
+ * audio, the time and byte offset of the first frame at or after it:
+ *
+ *   header   {u32 magic "MPX1", u16 version, u16 step_ms, u32 file_size,
+ *             u32 fingerprint, u32 count, u32 duration_ms, u32 reserved[2]}
+ *   entries  count * {u32 ms, u32 offset}
+ *
+ * Little endian. The fingerprint is the CRC-32 of the first and the last
+ * 4 KB of the file, so an index goes stale when the file is replaced and
+ * tools/mp3_index.py can build it on the host. A lookup is a binary search
+ * in the index file, O(log n) reads of one entry and nothing in RAM.
+ *
+ * The playback position of each file is kept in NVS, so long content
+ * resumes where it stopped after an interaction or a reboot.
+ */
+#define MP3_INDEX_MAGIC 0x3158504D /* "MPX1" */
+#define MP3_INDEX_VERSION 1
+#define MP3_INDEX_STEP_MS 1000
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t step_ms;
+    uint32_t file_size;
+    uint32_t fingerprint;
+    uint32_t count;
+    uint32_t duration_ms;
+    uint32_t reserved[2];
+} mp3_index_header_t;
+
+typedef struct {
+    uint32_t ms;
+    uint32_t offset;
+} mp3_index_entry_t;
+
+/*
+ * @brief Start building the index of `path` in the background unless a
+ *        valid one exists, lookups fail until it is written
+ */
+esp_err_t mp3_index_prepare(const char* path);
+
+/*
+ * @brief Build the index of `path` now
+ */
+esp_err_t mp3_index_build(const char* path);
+
+/*
+ * @brief Frame to start from to play `path` at `ms`: the indexed frame at
+ *        or before it
+ *
+ * @return
+ *     - ESP_OK, Success
+ *     - ESP_ERR_NOT_FOUND, No valid index yet
+ */
+esp_err_t mp3_index_seek(const char* path, uint32_t ms, uint32_t* offset,
+                         uint32_t* frame_ms);
+
+/*
+ * @brief Time in the file at byte `offset`, between indexed frames by
+ *        their byte rate
+ *
+ * @return ESP_OK or ESP_ERR_NOT_FOUND
+ */
+esp_err_t mp3_index_locate(const char* path, uint32_t offset, uint32_t* ms);
+
+/*
+ * @brief Keep the playback position of `path` in NVS
+ */
+esp_err_t mp3_resume_save(const char* path, uint32_t ms, uint32_t offset);
+
+/*
+ * @brief Saved playback position, ms is 0 when saved before the index
+ *        existed
+ *
+ * @return ESP_OK or ESP_ERR_NOT_FOUND
+ */
+esp_err_t mp3_resume_load(const char* path, uint32_t* ms, uint32_t* offset);
+
+/*
+ * @brief Played to the end, start from the beginning next time
+ */
+void mp3_resume_clear(const char* path);
+
+#endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "xtensa/hal.h"
+
+#include "esp_log.h"
+
+#include "audio_common.h"
+#include "audio_element.h"
+#include "audio_error.h"
+#include "audio_mem.h"
+
+#include "m_metrics.h"
+#include "m_nsagc.h"
+
+static const char* TAG = "nsagc";
+
+typedef struct {
+    nsagc_cfg_t cfg;
+    int16_t hop[NSAGC_HOP];
+    volatile bool bypass;
+    bool ns_on;
+    int overruns; /* Hops over budget in a row */
+    uint32_t hops;
+    uint32_t over_budget;
+    uint32_t max_cycles;
+    uint64_t ns_cycles;
+    nsagc_dsp_t dsp[]; /* One per channel */
+} nsagc_t;
+
+static esp_err_t _nsagc_open(audio_element_handle_t self) {
+    nsagc_t* ns = (nsagc_t*)audio_element_getdata(self);
+    nsagc_dsp_cfg_t dsp_cfg;
+    nsagc_dsp_cfg_db(&dsp_cfg, ns->cfg.floor_db, ns->cfg.target_dbfs,
+                     ns->cfg.max_gain_db);
+    for (int c = 0; c < ns->cfg.channels; c++) {
+        nsagc_dsp_init(&ns->dsp[c], &dsp_cfg);
+    }
+    ns->ns_on = true;
+    ns->overruns = 0;
+    ns->hops = 0;
+    ns->over_budget = 0;
+    ns->max_cycles = 0;
+    ns->ns_cycles = 0;
+    return ESP_OK;
+}
+
+// Cycles of one hop of suppression on every channel
+static void nsagc_account(nsagc_t* ns, uint32_t cycles) {
+    ns->hops++;
+    ns->ns_cycles += cycles;
+    if (cycles > ns->max_cycles) {
+        ns->max_cycles = cycles;
+    }
+    if (ns->cfg.budget_cycles == 0 || cycles <= ns->cfg.budget_cycles) {
+        ns->overruns = 0;
+        return;
+    }
+    ns->over_budget++;
+    metrics_add(METRIC_NSAGC_OVER_BUDGET, 1);
+    if (++ns->overruns == NSAGC_OVERRUN_LIMIT) {
+        ns->ns_on = false;
+        ESP_LOGW(TAG, "[ nsagc ] %u cycles per hop, budget %u, AGC only",
+                 cycles, ns->cfg.budget_cycles);
+    }
+}
+
+static int _nsagc_process(audio_element_handle_t self, char* in_buffer,
+                          int in_len) {
+    nsagc_t* ns = (nsagc_t*)audio_element_getdata(self);
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0 || ns->bypass) {
+        return r > 0 ? audio_element_output(self, in_buffer, r) : r;
+    }
+    int16_t* pcm = (int16_t*)in_buffer;
+    int ch = ns->cfg.channels;
+    int frames = r / (ch * sizeof(int16_t));
+    bool ns_on = ns->ns_on;
+    uint32_t cycles = 0;
+    // Channels are processed apart so stereo input stays stereo. The last
+    // hop of a stream is zero padded.
+    for (int c = 0; c < ch; c++) {
+        for (int i = 0; i < NSAGC_HOP; i++) {
+            ns->hop[i] = i < frames ? pcm[i * ch + c] : 0;
+        }
+        if (ns_on) {
+            uint32_t start = xthal_get_ccount();
+            nsagc_dsp_ns(&ns->dsp[c], ns->hop);
+            cycles += xthal_get_ccount() - start;
+        }
+        nsagc_dsp_agc(&ns->dsp[c], ns->hop, NSAGC_HOP);
+        for (int i = 0; i < frames; i++) {
+            pcm[i * ch + c] = ns->hop[i];
+        }
+    }
+    if (ns_on) {
+        nsagc_account(ns, cycles);
+    }
+    return audio_element_output(self, in_buffer, r);
+}
+
+static esp_err_t _nsagc_close(audio_element_handle_t self) {
+    nsagc_t* ns = (nsagc_t*)audio_element_getdata(self);
+    if (ns->hops) {
+        ESP_LOGI(TAG,
+                 "[ nsagc ] %u hops, %llu cycles/hop, max %u, %u over "
+                 "budget, AGC gain %d/65536",
+                 ns->hops, ns->ns_cycles / ns->hops, ns->max_cycles,
+                 ns->over_budget, ns->dsp[0].agc_gain);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _nsagc_destroy(audio_element_handle_t self) {
+    nsagc_t* ns = (nsagc_t*)audio_element_getdata(self);
+    audio_free(ns);
+    return ESP_OK;
+}
+
+audio_element_handle_t nsagc_init(nsagc_cfg_t* config) {
+    if (config->channels != 1 && config->channels != 2) {
+        ESP_LOGE(TAG, "[ nsagc ] %d channels not supported",
+                 config->channels);
+        return NULL;
+    }
+    nsagc_t* ns = audio_calloc(
+        1, sizeof(nsagc_t) + config->channels * sizeof(nsagc_dsp_t));
+    AUDIO_MEM_CHECK(TAG, ns, return NULL);
+    ns->cfg = *config;
+    ns->bypass = config->bypass;
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _nsagc_open;
+    cfg.process = _nsagc_process;
+    cfg.close = _nsagc_close;
+    cfg.destroy = _nsagc_destroy;
+    cfg.buffer_len = NSAGC_HOP * config->channels * sizeof(int16_t);
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.tag = "nsagc";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(ns);
+        return NULL;
+    });
+    audio_element_setdata(el, ns);
+    return el;
+}
+
+esp_err_t nsagc_set_bypass(audio_element_handle_t el, bool bypass) {
+    nsagc_t* ns = (nsagc_t*)audio_element_getdata(el);
+    ns->bypass = bypass;
+    ESP_LOGI(TAG, "[ nsagc ] bypass %s", bypass ? "on" : "off");
+    return ESP_OK;
+}
@@ -0,0 +1,68 @@
+#ifndef _M_NSAGC_H_
+#define _M_NSAGC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+
+#include "m_nsagc_dsp.h"
+
+/*
+ * Microphone front end element: noise suppression followed by AGC, see
+ * m_nsagc_dsp.h. It processes 16 bit PCM in hops of NSAGC_HOP frames.
+ * Each channel of stereo input has its own state, so the channels stay
+ * apart and the cost doubles.
+ *
+ * Each hop's noise suppression, over all channels, is timed in CPU cycles. After
+ * NSAGC_OVERRUN_LIMIT hops in a row over budget_cycles, suppression is
+ * turned off until the next open and only the AGC runs. Bypass passes the
+ * audio through untouched.
+ */
+#define NSAGC_OVERRUN_LIMIT 8
+
+typedef struct {
+    int channels;      /* 1 or 2 */
+    int floor_db;      /* Maximum suppression */
+    int target_dbfs;   /* AGC speech level */
+    int max_gain_db;   /* AGC gain limit, at most 30 */
+    uint32_t budget_cycles; /* Suppression cycles per hop, 0 no limit */
+    bool bypass;
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+} nsagc_cfg_t;
+
+#define NSAGC_TASK_STACK (4 * 1024)
+#define NSAGC_TASK_CORE (1)
+#define NSAGC_TASK_PRIO (6)
+#define NSAGC_RINGBUFFER_SIZE (8 * 1024)
+
+#define NSAGC_CFG_DEFAULT()                   \
+    {                                         \
+        .channels = 1,                        \
+        .floor_db = -15,                      \
+        .target_dbfs = -20,                   \
+        .max_gain_db = 24,                    \
+        .budget_cycles = 200000,              \
+        .bypass = false,                      \
+        .out_rb_size = NSAGC_RINGBUFFER_SIZE, \
+        .task_stack = NSAGC_TASK_STACK,       \
+        .task_core = NSAGC_TASK_CORE,         \
+        .task_prio = NSAGC_TASK_PRIO,         \
+    }
+
+/*
+ * @brief Create the noise suppression and AGC element
+ *
+ * @return The audio element handle
+ */
+audio_element_handle_t nsagc_init(nsagc_cfg_t* config);
+
+/*
+ * @brief Pass audio through untouched, takes effect on the next hop
+ */
+esp_err_t nsagc_set_bypass(audio_element_handle_t el, bool bypass);
+
+#endif
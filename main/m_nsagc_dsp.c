@@ -0,0 +1,234 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_nsagc_dsp.h"
+
+#define NSAGC_Q15 32768
+#define NSAGC_LOG2_FFT 8
+#define NSAGC_NOISE_INIT_FRAMES 16
+
+_Static_assert(NSAGC_FFT_SIZE == 1 << NSAGC_LOG2_FFT, "FFT size");
+
+static int32_t s_cos[NSAGC_FFT_SIZE / 2]; /* Q15 */
+static int32_t s_sin[NSAGC_FFT_SIZE / 2]; /* Q15 */
+static int32_t s_win[NSAGC_FFT_SIZE];     /* sqrt-Hann, Q15 */
+static bool s_tables;
+
+static void nsagc_tables(void) {
+    if (s_tables) {
+        return;
+    }
+    for (int i = 0; i < NSAGC_FFT_SIZE / 2; i++) {
+        double a = 2 * M_PI * i / NSAGC_FFT_SIZE;
+        s_cos[i] = lrint(cos(a) * NSAGC_Q15);
+        s_sin[i] = lrint(sin(a) * NSAGC_Q15);
+    }
+    // sin^2 windows of two overlapping hops add up to one
+    for (int i = 0; i < NSAGC_FFT_SIZE; i++) {
+        s_win[i] = lrint(sin(M_PI * i / NSAGC_FFT_SIZE) * NSAGC_Q15);
+    }
+    s_tables = true;
+}
+
+void nsagc_dsp_cfg_db(nsagc_dsp_cfg_t* cfg, int floor_db, int target_dbfs,
+                      int max_gain_db) {
+    if (max_gain_db > 30) {
+        max_gain_db = 30;
+    }
+    cfg->ns_floor = lrint(pow(10, floor_db / 20.0) * NSAGC_Q15);
+    cfg->ns_over = 2 * 256;
+    cfg->agc_target = lrint(pow(10, target_dbfs / 20.0) * NSAGC_Q15);
+    cfg->agc_max_gain = lrint(pow(10, max_gain_db / 20.0) * 65536);
+}
+
+void nsagc_dsp_init(nsagc_dsp_t* d, const nsagc_dsp_cfg_t* cfg) {
+    nsagc_tables();
+    memset(d, 0, sizeof(*d));
+    d->cfg = *cfg;
+    d->agc_gain = 65536;
+    for (int k = 0; k < NSAGC_BINS; k++) {
+        d->gain[k] = NSAGC_Q15;
+    }
+}
+
+// Radix-2, no scaling: |X| <= 2^15 * N fits, products are 64 bit
+static void nsagc_fft(int32_t* re, int32_t* im, bool inverse) {
+    for (int i = 1, j = 0; i < NSAGC_FFT_SIZE; i++) {
+        int bit = NSAGC_FFT_SIZE >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            int32_t t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+    for (int len = 2; len <= NSAGC_FFT_SIZE; len <<= 1) {
+        int half = len >> 1;
+        int step = NSAGC_FFT_SIZE / len;
+        for (int k = 0; k < half; k++) {
+            int32_t wr = s_cos[k * step];
+            int32_t wi = inverse ? s_sin[k * step] : -s_sin[k * step];
+            for (int i = k; i < NSAGC_FFT_SIZE; i += len) {
+                int j = i + half;
+                int32_t tr =
+                    ((int64_t)re[j] * wr - (int64_t)im[j] * wi) >> 15;
+                int32_t ti =
+                    ((int64_t)re[j] * wi + (int64_t)im[j] * wr) >> 15;
+                re[j] = re[i] - tr;
+                im[j] = im[i] - ti;
+                re[i] += tr;
+                im[i] += ti;
+            }
+        }
+    }
+}
+
+static inline int32_t nsagc_mag(int32_t re, int32_t im) {
+    int32_t a = abs(re);
+    int32_t b = abs(im);
+    int32_t mx = a > b ? a : b;
+    int32_t mn = a > b ? b : a;
+    // 15/16 max + 15/32 min, within 6%
+    return mx - (mx >> 4) + (mn >> 1) - (mn >> 5);
+}
+
+static inline int16_t nsagc_sat16(int32_t s) {
+    if (s > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if (s < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return s;
+}
+
+// noise / mag in Q15, clamped to one
+static inline int32_t nsagc_ratio_q15(int32_t noise, int32_t mag) {
+    if (noise >= mag) {
+        return NSAGC_Q15;
+    }
+    int shift = 17 - __builtin_clz(mag | 1);
+    if (shift > 0) {
+        noise >>= shift;
+        mag >>= shift;
+    }
+    return (noise << 15) / (mag | 1);
+}
+
+static void nsagc_update_gains(nsagc_dsp_t* d) {
+    const nsagc_dsp_cfg_t* cfg = &d->cfg;
+    bool init = d->frames < NSAGC_NOISE_INIT_FRAMES;
+    for (int k = 0; k < NSAGC_BINS; k++) {
+        int32_t m = nsagc_mag(d->re[k], d->im[k]);
+        int32_t s = d->frames ? d->mag[k] + ((m - d->mag[k]) >> 2) : m;
+        int32_t n = d->noise[k];
+        // Average the first frames, then follow the minimum and creep up
+        if (init) {
+            n = d->frames ? n + ((s - n) >> 2) : s;
+        } else if (s < n) {
+            n += (s - n) >> 3;
+        } else {
+            n += (n >> 8) + 1;
+        }
+        d->mag[k] = s;
+        d->noise[k] = n;
+
+        int32_t g = NSAGC_Q15 -
+                    ((nsagc_ratio_q15(n, s) * cfg->ns_over) >> 8);
+        if (g < cfg->ns_floor) {
+            g = cfg->ns_floor;
+        }
+        // Open at once for onsets, close slowly against musical noise
+        if (g < d->gain[k]) {
+            g = d->gain[k] + ((g - d->gain[k]) >> 2);
+        }
+        d->gain[k] = g;
+    }
+}
+
+void nsagc_dsp_ns(nsagc_dsp_t* d, int16_t* x) {
+    int32_t* re = d->re;
+    int32_t* im = d->im;
+    for (int i = 0; i < NSAGC_HOP; i++) {
+        re[i] = (d->prev[i] * s_win[i]) >> 15;
+        re[i + NSAGC_HOP] = (x[i] * s_win[i + NSAGC_HOP]) >> 15;
+    }
+    memset(im, 0, sizeof(d->im));
+    memcpy(d->prev, x, sizeof(d->prev));
+
+    nsagc_fft(re, im, false);
+    nsagc_update_gains(d);
+    d->frames++;
+    for (int k = 0; k < NSAGC_BINS; k++) {
+        int32_t g = d->gain[k];
+        re[k] = ((int64_t)re[k] * g) >> 15;
+        im[k] = ((int64_t)im[k] * g) >> 15;
+        if (k && k < NSAGC_FFT_SIZE / 2) {
+            re[NSAGC_FFT_SIZE - k] = re[k];
+            im[NSAGC_FFT_SIZE - k] = -im[k];
+        }
+    }
+    nsagc_fft(re, im, true);
+
+    for (int i = 0; i < NSAGC_HOP; i++) {
+        int32_t head = (re[i] >> NSAGC_LOG2_FFT) * s_win[i] >> 15;
+        int32_t tail = (re[i + NSAGC_HOP] >> NSAGC_LOG2_FFT) *
+                       s_win[i + NSAGC_HOP] >> 15;
+        x[i] = nsagc_sat16(d->ola[i] + head);
+        d->ola[i] = tail;
+    }
+}
+
+void nsagc_dsp_agc(nsagc_dsp_t* d, int16_t* x, int n) {
+    const nsagc_dsp_cfg_t* cfg = &d->cfg;
+    int32_t sum = 0;
+    int32_t peak = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t a = abs(x[i]);
+        sum += a;
+        if (a > peak) {
+            peak = a;
+        }
+    }
+    int32_t level = n ? sum / n : 0;
+    if (d->agc_floor == 0 || level < d->agc_floor) {
+        d->agc_floor += (level - d->agc_floor) >> 2;
+    } else {
+        d->agc_floor += (d->agc_floor >> 8) + 1;
+    }
+
+    int32_t g0 = d->agc_gain;
+    int32_t g = g0;
+    if (level > 2 * d->agc_floor && level > 32) {
+        int32_t out = ((int64_t)level * g) >> 16;
+        if (out < cfg->agc_target) {
+            g += (g >> 6) + 1;
+        } else {
+            g -= g >> 4;
+        }
+    }
+    if (g > cfg->agc_max_gain) {
+        g = cfg->agc_max_gain;
+    } else if (g < 65536 / 4) {
+        g = 65536 / 4;
+    }
+    if (peak && (((int64_t)peak * g) >> 16) > INT16_MAX) {
+        g = ((int64_t)INT16_MAX << 16) / peak;
+        g0 = g; // No ramp into a clip
+    }
+    d->agc_gain = g;
+
+    // Ramp over the frame, applied in Q10
+    int32_t step = n ? (g - g0) / n : 0;
+    for (int i = 0; i < n; i++, g0 += step) {
+        x[i] = nsagc_sat16((x[i] * (g0 >> 6)) >> 10);
+    }
+}
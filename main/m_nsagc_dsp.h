@@ -0,0 +1,66 @@
+#ifndef _M_NSAGC_DSP_H_
+#define _M_NSAGC_DSP_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed-point noise suppression and AGC kernels, plain C so they can be
+ * built on the host.
+ *
+ * Noise suppression is spectral subtraction. It uses a 256 point FFT, a
+ * sqrt-Hann window and 50% overlap-add, so every hop of 128 samples costs
+ * the same. The noise floor of each bin follows the minimum of the
+ * smoothed magnitude. The output is one hop late.
+ *
+ * The AGC moves the mean absolute level of speech frames towards a target.
+ * It does not adapt on frames near the noise floor, and it backs off at
+ * once when a peak would clip.
+ */
+#define NSAGC_FFT_SIZE 256
+#define NSAGC_HOP (NSAGC_FFT_SIZE / 2)
+#define NSAGC_BINS (NSAGC_FFT_SIZE / 2 + 1)
+
+typedef struct {
+    int32_t ns_floor;     /* Lowest suppression gain, Q15 */
+    int32_t ns_over;      /* Noise over-subtraction, Q8 */
+    int32_t agc_target;   /* Mean absolute level of speech */
+    int32_t agc_max_gain; /* Q16 */
+} nsagc_dsp_cfg_t;
+
+typedef struct {
+    nsagc_dsp_cfg_t cfg;
+    int16_t prev[NSAGC_HOP]; /* Input of the previous hop */
+    int32_t ola[NSAGC_HOP];  /* Overlap-add tail */
+    int32_t re[NSAGC_FFT_SIZE];
+    int32_t im[NSAGC_FFT_SIZE];
+    int32_t mag[NSAGC_BINS];   /* Smoothed magnitude */
+    int32_t noise[NSAGC_BINS]; /* Noise floor estimate */
+    int32_t gain[NSAGC_BINS];  /* Q15 */
+    uint32_t frames;
+    int32_t agc_gain;  /* Q16 */
+    int32_t agc_floor; /* Level of non-speech frames */
+} nsagc_dsp_t;
+
+/*
+ * @brief Fill the config from dB values
+ *
+ * @param floor_db     Maximum suppression, e.g. -15
+ * @param target_dbfs  Speech level the AGC aims for, e.g. -20
+ * @param max_gain_db  AGC gain limit, at most 30
+ */
+void nsagc_dsp_cfg_db(nsagc_dsp_cfg_t* cfg, int floor_db, int target_dbfs,
+                      int max_gain_db);
+
+void nsagc_dsp_init(nsagc_dsp_t* d, const nsagc_dsp_cfg_t* cfg);
+
+/*
+ * @brief Suppress noise in one hop of NSAGC_HOP mono samples, in place
+ */
+void nsagc_dsp_ns(nsagc_dsp_t* d, int16_t* x);
+
+/*
+ * @brief Apply the AGC to n mono samples, in place
+ */
+void nsagc_dsp_agc(nsagc_dsp_t* d, int16_t* x, int n);
+
+#endif
@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "nvs.h"
+
+#include "audio_mem.h"
+
+#include "m_assets.h"
+#include "m_metrics.h"
+#include "m_ota.h"
+#include "m_tasks.h"
+
+static const char* TAG = "ota";
+
+// The CA of the TLS streams, see m_tls.h
+extern const char server_ca_pem_start[] asm("_binary_server_ca_pem_start");
+
+#define OTA_SECTOR 4096
+#define OTA_VERIFY_LEN 256 /* Read back per flash read */
+#define OTA_MANIFEST_MAX 512
+#define OTA_URL_MAX 128
+#define OTA_TIMEOUT_MS 10000
+#define OTA_FIRST_CHECK_S 30 /* After boot, once WiFi had time to settle */
+#define OTA_POLL_MS 200      /* While the audio is active */
+#define OTA_GAP_MS 1000      /* Longest wait for a detection gap */
+#define OTA_NVS_NAMESPACE "ota"
+#define OTA_NVS_DIRTY "dirty" /* Bit per kind: its slot was written */
+#define OTA_IMAGE_MAGIC 0xE9 /* First byte of an ESP32 app image */
+
+typedef enum {
+    OTA_KIND_ASSETS, /* First, an app update restarts the device */
+    OTA_KIND_APP,
+    OTA_KIND_NUM
+} ota_kind_t;
+
+static const char* s_kind_name[OTA_KIND_NUM] = {
+    [OTA_KIND_ASSETS] = "assets",
+    [OTA_KIND_APP] = "app",
+};
+static const char* s_nvs_key[OTA_KIND_NUM] = {
+    [OTA_KIND_ASSETS] = "asset_ver",
+    [OTA_KIND_APP] = "app_ver",
+};
+
+typedef struct {
+    bool valid;
+    uint32_t version;
+    uint32_t size;
+    uint8_t sha256[32];
+    char url[OTA_URL_MAX];
+} ota_item_t;
+
+typedef struct {
+    ota_kind_t kind;
+    const esp_partition_t* part;
+    uint32_t offset; /* Of the image in part */
+    uint32_t room;
+    uint32_t generation; /* Of a new pack */
+    uint8_t* buf;
+    uint8_t* head; /* First sector of a pack, written last */
+    uint8_t* check;
+    mbedtls_sha256_context sha;
+    int64_t start_us;
+    int64_t paused_us;
+} ota_job_t;
+
+static ota_cfg_t s_cfg;
+static TaskHandle_t s_task;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool s_audio_active;
+static int64_t s_idle_since;
+static bool s_installed;
+static uint8_t s_dirty;
+static const esp_partition_t* s_boot; /* Set as the boot slot at restart */
+
+void ota_set_audio_active(bool active) {
+    portENTER_CRITICAL(&s_mux);
+    if (s_audio_active && !active) {
+        s_idle_since = esp_timer_get_time();
+    }
+    s_audio_active = active;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+// Microseconds the audio has been idle, -1 while it is active
+static int64_t ota_idle_us(void) {
+    portENTER_CRITICAL(&s_mux);
+    int64_t idle = s_audio_active ? -1 : esp_timer_get_time() - s_idle_since;
+    portEXIT_CRITICAL(&s_mux);
+    return idle;
+}
+
+void ota_detect_done(void) {
+    if (s_task) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+static int64_t ota_wait_audio(void) {
+    int64_t start = esp_timer_get_time();
+    while (ota_idle_us() < 0) {
+        vTaskDelay(OTA_POLL_MS / portTICK_PERIOD_MS);
+    }
+    int64_t paused = esp_timer_get_time() - start;
+    if (paused > 0) {
+        metrics_add(METRIC_OTA_PAUSED_MS, paused / 1000);
+    }
+    return paused;
+}
+
+/*
+ * Before a flash operation: wait out recording and playback, then for a
+ * chunk of the wake detection to finish. A gap that passed while the
+ * task was busy is stale, the next chunk may be about to start.
+ */
+static int64_t ota_wait_gap(void) {
+    int64_t paused = 0;
+    while (1) {
+        paused += ota_wait_audio();
+        int64_t start = esp_timer_get_time();
+        ulTaskNotifyTake(pdTRUE, 0);
+        bool gap = ulTaskNotifyTake(pdTRUE, OTA_GAP_MS / portTICK_PERIOD_MS);
+        int64_t waited = esp_timer_get_time() - start;
+        metrics_add(METRIC_OTA_PAUSED_MS, waited / 1000);
+        paused += waited;
+        if (gap && ota_idle_us() >= 0) {
+            return paused;
+        }
+    }
+}
+
+/*
+ * After a chunk that took busy_us: sleep long enough to keep the flash
+ * work at duty_pct, and to hold the average rate over the download,
+ * pauses for audio not counted.
+ */
+static void ota_throttle(ota_job_t* job, uint32_t done, int64_t busy_us) {
+    int64_t wait = busy_us * (100 - s_cfg.duty_pct) / s_cfg.duty_pct;
+    int64_t due = job->start_us + job->paused_us +
+                  (int64_t)done * 1000000 / (s_cfg.rate_kb_s * 1024);
+    int64_t now = esp_timer_get_time();
+    if (due - now > wait) {
+        wait = due - now;
+    }
+    vTaskDelay(wait / 1000 / portTICK_PERIOD_MS + 1);
+}
+
+static uint32_t ota_get_version(ota_kind_t kind) {
+    uint32_t version = 0;
+    nvs_handle nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, s_nvs_key[kind], &version);
+        nvs_close(nvs);
+    }
+    return version;
+}
+
+static esp_err_t ota_set_version(ota_kind_t kind, uint32_t version) {
+    nvs_handle nvs;
+    ota_wait_gap();
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_u32(nvs, s_nvs_key[kind], version);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void ota_set_dirty(uint8_t dirty) {
+    nvs_handle nvs;
+    s_dirty = dirty;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_u8(nvs, OTA_NVS_DIRTY, dirty);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+static bool ota_parse_sha(const char* hex, uint8_t* sha) {
+    if (strlen(hex) != 64) {
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+        char* end;
+        sha[i] = strtoul(byte, &end, 16);
+        if (*end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Paths in the manifest are relative to the manifest's host. Images may
+// come from anywhere, the manifest's SHA-256 vouches for them.
+static void ota_resolve(const char* path, char* url) {
+    if (strncmp(path, "http", 4) == 0) {
+        snprintf(url, OTA_URL_MAX, "%s", path);
+        return;
+    }
+    const char* host = strstr(s_cfg.manifest_url, "://");
+    const char* end = host ? strchr(host + 3, '/') : NULL;
+    int len = end ? end - s_cfg.manifest_url : strlen(s_cfg.manifest_url);
+    snprintf(url, OTA_URL_MAX, "%.*s%s%s", len, s_cfg.manifest_url,
+             path[0] == '/' ? "" : "/", path);
+}
+
+static void ota_parse_manifest(char* text, ota_item_t* items) {
+    char* save = NULL;
+    for (char* line = strtok_r(text, "\r\n", &save); line;
+         line = strtok_r(NULL, "\r\n", &save)) {
+        char kind[8], sha[65], path[OTA_URL_MAX];
+        unsigned version, size;
+        if (sscanf(line, "%7s %u %u %64s %127s", kind, &version, &size, sha,
+                   path) != 5) {
+            continue;
+        }
+        for (int k = 0; k < OTA_KIND_NUM; k++) {
+            if (strcmp(kind, s_kind_name[k]) != 0) {
+                continue;
+            }
+            ota_item_t* item = &items[k];
+            item->valid = ota_parse_sha(sha, item->sha256);
+            item->version = version;
+            item->size = size;
+            ota_resolve(path, item->url);
+        }
+    }
+}
+
+static esp_err_t ota_fetch_manifest(ota_item_t* items) {
+    esp_http_client_config_t cfg = {
+        .url = s_cfg.manifest_url,
+        .cert_pem = server_ca_pem_start,
+        .timeout_ms = OTA_TIMEOUT_MS,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&cfg);
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    char* text = audio_calloc(1, OTA_MANIFEST_MAX);
+    esp_err_t err = ESP_FAIL;
+    if (text && esp_http_client_open(client, 0) == ESP_OK) {
+        esp_http_client_fetch_headers(client);
+        int len = 0;
+        int r;
+        while (len < OTA_MANIFEST_MAX - 1 &&
+               (r = esp_http_client_read(client, text + len,
+                                         OTA_MANIFEST_MAX - 1 - len)) > 0) {
+            len += r;
+        }
+        if (esp_http_client_get_status_code(client) == 200) {
+            ota_parse_manifest(text, items);
+            err = ESP_OK;
+        }
+        esp_http_client_close(client);
+    }
+    esp_http_client_cleanup(client);
+    audio_free(text);
+    return err;
+}
+
+// Write and read back one sector of the image, the slot was erased at boot
+static esp_err_t ota_write_sector(ota_job_t* job, uint32_t pos,
+                                  const uint8_t* data, int len) {
+    uint32_t addr = job->offset + pos;
+    job->paused_us += ota_wait_gap();
+    esp_err_t err = esp_partition_write(job->part, addr, data, len);
+    for (int i = 0; err == ESP_OK && i < len; i += OTA_VERIFY_LEN) {
+        int n = len - i < OTA_VERIFY_LEN ? len - i : OTA_VERIFY_LEN;
+        err = esp_partition_read(job->part, addr + i, job->check, n);
+        if (err == ESP_OK && memcmp(job->check, data + i, n) != 0) {
+            ESP_LOGE(TAG, "[ ota ] Read back differs at 0x%x", addr + i);
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    return err;
+}
+
+// The first sector: check the image type, a pack gets its generation
+static esp_err_t ota_first_sector(ota_job_t* job, int len) {
+    if (job->kind == OTA_KIND_APP) {
+        return job->buf[0] == OTA_IMAGE_MAGIC ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+    asset_pack_header_t* header = (asset_pack_header_t*)job->buf;
+    if (len < sizeof(*header) || header->magic != ASSET_PACK_MAGIC ||
+        header->version != ASSET_PACK_VERSION ||
+        header->image_size > job->room) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    header->generation = job->generation;
+    memcpy(job->head, job->buf, len);
+    return ESP_OK;
+}
+
+static int ota_read_full(esp_http_client_handle_t client, uint8_t* buf,
+                         int len) {
+    int got = 0;
+    while (got < len) {
+        int r = esp_http_client_read(client, (char*)buf + got, len - got);
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+static esp_err_t ota_download(ota_job_t* job, const ota_item_t* item) {
+    esp_http_client_config_t cfg = {
+        .url = item->url,
+        .cert_pem = server_ca_pem_start,
+        .timeout_ms = OTA_TIMEOUT_MS,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&cfg);
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        esp_http_client_cleanup(client);
+        return err;
+    }
+    int len = esp_http_client_fetch_headers(client);
+    if (esp_http_client_get_status_code(client) != 200 ||
+        (len >= 0 && len != item->size)) {
+        ESP_LOGE(TAG, "[ ota ] %s: status %d, %d bytes", item->url,
+                 esp_http_client_get_status_code(client), len);
+        err = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    uint32_t pos = 0;
+    int first_len = 0;
+    while (err == ESP_OK && pos < item->size) {
+        job->paused_us += ota_wait_audio();
+        int want = item->size - pos < OTA_SECTOR ? item->size - pos
+                                                  : OTA_SECTOR;
+        if (ota_read_full(client, job->buf, want) != want) {
+            ESP_LOGE(TAG, "[ ota ] Download ended at %u of %u", pos,
+                     item->size);
+            err = ESP_FAIL;
+            break;
+        }
+        int64_t start = esp_timer_get_time();
+        mbedtls_sha256_update_ret(&job->sha, job->buf, want);
+        if (pos == 0) {
+            first_len = want;
+            err = ota_first_sector(job, want);
+        }
+        if (err == ESP_OK && (pos > 0 || job->kind == OTA_KIND_APP)) {
+            err = ota_write_sector(job, pos, job->buf, want);
+        }
+        pos += want;
+        int64_t busy = esp_timer_get_time() - start;
+        metrics_observe(METRIC_HIST_OTA_CHUNK_US, busy);
+        metrics_add(METRIC_OTA_BYTES, want);
+        ota_throttle(job, pos, busy);
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+
+    uint8_t sha[32];
+    mbedtls_sha256_finish_ret(&job->sha, sha);
+    if (err == ESP_OK && memcmp(sha, item->sha256, sizeof(sha)) != 0) {
+        ESP_LOGE(TAG, "[ ota ] %s: SHA-256 mismatch", item->url);
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK && job->kind == OTA_KIND_ASSETS) {
+        err = ota_write_sector(job, 0, job->head, first_len);
+    }
+    return err;
+}
+
+static esp_err_t ota_prepare(ota_job_t* job) {
+    if (job->kind == OTA_KIND_ASSETS) {
+        return assets_update_slot(&job->part, &job->offset, &job->room,
+                                  &job->generation);
+    }
+    job->part = esp_ota_get_next_update_partition(NULL);
+    if (job->part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    job->offset = 0;
+    job->room = job->part->size;
+    return ESP_OK;
+}
+
+/*
+ * Erase the slots written since the last boot. A 4 KB erase stalls the
+ * cache for tens of milliseconds, longer than the I2S reader's DMA holds,
+ * so it only runs here, before the first pipeline starts.
+ */
+static void ota_erase_slots(void) {
+    nvs_handle nvs;
+    s_dirty = 0xff; /* Unknown after flashing */
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u8(nvs, OTA_NVS_DIRTY, &s_dirty);
+        nvs_close(nvs);
+    }
+    uint8_t dirty = s_dirty;
+    for (int k = 0; k < OTA_KIND_NUM; k++) {
+        ota_job_t job = {.kind = k};
+        if (!(dirty & (1 << k)) || ota_prepare(&job) != ESP_OK) {
+            continue;
+        }
+        const esp_partition_t* running = esp_ota_get_running_partition();
+        if (k == OTA_KIND_APP && esp_ota_get_boot_partition() != running) {
+            esp_ota_set_boot_partition(running);
+        }
+        int64_t start = esp_timer_get_time();
+        if (esp_partition_erase_range(job.part, job.offset, job.room) ==
+            ESP_OK) {
+            dirty &= ~(1 << k);
+        }
+        ESP_LOGI(TAG, "[ ota ] Erased %s at 0x%x, %u bytes in %lld ms",
+                 job.part->label, job.offset, job.room,
+                 (esp_timer_get_time() - start) / 1000);
+    }
+    if (dirty != s_dirty) {
+        ota_set_dirty(dirty);
+    }
+}
+
+static esp_err_t ota_apply(ota_kind_t kind, const ota_item_t* item) {
+    ota_job_t job = {.kind = kind};
+    if (s_dirty & (1 << kind)) {
+        ESP_LOGI(TAG, "[ ota ] %s %u waits for the restart to erase its slot",
+                 s_kind_name[kind], item->version);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ota_prepare(&job);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[ ota ] No slot for %s: %d", s_kind_name[kind], err);
+        return err;
+    }
+    if (item->size > job.room) {
+        ESP_LOGE(TAG, "[ ota ] %s is %u bytes, the slot %u",
+                 s_kind_name[kind], item->size, job.room);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    job.buf = audio_malloc(OTA_SECTOR);
+    job.head = kind == OTA_KIND_ASSETS ? audio_malloc(OTA_SECTOR) : NULL;
+    job.check = audio_malloc(OTA_VERIFY_LEN);
+    if (job.buf == NULL || job.check == NULL ||
+        (kind == OTA_KIND_ASSETS && job.head == NULL)) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        ESP_LOGI(TAG, "[ ota ] %s %u, %u bytes to %s at 0x%x",
+                 s_kind_name[kind], item->version, item->size,
+                 job.part->label, job.offset);
+        mbedtls_sha256_init(&job.sha);
+        mbedtls_sha256_starts_ret(&job.sha, 0);
+        job.start_us = esp_timer_get_time();
+        job.paused_us += ota_wait_gap();
+        ota_set_dirty(s_dirty | (1 << kind));
+        err = ota_download(&job, item);
+        mbedtls_sha256_free(&job.sha);
+    }
+    audio_free(job.buf);
+    audio_free(job.head);
+    audio_free(job.check);
+
+    // Switching the boot slot erases a sector of otadata. With restart set
+    // that waits for the restart, only the image is checked now.
+    if (err == ESP_OK && kind == OTA_KIND_APP) {
+        esp_partition_pos_t pos = {
+            .offset = job.part->address,
+            .size = job.part->size,
+        };
+        esp_image_metadata_t data;
+        err = esp_image_verify(ESP_IMAGE_VERIFY, &pos, &data);
+        if (err == ESP_OK && s_cfg.restart) {
+            s_boot = job.part;
+        } else if (err == ESP_OK) {
+            ota_wait_gap();
+            err = esp_ota_set_boot_partition(job.part);
+        }
+    }
+    if (err == ESP_OK) {
+        err = ota_set_version(kind, item->version);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[ ota ] %s %u failed: %d", s_kind_name[kind],
+                 item->version, err);
+        metrics_add(METRIC_OTA_FAILURES, 1);
+        return err;
+    }
+    int64_t took = esp_timer_get_time() - job.start_us;
+    ESP_LOGI(TAG, "[ ota ] %s %u installed in %lld s, %lld s paused for audio",
+             s_kind_name[kind], item->version, took / 1000000,
+             job.paused_us / 1000000);
+    metrics_add(METRIC_OTA_UPDATES, 1);
+    s_installed = true;
+    return ESP_OK;
+}
+
+static void ota_check(void) {
+    ota_item_t items[OTA_KIND_NUM] = {0};
+    ota_wait_audio();
+    if (ota_fetch_manifest(items) != ESP_OK) {
+        ESP_LOGW(TAG, "[ ota ] No manifest at %s", s_cfg.manifest_url);
+        return;
+    }
+    for (int k = 0; k < OTA_KIND_NUM; k++) {
+        if (items[k].valid && items[k].version > ota_get_version(k)) {
+            ota_apply(k, &items[k]);
+        }
+    }
+}
+
+static void ota_task(void* arg) {
+    int64_t next = esp_timer_get_time() + OTA_FIRST_CHECK_S * 1000000LL;
+    while (1) {
+        int64_t idle = ota_idle_us();
+        if (s_installed && s_cfg.restart &&
+            idle > s_cfg.restart_idle_s * 1000000LL) {
+            ESP_LOGI(TAG, "[ ota ] Restarting into the update");
+            if (s_boot) {
+                esp_ota_set_boot_partition(s_boot);
+            }
+            esp_restart();
+        }
+        if (esp_timer_get_time() >= next) {
+            ota_check();
+            next = esp_timer_get_time() + s_cfg.period_s * 1000000LL;
+        }
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+}
+
+esp_err_t ota_start(const ota_cfg_t* cfg) {
+    if (s_task) {
+        return ESP_OK;
+    }
+    if (cfg->manifest_url == NULL || cfg->period_s <= 0 ||
+        cfg->rate_kb_s <= 0 || cfg->duty_pct <= 0 || cfg->duty_pct > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (strncmp(cfg->manifest_url, "https://", 8) != 0) {
+        ESP_LOGE(TAG, "[ ota ] The manifest needs https: %s",
+                 cfg->manifest_url);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (esp_ota_get_next_update_partition(NULL) == NULL) {
+        ESP_LOGE(TAG, "[ ota ] No spare app slot, flash partitions_ota.csv");
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_cfg = *cfg;
+    s_idle_since = esp_timer_get_time();
+    ota_erase_slots();
+    const task_placement_t* p = task_placement_get(TASK_SLOT_OTA);
+    if (xTaskCreatePinnedToCore(ota_task, p->name, p->stack, NULL, p->prio,
+                                &s_task, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ ota ] Error create task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ ota ] %s every %d s, app %u, assets %u, running %s",
+             s_cfg.manifest_url, s_cfg.period_s,
+             ota_get_version(OTA_KIND_APP), ota_get_version(OTA_KIND_ASSETS),
+             esp_ota_get_running_partition()->label);
+    return ESP_OK;
+}
@@ -0,0 +1,77 @@
+#ifndef _M_OTA_H_
+#define _M_OTA_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+/*
+ * Background firmware and prompt pack updates. The server publishes a
+ * manifest, one line per image, fetched over https and checked against
+ * the CA of the TLS streams (m_tls.h), so the SHA-256 it lists can be
+ * trusted:
+ *
+ *   app     3  1503232  <sha256 hex>  /ai/ota/app.bin
+ *   assets  2    46496  <sha256 hex>  /ai/ota/assets.bin
+ *
+ * An image whose version is above the one recorded in NVS is downloaded
+ * by a low priority task into the app slot that is not running, or the
+ * half of the asset partition that is not mapped (m_assets.h). Every 4 KB
+ * sector is written and read back as it arrives, the SHA-256 of the whole
+ * image is checked at the end. A firmware image only becomes the boot
+ * partition once it verified, a pack only gets its header written then,
+ * so an interrupted update leaves the running images in place.
+ *
+ * Flash erases and writes stall the cache of both cores. A sector erase
+ * takes longer than the I2S reader's DMA holds, so erases never run next
+ * to a mic pipeline: ota_start erases the slots written since the last
+ * boot before the first pipeline starts, and a slot written since waits
+ * for the next restart. The download stops while audio is recorded or
+ * played (ota_set_audio_active). While the device listens for the wake
+ * word every sector write waits for the detection to finish a chunk
+ * (ota_detect_done) and runs while the next chunk is recorded, one per
+ * chunk. On top the download keeps to rate_kb_s and to duty_pct of the
+ * time for its own work per chunk. Updates take effect at the next
+ * restart, restart_idle_s after the audio went back to listening when
+ * restart is set. Switching the boot slot erases a sector of otadata, it
+ * waits for that restart, or runs between two chunks without restart.
+ *
+ * Needs the two app slots of partitions_ota.csv.
+ */
+typedef struct {
+    const char* manifest_url; /* https:// */
+    int period_s;       /* Between manifest checks */
+    int rate_kb_s;      /* Average download rate */
+    int duty_pct;       /* Share of the time spent writing flash */
+    bool restart;       /* Restart into an update once the audio is idle */
+    int restart_idle_s; /* Idle time before that restart */
+} ota_cfg_t;
+
+#define OTA_CFG_DEFAULT()          \
+    {                              \
+        .manifest_url = NULL,      \
+        .period_s = 3600,          \
+        .rate_kb_s = 32,           \
+        .duty_pct = 10,            \
+        .restart = true,           \
+        .restart_idle_s = 60,      \
+    }
+
+/*
+ * @brief Erase the update slots written since the last boot, then start
+ *        the update task. Call before any mic pipeline runs.
+ */
+esp_err_t ota_start(const ota_cfg_t* cfg);
+
+/*
+ * @brief A recording or playback pipeline started or stopped, downloads
+ *        pause while one runs
+ */
+void ota_set_audio_active(bool active);
+
+/*
+ * @brief The wake detection finished a chunk, a flash operation may run
+ *        until the next one is recorded
+ */
+void ota_detect_done(void);
+
+#endif
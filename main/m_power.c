@@ -0,0 +1,223 @@
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#if CONFIG_PM_ENABLE
+#include "esp32/pm.h"
+#endif
+
+#include "m_dlog.h"
+#include "m_power.h"
+#include "m_power_policy.h"
+
+static const char* TAG = "power";
+
+#if CONFIG_POWER_MANAGEMENT_ENABLE
+#define POWER_MIN_MHZ CONFIG_POWER_MIN_MHZ
+#define POWER_MAX_MHZ 240
+#else
+// esp_pm is off, the clock stays fixed and only the metrics are collected
+#define POWER_MIN_MHZ CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define POWER_MAX_MHZ CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#endif
+#define POWER_WINDOW_US (1000 * 1000)
+
+static const int s_steps_mhz[] = {80, 160, 240};
+
+static const power_policy_t s_listen_policy = {
+    .steps_mhz = s_steps_mhz,
+    .step_num = sizeof(s_steps_mhz) / sizeof(s_steps_mhz[0]),
+    .up_pct = 70,
+    .down_pct = 50,
+};
+
+// CPU current in mA at 80/160/240 MHz, mid range of the ESP32 datasheet
+// modem-sleep figures. Radio and codec are not included.
+static const int s_cpu_ma[] = {25, 35, 50};
+
+typedef struct {
+    int64_t time_us;
+    int64_t mhz_us; /* Frequency integrated over time */
+    int64_t busy_us;
+    int64_t budget_us;
+} power_stats_t;
+
+static power_stats_t s_stats[POWER_STATE_MAX];
+static int s_state = -1;
+static power_mode_t s_mode = POWER_MODE_LISTEN;
+static bool s_work; /* Between power_work_begin() and power_add_work() */
+static int s_cur_mhz = POWER_MAX_MHZ;
+static int s_listen_mhz = POWER_MAX_MHZ;
+static int64_t s_state_start_us;
+static int64_t s_seg_start_us; /* Start of the current frequency segment */
+static int64_t s_win_busy_us, s_win_budget_us;
+
+#if CONFIG_POWER_MANAGEMENT_ENABLE
+static esp_pm_lock_handle_t s_freq_lock;
+static bool s_lock_held;
+#endif
+
+// Frequency outside real-time work. Listening only holds the lock around
+// detection, in between esp_pm falls back to the minimum frequency.
+static int power_floor_mhz(void) {
+    return s_mode == POWER_MODE_BOOST ? s_cur_mhz : POWER_MIN_MHZ;
+}
+
+static void power_hold(bool hold) {
+#if CONFIG_POWER_MANAGEMENT_ENABLE
+    // Without the lock esp_pm falls back to the minimum frequency
+    if (hold && !s_lock_held) {
+        esp_pm_lock_acquire(s_freq_lock);
+    } else if (!hold && s_lock_held) {
+        esp_pm_lock_release(s_freq_lock);
+    }
+    s_lock_held = hold;
+#endif
+}
+
+static void power_set_mhz(int mhz) {
+    if (mhz < POWER_MIN_MHZ) {
+        mhz = POWER_MIN_MHZ;
+    } else if (mhz > POWER_MAX_MHZ) {
+        mhz = POWER_MAX_MHZ;
+    }
+    int64_t now = esp_timer_get_time();
+    if (s_state >= 0) {
+        s_stats[s_state].mhz_us +=
+            (int64_t)power_floor_mhz() * (now - s_seg_start_us);
+    }
+    s_seg_start_us = now;
+    s_cur_mhz = mhz;
+#if CONFIG_POWER_MANAGEMENT_ENABLE
+    // The mic and Wi-Fi drivers hold locks against light sleep whenever
+    // they run, and one of them always runs after boot
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = mhz,
+        .min_freq_mhz = POWER_MIN_MHZ,
+        .light_sleep_enable = false,
+    };
+    esp_pm_configure(&pm_config);
+#endif
+    power_hold(s_mode == POWER_MODE_BOOST || s_work);
+}
+
+static int power_est_mw(int avg_mhz) {
+    int n = sizeof(s_steps_mhz) / sizeof(s_steps_mhz[0]);
+    int ma = s_cpu_ma[n - 1];
+    for (int i = 0; i < n; i++) {
+        if (avg_mhz <= s_steps_mhz[i]) {
+            if (i == 0) {
+                ma = s_cpu_ma[0];
+            } else {
+                ma = s_cpu_ma[i - 1] + (s_cpu_ma[i] - s_cpu_ma[i - 1]) *
+                                           (avg_mhz - s_steps_mhz[i - 1]) /
+                                           (s_steps_mhz[i] - s_steps_mhz[i - 1]);
+            }
+            break;
+        }
+    }
+    return ma * 33 / 10;
+}
+
+static void power_report(int state) {
+    power_stats_t* st = &s_stats[state];
+    if (st->time_us == 0) {
+        return;
+    }
+    int avg_mhz = st->mhz_us / st->time_us;
+    int load = st->budget_us ? st->busy_us * 100 / st->budget_us : -1;
+    ESP_LOGI(TAG,
+             "[ power ] state %d: %lld ms, avg %d MHz, load %d%%, est %d mW",
+             state, st->time_us / 1000, avg_mhz, load,
+             power_est_mw(avg_mhz));
+}
+
+esp_err_t power_init(void) {
+#if CONFIG_POWER_MANAGEMENT_ENABLE
+    esp_err_t err =
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "audio", &s_freq_lock);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "[ power ] lock create failed: %d", err);
+        return err;
+    }
+#endif
+    s_seg_start_us = esp_timer_get_time();
+    power_set_mhz(POWER_MIN_MHZ);
+    return ESP_OK;
+}
+
+void power_enter_state(int state, power_mode_t mode) {
+    if (state < 0 || state >= POWER_STATE_MAX || state == s_state) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (s_state >= 0) {
+        power_stats_t* st = &s_stats[s_state];
+        st->mhz_us += (int64_t)power_floor_mhz() * (now - s_seg_start_us);
+        st->time_us += now - s_state_start_us;
+        power_report(s_state);
+    }
+    s_state = state;
+    s_mode = mode;
+    s_work = false;
+    s_state_start_us = now;
+    s_seg_start_us = now;
+    s_win_busy_us = 0;
+    s_win_budget_us = 0;
+    switch (mode) {
+        case POWER_MODE_LISTEN:
+            power_set_mhz(s_listen_mhz);
+            break;
+        case POWER_MODE_BOOST:
+            power_set_mhz(POWER_MAX_MHZ);
+            break;
+    }
+}
+
+void power_work_begin(void) {
+    if (s_state < 0 || s_mode != POWER_MODE_LISTEN) {
+        return;
+    }
+    s_work = true;
+    power_hold(true);
+}
+
+void power_add_work(int64_t busy_us, int64_t budget_us) {
+    if (s_state < 0) {
+        return;
+    }
+    if (s_work) {
+        s_work = false;
+        power_hold(false);
+        // The floor was accounted for the whole segment, add the boost
+        s_stats[s_state].mhz_us +=
+            (int64_t)(s_cur_mhz - POWER_MIN_MHZ) * busy_us;
+    }
+    s_stats[s_state].busy_us += busy_us;
+    s_stats[s_state].budget_us += budget_us;
+    s_win_busy_us += busy_us;
+    s_win_budget_us += budget_us;
+    if (s_win_budget_us < POWER_WINDOW_US) {
+        return;
+    }
+    int load = s_win_busy_us * 100 / s_win_budget_us;
+    // Trace for tools/host power_replay, see README.md "Host tests"
+    DLOGD(TAG, "[ power ] window %d MHz busy %d us budget %d us", s_cur_mhz,
+          (int)s_win_busy_us, (int)s_win_budget_us);
+    s_win_busy_us = 0;
+    s_win_budget_us = 0;
+    if (s_mode != POWER_MODE_LISTEN || POWER_MIN_MHZ == POWER_MAX_MHZ) {
+        return;
+    }
+    int mhz = power_policy_next_mhz(&s_listen_policy, s_cur_mhz, load);
+    if (mhz != s_cur_mhz) {
+        ESP_LOGI(TAG, "[ power ] listen load %d%% at %d MHz, switch to %d MHz",
+                 load, s_cur_mhz, mhz);
+        s_listen_mhz = mhz;
+        power_set_mhz(mhz);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _M_POWER_H_
+#define _M_POWER_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Dynamic frequency scaling driven by the app state machine. Listening
+ * runs the wake-word detection at the lowest frequency that keeps it real
+ * time and the minimum frequency in between, decode and upload are boosted
+ * to the maximum. There is no idle state: after boot the app always
+ * listens or plays.
+ */
+typedef enum {
+    POWER_MODE_LISTEN,
+    POWER_MODE_BOOST,
+} power_mode_t;
+
+#define POWER_STATE_MAX 8
+
+/*
+ * @brief Configure esp_pm and create the frequency lock
+ */
+esp_err_t power_init(void);
+
+/*
+ * @brief The state machine moved to `state`, log the metrics of the state
+ *        it left and apply the frequency of `mode`
+ */
+void power_enter_state(int state, power_mode_t mode);
+
+/*
+ * @brief Real-time work on a chunk starts: hold the listening frequency
+ *        until the matching power_add_work()
+ */
+void power_work_begin(void);
+
+/*
+ * @brief Account real-time work: `busy_us` spent on a chunk that covers
+ *        `budget_us` of audio. Drives the listening frequency policy.
+ */
+void power_add_work(int64_t busy_us, int64_t budget_us);
+
+#endif
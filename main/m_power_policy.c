@@ -0,0 +1,26 @@
+#include "m_power_policy.h"
+
+int power_policy_next_mhz(const power_policy_t* policy, int cur_mhz,
+                          int load_pct) {
+    int cur = 0;
+    while (cur < policy->step_num - 1 && policy->steps_mhz[cur] < cur_mhz) {
+        cur++;
+    }
+    // Work scales with 1/f, project the load onto every step
+    if (load_pct > policy->up_pct) {
+        for (int i = cur + 1; i < policy->step_num; i++) {
+            if (load_pct * cur_mhz / policy->steps_mhz[i] <= policy->up_pct) {
+                return policy->steps_mhz[i];
+            }
+        }
+        return policy->steps_mhz[policy->step_num - 1];
+    }
+    int next = cur;
+    for (int i = cur - 1; i >= 0; i--) {
+        if (load_pct * cur_mhz / policy->steps_mhz[i] >= policy->down_pct) {
+            break;
+        }
+        next = i;
+    }
+    return policy->steps_mhz[next];
+}
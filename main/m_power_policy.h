@@ -0,0 +1,26 @@
+#ifndef _M_POWER_POLICY_H_
+#define _M_POWER_POLICY_H_
+
+/*
+ * CPU frequency selection for the listening state. Plain C without any
+ * ESP-IDF dependency so recorded load traces can be replayed on the host.
+ */
+typedef struct {
+    const int* steps_mhz; /* Ascending */
+    int step_num;
+    int up_pct;   /* Step up when the load is above this */
+    int down_pct; /* Step down when the load at the lower step stays below */
+} power_policy_t;
+
+/*
+ * @brief Pick the CPU frequency for the next window
+ *
+ * @param cur_mhz   Frequency the load was measured at
+ * @param load_pct  Busy time of the real-time work in percent of its budget
+ *
+ * @return The lowest step expected to keep the load under up_pct
+ */
+int power_policy_next_mhz(const power_policy_t* policy, int cur_mhz,
+                          int load_pct);
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_element.h"
+
+#include "m_metrics.h"
+#include "m_profile.h"
+
+static const char* TAG = "profile";
+
+static const audio_profile_t s_profiles[AUDIO_PROFILE_NUM] = {
+    [AUDIO_PROFILE_LOW_LATENCY] =
+        {
+            .name = "low-latency",
+            .dma_buf_count = 3,
+            .dma_buf_len = 128,
+            .pipeline_rb_size = 4 * 1024,
+            .stream_rb_size = 4 * 1024,
+            .codec_rb_size = 4 * 1024,
+        },
+    [AUDIO_PROFILE_STREAMING] =
+        {
+            .name = "streaming",
+            .dma_buf_count = 8,
+            .dma_buf_len = 300,
+            .pipeline_rb_size = 8 * 1024,
+            .stream_rb_size = 24 * 1024,
+            .codec_rb_size = 8 * 1024,
+        },
+};
+
+#define AUDIO_PROFILE_STAGE_MAX 8
+#define AUDIO_PROFILE_TAG_LEN 12
+
+// One element of the pipelines run with a profile: when it was running
+// after audio_pipeline_run, and its own underruns
+typedef struct {
+    char tag[AUDIO_PROFILE_TAG_LEN];
+    uint32_t runs;
+    int64_t ready_sum_us;
+    int64_t ready_max_us;
+    uint32_t underruns;
+} audio_profile_stage_t;
+
+typedef struct {
+    bool waiting;
+    int64_t start_us;
+    uint32_t runs;
+    uint32_t underruns;
+    int64_t latency_sum_us;
+    int64_t latency_max_us;
+    bool reading;
+    bool behind_set;
+    int64_t read_start_us;
+    int64_t read_audio_us; /* Since read_start_us */
+    int64_t behind_us;     /* Least lag of the audio behind the clock */
+    int64_t overrun_us;
+    int stage_num;
+    audio_profile_stage_t stage[AUDIO_PROFILE_STAGE_MAX];
+} audio_profile_stats_t;
+
+static audio_profile_stats_t s_stats[AUDIO_PROFILE_NUM];
+
+const audio_profile_t* audio_profile_get(audio_profile_id_t id) {
+    return &s_profiles[id < AUDIO_PROFILE_NUM ? id : AUDIO_PROFILE_STREAMING];
+}
+
+void audio_profile_mark_start(audio_profile_id_t id) {
+    s_stats[id].waiting = true;
+    s_stats[id].reading = false;
+    s_stats[id].start_us = esp_timer_get_time();
+}
+
+void audio_profile_mark_first_audio(audio_profile_id_t id) {
+    audio_profile_stats_t* st = &s_stats[id];
+    if (!st->waiting) {
+        return;
+    }
+    int64_t latency = esp_timer_get_time() - st->start_us;
+    st->waiting = false;
+    st->runs++;
+    st->latency_sum_us += latency;
+    if (latency > st->latency_max_us) {
+        st->latency_max_us = latency;
+    }
+    metrics_observe(METRIC_HIST_START_MS, latency / 1000);
+}
+
+void audio_profile_mark_read(audio_profile_id_t id, int64_t audio_us,
+                             int64_t wait_us) {
+    audio_profile_stats_t* st = &s_stats[id];
+    int64_t now = esp_timer_get_time();
+    if (!st->reading) {
+        st->reading = true;
+        st->behind_set = false;
+        st->read_start_us = now;
+        st->read_audio_us = 0;
+        return;
+    }
+    st->read_audio_us += audio_us;
+    if (wait_us < audio_us / 2) {
+        return; /* Served from the buffers */
+    }
+    // Audio that never arrived leaves the reads further behind for good
+    int64_t behind = now - st->read_start_us - st->read_audio_us;
+    if (!st->behind_set) {
+        st->behind_set = true;
+        st->behind_us = behind;
+    } else if (behind > st->behind_us) {
+        st->overrun_us += behind - st->behind_us;
+        st->behind_us = behind;
+    }
+}
+
+static audio_profile_stage_t* audio_profile_stage(audio_profile_stats_t* st,
+                                                   audio_element_handle_t el) {
+    const char* tag = audio_element_get_tag(el);
+    if (tag == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < st->stage_num; i++) {
+        if (strncmp(st->stage[i].tag, tag, AUDIO_PROFILE_TAG_LEN - 1) == 0) {
+            return &st->stage[i];
+        }
+    }
+    if (st->stage_num == AUDIO_PROFILE_STAGE_MAX) {
+        return NULL;
+    }
+    audio_profile_stage_t* stage = &st->stage[st->stage_num++];
+    strlcpy(stage->tag, tag, sizeof(stage->tag));
+    return stage;
+}
+
+void audio_profile_track_event(audio_profile_id_t id,
+                               audio_event_iface_msg_t* msg) {
+    if (msg->source_type != AUDIO_ELEMENT_TYPE_ELEMENT) {
+        return;
+    }
+    audio_profile_stats_t* st = &s_stats[id];
+    if (msg->cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
+        audio_profile_mark_first_audio(id);
+        return;
+    }
+    if (msg->cmd != AEL_MSG_CMD_REPORT_STATUS) {
+        return;
+    }
+    audio_profile_stage_t* stage =
+        audio_profile_stage(st, (audio_element_handle_t)msg->source);
+    if (stage == NULL) {
+        return;
+    }
+    if ((int)msg->data == AEL_STATUS_INPUT_BUFFERING) {
+        st->underruns++;
+        stage->underruns++;
+    } else if ((int)msg->data == AEL_STATUS_STATE_RUNNING) {
+        // Running means opened: a file, a connection, a codec
+        int64_t ready = esp_timer_get_time() - st->start_us;
+        stage->runs++;
+        stage->ready_sum_us += ready;
+        if (ready > stage->ready_max_us) {
+            stage->ready_max_us = ready;
+        }
+    }
+}
+
+void audio_profile_report(audio_profile_id_t id) {
+    audio_profile_stats_t* st = &s_stats[id];
+    if (st->runs == 0) {
+        return;
+    }
+    ESP_LOGI(TAG,
+             "[ profile ] %s: runs=%u, start latency avg=%lld us max=%lld us, "
+             "underruns=%u",
+             s_profiles[id].name, st->runs, st->latency_sum_us / st->runs,
+             st->latency_max_us, st->underruns);
+    for (int i = 0; i < st->stage_num; i++) {
+        audio_profile_stage_t* stage = &st->stage[i];
+        if (stage->runs == 0 && stage->underruns == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG,
+                 "[ profile ] %s: %-10s running after avg=%lld us "
+                 "max=%lld us, underruns=%u",
+                 s_profiles[id].name, stage->tag,
+                 stage->runs ? stage->ready_sum_us / stage->runs : 0,
+                 stage->ready_max_us, stage->underruns);
+    }
+}
+
+uint32_t audio_profile_underruns(audio_profile_id_t id) {
+    return s_stats[id].underruns;
+}
+
+uint32_t audio_profile_overrun_ms(audio_profile_id_t id) {
+    return s_stats[id].overrun_us / 1000;
+}
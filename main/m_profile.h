@@ -0,0 +1,74 @@
+#ifndef _M_PROFILE_H_
+#define _M_PROFILE_H_
+
+#include <stdint.h>
+#include "audio_event_iface.h"
+
+/*
+ * Named buffering profiles. A pipeline picks one when it is built; the
+ * profile sets the I2S DMA buffers and the ringbuffers between elements.
+ */
+typedef enum {
+    AUDIO_PROFILE_LOW_LATENCY,
+    AUDIO_PROFILE_STREAMING,
+    AUDIO_PROFILE_NUM
+} audio_profile_id_t;
+
+typedef struct {
+    const char* name;
+    int dma_buf_count;
+    int dma_buf_len;      /* In samples */
+    int pipeline_rb_size; /* Ringbuffers created by audio_pipeline_link */
+    int stream_rb_size;   /* Output ringbuffer of http/file/raw streams */
+    int codec_rb_size;    /* Output ringbuffer of decoders and encoders */
+} audio_profile_t;
+
+const audio_profile_t* audio_profile_get(audio_profile_id_t id);
+
+/*
+ * @brief Start timing a pipeline run of this profile
+ */
+void audio_profile_mark_start(audio_profile_id_t id);
+
+/*
+ * @brief The first audio of the current run is available, records the
+ *        start latency once per run
+ */
+void audio_profile_mark_first_audio(audio_profile_id_t id);
+
+/*
+ * @brief Feed pipeline events: music info marks the first decoded audio,
+ *        input buffering reports count as underruns. Both and the time
+ *        each element is running after the start are kept per element, so
+ *        the report splits the start latency and the underruns by stage.
+ */
+void audio_profile_track_event(audio_profile_id_t id,
+                               audio_event_iface_msg_t* msg);
+
+/*
+ * @brief A reader of the current run got audio_us of audio after waiting
+ *        wait_us. A read that had to wait found the buffers empty, then
+ *        the clock against the audio read since the first one shows what
+ *        the pipeline dropped, an I2S reader overrun. Counts only losses
+ *        of a few milliseconds or more, the resolution of a DMA buffer.
+ */
+void audio_profile_mark_read(audio_profile_id_t id, int64_t audio_us,
+                             int64_t wait_us);
+
+/*
+ * @brief Log the start latency and underrun counters of a profile, in
+ *        total and per stage
+ */
+void audio_profile_report(audio_profile_id_t id);
+
+/*
+ * @brief Underruns counted for a profile since boot
+ */
+uint32_t audio_profile_underruns(audio_profile_id_t id);
+
+/*
+ * @brief Milliseconds of input audio dropped by a profile since boot
+ */
+uint32_t audio_profile_overrun_ms(audio_profile_id_t id);
+
+#endif
@@ -0,0 +1,386 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_http_client.h"
+#include "esp_log.h"
+
+#include "audio_mem.h"
+
+#include "m_metrics.h"
+#include "m_reply_cache.h"
+#include "m_reply_index.h"
+
+static const char* TAG = "reply_cache";
+
+#define REPLY_CACHE_PATH_MAX 32
+#define REPLY_CACHE_DIR_MAX 16
+#define REPLY_CACHE_TIMEOUT_MS 5000
+// Card files start with the ETag, zero padded
+#define REPLY_CACHE_HEAD REPLY_INDEX_ETAG_MAX
+#define REPLY_STREAM_BUF_SIZE (2 * 1024)
+
+typedef struct {
+    esp_http_client_handle_t http;
+    FILE* fp;     /* The card copy on a hit, the fill file on a miss */
+    bool hit;
+    bool filling;
+    bool complete;
+    int expect;   /* Content-Length, -1 when chunked */
+    uint32_t bytes;
+    char etag[REPLY_INDEX_ETAG_MAX];
+} reply_stream_t;
+
+static char s_dir[REPLY_CACHE_DIR_MAX];
+static reply_index_t s_idx;
+static uint32_t s_hits, s_misses, s_saved_bytes;
+
+// FAT without long names: 8 hex digit file names
+static void reply_cache_path(const char* etag, char* path, int path_len) {
+    snprintf(path, path_len, "%s/%08X.MP3", s_dir, reply_index_name(etag));
+}
+
+static void reply_cache_tmp_path(char* path, int path_len) {
+    snprintf(path, path_len, "%s/FILL.TMP", s_dir);
+}
+
+static void reply_cache_evict(void) {
+    char path[REPLY_CACHE_PATH_MAX];
+    int i;
+    while ((i = reply_index_victim(&s_idx)) >= 0) {
+        reply_cache_path(s_idx.entries[i].etag, path, sizeof(path));
+        unlink(path);
+        ESP_LOGI(TAG, "[ cache ] evict %s", path);
+        reply_index_remove(&s_idx, i);
+    }
+}
+
+// The ETag a card file starts with, if it is one of ours
+static bool reply_cache_read_head(const char* path, uint32_t name,
+                                  char* etag) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fread(etag, 1, REPLY_CACHE_HEAD, fp) == REPLY_CACHE_HEAD;
+    fclose(fp);
+    return ok && etag[0] == '"' && memchr(etag, '\0', REPLY_CACHE_HEAD) &&
+           reply_index_name(etag) == name;
+}
+
+esp_err_t reply_cache_init(const char* dir, int max_entries,
+                           uint32_t max_bytes) {
+    char path[REPLY_CACHE_PATH_MAX];
+    char etag[REPLY_CACHE_HEAD];
+    if (strlen(dir) >= REPLY_CACHE_DIR_MAX || max_entries <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_idx.entries = audio_calloc(max_entries + 1, sizeof(reply_index_entry_t));
+    AUDIO_MEM_CHECK(TAG, s_idx.entries, return ESP_ERR_NO_MEM);
+    strcpy(s_dir, dir);
+    s_idx.max = max_entries;
+    s_idx.max_bytes = max_bytes;
+
+    if (mkdir(s_dir, 0775) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "[ cache ] Cannot create %s", s_dir);
+    }
+    reply_cache_tmp_path(path, sizeof(path));
+    unlink(path);
+
+    DIR* d = opendir(s_dir);
+    if (d == NULL) {
+        ESP_LOGE(TAG, "[ cache ] Cannot open %s, cache disabled", s_dir);
+        s_idx.max = 0;
+        return ESP_FAIL;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        char* end;
+        uint32_t name = strtoul(de->d_name, &end, 16);
+        struct stat st;
+        if (end != de->d_name + 8 || strcasecmp(end, ".MP3") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", s_dir, de->d_name);
+        // Files of an older layout or cut short are dropped
+        if (stat(path, &st) != 0 || st.st_size <= REPLY_CACHE_HEAD ||
+            !reply_cache_read_head(path, name, etag) ||
+            reply_index_find(&s_idx, etag) || s_idx.num == s_idx.max) {
+            unlink(path);
+            continue;
+        }
+        reply_index_add(&s_idx, etag, st.st_size - REPLY_CACHE_HEAD);
+    }
+    closedir(d);
+    reply_cache_evict();
+    ESP_LOGI(TAG, "[ cache ] %d replies, %u bytes in %s", s_idx.num,
+             s_idx.bytes, s_dir);
+    return ESP_OK;
+}
+
+static esp_err_t reply_stream_http_event(esp_http_client_event_t* evt) {
+    reply_stream_t* stream = (reply_stream_t*)evt->user_data;
+    if (evt->event_id == HTTP_EVENT_ON_HEADER &&
+        strcasecmp(evt->header_key, "ETag") == 0 &&
+        reply_index_etag(evt->header_value, stream->etag,
+                         sizeof(stream->etag)) != 0) {
+        stream->etag[0] = '\0';
+    }
+    return ESP_OK;
+}
+
+// GET the reply, If-None-Match lists the cached ETags when `inm` is set
+static int reply_stream_request(reply_stream_t* stream, const char* url,
+                                const char* inm) {
+    esp_http_client_config_t cfg = {
+        .url = url,
+        .timeout_ms = REPLY_CACHE_TIMEOUT_MS,
+        .event_handler = reply_stream_http_event,
+        .user_data = stream,
+        // The request headers, the ETag list included, go through it
+        .buffer_size = REPLY_STREAM_BUF_SIZE,
+    };
+    stream->etag[0] = '\0';
+    stream->http = esp_http_client_init(&cfg);
+    if (stream->http == NULL) {
+        return -1;
+    }
+    if (inm) {
+        esp_http_client_set_header(stream->http, "If-None-Match", inm);
+    }
+    if (esp_http_client_open(stream->http, 0) != ESP_OK) {
+        return -1;
+    }
+    stream->expect = esp_http_client_fetch_headers(stream->http);
+    return esp_http_client_get_status_code(stream->http);
+}
+
+static void reply_stream_release(reply_stream_t* stream) {
+    if (stream->http) {
+        esp_http_client_close(stream->http);
+        esp_http_client_cleanup(stream->http);
+        stream->http = NULL;
+    }
+}
+
+static bool reply_stream_open_hit(reply_stream_t* stream) {
+    char path[REPLY_CACHE_PATH_MAX];
+    reply_index_entry_t* e = reply_index_find(&s_idx, stream->etag);
+    if (e == NULL) {
+        return false;
+    }
+    reply_cache_path(e->etag, path, sizeof(path));
+    stream->fp = fopen(path, "rb");
+    if (stream->fp == NULL || fseek(stream->fp, REPLY_CACHE_HEAD, SEEK_SET)) {
+        ESP_LOGW(TAG, "[ cache ] Cannot read %s", path);
+        if (stream->fp) {
+            fclose(stream->fp);
+            stream->fp = NULL;
+        }
+        return false;
+    }
+    reply_index_touch(&s_idx, e);
+    stream->hit = true;
+    stream->expect = e->size;
+    s_hits++;
+    s_saved_bytes += e->size;
+    metrics_add(METRIC_REPLY_CACHE_HITS, 1);
+    metrics_add(METRIC_REPLY_CACHE_SAVED_BYTES, e->size);
+    ESP_LOGI(TAG, "[ cache ] hit %s %s", e->etag, path);
+    return true;
+}
+
+static void reply_stream_open_fill(reply_stream_t* stream) {
+    char tmp[REPLY_CACHE_PATH_MAX];
+    if (stream->etag[0] != '"') {
+        ESP_LOGW(TAG, "[ cache ] no ETag, not caching this reply");
+        return;
+    }
+    s_misses++;
+    metrics_add(METRIC_REPLY_CACHE_MISSES, 1);
+    reply_cache_tmp_path(tmp, sizeof(tmp));
+    stream->fp = fopen(tmp, "wb");
+    char head[REPLY_CACHE_HEAD] = {0};
+    strcpy(head, stream->etag);
+    if (stream->fp == NULL ||
+        fwrite(head, 1, sizeof(head), stream->fp) != sizeof(head)) {
+        ESP_LOGE(TAG, "[ cache ] Cannot write %s", tmp);
+        if (stream->fp) {
+            fclose(stream->fp);
+            stream->fp = NULL;
+        }
+        unlink(tmp);
+        return;
+    }
+    stream->filling = true;
+    ESP_LOGI(TAG, "[ cache ] miss %s, caching the download", stream->etag);
+}
+
+static esp_err_t _reply_stream_open(audio_element_handle_t self) {
+    reply_stream_t* stream = (reply_stream_t*)audio_element_getdata(self);
+    char* url = audio_element_get_uri(self);
+    char* inm = NULL;
+    stream->hit = stream->filling = stream->complete = false;
+    stream->bytes = 0;
+    if (s_idx.num) {
+        int size = s_idx.num * REPLY_INDEX_ETAG_MAX;
+        inm = audio_malloc(size);
+        if (inm && reply_index_if_none_match(&s_idx, inm, size) <= 0) {
+            audio_free(inm);
+            inm = NULL;
+        }
+    }
+    int status = reply_stream_request(stream, url, inm);
+    audio_free(inm);
+    if (status == 304 && reply_stream_open_hit(stream)) {
+        reply_stream_release(stream);
+    } else {
+        if (status == 304) {
+            // Not a copy we have (any more), ask again without a condition
+            reply_stream_release(stream);
+            status = reply_stream_request(stream, url, NULL);
+        }
+        if (status != 200) {
+            ESP_LOGE(TAG, "[ cache ] %s: status %d", url ? url : "(null)",
+                     status);
+            reply_stream_release(stream);
+            return ESP_FAIL;
+        }
+        if (s_idx.max) {
+            reply_stream_open_fill(stream);
+        }
+    }
+    audio_element_set_total_bytes(self, stream->expect > 0 ? stream->expect
+                                                           : 0);
+    return ESP_OK;
+}
+
+static void reply_stream_drop_fill(reply_stream_t* stream) {
+    char tmp[REPLY_CACHE_PATH_MAX];
+    fclose(stream->fp);
+    stream->fp = NULL;
+    stream->filling = false;
+    reply_cache_tmp_path(tmp, sizeof(tmp));
+    unlink(tmp);
+}
+
+static int _reply_stream_process(audio_element_handle_t self, char* in_buffer,
+                                 int in_len) {
+    reply_stream_t* stream = (reply_stream_t*)audio_element_getdata(self);
+    int r;
+    if (stream->hit) {
+        r = fread(in_buffer, 1, in_len, stream->fp);
+    } else {
+        r = esp_http_client_read(stream->http, in_buffer, in_len);
+    }
+    if (r < 0) {
+        ESP_LOGE(TAG, "[ cache ] read failed");
+        return AEL_IO_FAIL;
+    }
+    if (r == 0) {
+        stream->complete = stream->expect <= 0 ||
+                           stream->bytes == (uint32_t)stream->expect;
+        return AEL_IO_DONE;
+    }
+    stream->bytes += r;
+    if (stream->filling && fwrite(in_buffer, 1, r, stream->fp) != r) {
+        ESP_LOGW(TAG, "[ cache ] write failed, not caching this reply");
+        reply_stream_drop_fill(stream);
+    }
+    int w_size = audio_element_output(self, in_buffer, r);
+    if (w_size > 0) {
+        audio_element_update_byte_pos(self, w_size);
+    }
+    return w_size;
+}
+
+// Keep a completely downloaded reply, it replaces one that shares its name
+static void reply_stream_commit(reply_stream_t* stream) {
+    char tmp[REPLY_CACHE_PATH_MAX];
+    char path[REPLY_CACHE_PATH_MAX];
+    fclose(stream->fp);
+    stream->fp = NULL;
+    stream->filling = false;
+    reply_cache_tmp_path(tmp, sizeof(tmp));
+    reply_cache_path(stream->etag, path, sizeof(path));
+    uint32_t name = reply_index_name(stream->etag);
+    for (int i = 0; i < s_idx.num; i++) {
+        if (reply_index_name(s_idx.entries[i].etag) == name) {
+            reply_index_remove(&s_idx, i);
+            break;
+        }
+    }
+    unlink(path);
+    if (rename(tmp, path) == 0) {
+        reply_index_add(&s_idx, stream->etag, stream->bytes);
+        reply_cache_evict();
+    } else {
+        unlink(tmp);
+    }
+}
+
+static esp_err_t _reply_stream_close(audio_element_handle_t self) {
+    reply_stream_t* stream = (reply_stream_t*)audio_element_getdata(self);
+    if (stream->filling) {
+        if (stream->complete && stream->bytes) {
+            reply_stream_commit(stream);
+        } else {
+            reply_stream_drop_fill(stream);
+        }
+    }
+    if (stream->fp) {
+        fclose(stream->fp);
+        stream->fp = NULL;
+    }
+    reply_stream_release(stream);
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_report_pos(self);
+        audio_element_set_byte_pos(self, 0);
+    }
+    uint32_t total = s_hits + s_misses;
+    if (total) {
+        ESP_LOGI(TAG,
+                 "[ cache ] hits=%u misses=%u (%u%%), saved %u bytes, "
+                 "%d replies %u bytes",
+                 s_hits, s_misses, s_hits * 100 / total, s_saved_bytes,
+                 s_idx.num, s_idx.bytes);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _reply_stream_destroy(audio_element_handle_t self) {
+    reply_stream_t* stream = (reply_stream_t*)audio_element_getdata(self);
+    audio_free(stream);
+    return ESP_OK;
+}
+
+audio_element_handle_t reply_stream_init(reply_stream_cfg_t* config) {
+    reply_stream_t* stream = audio_calloc(1, sizeof(reply_stream_t));
+    AUDIO_MEM_CHECK(TAG, stream, return NULL);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _reply_stream_open;
+    cfg.process = _reply_stream_process;
+    cfg.close = _reply_stream_close;
+    cfg.destroy = _reply_stream_destroy;
+    cfg.buffer_len = REPLY_STREAM_BUF_SIZE;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.tag = "reply";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(stream);
+        return NULL;
+    });
+    audio_element_setdata(el, stream);
+    return el;
+}
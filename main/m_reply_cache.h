@@ -0,0 +1,54 @@
+#ifndef _M_REPLY_CACHE_H_
+#define _M_REPLY_CACHE_H_
+
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+
+/*
+ * LRU cache of TTS replies on the SD card, keyed by the reply's ETag.
+ * Replies are read by a reader element that sends one conditional GET:
+ * If-None-Match lists the cached ETags, a 304 plays the card copy, a 200
+ * streams the reply and tees it into the cache. Each card file starts with
+ * its ETag; the index (m_reply_index.h) lives in RAM and is rebuilt from
+ * the file headers at boot.
+ */
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+} reply_stream_cfg_t;
+
+#define REPLY_STREAM_TASK_STACK (6 * 1024)
+#define REPLY_STREAM_TASK_CORE (0)
+#define REPLY_STREAM_TASK_PRIO (4)
+#define REPLY_STREAM_RINGBUFFER_SIZE (20 * 1024)
+
+#define REPLY_STREAM_CFG_DEFAULT()                     \
+    {                                                  \
+        .out_rb_size = REPLY_STREAM_RINGBUFFER_SIZE,   \
+        .task_stack = REPLY_STREAM_TASK_STACK,         \
+        .task_core = REPLY_STREAM_TASK_CORE,           \
+        .task_prio = REPLY_STREAM_TASK_PRIO,           \
+    }
+
+/*
+ * @brief Build the index from `dir` on the mounted card. Without a card
+ *        the reader still streams, without caching.
+ *
+ * @param max_entries  Number of replies kept
+ * @param max_bytes    Total size of the cached replies
+ */
+esp_err_t reply_cache_init(const char* dir, int max_entries,
+                           uint32_t max_bytes);
+
+/*
+ * @brief Create a reader element that plays the reply at its uri, from the
+ *        card when the server says the cached copy is current
+ *
+ * @return The audio element handle
+ */
+audio_element_handle_t reply_stream_init(reply_stream_cfg_t* config);
+
+#endif
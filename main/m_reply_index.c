@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "m_reply_index.h"
+
+int reply_index_etag(const char* header, char* etag, int etag_len) {
+    if (strncmp(header, "W/", 2) == 0) {
+        header += 2;
+    }
+    int n = strlen(header);
+    if (n == 0 || n >= etag_len) {
+        return -1;
+    }
+    memcpy(etag, header, n + 1);
+    return 0;
+}
+
+// FNV-1a
+uint32_t reply_index_name(const char* etag) {
+    uint32_t h = 2166136261u;
+    for (; *etag; etag++) {
+        h = (h ^ (uint8_t)*etag) * 16777619u;
+    }
+    return h;
+}
+
+reply_index_entry_t* reply_index_find(reply_index_t* idx, const char* etag) {
+    for (int i = 0; i < idx->num; i++) {
+        if (strcmp(idx->entries[i].etag, etag) == 0) {
+            return &idx->entries[i];
+        }
+    }
+    return NULL;
+}
+
+void reply_index_touch(reply_index_t* idx, reply_index_entry_t* e) {
+    e->last_use = ++idx->clock;
+}
+
+reply_index_entry_t* reply_index_add(reply_index_t* idx, const char* etag,
+                                     uint32_t size) {
+    if (idx->num > idx->max) {
+        return NULL;
+    }
+    reply_index_entry_t* e = &idx->entries[idx->num++];
+    snprintf(e->etag, sizeof(e->etag), "%s", etag);
+    e->size = size;
+    e->last_use = ++idx->clock;
+    idx->bytes += size;
+    return e;
+}
+
+int reply_index_victim(const reply_index_t* idx) {
+    if (idx->num <= 1 ||
+        (idx->num <= idx->max && idx->bytes <= idx->max_bytes)) {
+        return -1;
+    }
+    int lru = 0;
+    for (int i = 1; i < idx->num; i++) {
+        if (idx->entries[i].last_use < idx->entries[lru].last_use) {
+            lru = i;
+        }
+    }
+    return lru;
+}
+
+void reply_index_remove(reply_index_t* idx, int i) {
+    idx->bytes -= idx->entries[i].size;
+    idx->entries[i] = idx->entries[--idx->num];
+}
+
+int reply_index_if_none_match(const reply_index_t* idx, char* buf, int size) {
+    int len = 0;
+    for (int i = 0; i < idx->num; i++) {
+        int n = snprintf(buf + len, size - len, "%s%s", i ? ", " : "",
+                         idx->entries[i].etag);
+        if (n < 0 || n >= size - len) {
+            return -1;
+        }
+        len += n;
+    }
+    return len;
+}
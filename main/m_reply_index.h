@@ -0,0 +1,73 @@
+#ifndef _M_REPLY_INDEX_H_
+#define _M_REPLY_INDEX_H_
+
+#include <stdint.h>
+
+/*
+ * In-memory index of the reply cache: ETag, size and last use of every
+ * cached reply, LRU eviction and the If-None-Match list. Plain C without
+ * any ESP-IDF dependency so the cache decisions can be checked on the host.
+ *
+ * ETags are compared in full (server.py sends the whole SHA-1 of the
+ * reply). A weak "W/" prefix is dropped, If-None-Match compares weakly.
+ */
+#define REPLY_INDEX_ETAG_MAX 64 /* Quotes and terminator included */
+
+typedef struct {
+    char etag[REPLY_INDEX_ETAG_MAX];
+    uint32_t size;
+    uint32_t last_use;
+} reply_index_entry_t;
+
+typedef struct {
+    reply_index_entry_t* entries; /* max + 1, one spare for an add */
+    int num;
+    int max;
+    uint32_t bytes;
+    uint32_t max_bytes;
+    uint32_t clock;
+} reply_index_t;
+
+/*
+ * @brief Copy the ETag of a response header without a weak prefix
+ *
+ * @return 0, or -1 when it is empty or does not fit
+ */
+int reply_index_etag(const char* header, char* etag, int etag_len);
+
+/*
+ * @brief The 8.3 file name stem of an ETag (FAT has no long names here).
+ *        Two ETags may share one, the file keeps its ETag to tell them apart.
+ */
+uint32_t reply_index_name(const char* etag);
+
+reply_index_entry_t* reply_index_find(reply_index_t* idx, const char* etag);
+
+/*
+ * @brief Mark an entry as just used
+ */
+void reply_index_touch(reply_index_t* idx, reply_index_entry_t* e);
+
+/*
+ * @brief Add an entry as the most recently used, evict after adding
+ */
+reply_index_entry_t* reply_index_add(reply_index_t* idx, const char* etag,
+                                     uint32_t size);
+
+/*
+ * @return The entry to evict next (least recently used) while the index
+ *         is over its entry or byte limit, -1 when it is within both. The
+ *         last entry is never evicted.
+ */
+int reply_index_victim(const reply_index_t* idx);
+
+void reply_index_remove(reply_index_t* idx, int i);
+
+/*
+ * @brief Write the If-None-Match value listing every cached ETag
+ *
+ * @return Its length, 0 when the index is empty, -1 when it does not fit
+ */
+int reply_index_if_none_match(const reply_index_t* idx, char* buf, int size);
+
+#endif
@@ -0,0 +1,386 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_element.h"
+#include "audio_mem.h"
+
+#include "m_metrics.h"
+#include "m_session_rec.h"
+#include "m_tasks.h"
+
+static const char* TAG = "session_rec";
+
+#define SESSION_REC_DIR_MAX 16
+#define SESSION_REC_PATH_MAX 32
+#define SESSION_REC_EVENT_MAX 96
+#define SESSION_REC_IDLE_MS 1000 /* Write a partial block after this */
+#define SESSION_REC_SYNC_BLOCKS 16
+#define SESSION_REC_TAP_BUF 1024
+#define SESSION_REC_ALIGN(n) (((n) + 7) & ~7)
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len;
+    uint32_t time_ms;
+} session_rec_hdr_t;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t bytes;
+    uint32_t dropped;
+    uint32_t max_us;
+    uint64_t us;
+} session_rec_stat_t;
+
+static session_rec_cfg_t s_cfg;
+static char s_dir[SESSION_REC_DIR_MAX];
+static uint8_t** s_blocks;
+static TaskHandle_t s_task;
+static volatile bool s_running;
+
+/*
+ * Blocks are filled and written in order: s_head is being filled at
+ * s_pos, the s_pending blocks from s_tail on wait for the card. Callers
+ * copy outside the lock, s_copies counts the copies still running into
+ * each block.
+ */
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static int* s_copies;
+static int s_head;
+static int s_pos;
+static int s_tail;
+static int s_pending;
+static session_rec_stat_t s_stat[SESSION_REC_PAD];
+
+// Writer task only
+static int s_fd = -1;
+static uint32_t s_first_id;
+static uint32_t s_next_id;
+static uint32_t s_file_bytes;
+
+static void session_rec_path(uint32_t id, char* path, int path_len) {
+    snprintf(path, path_len, "%s/S%07u.REC", s_dir, id);
+}
+
+// Lock held. Pad the current block and move on if a free block is left.
+static bool session_rec_next_block(void) {
+    uint8_t* block = s_blocks[s_head];
+    int rest = s_cfg.block_size - s_pos;
+    if (rest > 0) {
+        session_rec_hdr_t* h = (session_rec_hdr_t*)(block + s_pos);
+        h->type = SESSION_REC_PAD;
+        h->reserved = 0;
+        h->len = rest - sizeof(session_rec_hdr_t);
+        h->time_ms = 0;
+        s_pos = s_cfg.block_size;
+    }
+    if (s_pending + 1 >= s_cfg.block_num) {
+        return false;
+    }
+    s_pending++;
+    s_head = (s_head + 1) % s_cfg.block_num;
+    s_pos = 0;
+    return true;
+}
+
+void session_rec_write(session_rec_type_t type, const void* data, int len) {
+    if (!s_running || len <= 0 || type >= SESSION_REC_PAD) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    uint32_t now = esp_log_timestamp();
+    const uint8_t* p = data;
+    int total = len;
+    bool notify = false;
+
+    // Space is reserved under the lock and filled outside it; the writer
+    // task skips a block until its copies are done
+    while (len > 0) {
+        portENTER_CRITICAL(&s_mux);
+        int room = s_cfg.block_size - s_pos - (int)sizeof(session_rec_hdr_t);
+        // Streams are split across blocks, an event is kept whole
+        if (room < 8 || (type == SESSION_REC_EVENT && room < len)) {
+            bool next = session_rec_next_block();
+            portEXIT_CRITICAL(&s_mux);
+            if (!next) {
+                break;
+            }
+            notify = true;
+            continue;
+        }
+        int block = s_head;
+        int n = len < room ? len : room;
+        session_rec_hdr_t* h = (session_rec_hdr_t*)(s_blocks[block] + s_pos);
+        s_pos += SESSION_REC_ALIGN(sizeof(session_rec_hdr_t) + n);
+        s_copies[block]++;
+        portEXIT_CRITICAL(&s_mux);
+
+        h->type = type;
+        h->reserved = 0;
+        h->len = n;
+        h->time_ms = now;
+        memcpy(h + 1, p, n);
+        p += n;
+        len -= n;
+
+        portENTER_CRITICAL(&s_mux);
+        // The last copy into a block that is already waiting for the card
+        notify |= --s_copies[block] == 0 && block != s_head;
+        portEXIT_CRITICAL(&s_mux);
+    }
+    if (notify) {
+        xTaskNotifyGive(s_task);
+    }
+
+    uint32_t us = esp_timer_get_time() - start;
+    session_rec_stat_t* st = &s_stat[type];
+    portENTER_CRITICAL(&s_mux);
+    st->calls++;
+    st->bytes += total - len;
+    st->dropped += len;
+    st->us += us;
+    if (us > st->max_us) {
+        st->max_us = us;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    metrics_observe(METRIC_HIST_SESSION_REC_US, us);
+    if (len) {
+        metrics_add(METRIC_SESSION_REC_DROPPED_BYTES, len);
+    }
+}
+
+void session_rec_event(const char* fmt, ...) {
+    char text[SESSION_REC_EVENT_MAX];
+    if (!s_running) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(text)) {
+        len = sizeof(text) - 1;
+    }
+    session_rec_write(SESSION_REC_EVENT, text, len);
+}
+
+static void session_rec_report(void) {
+    static const char* name[SESSION_REC_PAD] = {"mic", "upload", "reply",
+                                                 "event"};
+    session_rec_stat_t st[SESSION_REC_PAD];
+    portENTER_CRITICAL(&s_mux);
+    memcpy(st, s_stat, sizeof(st));
+    portEXIT_CRITICAL(&s_mux);
+    for (int i = 0; i < SESSION_REC_PAD; i++) {
+        if (st[i].calls) {
+            ESP_LOGI(TAG,
+                     "[ rec ] %s: %u calls, %u bytes, %u dropped, %llu "
+                     "us/call, max %u us",
+                     name[i], st[i].calls, st[i].bytes, st[i].dropped,
+                     st[i].us / st[i].calls, st[i].max_us);
+        }
+    }
+}
+
+static void session_rec_close_file(void) {
+    if (s_fd >= 0) {
+        close(s_fd);
+        s_fd = -1;
+        session_rec_report();
+    }
+}
+
+// Rolling files: drop the oldest, then start the next
+static bool session_rec_open_file(void) {
+    char path[SESSION_REC_PATH_MAX];
+    while (s_next_id - s_first_id >= s_cfg.file_num) {
+        session_rec_path(s_first_id++, path, sizeof(path));
+        unlink(path);
+    }
+    session_rec_path(s_next_id++, path, sizeof(path));
+    s_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (s_fd < 0) {
+        ESP_LOGE(TAG, "[ rec ] Cannot open %s", path);
+        return false;
+    }
+    s_file_bytes = 0;
+    ESP_LOGI(TAG, "[ rec ] %s", path);
+    return true;
+}
+
+static bool session_rec_write_block(const uint8_t* block) {
+    if (s_fd < 0 && !session_rec_open_file()) {
+        return false;
+    }
+    if (write(s_fd, block, s_cfg.block_size) != s_cfg.block_size) {
+        ESP_LOGE(TAG, "[ rec ] Write failed (%d), recording stopped", errno);
+        session_rec_close_file();
+        return false;
+    }
+    s_file_bytes += s_cfg.block_size;
+    metrics_add(METRIC_SESSION_REC_BYTES, s_cfg.block_size);
+    if (s_file_bytes >= s_cfg.file_size) {
+        session_rec_close_file();
+    } else if ((s_file_bytes / s_cfg.block_size) % SESSION_REC_SYNC_BLOCKS ==
+               0) {
+        fsync(s_fd);
+    }
+    return true;
+}
+
+static void session_rec_task(void* arg) {
+    while (s_running) {
+        if (ulTaskNotifyTake(pdTRUE, SESSION_REC_IDLE_MS / portTICK_PERIOD_MS) ==
+            0) {
+            // Quiet for a while: do not keep a partial block in RAM
+            portENTER_CRITICAL(&s_mux);
+            if (s_pending == 0 && s_pos > 0) {
+                session_rec_next_block();
+            }
+            portEXIT_CRITICAL(&s_mux);
+        }
+        while (1) {
+            portENTER_CRITICAL(&s_mux);
+            int pending = s_pending;
+            int tail = s_tail;
+            int copies = s_copies[tail];
+            portEXIT_CRITICAL(&s_mux);
+            // The last copy into the block notifies again
+            if (pending == 0 || copies) {
+                break;
+            }
+            if (!session_rec_write_block(s_blocks[tail])) {
+                s_running = false;
+                break;
+            }
+            portENTER_CRITICAL(&s_mux);
+            s_tail = (s_tail + 1) % s_cfg.block_num;
+            s_pending--;
+            portEXIT_CRITICAL(&s_mux);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+// Continue numbering after the files already on the card
+static void session_rec_scan(void) {
+    DIR* d = opendir(s_dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* de;
+    bool found = false;
+    while ((de = readdir(d)) != NULL) {
+        char* end;
+        if (de->d_name[0] != 'S') {
+            continue;
+        }
+        uint32_t id = strtoul(de->d_name + 1, &end, 10);
+        if (end != de->d_name + 8 || strcasecmp(end, ".REC") != 0) {
+            continue;
+        }
+        if (!found || id < s_first_id) {
+            s_first_id = id;
+        }
+        if (!found || id >= s_next_id) {
+            s_next_id = id + 1;
+        }
+        found = true;
+    }
+    closedir(d);
+}
+
+esp_err_t session_rec_start(const char* dir, const session_rec_cfg_t* cfg) {
+    if (strlen(dir) >= SESSION_REC_DIR_MAX || cfg->block_num < 2 ||
+        cfg->block_size % 512 || cfg->file_num < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cfg = *cfg;
+    strcpy(s_dir, dir);
+    if (mkdir(s_dir, 0775) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "[ rec ] Cannot create %s", s_dir);
+        return ESP_FAIL;
+    }
+    session_rec_scan();
+
+    s_copies = audio_calloc(cfg->block_num, sizeof(int));
+    AUDIO_MEM_CHECK(TAG, s_copies, return ESP_ERR_NO_MEM);
+    s_blocks = audio_calloc(cfg->block_num, sizeof(uint8_t*));
+    AUDIO_MEM_CHECK(TAG, s_blocks, {
+        audio_free(s_copies);
+        s_copies = NULL;
+        return ESP_ERR_NO_MEM;
+    });
+    for (int i = 0; i < cfg->block_num; i++) {
+        // Word aligned for the SD DMA, no bounce buffer
+        s_blocks[i] = heap_caps_malloc(cfg->block_size,
+                                       MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+        if (s_blocks[i] == NULL) {
+            ESP_LOGE(TAG, "[ rec ] No memory for %d blocks", cfg->block_num);
+            while (i--) {
+                heap_caps_free(s_blocks[i]);
+            }
+            audio_free(s_blocks);
+            s_blocks = NULL;
+            audio_free(s_copies);
+            s_copies = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    s_running = true;
+    const task_placement_t* p = task_placement_get(TASK_SLOT_SESSION_REC);
+    if (xTaskCreatePinnedToCore(session_rec_task, p->name, p->stack, NULL,
+                                p->prio, &s_task, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ rec ] Error create writer task");
+        s_running = false;
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ rec ] %d x %d byte blocks, files %u.. in %s",
+             cfg->block_num, cfg->block_size, s_next_id, s_dir);
+    return ESP_OK;
+}
+
+static int _tap_process(audio_element_handle_t self, char* in_buffer,
+                        int in_len) {
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0) {
+        return r;
+    }
+    session_rec_write((session_rec_type_t)(intptr_t)audio_element_getdata(self),
+                      in_buffer, r);
+    return audio_element_output(self, in_buffer, r);
+}
+
+audio_element_handle_t session_rec_tap_init(session_rec_type_t type,
+                                            int out_rb_size) {
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    const task_placement_t* p = task_placement_get(TASK_SLOT_REC_TAP);
+    cfg.process = _tap_process;
+    cfg.buffer_len = SESSION_REC_TAP_BUF;
+    cfg.task_stack = p->stack;
+    cfg.task_core = p->core;
+    cfg.task_prio = p->prio;
+    cfg.out_rb_size = out_rb_size;
+    cfg.tag = "rec_tap";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, return NULL);
+    audio_element_setdata(el, (void*)(intptr_t)type);
+    return el;
+}
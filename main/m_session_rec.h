@@ -0,0 +1,68 @@
+#ifndef _M_SESSION_REC_H_
+#define _M_SESSION_REC_H_
+
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+
+/*
+ * Field recorder: the microphone frames WakeNet sees, the uploaded
+ * stream, the decoded reply and timestamped events go to rolling files
+ * on the SD card (<dir>/S0000001.REC, ...). tools/session_rec.py splits a
+ * file into WAVs and an event list.
+ *
+ * Callers reserve room in fixed blocks under a spinlock, copy outside it
+ * and never wait. A low priority task writes whole blocks at block aligned
+ * offsets once their copies are done. When every block is waiting for the
+ * card, new data is dropped and counted.
+ *
+ * File layout: records of {u8 type, u8 reserved, u16 len, u32 time_ms}
+ * followed by len bytes padded to 8. A record never crosses a block, the
+ * rest of a block is a SESSION_REC_PAD record.
+ */
+typedef enum {
+    SESSION_REC_MIC,    /* 16 kHz mono, as read from raw_read_asr */
+    SESSION_REC_UPLOAD, /* WAV bytes posted to the server */
+    SESSION_REC_REPLY,  /* Decoded reply PCM, format in a "reply" event */
+    SESSION_REC_EVENT,  /* Text */
+    SESSION_REC_PAD,
+} session_rec_type_t;
+
+typedef struct {
+    int block_size;  /* Bytes per card write, multiple of 512 */
+    int block_num;   /* Blocks of buffering */
+    int file_size;   /* A new file is started after this many bytes */
+    int file_num;    /* Older files are deleted */
+} session_rec_cfg_t;
+
+#define SESSION_REC_CFG_DEFAULT()      \
+    {                                  \
+        .block_size = 4 * 1024,        \
+        .block_num = 4,                \
+        .file_size = 2 * 1024 * 1024,  \
+        .file_num = 16,                \
+    }
+
+/*
+ * @brief Allocate the blocks and start the writer task on the mounted card
+ */
+esp_err_t session_rec_start(const char* dir, const session_rec_cfg_t* cfg);
+
+/*
+ * @brief Copy stream data, drops it if the recorder is behind or stopped
+ */
+void session_rec_write(session_rec_type_t type, const void* data, int len);
+
+/*
+ * @brief Record a printf style event
+ */
+void session_rec_event(const char* fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/*
+ * @brief Pass-through element that records what flows through it
+ */
+audio_element_handle_t session_rec_tap_init(session_rec_type_t type,
+                                            int out_rb_size);
+
+#endif
@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "m_ctrl.h"
+#include "m_metrics.h"
+#include "m_sync.h"
+#include "m_tasks.h"
+
+static const char* TAG = "sync";
+
+#define SYNC_VERSION 1
+#define SYNC_REQUEST 1
+#define SYNC_RESPONSE 2
+#define SYNC_GAP_MS 10 /* Between the requests of a burst */
+#define SYNC_TIMEOUT_MS 200
+#define SYNC_PHASE_GAIN 0.5
+#define SYNC_FREQ_GAIN 0.25
+#define SYNC_DRIFT_MAX 500e-6
+#define SYNC_STEP_US 50000 /* A larger error restarts the loop */
+#define SYNC_REPORT_MS 1000
+#define SYNC_ACTIVE_US 2000000 /* A group plays while reports are newer */
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t version;
+    uint16_t seq;
+    int64_t t1;
+} sync_request_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t version;
+    uint16_t seq;
+    int64_t t1;
+    int64_t t2;
+    int64_t t3;
+} sync_response_t;
+
+static sync_cfg_t s_cfg;
+static TaskHandle_t s_task;
+static int s_sock = -1;
+static struct sockaddr_in s_addr;
+static uint16_t s_seq;
+
+/*
+ * Timeline = local + s_offset + s_drift * (local - s_local_ref). Written
+ * by the sync task, read by the playback stage.
+ */
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool s_valid;
+static int64_t s_local_ref;
+static int64_t s_offset;
+static double s_drift;
+static uint32_t s_uncertainty_us;
+static sync_report_t s_report;
+static int64_t s_report_us; /* Local time of the last report, 0 none */
+
+bool sync_now(int64_t* shared_us) {
+    int64_t local = esp_timer_get_time();
+    portENTER_CRITICAL(&s_mux);
+    bool valid = s_valid;
+    int64_t ref = s_local_ref;
+    int64_t offset = s_offset;
+    double drift = s_drift;
+    portEXIT_CRITICAL(&s_mux);
+    *shared_us = local + offset + (int64_t)(drift * (local - ref));
+    return valid;
+}
+
+void sync_report(const sync_report_t* report) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_mux);
+    bool idle = s_report_us == 0 || now - s_report_us >= SYNC_ACTIVE_US;
+    s_report = *report;
+    s_report_us = now;
+    portEXIT_CRITICAL(&s_mux);
+    // Switch the task to the faster bursts at once
+    if (idle && s_task) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+static esp_err_t sync_open(void) {
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo* res;
+    if (getaddrinfo(s_cfg.host, NULL, &hints, &res) != 0 || res == NULL) {
+        ESP_LOGW(TAG, "[ sync ] Cannot resolve %s", s_cfg.host);
+        return ESP_FAIL;
+    }
+    memcpy(&s_addr, res->ai_addr, sizeof(s_addr));
+    s_addr.sin_port = htons(s_cfg.port);
+    freeaddrinfo(res);
+
+    s_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s_sock < 0) {
+        return ESP_FAIL;
+    }
+    struct timeval tv = {
+        .tv_sec = 0,
+        .tv_usec = SYNC_TIMEOUT_MS * 1000,
+    };
+    setsockopt(s_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return ESP_OK;
+}
+
+// One request, false on a timeout
+static bool sync_exchange(int64_t* offset, int64_t* delay, int64_t* local) {
+    sync_request_t req = {
+        .type = SYNC_REQUEST,
+        .version = SYNC_VERSION,
+        .seq = ++s_seq,
+    };
+    sync_response_t resp;
+    req.t1 = esp_timer_get_time();
+    if (sendto(s_sock, &req, sizeof(req), 0, (struct sockaddr*)&s_addr,
+               sizeof(s_addr)) != sizeof(req)) {
+        return false;
+    }
+    while (1) {
+        int r = recv(s_sock, &resp, sizeof(resp), 0);
+        int64_t t4 = esp_timer_get_time();
+        if (r < 0) {
+            return false;
+        }
+        // Anything else answers an earlier request that timed out
+        if (r == sizeof(resp) && resp.type == SYNC_RESPONSE &&
+            resp.seq == req.seq && resp.t1 == req.t1) {
+            *offset = ((resp.t2 - resp.t1) + (resp.t3 - t4)) / 2;
+            *delay = (t4 - resp.t1) - (resp.t3 - resp.t2);
+            *local = t4;
+            return true;
+        }
+    }
+}
+
+static void sync_update(int64_t local, int64_t offset, int64_t delay) {
+    portENTER_CRITICAL(&s_mux);
+    bool valid = s_valid;
+    int64_t ref = s_local_ref;
+    int64_t timeline = s_offset;
+    double drift = s_drift;
+    portEXIT_CRITICAL(&s_mux);
+
+    int64_t error = 0;
+    if (valid) {
+        int64_t predicted = timeline + (int64_t)(drift * (local - ref));
+        error = offset - predicted;
+        if (error > SYNC_STEP_US || error < -SYNC_STEP_US) {
+            ESP_LOGW(TAG, "[ sync ] Timeline off by %lld us, restart", error);
+            valid = false;
+        } else {
+            drift += SYNC_FREQ_GAIN * error / (local - ref);
+            if (drift > SYNC_DRIFT_MAX) {
+                drift = SYNC_DRIFT_MAX;
+            } else if (drift < -SYNC_DRIFT_MAX) {
+                drift = -SYNC_DRIFT_MAX;
+            }
+            timeline = predicted + (int64_t)(SYNC_PHASE_GAIN * error);
+        }
+    }
+    if (!valid) {
+        timeline = offset;
+        drift = 0;
+    }
+    portENTER_CRITICAL(&s_mux);
+    s_valid = true;
+    s_local_ref = local;
+    s_offset = timeline;
+    s_drift = drift;
+    s_uncertainty_us = delay / 2;
+    portEXIT_CRITICAL(&s_mux);
+    ESP_LOGD(TAG, "[ sync ] Error %lld us, drift %d ppb, round trip %lld us",
+             error, (int)(drift * 1e9), delay);
+}
+
+static void sync_burst(void) {
+    int64_t best_offset = 0;
+    int64_t best_delay = INT64_MAX;
+    int64_t best_local = 0;
+    for (int i = 0; i < SYNC_BURST; i++) {
+        int64_t offset, delay, local;
+        if (sync_exchange(&offset, &delay, &local) && delay < best_delay) {
+            best_offset = offset;
+            best_delay = delay;
+            best_local = local;
+        }
+        vTaskDelay(SYNC_GAP_MS / portTICK_PERIOD_MS);
+    }
+    if (best_delay == INT64_MAX) {
+        ESP_LOGW(TAG, "[ sync ] No answer from %s:%d", s_cfg.host,
+                 s_cfg.port);
+        return;
+    }
+    metrics_observe(METRIC_HIST_SYNC_RTT_US, best_delay);
+    sync_update(best_local, best_offset, best_delay);
+}
+
+static void sync_send_report(void) {
+    portENTER_CRITICAL(&s_mux);
+    sync_report_t report = s_report;
+    report.uncertainty_us = s_uncertainty_us;
+    double drift = s_drift;
+    portEXIT_CRITICAL(&s_mux);
+    report.drift_ppb = drift * 1e9;
+    metrics_observe(METRIC_HIST_SYNC_ERROR_US, report.error_us < 0
+                                                   ? -report.error_us
+                                                   : report.error_us);
+    ctrl_post(CTRL_MSG_SYNC_REPORT, &report, sizeof(report));
+}
+
+static void sync_task(void* arg) {
+    int64_t next_burst = 0;
+    while (s_sock < 0) {
+        if (sync_open() != ESP_OK) {
+            vTaskDelay(s_cfg.period_s * 1000 / portTICK_PERIOD_MS);
+        }
+    }
+    while (1) {
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&s_mux);
+        bool active = s_report_us && now - s_report_us < SYNC_ACTIVE_US;
+        portEXIT_CRITICAL(&s_mux);
+        int64_t period = active ? SYNC_ACTIVE_PERIOD_S : s_cfg.period_s;
+        if (now >= next_burst || next_burst - now > period * 1000000) {
+            sync_burst();
+            next_burst = now + period * 1000000;
+        }
+        if (active) {
+            sync_send_report();
+            vTaskDelay(SYNC_REPORT_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+        // Idle: one wakeup per burst, or the first report of a group
+        int wait_ms = (next_burst - esp_timer_get_time()) / 1000;
+        ulTaskNotifyTake(pdTRUE, wait_ms > 0 ? wait_ms / portTICK_PERIOD_MS
+                                             : 0);
+    }
+}
+
+esp_err_t sync_start(const sync_cfg_t* cfg) {
+    if (s_task) {
+        return ESP_OK;
+    }
+    if (cfg->host == NULL || cfg->period_s <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cfg = *cfg;
+    const task_placement_t* p = task_placement_get(TASK_SLOT_SYNC);
+    if (xTaskCreatePinnedToCore(sync_task, p->name, p->stack, NULL, p->prio,
+                                &s_task, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ sync ] Error create task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ sync ] Coordinator %s:%d, every %d s", s_cfg.host,
+             s_cfg.port, s_cfg.period_s);
+    return ESP_OK;
+}
@@ -0,0 +1,65 @@
+#ifndef _M_SYNC_H_
+#define _M_SYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Shared timeline for group playback: the coordinator's clock in
+ * microseconds, estimated over UDP the NTP way. Each burst sends
+ * SYNC_BURST requests and keeps the exchange with the shortest round
+ * trip. Its offset drives a phase and frequency loop, so the timeline
+ * keeps following the coordinator between bursts. Bursts go out every
+ * period_s, and every SYNC_ACTIVE_PERIOD_S while a group plays.
+ *
+ * Request   {u8 type = 1, u8 version, u16 seq, i64 t1}
+ * Response  {u8 type = 2, u8 version, u16 seq, i64 t1, i64 t2, i64 t3}
+ *
+ * Little endian. t1 is the device send time, t2 and t3 the coordinator
+ * receive and send times. tools/sync_sim.py runs this code and the
+ * playback stage in simulated devices, built by tools/host.
+ */
+#define SYNC_BURST 8
+#define SYNC_ACTIVE_PERIOD_S 4
+
+/* Sent over the control channel once a second while a group plays */
+typedef struct __attribute__((packed)) {
+    uint16_t group;
+    int32_t error_us;        /* Played position minus the timeline */
+    uint32_t uncertainty_us; /* Half the round trip of the clock sample */
+    int32_t drift_ppb;       /* Local clock rate against the coordinator */
+    uint32_t inserted;       /* Frames repeated to wait for the timeline */
+    uint32_t dropped;        /* Frames skipped to catch up */
+} sync_report_t;
+
+typedef struct {
+    const char* host; /* Coordinator */
+    int port;
+    int period_s; /* Between bursts while no group plays */
+} sync_cfg_t;
+
+#define SYNC_CFG_DEFAULT() \
+    {                      \
+        .host = NULL,      \
+        .port = 8001,      \
+        .period_s = 16,    \
+    }
+
+/*
+ * @brief Start the task that keeps the timeline
+ */
+esp_err_t sync_start(const sync_cfg_t* cfg);
+
+/*
+ * @brief Current time on the timeline, false until the first burst
+ */
+bool sync_now(int64_t* shared_us);
+
+/*
+ * @brief Where group playback stands, the sync task forwards it with its
+ *        own uncertainty and drift filled in
+ */
+void sync_report(const sync_report_t* report);
+
+#endif
@@ -0,0 +1,260 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "audio_common.h"
+#include "audio_element.h"
+#include "audio_error.h"
+#include "audio_mem.h"
+#include "ringbuf.h"
+
+#include "m_metrics.h"
+#include "m_sync.h"
+#include "m_sync_play.h"
+
+static const char* TAG = "sync_play";
+
+#define SYNC_PLAY_BUF 2048
+#define SYNC_PLAY_AVG 16 /* Error averaging, in buffers */
+#define SYNC_PLAY_DEADBAND_US 500
+#define SYNC_PLAY_HORIZON_MS 2000 /* Time a correction is spread over */
+#define SYNC_PLAY_INFO_WAIT_MS 500
+
+typedef struct {
+    sync_play_cfg_t cfg;
+    volatile int rate;
+    volatile int channels;
+    int64_t start; /* Timeline, 0 when not armed */
+    uint16_t group;
+    bool started;
+    int64_t pos;      /* Stream frame of the next frame written */
+    int64_t skip;     /* Stream frames still to leave out */
+    int64_t error_q8; /* Averaged error in frames, + is early */
+    int countdown;    /* Frames to copy before the next correction */
+    uint32_t inserted;
+    uint32_t dropped;
+    char* out;
+    int out_size;
+} sync_play_t;
+
+static esp_err_t _sync_play_open(audio_element_handle_t self) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(self);
+    sp->started = false;
+    sp->pos = 0;
+    sp->skip = 0;
+    sp->error_q8 = 0;
+    sp->countdown = 0;
+    sp->inserted = 0;
+    sp->dropped = 0;
+    return ESP_OK;
+}
+
+// The decoder reports its format once it has decoded the first frame
+static bool sync_play_wait_info(sync_play_t* sp) {
+    for (int i = 0; sp->rate == 0 && i < SYNC_PLAY_INFO_WAIT_MS / 10; i++) {
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    return sp->rate > 0 && (sp->channels == 1 || sp->channels == 2);
+}
+
+// Correct the error at once: silence when early, skip when late
+static void sync_play_jump(audio_element_handle_t self, sync_play_t* sp,
+                           int64_t error, int fb) {
+    if (error < 0) {
+        sp->skip = -error;
+        return;
+    }
+    memset(sp->out, 0, sp->out_size);
+    while (error > 0) {
+        int n = error < sp->out_size / fb ? error : sp->out_size / fb;
+        if (audio_element_output(self, sp->out, n * fb) <= 0) {
+            break;
+        }
+        sp->inserted += n;
+        error -= n;
+    }
+}
+
+/*
+ * Copy `frames` to sp->out. Outside the deadband every step-th frame is
+ * played twice when early or left out when late, and each correction is
+ * taken off the averaged error so it does not overshoot while the
+ * average catches up.
+ */
+static int sync_play_correct(sync_play_t* sp, const char* in, int frames,
+                             int fb) {
+    int64_t error = sp->error_q8 >> 8;
+    int64_t deadband = (int64_t)sp->rate * SYNC_PLAY_DEADBAND_US / 1000000;
+    int step = 0;
+    if (error > deadband || error < -deadband) {
+        int64_t s = (int64_t)sp->rate * SYNC_PLAY_HORIZON_MS / 1000 /
+                    (error < 0 ? -error : error);
+        step = s < SYNC_PLAY_STEP_MIN ? SYNC_PLAY_STEP_MIN : s;
+        if (sp->countdown > step) {
+            sp->countdown = step;
+        }
+    }
+    int i = 0;
+    int n = 0;
+    if (sp->skip) {
+        i = sp->skip < frames ? sp->skip : frames;
+        sp->skip -= i;
+        sp->pos += i;
+        sp->dropped += i;
+    }
+    while (i < frames) {
+        int run = frames - i;
+        if (step && sp->countdown < run) {
+            run = sp->countdown;
+        }
+        memcpy(sp->out + n * fb, in + i * fb, run * fb);
+        i += run;
+        n += run;
+        sp->pos += run;
+        if (step == 0 || i == frames) {
+            sp->countdown -= step ? run : 0;
+            continue;
+        }
+        sp->countdown = step;
+        if (sp->error_q8 > 0) {
+            memcpy(sp->out + n * fb, in + i * fb, fb);
+            n++;
+            sp->inserted++;
+            sp->error_q8 -= 1 << 8;
+        } else {
+            i++;
+            sp->pos++;
+            sp->dropped++;
+            sp->error_q8 += 1 << 8;
+        }
+    }
+    return n;
+}
+
+static int _sync_play_process(audio_element_handle_t self, char* in_buffer,
+                              int in_len) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(self);
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0 || sp->start == 0) {
+        return r > 0 ? audio_element_output(self, in_buffer, r) : r;
+    }
+    int64_t now;
+    if (!sync_play_wait_info(sp) || !sync_now(&now)) {
+        ESP_LOGW(TAG, "[ sync_play ] No %s, playing unsynchronized",
+                 sp->rate ? "timeline" : "stream format");
+        sp->start = 0;
+        return audio_element_output(self, in_buffer, r);
+    }
+    int fb = sp->channels * sizeof(int16_t);
+    ringbuf_handle_t rb = audio_element_get_output_ringbuf(self);
+    int64_t dma = sp->cfg.dma_frames;
+    if (sp->cfg.dma_rate) {
+        dma = dma * sp->rate / sp->cfg.dma_rate;
+    }
+    int64_t queued = rb_bytes_filled(rb) / fb + dma;
+    int64_t due = (now - sp->start) * sp->rate / 1000000;
+    // Stream frame at the DAC against the frame the timeline wants there
+    int64_t error = sp->pos - queued - due;
+    if (!sp->started) {
+        sp->started = true;
+        ESP_LOGI(TAG, "[ sync_play ] Group %d starts %lld us %s", sp->group,
+                 (error < 0 ? -error : error) * 1000000 / sp->rate,
+                 error < 0 ? "late" : "ahead");
+        sync_play_jump(self, sp, error, fb);
+    } else {
+        sp->error_q8 += ((error << 8) - sp->error_q8) / SYNC_PLAY_AVG;
+        error = sp->error_q8 >> 8;
+        if ((error < 0 ? -error : error) * 1000000 / sp->rate >
+            SYNC_PLAY_RESYNC_US) {
+            sync_play_jump(self, sp, error, fb);
+            sp->error_q8 = 0;
+        }
+    }
+
+    int n = sync_play_correct(sp, in_buffer, r / fb, fb);
+    sync_report_t report = {
+        .group = sp->group,
+        .error_us = (sp->error_q8 >> 8) * 1000000 / sp->rate,
+        .inserted = sp->inserted,
+        .dropped = sp->dropped,
+    };
+    sync_report(&report);
+    // A whole buffer skipped is not the end of the stream
+    return n ? audio_element_output(self, sp->out, n * fb) : r;
+}
+
+static esp_err_t _sync_play_close(audio_element_handle_t self) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(self);
+    if (sp->started) {
+        ESP_LOGI(TAG,
+                 "[ sync_play ] Group %d: %u frames repeated, %u skipped, "
+                 "error %d us",
+                 sp->group, sp->inserted, sp->dropped,
+                 (int)((sp->error_q8 >> 8) * 1000000 / sp->rate));
+        metrics_add(METRIC_SYNC_INSERTED_FRAMES, sp->inserted);
+        metrics_add(METRIC_SYNC_DROPPED_FRAMES, sp->dropped);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _sync_play_destroy(audio_element_handle_t self) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(self);
+    audio_free(sp->out);
+    audio_free(sp);
+    return ESP_OK;
+}
+
+audio_element_handle_t sync_play_init(sync_play_cfg_t* config) {
+    sync_play_t* sp = audio_calloc(1, sizeof(sync_play_t));
+    AUDIO_MEM_CHECK(TAG, sp, return NULL);
+    sp->cfg = *config;
+    // Room for the frames repeated in one buffer, 2 byte frames at worst
+    sp->out_size =
+        SYNC_PLAY_BUF + (SYNC_PLAY_BUF / 2 / SYNC_PLAY_STEP_MIN + 1) * 4;
+    sp->out = audio_malloc(sp->out_size);
+    AUDIO_MEM_CHECK(TAG, sp->out, {
+        audio_free(sp);
+        return NULL;
+    });
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _sync_play_open;
+    cfg.process = _sync_play_process;
+    cfg.close = _sync_play_close;
+    cfg.destroy = _sync_play_destroy;
+    cfg.buffer_len = SYNC_PLAY_BUF;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.tag = "sync_play";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(sp->out);
+        audio_free(sp);
+        return NULL;
+    });
+    audio_element_setdata(el, sp);
+    return el;
+}
+
+esp_err_t sync_play_set_info(audio_element_handle_t el, int rate,
+                             int channels) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(el);
+    sp->channels = channels;
+    sp->rate = rate;
+    return ESP_OK;
+}
+
+esp_err_t sync_play_arm(audio_element_handle_t el, int64_t start_us,
+                        uint16_t group) {
+    sync_play_t* sp = (sync_play_t*)audio_element_getdata(el);
+    sp->start = start_us;
+    sp->group = group;
+    // Wait for the new stream's format
+    sp->rate = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,73 @@
+#ifndef _M_SYNC_PLAY_H_
+#define _M_SYNC_PLAY_H_
+
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_err.h"
+
+/*
+ * Group playback stage, placed after the decoder and ahead of the I2S
+ * writer. Until it is armed it passes audio through.
+ *
+ * When armed with a start time on the shared timeline (m_sync.h), frame
+ * k of the stream is due at the DAC at start + k / rate. Data waiting in
+ * the output ringbuffer and the I2S DMA buffers (dma_frames) counts as
+ * not played yet. When the I2S runs at a fixed dma_rate, dma_frames are
+ * converted to frames of the stream. The first buffer is preceded by silence, or its head
+ * is skipped when the stream is late. After that the averaged error is
+ * corrected by repeating or skipping single frames, at most one every
+ * SYNC_PLAY_STEP_MIN frames. Errors over SYNC_PLAY_RESYNC_US, such as
+ * after a network stall, are corrected at once.
+ *
+ * 16 bit PCM only. Buffers after the output ringbuffer, in a resampler
+ * or the mixer, are not counted. They add about the same latency on every
+ * device of a build.
+ */
+#define SYNC_PLAY_STEP_MIN 100
+#define SYNC_PLAY_RESYNC_US 20000
+
+typedef struct {
+    int dma_frames; /* Frames the I2S DMA buffers hold on average */
+    int dma_rate;   /* Rate of dma_frames, 0 when it is the stream's */
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+} sync_play_cfg_t;
+
+#define SYNC_PLAY_TASK_STACK (3 * 1024)
+#define SYNC_PLAY_TASK_CORE (1)
+#define SYNC_PLAY_TASK_PRIO (5)
+#define SYNC_PLAY_RINGBUFFER_SIZE (8 * 1024)
+
+#define SYNC_PLAY_CFG_DEFAULT()                   \
+    {                                             \
+        .dma_frames = 0,                          \
+        .dma_rate = 0,                            \
+        .out_rb_size = SYNC_PLAY_RINGBUFFER_SIZE, \
+        .task_stack = SYNC_PLAY_TASK_STACK,       \
+        .task_core = SYNC_PLAY_TASK_CORE,         \
+        .task_prio = SYNC_PLAY_TASK_PRIO,         \
+    }
+
+/*
+ * @brief Create the group playback stage
+ *
+ * @return The audio element handle
+ */
+audio_element_handle_t sync_play_init(sync_play_cfg_t* config);
+
+/*
+ * @brief Format of the decoded stream, from AEL_MSG_CMD_REPORT_MUSIC_INFO
+ */
+esp_err_t sync_play_set_info(audio_element_handle_t el, int rate,
+                             int channels);
+
+/*
+ * @brief Schedule the next stream at start_us on the timeline, 0 plays
+ *        it as it comes
+ */
+esp_err_t sync_play_arm(audio_element_handle_t el, int64_t start_us,
+                        uint16_t group);
+
+#endif
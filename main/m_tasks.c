@@ -0,0 +1,162 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "m_tasks.h"
+
+static const char* TAG = "tasks";
+
+// Elements: the ADF defaults (HTTP_STREAM_TASK_*, FATFS_STREAM_TASK_*,
+// MP3_DECODER_TASK_*, WAV_ENCODER_TASK_*, RSP_FILTER_TASK_*,
+// I2S_STREAM_TASK_*) and those of m_nsagc.h, m_mixer.h and m_sync_play.h.
+// Move one only with the task statistics behind it.
+static const task_placement_t s_placement[TASK_SLOT_NUM] = {
+    [TASK_SLOT_HTTP_READER] = {"http_reader", 0, 4, 6 * 1024},
+    [TASK_SLOT_HTTP_WRITER] = {"http_writer", 0, 4, 6 * 1024},
+    [TASK_SLOT_FILE_READER] = {"file_reader", 0, 4, 3 * 1024},
+    [TASK_SLOT_MP3_DECODER] = {"mp3", 0, 5, 5 * 1024},
+    [TASK_SLOT_WAV_ENCODER] = {"wav", 0, 5, 3 * 1024},
+    [TASK_SLOT_PLAY_FILTER] = {"play_filter", 0, 5, 4 * 1024},
+    [TASK_SLOT_MIC_FILTER] = {"mic_filter", 0, 5, 4 * 1024},
+    [TASK_SLOT_MIC_NSAGC] = {"mic_nsagc", 1, 6, 4 * 1024},
+    [TASK_SLOT_I2S_WRITER] = {"i2s_writer", 0, 23, 3584},
+    [TASK_SLOT_I2S_READER] = {"i2s_reader", 0, 23, 3584},
+    [TASK_SLOT_MIXER] = {"mixer", 0, 6, 3 * 1024},
+    [TASK_SLOT_STATS] = {"task_stats", 0, 1, 3 * 1024},
+    [TASK_SLOT_METRICS] = {"metrics", 0, 2, 4 * 1024},
+    [TASK_SLOT_DLOG] = {"dlog", 0, 1, 3 * 1024},
+    // Behind the decoder, on its core
+    [TASK_SLOT_REC_TAP] = {"rec_tap", 0, 5, 2 * 1024},
+    // Card writes may stall, nothing real-time waits on this task
+    [TASK_SLOT_SESSION_REC] = {"session_rec", 0, 1, 3 * 1024},
+    [TASK_SLOT_CTRL] = {"ctrl", 0, 3, 4 * 1024},
+    // Clock samples are timestamped here, keep it above the network tasks
+    [TASK_SLOT_SYNC] = {"sync", 0, 5, 3 * 1024},
+    [TASK_SLOT_SYNC_PLAY] = {"sync_play", 1, 5, 3 * 1024},
+    // Off the decoder's core so the sink does not slow what it measures
+    [TASK_SLOT_BENCH_SINK] = {"bench_sink", 0, 5, 3 * 1024},
+    // Below everything audio, its flash writes are throttled on top
+    [TASK_SLOT_OTA] = {"ota", 0, 1, 4 * 1024},
+    // Carries the HTTP streams, next to their elements. The handshake
+    // verifies RSA signatures on this stack.
+    [TASK_SLOT_TLS] = {"tls", 0, 4, 8 * 1024},
+    // Reads a whole file once, must not starve the SD reader
+    [TASK_SLOT_MP3_INDEX] = {"mp3_index", 0, 1, 3 * 1024},
+};
+
+const task_placement_t* task_placement_get(task_slot_t slot) {
+    return &s_placement[slot < TASK_SLOT_NUM ? slot : TASK_SLOT_STATS];
+}
+
+static SemaphoreHandle_t s_lock;
+static task_stat_t s_snapshot[TASK_STATS_MAX];
+static int s_snapshot_num;
+
+int task_stats_get(task_stat_t* out, int max) {
+    if (s_lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    int n = s_snapshot_num < max ? s_snapshot_num : max;
+    memcpy(out, s_snapshot, n * sizeof(task_stat_t));
+    xSemaphoreGive(s_lock);
+    return n;
+}
+
+#if CONFIG_TASK_STATS_ENABLE
+static TaskStatus_t s_status[TASK_STATS_MAX];
+static TaskHandle_t s_prev_handle[TASK_STATS_MAX];
+static uint32_t s_prev_runtime[TASK_STATS_MAX];
+static int s_prev_num;
+static uint32_t s_prev_total;
+
+static uint32_t task_prev_runtime(TaskHandle_t handle) {
+    for (int i = 0; i < s_prev_num; i++) {
+        if (s_prev_handle[i] == handle) {
+            return s_prev_runtime[i];
+        }
+    }
+    return 0;
+}
+
+static void task_stats_collect(void) {
+    uint32_t total = 0;
+    int num = uxTaskGetSystemState(s_status, TASK_STATS_MAX, &total);
+    if (num == 0) {
+        ESP_LOGW(TAG, "[ tasks ] more than %d tasks", TASK_STATS_MAX);
+        return;
+    }
+    uint32_t elapsed = total - s_prev_total;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < num; i++) {
+        TaskStatus_t* ts = &s_status[i];
+        task_stat_t* st = &s_snapshot[i];
+        strlcpy(st->name, ts->pcTaskName, sizeof(st->name));
+#if CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+        st->core = ts->xCoreID == tskNO_AFFINITY ? -1 : ts->xCoreID;
+#else
+        st->core = -1;
+#endif
+        st->prio = ts->uxCurrentPriority;
+        uint32_t run = ts->ulRunTimeCounter - task_prev_runtime(ts->xHandle);
+        st->cpu_permille = elapsed ? (uint64_t)run * 1000 / elapsed : 0;
+        st->stack_min = ts->usStackHighWaterMark;
+    }
+    s_snapshot_num = num;
+    xSemaphoreGive(s_lock);
+
+    for (int i = 0; i < num; i++) {
+        s_prev_handle[i] = s_status[i].xHandle;
+        s_prev_runtime[i] = s_status[i].ulRunTimeCounter;
+    }
+    s_prev_num = num;
+    s_prev_total = total;
+}
+
+static void task_stats_log(void) {
+    ESP_LOGI(TAG, "[ tasks ] %-16s core prio cpu%%  stack_min", "name");
+    for (int i = 0; i < s_snapshot_num; i++) {
+        task_stat_t* st = &s_snapshot[i];
+        ESP_LOGI(TAG, "[ tasks ] %-16s %4d %4d %3d.%d %6u", st->name, st->core,
+                 st->prio, st->cpu_permille / 10, st->cpu_permille % 10,
+                 st->stack_min);
+    }
+}
+
+static void task_stats_task(void* arg) {
+    TickType_t period = (int)arg / portTICK_PERIOD_MS;
+    while (1) {
+        vTaskDelay(period);
+        task_stats_collect();
+        task_stats_log();
+    }
+}
+#endif
+
+esp_err_t task_stats_start(int period_ms) {
+#if CONFIG_TASK_STATS_ENABLE
+    if (s_lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    const task_placement_t* p = task_placement_get(TASK_SLOT_STATS);
+    if (xTaskCreatePinnedToCore(task_stats_task, p->name, p->stack,
+                                (void*)period_ms, p->prio, NULL,
+                                p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ tasks ] Error create stats task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+#else
+    (void)period_ms;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
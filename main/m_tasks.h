@@ -0,0 +1,85 @@
+#ifndef _M_TASKS_H_
+#define _M_TASKS_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Core, priority and stack of every element and service task, in one table
+ * so placement can be changed from measurements instead of per call site.
+ * The element slots hold the defaults of their ADF or m_* element, so the
+ * table changes nothing until an entry is moved on the strength of the
+ * task statistics (CONFIG_TASK_STATS_ENABLE): stack high-water mark and
+ * CPU share per core.
+ */
+typedef enum {
+    TASK_SLOT_HTTP_READER,
+    TASK_SLOT_HTTP_WRITER,
+    TASK_SLOT_FILE_READER, /* fatfs, spiffs and asset pack readers */
+    TASK_SLOT_MP3_DECODER,
+    TASK_SLOT_WAV_ENCODER,
+    TASK_SLOT_PLAY_FILTER,
+    TASK_SLOT_MIC_FILTER,
+    TASK_SLOT_MIC_NSAGC,
+    TASK_SLOT_I2S_WRITER,
+    TASK_SLOT_I2S_READER,
+    TASK_SLOT_MIXER,
+    TASK_SLOT_STATS,
+    TASK_SLOT_METRICS,
+    TASK_SLOT_DLOG,
+    TASK_SLOT_REC_TAP,
+    TASK_SLOT_SESSION_REC,
+    TASK_SLOT_CTRL,
+    TASK_SLOT_SYNC,
+    TASK_SLOT_SYNC_PLAY,
+    TASK_SLOT_BENCH_SINK,
+    TASK_SLOT_OTA,
+    TASK_SLOT_TLS,
+    TASK_SLOT_MP3_INDEX,
+    TASK_SLOT_NUM
+} task_slot_t;
+
+typedef struct {
+    const char* name;
+    int core;
+    int prio;
+    int stack;
+} task_placement_t;
+
+const task_placement_t* task_placement_get(task_slot_t slot);
+
+/*
+ * @brief Apply a placement to any ADF config struct with task_core,
+ *        task_prio and task_stack fields
+ */
+#define TASK_PLACE(cfg, slot)                                      \
+    do {                                                           \
+        const task_placement_t* _place = task_placement_get(slot); \
+        (cfg).task_core = _place->core;                            \
+        (cfg).task_prio = _place->prio;                            \
+        (cfg).task_stack = _place->stack;                          \
+    } while (0)
+
+#define TASK_STATS_MAX 32
+
+typedef struct {
+    char name[16];
+    int core; /* -1 when not pinned or unknown */
+    int prio;
+    int cpu_permille;   /* Share of one core over the last period */
+    uint32_t stack_min; /* Stack high-water mark, bytes never used */
+} task_stat_t;
+
+/*
+ * @brief Start the periodic collector (CONFIG_TASK_STATS_ENABLE)
+ */
+esp_err_t task_stats_start(int period_ms);
+
+/*
+ * @brief Copy the latest snapshot
+ *
+ * @return Number of tasks written to `out`
+ */
+int task_stats_get(task_stat_t* out, int max);
+
+#endif
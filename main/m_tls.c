@@ -0,0 +1,524 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "nvs.h"
+
+#include "m_metrics.h"
+#include "m_tasks.h"
+#include "m_tls.h"
+
+static const char* TAG = "tls";
+
+#define TLS_NVS_NAMESPACE "tls"
+#define TLS_NVS_KEY "session"
+#define TLS_SESSION_MAGIC 0x31534C54 /* "TLS1" */
+#define TLS_HOST_MAX 64
+#define TLS_TICKET_MAX 512
+#define TLS_HEAD_MAX 1536 /* Request head, read whole to fix its Host */
+#define TLS_BUF_SIZE 2048
+#define TLS_IO_TIMEOUT_MS 30000
+
+#if CONFIG_TLS_ENABLE
+// Embedded with the option only, tools/tls/mkcerts.sh writes it
+extern const char server_ca_pem_start[] asm("_binary_server_ca_pem_start");
+#else
+static const char server_ca_pem_start[] = "";
+#endif
+
+/*
+ * What a client needs to resume, without the peer certificate: a resumed
+ * handshake does not send it, so a session restored from here tells a
+ * resumption (no certificate afterwards) from a full handshake.
+ */
+typedef struct {
+    uint32_t magic;
+    char host[TLS_HOST_MAX];
+    uint16_t port;
+    uint16_t ciphersuite;
+    uint8_t compression;
+    uint8_t mfl_code;
+    uint8_t trunc_hmac;
+    uint8_t encrypt_then_mac;
+    uint8_t id_len;
+    uint8_t id[32];
+    uint8_t master[48];
+    uint32_t ticket_lifetime;
+    uint16_t ticket_len;
+    uint8_t ticket[TLS_TICKET_MAX];
+} tls_saved_t;
+
+#define TLS_SAVED_SIZE(s) (offsetof(tls_saved_t, ticket) + (s)->ticket_len)
+
+/*
+ * AES and SHA-256 run on the crypto accelerators and RSA on the MPI unit
+ * (CONFIG_MBEDTLS_HARDWARE_*), the elliptic curves in software. A
+ * resumption skips both the key exchange and the certificate check.
+ */
+static const int s_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    0,
+};
+
+static tls_cfg_t s_cfg;
+static TaskHandle_t s_task;
+static int s_listen = -1;
+static mbedtls_entropy_context s_entropy;
+static mbedtls_ctr_drbg_context s_drbg;
+static mbedtls_x509_crt s_ca;
+static mbedtls_ssl_config s_conf;
+
+/* Owned by the tunnel task */
+static tls_saved_t s_saved;
+static tls_saved_t s_next;
+static bool s_dirty;
+static char s_head[TLS_HEAD_MAX];
+static char s_buf[TLS_BUF_SIZE];
+
+static void tls_session_load(void) {
+    memset(&s_saved, 0, sizeof(s_saved));
+    nvs_handle nvs;
+    if (nvs_open(TLS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    size_t size = sizeof(s_saved);
+    esp_err_t err = nvs_get_blob(nvs, TLS_NVS_KEY, &s_saved, &size);
+    nvs_close(nvs);
+    if (err != ESP_OK || s_saved.magic != TLS_SESSION_MAGIC ||
+        s_saved.ticket_len > TLS_TICKET_MAX ||
+        size != TLS_SAVED_SIZE(&s_saved) ||
+        strncmp(s_saved.host, s_cfg.host, TLS_HOST_MAX) != 0 ||
+        s_saved.port != s_cfg.port) {
+        memset(&s_saved, 0, sizeof(s_saved));
+        return;
+    }
+    ESP_LOGI(TAG, "[ tls ] Loaded a session for %s:%d%s", s_saved.host,
+             s_saved.port, s_saved.ticket_len ? ", with ticket" : "");
+}
+
+static void tls_session_write(void) {
+    nvs_handle nvs;
+    esp_err_t err = nvs_open(TLS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        if (s_saved.magic == TLS_SESSION_MAGIC) {
+            err = nvs_set_blob(nvs, TLS_NVS_KEY, &s_saved,
+                               TLS_SAVED_SIZE(&s_saved));
+        } else {
+            err = nvs_erase_key(nvs, TLS_NVS_KEY);
+            err = err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "[ tls ] Session not saved: %d", err);
+    }
+}
+
+static void tls_session_restore(const tls_saved_t* saved,
+                                mbedtls_ssl_session* session) {
+    session->ciphersuite = saved->ciphersuite;
+    session->compression = saved->compression;
+    session->id_len = saved->id_len;
+    memcpy(session->id, saved->id, sizeof(session->id));
+    memcpy(session->master, saved->master, sizeof(session->master));
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    session->mfl_code = saved->mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+    session->trunc_hmac = saved->trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+    session->encrypt_then_mac = saved->encrypt_then_mac;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+    if (saved->ticket_len) {
+        // Freed with the session by mbedtls_ssl_session_free
+        session->ticket = mbedtls_calloc(1, saved->ticket_len);
+        if (session->ticket) {
+            memcpy(session->ticket, saved->ticket, saved->ticket_len);
+            session->ticket_len = saved->ticket_len;
+            session->ticket_lifetime = saved->ticket_lifetime;
+        }
+    }
+#endif
+}
+
+/*
+ * Take the session of the connection just made into s_next, to be saved
+ * once the connection is done
+ */
+static void tls_session_take(mbedtls_ssl_context* ssl) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+    tls_saved_t* next = &s_next;
+    memset(next, 0, sizeof(*next));
+    next->magic = TLS_SESSION_MAGIC;
+    strlcpy(next->host, s_cfg.host, sizeof(next->host));
+    next->port = s_cfg.port;
+    next->ciphersuite = session.ciphersuite;
+    next->compression = session.compression;
+    next->id_len = session.id_len;
+    memcpy(next->id, session.id, sizeof(next->id));
+    memcpy(next->master, session.master, sizeof(next->master));
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    next->mfl_code = session.mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+    next->trunc_hmac = session.trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+    next->encrypt_then_mac = session.encrypt_then_mac;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+    if (session.ticket && session.ticket_len <= TLS_TICKET_MAX) {
+        memcpy(next->ticket, session.ticket, session.ticket_len);
+        next->ticket_len = session.ticket_len;
+        next->ticket_lifetime = session.ticket_lifetime;
+    }
+#endif
+    mbedtls_ssl_session_free(&session);
+
+    if (next->id_len == 0 && next->ticket_len == 0) {
+        return; // The server does not resume
+    }
+    if (s_saved.magic != TLS_SESSION_MAGIC ||
+        memcmp(&s_saved, next, TLS_SAVED_SIZE(next)) != 0) {
+        s_dirty = true;
+    }
+}
+
+static esp_err_t tls_open(mbedtls_net_context* net, mbedtls_ssl_context* ssl,
+                          bool offer) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", s_cfg.port);
+    int ret = mbedtls_net_connect(net, s_cfg.host, port, MBEDTLS_NET_PROTO_TCP);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "[ tls ] Connect %s:%s failed: -0x%04x", s_cfg.host,
+                 port, -ret);
+        return ESP_FAIL;
+    }
+    // After a resumed handshake the client speaks last, its request must
+    // not wait for the ACK of its Finished
+    int nodelay = 1;
+    setsockopt(net->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if ((ret = mbedtls_ssl_setup(ssl, &s_conf)) != 0 ||
+        (ret = mbedtls_ssl_set_hostname(ssl, s_cfg.host)) != 0) {
+        ESP_LOGE(TAG, "[ tls ] Setup failed: -0x%04x", -ret);
+        return ESP_FAIL;
+    }
+    mbedtls_ssl_set_bio(ssl, net, mbedtls_net_send, NULL,
+                        mbedtls_net_recv_timeout);
+    if (offer) {
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        tls_session_restore(&s_saved, &session);
+        mbedtls_ssl_set_session(ssl, &session);
+        mbedtls_ssl_session_free(&session);
+    }
+
+    int64_t start = esp_timer_get_time();
+    while ((ret = mbedtls_ssl_handshake(ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGW(TAG, "[ tls ] Handshake failed: -0x%04x, verify 0x%x",
+                     -ret, mbedtls_ssl_get_verify_result(ssl));
+            metrics_add(METRIC_TLS_FAILURES, 1);
+            return ESP_FAIL;
+        }
+    }
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    bool resumed = mbedtls_ssl_get_peer_cert(ssl) == NULL;
+    metrics_observe(
+        resumed ? METRIC_HIST_TLS_RESUMED_MS : METRIC_HIST_TLS_FULL_MS, ms);
+    ESP_LOGI(TAG, "[ tls ] %s handshake %u ms, %s",
+             resumed ? "Resumed" : "Full", ms,
+             mbedtls_ssl_get_ciphersuite(ssl));
+    tls_session_take(ssl);
+    return ESP_OK;
+}
+
+static int tls_send_all(int sock, const char* data, int len) {
+    while (len > 0) {
+        int n = send(sock, data, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int tls_write_all(mbedtls_ssl_context* ssl, const char* data,
+                         int len) {
+    while (len > 0) {
+        int n = mbedtls_ssl_write(ssl, (const unsigned char*)data, len);
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read up to the end of the request head, body bytes that came with it
+ * stay in the buffer
+ */
+static int tls_read_head(int client, char* buf, int cap) {
+    int len = 0;
+    buf[0] = '\0';
+    while (len < cap - 1 && strstr(buf, "\r\n\r\n") == NULL) {
+        int n = recv(client, buf + len, cap - 1 - len, 0);
+        if (n <= 0) {
+            return len ? len : -1;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+/*
+ * The stream asked 127.0.0.1 for the page, tell the server which host it
+ * is for. Returns the new length.
+ */
+static int tls_rewrite_host(char* buf, int len, int cap) {
+    char* end = strstr(buf, "\r\n\r\n");
+    char* line = strstr(buf, "\r\n");
+    while (end && line && line < end) {
+        line += 2;
+        char* next = strstr(line, "\r\n");
+        if (strncasecmp(line, "Host:", 5) == 0) {
+            char host[TLS_HOST_MAX + 16];
+            int host_len =
+                s_cfg.port == 443
+                    ? snprintf(host, sizeof(host), "Host: %s", s_cfg.host)
+                    : snprintf(host, sizeof(host), "Host: %s:%d", s_cfg.host,
+                               s_cfg.port);
+            int old_len = next - line;
+            if (len - old_len + host_len >= cap) {
+                break;
+            }
+            memmove(line + host_len, next, buf + len - next + 1);
+            memcpy(line, host, host_len);
+            return len - old_len + host_len;
+        }
+        line = next;
+    }
+    return len;
+}
+
+static void tls_pipe(int client, mbedtls_net_context* net,
+                     mbedtls_ssl_context* ssl, const char* head,
+                     int head_len) {
+    if (tls_write_all(ssl, head, head_len) != 0) {
+        return;
+    }
+    for (;;) {
+        // Records already decrypted are not seen by select
+        if (mbedtls_ssl_get_bytes_avail(ssl) == 0) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(client, &fds);
+            FD_SET(net->fd, &fds);
+            struct timeval tv = {TLS_IO_TIMEOUT_MS / 1000, 0};
+            int n = select((client > net->fd ? client : net->fd) + 1, &fds,
+                           NULL, NULL, &tv);
+            if (n <= 0) {
+                ESP_LOGW(TAG, "[ tls ] Connection idle, closed");
+                return;
+            }
+            if (FD_ISSET(client, &fds)) {
+                n = recv(client, s_buf, sizeof(s_buf), 0);
+                if (n <= 0 || tls_write_all(ssl, s_buf, n) != 0) {
+                    return;
+                }
+            }
+            if (!FD_ISSET(net->fd, &fds)) {
+                continue;
+            }
+        }
+        int n = mbedtls_ssl_read(ssl, (unsigned char*)s_buf, sizeof(s_buf));
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        // 0 or close notify: the server is done, closing the stream's
+        // socket ends a reply sent without a length
+        if (n <= 0 || tls_send_all(client, s_buf, n) != 0) {
+            return;
+        }
+    }
+}
+
+static void tls_tunnel(int client) {
+    int len = tls_read_head(client, s_head, sizeof(s_head));
+    if (len <= 0) {
+        return;
+    }
+    len = tls_rewrite_host(s_head, len, sizeof(s_head));
+
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    bool offer = s_saved.magic == TLS_SESSION_MAGIC;
+    mbedtls_net_init(&net);
+    mbedtls_ssl_init(&ssl);
+    esp_err_t err = tls_open(&net, &ssl, offer);
+    if (err != ESP_OK && offer) {
+        // A session the server chokes on would fail every connection
+        s_saved.magic = 0;
+        s_dirty = true;
+        mbedtls_ssl_free(&ssl);
+        mbedtls_net_free(&net);
+        mbedtls_net_init(&net);
+        mbedtls_ssl_init(&ssl);
+        err = tls_open(&net, &ssl, false);
+    }
+    if (err == ESP_OK) {
+        tls_pipe(client, &net, &ssl, s_head, len);
+        mbedtls_ssl_close_notify(&ssl);
+    }
+    mbedtls_ssl_free(&ssl);
+    mbedtls_net_free(&net);
+}
+
+static void tls_task(void* arg) {
+    for (;;) {
+        int client = accept(s_listen, NULL, NULL);
+        if (client < 0) {
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+            continue;
+        }
+        struct timeval tv = {TLS_IO_TIMEOUT_MS / 1000, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        s_next.magic = 0;
+        tls_tunnel(client);
+        close(client);
+        // Off the stream's path: the flash write waits until it closed
+        if (s_next.magic == TLS_SESSION_MAGIC && s_dirty) {
+            s_saved = s_next;
+        }
+        if (s_dirty) {
+            tls_session_write();
+            s_dirty = false;
+        }
+    }
+}
+
+const char* tls_url(const char* url, char* buf, size_t size) {
+    if (s_task == NULL || strncmp(url, "https://", 8) != 0) {
+        return url;
+    }
+    const char* host = url + 8;
+    size_t host_len = strcspn(host, ":/");
+    const char* path = host + host_len;
+    int port = 443;
+    if (*path == ':') {
+        port = atoi(path + 1);
+        path += strcspn(path, "/");
+    }
+    if (host_len != strlen(s_cfg.host) ||
+        strncmp(host, s_cfg.host, host_len) != 0 || port != s_cfg.port) {
+        return url;
+    }
+    snprintf(buf, size, "http://127.0.0.1:%d%s", s_cfg.local_port,
+             *path ? path : "/");
+    return buf;
+}
+
+esp_err_t tls_start(const tls_cfg_t* cfg) {
+    if (s_task) {
+        return ESP_OK;
+    }
+    if (cfg->host == NULL || strlen(cfg->host) >= TLS_HOST_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cfg = *cfg;
+    const char* ca = cfg->ca_pem ? cfg->ca_pem : server_ca_pem_start;
+
+    mbedtls_entropy_init(&s_entropy);
+    mbedtls_ctr_drbg_init(&s_drbg);
+    mbedtls_x509_crt_init(&s_ca);
+    mbedtls_ssl_config_init(&s_conf);
+    int ret = mbedtls_ctr_drbg_seed(&s_drbg, mbedtls_entropy_func, &s_entropy,
+                                    (const unsigned char*)TAG, strlen(TAG));
+    if (ret == 0) {
+        ret = mbedtls_x509_crt_parse(&s_ca, (const unsigned char*)ca,
+                                     strlen(ca) + 1);
+    }
+    if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&s_conf, MBEDTLS_SSL_IS_CLIENT,
+                                          MBEDTLS_SSL_TRANSPORT_STREAM,
+                                          MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "[ tls ] Init failed: -0x%04x", -ret);
+        return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_authmode(&s_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&s_conf, &s_ca, NULL);
+    mbedtls_ssl_conf_rng(&s_conf, mbedtls_ctr_drbg_random, &s_drbg);
+    mbedtls_ssl_conf_ciphersuites(&s_conf, s_ciphersuites);
+    mbedtls_ssl_conf_read_timeout(&s_conf, TLS_IO_TIMEOUT_MS);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&s_conf,
+                                     MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    tls_session_load();
+
+    s_listen = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(s_cfg.local_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s_listen < 0 ||
+        bind(s_listen, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(s_listen, 2) != 0) {
+        ESP_LOGE(TAG, "[ tls ] Listen on port %d failed", s_cfg.local_port);
+        if (s_listen >= 0) {
+            close(s_listen);
+            s_listen = -1;
+        }
+        return ESP_FAIL;
+    }
+    const task_placement_t* p = task_placement_get(TASK_SLOT_TLS);
+    if (xTaskCreatePinnedToCore(tls_task, p->name, p->stack, NULL, p->prio,
+                                &s_task, p->core) != pdPASS) {
+        ESP_LOGE(TAG, "[ tls ] Error create task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ tls ] Tunnel 127.0.0.1:%d to %s:%d", s_cfg.local_port,
+             s_cfg.host, s_cfg.port);
+    return ESP_OK;
+}
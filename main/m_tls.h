@@ -0,0 +1,53 @@
+#ifndef _M_TLS_H_
+#define _M_TLS_H_
+
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * TLS for the upload and reply streams. esp_http_client in this IDF opens
+ * every connection with a new session and gives no access to it, so the
+ * streams talk plain HTTP to a tunnel on the loopback interface instead
+ * (tls_url rewrites their URLs), and the tunnel task carries each
+ * connection to the server over mbedTLS.
+ *
+ * The tunnel keeps the last session, ticket included, in RAM and in NVS.
+ * A connection offers it and the server can resume without the
+ * certificate exchange and key agreement, also after a reboot. Handshake
+ * time is logged per connection and exported by the metrics endpoint,
+ * full and resumed apart. A resumption the server refuses falls back to a
+ * full handshake; a handshake that fails with a session offered forgets
+ * it and is retried once without.
+ *
+ * One connection is carried at a time, the streams never overlap. The
+ * session context takes about 40 KB of heap while a connection is open.
+ */
+typedef struct {
+    const char* host; /* Server, checked against its certificate */
+    int port;
+    const char* ca_pem; /* NUL terminated, NULL selects the embedded CA */
+    int local_port;     /* Tunnel on 127.0.0.1 */
+} tls_cfg_t;
+
+#define TLS_CFG_DEFAULT()    \
+    {                        \
+        .host = NULL,        \
+        .port = 443,         \
+        .ca_pem = NULL,      \
+        .local_port = 8443,  \
+    }
+
+/*
+ * @brief Load the saved session and start the tunnel task
+ */
+esp_err_t tls_start(const tls_cfg_t* cfg);
+
+/*
+ * @brief URL a stream has to open: an https URL on the tunnel's server
+ *        becomes http://127.0.0.1:<local_port>/<path> in `buf`, any other
+ *        URL, or every URL while the tunnel is not started, is returned
+ *        as it is
+ */
+const char* tls_url(const char* url, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_pipeline.h"
+#include "fatfs_stream.h"
+#include "filter_resample.h"
+#include "raw_stream.h"
+
+#include "m_includes.h"
+#include "m_nsagc.h"
+#include "m_tasks.h"
+#include "m_wake_eval.h"
+
+static const char* TAG = "wake_eval";
+
+#define WAKE_EVAL_NAME_MAX 16
+#define WAKE_EVAL_PATH_MAX 48
+#define WAKE_EVAL_DETECT_MAX 64
+
+typedef struct {
+    det_mode_t mode;
+    const char* name;
+} wake_eval_mode_t;
+
+static const wake_eval_mode_t s_modes[] = {
+    {DET_MODE_90, "DET_MODE_90"},
+    {DET_MODE_95, "DET_MODE_95"},
+};
+
+typedef struct {
+    audio_pipeline_handle_t pipeline;
+    audio_element_handle_t reader;
+    audio_element_handle_t filter;
+    audio_element_handle_t nsagc; /* NULL unless CONFIG_NSAGC_ENABLE */
+    audio_element_handle_t raw;
+} wake_eval_chain_t;
+
+// The ASR pipeline with the I2S reader replaced by a file reader
+static esp_err_t wake_eval_chain_init(wake_eval_chain_t* c) {
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    c->pipeline = audio_pipeline_init(&pipeline_cfg);
+    AUDIO_MEM_CHECK(TAG, c->pipeline, return ESP_ERR_NO_MEM);
+
+    fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
+    fatfs_cfg.type = AUDIO_STREAM_READER;
+    TASK_PLACE(fatfs_cfg, TASK_SLOT_FILE_READER);
+    c->reader = fatfs_stream_init(&fatfs_cfg);
+
+    rsp_filter_cfg_t rsp_cfg = DEFAULT_RESAMPLE_FILTER_CONFIG();
+    rsp_cfg.src_rate = 48000;
+    rsp_cfg.src_ch = 2;
+    rsp_cfg.dest_rate = 16000;
+    rsp_cfg.dest_ch = 1;
+    rsp_cfg.type = AUDIO_CODEC_TYPE_ENCODER;
+    TASK_PLACE(rsp_cfg, TASK_SLOT_MIC_FILTER);
+    c->filter = rsp_filter_init(&rsp_cfg);
+
+    raw_stream_cfg_t raw_cfg = {
+        .out_rb_size = 8 * 1024,
+        .type = AUDIO_STREAM_READER,
+    };
+    c->raw = raw_stream_init(&raw_cfg);
+
+    audio_pipeline_register(c->pipeline, c->reader, "file");
+    audio_pipeline_register(c->pipeline, c->filter, "filter");
+    audio_pipeline_register(c->pipeline, c->raw, "raw_read");
+#if CONFIG_NSAGC_ENABLE
+    nsagc_cfg_t nsagc_cfg = NSAGC_CFG_DEFAULT();
+    nsagc_cfg.floor_db = CONFIG_NSAGC_FLOOR_DB;
+    nsagc_cfg.target_dbfs = CONFIG_NSAGC_TARGET_DBFS;
+    nsagc_cfg.budget_cycles = CONFIG_NSAGC_BUDGET_KCYCLES * 1000;
+#if CONFIG_NSAGC_BYPASS
+    nsagc_cfg.bypass = true;
+#endif
+    TASK_PLACE(nsagc_cfg, TASK_SLOT_MIC_NSAGC);
+    c->nsagc = nsagc_init(&nsagc_cfg);
+    audio_pipeline_register(c->pipeline, c->nsagc, "nsagc");
+    audio_pipeline_link(
+        c->pipeline, (const char* []){"file", "filter", "nsagc", "raw_read"},
+        4);
+#else
+    c->nsagc = NULL;
+    audio_pipeline_link(c->pipeline,
+                        (const char* []){"file", "filter", "raw_read"}, 3);
+#endif
+    return ESP_OK;
+}
+
+static void wake_eval_chain_deinit(wake_eval_chain_t* c) {
+    audio_pipeline_terminate(c->pipeline);
+    audio_pipeline_unregister(c->pipeline, c->reader);
+    audio_pipeline_unregister(c->pipeline, c->filter);
+    audio_pipeline_unregister(c->pipeline, c->raw);
+    if (c->nsagc) {
+        audio_pipeline_unregister(c->pipeline, c->nsagc);
+    }
+    audio_pipeline_deinit(c->pipeline);
+    audio_element_deinit(c->reader);
+    audio_element_deinit(c->filter);
+    audio_element_deinit(c->raw);
+    if (c->nsagc) {
+        audio_element_deinit(c->nsagc);
+    }
+}
+
+/*
+ * A fresh model per file so results do not depend on the file order.
+ * Detections are reported as the 16 kHz sample at the end of the frame.
+ */
+static void wake_eval_file(wake_eval_chain_t* c, esp_wn_iface_t* wn,
+                           model_coeff_getter_t* coeff,
+                           const wake_eval_mode_t* m, const char* dir,
+                           const char* name) {
+    char path[WAKE_EVAL_PATH_MAX];
+    uint32_t det[WAKE_EVAL_DETECT_MAX];
+    int det_num = 0;
+    uint32_t frames = 0;
+    uint32_t us_max = 0;
+    uint64_t us_sum = 0;
+
+    model_iface_data_t* model = wn->create(coeff, m->mode);
+    if (model == NULL) {
+        ESP_LOGE(TAG, "[ eval ] Cannot create model");
+        return;
+    }
+    int chunk = wn->get_samp_chunksize(model);
+    int16_t* buff = audio_malloc(chunk * sizeof(int16_t));
+    if (buff == NULL) {
+        wn->destroy(model);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    audio_element_set_uri(c->reader, path);
+    audio_pipeline_run(c->pipeline);
+    int bytes = chunk * sizeof(int16_t);
+    while (raw_stream_read(c->raw, (char*)buff, bytes) == bytes) {
+        int64_t start = esp_timer_get_time();
+        int keyword = wn->detect(model, buff);
+        uint32_t us = esp_timer_get_time() - start;
+        frames++;
+        us_sum += us;
+        if (us > us_max) {
+            us_max = us;
+        }
+        if (keyword > 0 && det_num < WAKE_EVAL_DETECT_MAX) {
+            det[det_num++] = frames * chunk;
+        }
+    }
+    stop_pipeline_element(c->pipeline, c->reader, c->filter, c->raw);
+
+    printf("WAKE_EVAL {\"type\":\"file\",\"mode\":\"%s\",\"file\":\"%s\","
+           "\"samples\":%u,\"frames\":%u,\"detect_us_sum\":%llu,"
+           "\"detect_us_max\":%u,\"detections\":[",
+           m->name, name, frames * chunk, frames, us_sum, us_max);
+    for (int i = 0; i < det_num; i++) {
+        printf("%s%u", i ? "," : "", det[i]);
+    }
+    printf("]}\n");
+
+    audio_free(buff);
+    wn->destroy(model);
+}
+
+esp_err_t wake_eval_run(esp_wn_iface_t* wn, model_coeff_getter_t* coeff,
+                        const char* dir) {
+    char path[WAKE_EVAL_PATH_MAX];
+    char name[WAKE_EVAL_NAME_MAX];
+    wake_eval_chain_t chain;
+
+    snprintf(path, sizeof(path), "%s/INDEX.TXT", dir);
+    FILE* index = fopen(path, "r");
+    if (index == NULL) {
+        ESP_LOGE(TAG, "[ eval ] Cannot open %s", path);
+        return ESP_FAIL;
+    }
+    if (wake_eval_chain_init(&chain) != ESP_OK) {
+        fclose(index);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < sizeof(s_modes) / sizeof(s_modes[0]); i++) {
+        const wake_eval_mode_t* m = &s_modes[i];
+        model_iface_data_t* model = wn->create(coeff, m->mode);
+        if (model == NULL) {
+            continue;
+        }
+        printf("WAKE_EVAL {\"type\":\"mode\",\"mode\":\"%s\","
+               "\"threshold\":%f,\"sample_rate\":%d,\"chunk\":%d,"
+               "\"cpu_mhz\":%d}\n",
+               m->name, wn->get_det_threshold(model, 1),
+               wn->get_samp_rate(model), wn->get_samp_chunksize(model),
+               CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+        wn->destroy(model);
+
+        rewind(index);
+        while (fgets(name, sizeof(name), index)) {
+            name[strcspn(name, "\r\n")] = '\0';
+            if (name[0] == '\0' || name[0] == '#') {
+                continue;
+            }
+            ESP_LOGI(TAG, "[ eval ] %s %s", m->name, name);
+            wake_eval_file(&chain, wn, coeff, m, dir, name);
+        }
+    }
+    printf("WAKE_EVAL {\"type\":\"end\"}\n");
+
+    wake_eval_chain_deinit(&chain);
+    fclose(index);
+    return ESP_OK;
+}
@@ -0,0 +1,18 @@
+#ifndef _M_WAKE_EVAL_H_
+#define _M_WAKE_EVAL_H_
+
+#include "esp_err.h"
+#include "esp_wn_iface.h"
+
+/*
+ * Offline wake word evaluation. Every file listed in <dir>/INDEX.TXT is
+ * raw 48 kHz stereo PCM, as the I2S reader would deliver it, prepared by
+ * tools/wake_eval.py. Each file goes through the ASR chain (resampler,
+ * raw stream, detect) once per detection mode, and one JSON line per file
+ * is printed on the console with the detections and per-frame detect time.
+ * tools/wake_eval.py turns the log into FAR, FRR and delay figures.
+ */
+esp_err_t wake_eval_run(esp_wn_iface_t* wn, model_coeff_getter_t* coeff,
+                        const char* dir);
+
+#endif
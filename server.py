@@ -1,11 +1,666 @@
-import os, datetime, sys, urlparse
-import SimpleHTTPServer, BaseHTTPServer
+import os, datetime, sys, urlparse, hashlib, uuid, threading, time
+import base64, socket, struct, ssl, json, collections, cStringIO, hmac
+import SimpleHTTPServer, BaseHTTPServer, SocketServer
 import wave
 
-PORT = 8000
+# PORT, SYNC_PORT and TLS_PORT from the environment let the tools/ tests
+# run servers side by side
+PORT = int(os.environ.get('PORT', 8000))
 HOST = '0.0.0.0'
 
+# Stand-in for TTS: every upload gets this file with an ID3v1 tag naming
+# the reply, so each reply has its own content and ETag. It is written out
+# at TTS_BYTES_PER_SEC under ai/reply/<id> while the device streams it.
+REPLY_SOURCE = 'ai/tts/output.mp3'
+REPLY_DIR = 'ai/reply'
+# A reply id stays valid for REPLY_KEEP_S seconds, however many uploads
+# come in meanwhile, and after that until REPLY_KEEP newer ones exist.
+REPLY_KEEP = int(os.environ.get('REPLY_KEEP', 64))
+REPLY_KEEP_S = float(os.environ.get('REPLY_KEEP_S', 60))
+TTS_BYTES_PER_SEC = 16 * 1024
+
+# Generated replies and MP3 files in memory (ReplyStore),
+# REPLY_STORE_BYTES=0 serves every request from disk as before. Hit rate, time to first byte and
+# requests per second are served as JSON on /ai/store.
+REPLY_STORE_BYTES = int(os.environ.get('REPLY_STORE_BYTES', 16 << 20))
+REPLY_STORE_CHUNK = 64 * 1024
+STORE_PATH = 'ai/store'
+
+_etags = {}
+
+def data_etag(data):
+    return '"{}"'.format(hashlib.sha1(data).hexdigest())
+
+def file_etag(path):
+    # The SHA-1 of the content, the device's reply cache compares it in full
+    st = os.stat(path)
+    cached = _etags.get(path)
+    if cached and cached[0] == (st.st_mtime, st.st_size):
+        return cached[1]
+    h = hashlib.sha1()
+    with open(path, 'rb') as f:
+        for block in iter(lambda: f.read(65536), b''):
+            h.update(block)
+    etag = '"{}"'.format(h.hexdigest())
+    _etags[path] = ((st.st_mtime, st.st_size), etag)
+    return etag
+
+def store_key(etag):
+    # The full SHA-1 digest the ETag carries, so two contents never share
+    # an entry
+    return etag.strip('"').decode('hex')
+
+class ReplyStore(object):
+    """MP3s by the SHA-1 of their content, bounded in bytes. Segmented
+    LRU: an entry starts on probation and is protected from its second hit
+    on, so a burst of one-off replies evicts other one-offs before the
+    replies that repeat. Protected entries past PROTECTED_SHARE go back on
+    probation."""
+    PROTECTED_SHARE = 0.8
+
+    def __init__(self, limit):
+        self.limit = limit
+        self.probation = collections.OrderedDict()
+        self.protected = collections.OrderedDict()
+        self.size = 0
+        self.protected_size = 0
+        self.lock = threading.Lock()
+        self.hits = self.misses = self.evictions = 0
+
+    def get(self, key):
+        with self.lock:
+            data = self.probation.pop(key, None)
+            if data is not None:
+                self.protected[key] = data
+                self.protected_size += len(data)
+                while self.protected_size > self.limit * self.PROTECTED_SHARE:
+                    old, old_data = self.protected.popitem(last=False)
+                    self.protected_size -= len(old_data)
+                    self.probation[old] = old_data
+            elif key in self.protected:
+                data = self.protected.pop(key)
+                self.protected[key] = data
+            if data is None:
+                self.misses += 1
+            else:
+                self.hits += 1
+            return data
+
+    def put(self, key, data):
+        # A reply larger than a quarter of the store would flush it
+        if not self.limit or len(data) > self.limit / 4:
+            return
+        with self.lock:
+            if key in self.probation or key in self.protected:
+                return
+            self.probation[key] = data
+            self.size += len(data)
+            while self.size > self.limit:
+                segment = self.probation or self.protected
+                old, old_data = segment.popitem(last=False)
+                self.size -= len(old_data)
+                if segment is self.protected:
+                    self.protected_size -= len(old_data)
+                self.evictions += 1
+
+    def stats(self):
+        with self.lock:
+            lookups = self.hits + self.misses
+            return {'limit_bytes': self.limit, 'bytes': self.size,
+                    'entries': len(self.probation) + len(self.protected),
+                    'protected': len(self.protected), 'hits': self.hits,
+                    'misses': self.misses, 'evictions': self.evictions,
+                    'hit_rate': round(float(self.hits) / lookups, 4)
+                                if lookups else None}
+
+store = ReplyStore(REPLY_STORE_BYTES)
+
+
+class ServeStats(object):
+    """Time to first body byte of the last responses, and their rate"""
+    WINDOW = 10.0
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.recent = collections.deque(maxlen=4096)
+        self.requests = 0
+
+    def add(self, ttfb):
+        with self.lock:
+            self.recent.append((time.time(), ttfb))
+            self.requests += 1
+
+    def stats(self):
+        now = time.time()
+        with self.lock:
+            recent = list(self.recent)
+            requests = self.requests
+        # Shorter when the first response kept is more recent
+        window = min(self.WINDOW, now - recent[0][0]) if recent else 0
+        ttfb = sorted(t for _, t in recent)
+        pct = lambda p: (round(ttfb[min(len(ttfb) - 1, int(len(ttfb) * p))]
+                               * 1000, 3) if ttfb else None)
+        return {'requests': requests,
+                'rps': round(sum(1 for t, _ in recent if now - t <= window) /
+                             window, 1) if window > 0 else None,
+                'ttfb_ms_p50': pct(0.5), 'ttfb_ms_p90': pct(0.9),
+                'ttfb_ms_p99': pct(0.99)}
+
+serve_stats = ServeStats()
+
+
+def write_chunked(sock, data, head=''):
+    # Slices of a memoryview go to the socket without a copy of the reply,
+    # the socket's file object would str() them. Python 2 has no
+    # os.sendfile, and the bytes are in memory anyway. The response head
+    # and each chunk's framing go out in one write.
+    view = memoryview(data)
+    prefix = head
+    for i in range(0, len(view), REPLY_STORE_CHUNK):
+        chunk = view[i:i + REPLY_STORE_CHUNK]
+        sock.sendall(prefix + '{:x}\r\n'.format(len(chunk)))
+        sock.sendall(chunk)
+        prefix = '\r\n'
+    sock.sendall(prefix + '0\r\n\r\n')
+
+
+def tts_stand_in(source, reply_id):
+    with open(source, 'rb') as f:
+        data = f.read()
+    return data + 'TAG' + 'reply {}'.format(reply_id).ljust(125, '\0')
+
+
+class Reply(object):
+    def __init__(self, reply_id, source):
+        self.id = reply_id
+        self.path = os.path.join(REPLY_DIR, reply_id + '.mp3')
+        self.created = time.time()
+        # What will be said and its content address, known before it is
+        # generated
+        self.body = tts_stand_in(source, reply_id)
+        self.etag = data_etag(self.body)
+        self.done = False
+        self.evicted = False
+        self.cond = threading.Condition()
+        self.thread = threading.Thread(target=self._generate)
+        self.thread.daemon = True
+        # Exists before the id is handed out, the GET may come first
+        open(self.path, 'wb').close()
+
+    def _generate(self):
+        step = TTS_BYTES_PER_SEC / 10
+        with open(self.path, 'wb') as dst:
+            for at in range(0, len(self.body), step):
+                if self.evicted:
+                    break
+                time.sleep(0.1)
+                dst.write(self.body[at:at + step])
+                dst.flush()
+                with self.cond:
+                    self.cond.notify_all()
+        if not self.evicted:
+            store.put(store_key(self.etag), self.body)
+        with self.cond:
+            self.done = True
+            self.cond.notify_all()
+            if self.evicted:
+                os.remove(self.path)
+
+    def evict(self):
+        # A reply still being generated is removed by its generator
+        with self.cond:
+            self.evicted = True
+            if self.done and os.path.exists(self.path):
+                os.remove(self.path)
+
+    def stream(self, handler, head):
+        # In the store once generated, until the store drops it
+        data = store.get(store_key(self.etag)) if self.done else None
+        if data is not None:
+            handler._first_byte()
+            return write_chunked(handler.connection, data, head)
+        wfile = handler.wfile
+        wfile.write(head)
+        sent = 0
+        with open(self.path, 'rb') as f:
+            while True:
+                block = f.read(4096)
+                if block:
+                    if not sent:
+                        handler._first_byte()
+                    wfile.write('{:x}\r\n'.format(len(block)) + block + '\r\n')
+                    sent += len(block)
+                    continue
+                # The open file outlives an eviction, its path does not
+                with self.cond:
+                    if self.done and os.fstat(f.fileno()).st_size == sent:
+                        break
+                    self.cond.wait(1.0)
+        wfile.write('0\r\n\r\n')
+
+
+replies = {}
+replies_order = []
+replies_lock = threading.Lock()
+
+def new_reply():
+    if not os.path.isdir(REPLY_DIR):
+        os.makedirs(REPLY_DIR)
+    reply = Reply(uuid.uuid4().hex[:12], REPLY_SOURCE)
+    with replies_lock:
+        replies[reply.id] = reply
+        replies_order.append(reply.id)
+        while (len(replies_order) > REPLY_KEEP and
+               reply.created - replies[replies_order[0]].created >
+               REPLY_KEEP_S):
+            replies.pop(replies_order.pop(0)).evict()
+    reply.thread.start()
+    return reply
+
+def find_reply(path):
+    parts = path.strip('/').split('/')
+    if len(parts) != 3 or '/'.join(parts[:2]) != REPLY_DIR:
+        return None
+    with replies_lock:
+        return replies.get(parts[2])
+
+
+# Control channel stand-in (main/m_ctrl.h): devices keep a WebSocket open on
+# /ai/ctrl, commands are pushed to all of them with
+#   curl -d http://host/x.mp3 http://localhost:8000/ai/ctrl/play
+#   curl -d 40 http://localhost:8000/ai/ctrl/volume
+#   curl -X POST http://localhost:8000/ai/ctrl/reply  (a new reply, as a reminder)
+#   curl -X POST http://localhost:8000/ai/ctrl/group  (a new reply, all in step)
+# each with -H "Authorization: Bearer $CTRL_TOKEN". Pushes are refused
+# until CTRL_TOKEN is set, the tools/ scripts send it from the environment.
+CTRL_PATH = 'ai/ctrl'
+CTRL_TOKEN = os.environ.get('CTRL_TOKEN', '')
+CTRL_IDLE_TIMEOUT = 300
+WS_CONTROL_MAX = 125  # RFC 6455 5.5
+WS_CLOSE_PROTOCOL_ERROR = 1002
+(CTRL_HELLO, CTRL_HEARTBEAT, CTRL_ACK, CTRL_PLAY, CTRL_VOLUME, CTRL_PLAY_AT,
+ CTRL_SYNC_REPORT, CTRL_END_OF_UTTERANCE) = range(1, 9)
+WS_GUID = '258EAFA5-E914-47DA-95CA-C5AB0DC85B11'
+WS_BINARY, WS_CLOSE, WS_PING, WS_PONG = 0x2, 0x8, 0x9, 0xA
+
+class CtrlClient(object):
+    def __init__(self, handler):
+        self.rfile = handler.rfile
+        self.wfile = handler.wfile
+        # Reply URLs pushed to the device use the address it connected to
+        self.host = handler.headers.get('Host', '')
+        self.name = handler.client_address[0]
+        self.addr = handler.client_address[0]
+        self.lock = threading.Lock()
+        self.seq = 0
+
+    def _read(self, n):
+        data = self.rfile.read(n)
+        if len(data) < n:
+            raise EOFError
+        return data
+
+    def read_frame(self):
+        b0, b1 = struct.unpack('BB', self._read(2))
+        length = b1 & 0x7f
+        if length == 126:
+            length, = struct.unpack('>H', self._read(2))
+        elif length == 127:
+            length, = struct.unpack('>Q', self._read(8))
+        mask = bytearray(self._read(4)) if b1 & 0x80 else None
+        data = bytearray(self._read(length))
+        if mask:
+            for i in range(length):
+                data[i] ^= mask[i % 4]
+        return b0 & 0x0f, bytes(data)
+
+    def send_frame(self, opcode, payload):
+        if len(payload) < 126:
+            header = struct.pack('BB', 0x80 | opcode, len(payload))
+        else:
+            header = struct.pack('>BBH', 0x80 | opcode, 126, len(payload))
+        with self.lock:
+            self.wfile.write(header + payload)
+            self.wfile.flush()
+
+    def send(self, msg_type, payload):
+        with self.lock:
+            self.seq = (self.seq + 1) & 0xff
+            seq = self.seq
+        self.send_frame(WS_BINARY, struct.pack('BB', msg_type, seq) + payload)
+        return seq
+
+    def serve(self):
+        while True:
+            opcode, data = self.read_frame()
+            if opcode >= WS_CLOSE and len(data) > WS_CONTROL_MAX:
+                print('ctrl: {} sent a {} byte control frame'.format(
+                    self.name, len(data)))
+                self.send_frame(WS_CLOSE,
+                                struct.pack('>H', WS_CLOSE_PROTOCOL_ERROR))
+                return
+            if opcode == WS_CLOSE:
+                self.send_frame(WS_CLOSE, data[:2])
+                return
+            if opcode == WS_PING:
+                self.send_frame(WS_PONG, data)
+                continue
+            if opcode != WS_BINARY or len(data) < 2:
+                continue
+            msg_type, seq = struct.unpack('BB', data[:2])
+            payload = bytearray(data[2:])
+            if msg_type == CTRL_HEARTBEAT:
+                self.send_frame(WS_BINARY, data)
+            elif msg_type == CTRL_HELLO:
+                mac = ':'.join('{:02x}'.format(b) for b in payload)
+                print('ctrl: {} connected, MAC {}'.format(self.name, mac))
+                self.name = '{}/{}'.format(self.name, mac)
+            elif msg_type == CTRL_SYNC_REPORT:
+                sync_report(self.name, bytes(payload))
+            elif msg_type == CTRL_ACK:
+                print('ctrl: {} acked seq {}, status {}'.format(
+                    self.name, seq, payload[0] if payload else None))
+
+
+ctrl_clients = []
+ctrl_lock = threading.Lock()
+
+
+# Streaming recognizer stand-in: the utterance is final once EOU_AFTER_MS
+# of audio has been uploaded (0 never is). The device uploading from the
+# same address is told over its control channel and stops recording early.
+#   EOU_AFTER_MS=800 python server.py
+EOU_AFTER_MS = int(os.environ.get('EOU_AFTER_MS', 1500))
+
+class Recognizer(object):
+    def __init__(self, rate, bits, channels):
+        self.bytes_per_ms = rate * bits * channels / 8000.0
+        self.bytes = 0
+        self.final = False
+
+    def audio_ms(self):
+        return int(self.bytes / self.bytes_per_ms) if self.bytes_per_ms else 0
+
+    # True once, for the chunk that completes the utterance
+    def feed(self, n):
+        self.bytes += n
+        if self.final or not EOU_AFTER_MS or self.audio_ms() < EOU_AFTER_MS:
+            return False
+        self.final = True
+        return True
+
+def ctrl_end_of_utterance(addr, audio_ms):
+    with ctrl_lock:
+        clients = [c for c in ctrl_clients if c.addr == addr]
+    for client in clients:
+        try:
+            seq = client.send(CTRL_END_OF_UTTERANCE,
+                              struct.pack('<I', audio_ms))
+        except socket.error:
+            continue
+        print('ctrl: {} end of utterance after {} ms, seq {}'.format(
+            client.name, audio_ms, seq))
+    return len(clients)
+
+
+# Group clock (main/m_sync.h): devices sample this clock over UDP, a group
+# play starts GROUP_LEAD_US ahead so every device has fetched and decoded
+# its first frames. Their reports are printed as the skew of the group:
+# self-reported, each device's own error against its own clock estimate,
+# so an error in that estimate does not show. tools/sync_sim.py measures
+# the true skew of simulated devices.
+SYNC_PORT = int(os.environ.get('SYNC_PORT', 8001))
+SYNC_REQUEST, SYNC_RESPONSE = 1, 2
+SYNC_REQUEST_FORMAT = '<BBHq'
+SYNC_RESPONSE_FORMAT = '<BBHqqq'
+SYNC_REPORT_FORMAT = '<HiIiII'
+SYNC_REPORT_LIVE = 2.0
+GROUP_LEAD_US = 1500000
+
+def now_us():
+    return int(time.time() * 1000000)
+
+def sync_serve():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((HOST, SYNC_PORT))
+    size = struct.calcsize(SYNC_REQUEST_FORMAT)
+    while True:
+        data, addr = sock.recvfrom(64)
+        t2 = now_us()
+        if len(data) != size:
+            continue
+        msg_type, version, seq, t1 = struct.unpack(SYNC_REQUEST_FORMAT, data)
+        if msg_type != SYNC_REQUEST:
+            continue
+        sock.sendto(struct.pack(SYNC_RESPONSE_FORMAT, SYNC_RESPONSE, version,
+                                seq, t1, t2, now_us()), addr)
+
+groups = {}
+group_printed = {}
+group_next = [1]
+group_lock = threading.Lock()
+
+def new_group():
+    with group_lock:
+        group = group_next[0]
+        group_next[0] = group % 0xffff + 1
+        groups.pop(group, None)
+    return group
+
+def sync_report(name, payload):
+    if len(payload) != struct.calcsize(SYNC_REPORT_FORMAT):
+        return
+    group, error, uncertainty, drift, inserted, dropped = struct.unpack(
+        SYNC_REPORT_FORMAT, payload)
+    now = time.time()
+    with group_lock:
+        devices = groups.setdefault(group, {})
+        devices[name] = (now, error, uncertainty, inserted, dropped)
+        live = [r for r in devices.values() if now - r[0] < SYNC_REPORT_LIVE]
+        if now - group_printed.get(group, 0) < 1:
+            return
+        group_printed[group] = now
+    errors = [r[1] for r in live]
+    print('sync: group {} on {} devices, self-reported skew {} us, '
+          'error {}..{} us, uncertainty {} us, frames +{} -{}'.format(
+              group, len(live), max(errors) - min(errors), min(errors),
+              max(errors), max(r[2] for r in live),
+              sum(r[3] for r in live), sum(r[4] for r in live)))
+
+def ctrl_authorized(header):
+    scheme, _, token = header.partition(' ')
+    return (bool(CTRL_TOKEN) and scheme.lower() == 'bearer' and
+            hmac.compare_digest(token.strip(), CTRL_TOKEN))
+
+# Raises ValueError for a body the device would refuse
+def ctrl_push(cmd, body):
+    if cmd not in ('play', 'volume', 'reply', 'group'):
+        return None
+    if cmd == 'volume':
+        if not body.isdigit() or int(body) > 100:
+            raise ValueError('volume is an integer from 0 to 100')
+    elif cmd == 'play' and not body:
+        raise ValueError('play needs a URL')
+    if cmd == 'reply' or (cmd == 'group' and not body):
+        reply = new_reply()
+    if cmd == 'group':
+        group = new_group()
+        start = now_us() + GROUP_LEAD_US
+    with ctrl_lock:
+        clients = list(ctrl_clients)
+    pushed = []
+    for client in clients:
+        if cmd == 'play':
+            msg = (CTRL_PLAY, body)
+        elif cmd == 'reply':
+            msg = (CTRL_PLAY, 'http://{}/{}/{}'.format(client.host, REPLY_DIR,
+                                                      reply.id))
+        elif cmd == 'group':
+            url = body or 'http://{}/{}/{}'.format(client.host, REPLY_DIR,
+                                                   reply.id)
+            msg = (CTRL_PLAY_AT, struct.pack('<QH', start, group) + url)
+        else:
+            msg = (CTRL_VOLUME, struct.pack('B', int(body)))
+        try:
+            seq = client.send(*msg)
+        except socket.error:
+            continue
+        pushed.append('{} seq {}'.format(client.name, seq))
+    return pushed
+
+
+# TLS for the upload and reply streams (CONFIG_TLS_ENABLE) on TLS_PORT,
+# with the lab certificate from tools/tls/mkcerts.sh, not started until
+# the script made it. Sessions resume by ID and by ticket; POST 0 to
+# /ai/tls/resume makes every handshake a full one to compare against, 1
+# turns resumption back on.
+TLS_PORT = int(os.environ.get('TLS_PORT', 8443))
+TLS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'tools',
+                       'tls')
+TLS_CERT = os.environ.get('TLS_CERT', os.path.join(TLS_DIR, 'server_cert.pem'))
+TLS_KEY = os.environ.get('TLS_KEY', os.path.join(TLS_DIR, 'server_key.pem'))
+TLS_PATH = 'ai/tls/resume'
+tls_resume = os.environ.get('TLS_RESUME', '1') != '0'
+
+def tls_context():
+    ctx = ssl.SSLContext(ssl.PROTOCOL_SSLv23)
+    ctx.options |= ssl.OP_NO_SSLv2 | ssl.OP_NO_SSLv3
+    ctx.load_cert_chain(TLS_CERT, TLS_KEY)
+    return ctx
+
+
 class Handler(SimpleHTTPServer.SimpleHTTPRequestHandler):
+    etag = None
+    start = None
+
+    def parse_request(self):
+        self.start = time.time()
+        return SimpleHTTPServer.SimpleHTTPRequestHandler.parse_request(self)
+
+    def _first_byte(self):
+        serve_stats.add(time.time() - self.start)
+
+    def end_headers(self):
+        if self.etag:
+            self.send_header('ETag', self.etag)
+        SimpleHTTPServer.SimpleHTTPRequestHandler.end_headers(self)
+
+    def _etag_matches(self):
+        tags = [t.strip() for t in self.headers.get('If-None-Match', '').split(',')]
+        return '*' in tags or self.etag in tags or 'W/' + self.etag in tags
+
+    def do_GET(self):
+        if (urlparse.urlparse(self.path).path.strip('/') == CTRL_PATH
+            and self.headers.get('Upgrade', '').lower() == 'websocket'):
+            return self._serve_ctrl()
+        if urlparse.urlparse(self.path).path.strip('/') == STORE_PATH:
+            stats = dict(store.stats(), **serve_stats.stats())
+            body = json.dumps(stats, indent=2, sort_keys=True,
+                              separators=(',', ': ')) + '\n'
+            self._set_headers(len(body))
+            self.wfile.write(body)
+            return
+        return SimpleHTTPServer.SimpleHTTPRequestHandler.do_GET(self)
+
+    def _serve_ctrl(self):
+        key = self.headers.get('Sec-WebSocket-Key', '')
+        accept = base64.b64encode(hashlib.sha1(key + WS_GUID).digest())
+        self.protocol_version = 'HTTP/1.1'
+        self.close_connection = 1
+        self.send_response(101, 'Switching Protocols')
+        self.send_header('Upgrade', 'websocket')
+        self.send_header('Connection', 'Upgrade')
+        self.send_header('Sec-WebSocket-Accept', accept)
+        self.end_headers()
+        self.wfile.flush()
+        self.connection.settimeout(CTRL_IDLE_TIMEOUT)
+        client = CtrlClient(self)
+        with ctrl_lock:
+            ctrl_clients.append(client)
+        try:
+            client.serve()
+        except (EOFError, socket.error):
+            pass
+        finally:
+            with ctrl_lock:
+                ctrl_clients.remove(client)
+            print('ctrl: {} disconnected'.format(client.name))
+
+    # GET and HEAD of files carry an ETag, If-None-Match answers 304
+    def send_head(self):
+        reply = find_reply(urlparse.urlparse(self.path).path)
+        if reply:
+            return self._send_reply_head(reply)
+        path = self.translate_path(self.path)
+        if os.path.isfile(path):
+            self.etag = file_etag(path)
+            if self._etag_matches():
+                self.send_response(304)
+                self.end_headers()
+                return None
+            if store.limit and path.endswith('.mp3'):
+                return self._send_stored(path)
+        return SimpleHTTPServer.SimpleHTTPRequestHandler.send_head(self)
+
+    def copyfile(self, source, outputfile):
+        block = source.read(16 * 1024)
+        self._first_byte()
+        while block:
+            outputfile.write(block)
+            block = source.read(16 * 1024)
+
+    # Status and headers of a chunked MP3, returned to be sent with the
+    # body: Python 2 writes every header line to the socket on its own
+    def _send_chunked_head(self):
+        self.protocol_version = 'HTTP/1.1'
+        self.close_connection = 1
+        # The chunk framing is small writes, they must not wait for ACKs
+        self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        wfile, self.wfile = self.wfile, cStringIO.StringIO()
+        try:
+            self.send_response(200)
+            self.send_header('Content-type', 'audio/mpeg')
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.send_header('Connection', 'close')
+            self.end_headers()
+            return self.wfile.getvalue()
+        finally:
+            self.wfile = wfile
+
+    # An MP3 is read from disk once, then served from the store by ETag.
+    # HEAD sends the chunked head only: nothing is read, counted or
+    # promoted for it.
+    def _send_stored(self, path):
+        head = self._send_chunked_head()
+        if self.command != 'GET':
+            self.connection.sendall(head)
+            return None
+        key = store_key(self.etag)
+        data = store.get(key)
+        if data is None:
+            with open(path, 'rb') as f:
+                data = f.read()
+            # Not if the file was replaced since its ETag was taken
+            if data_etag(data) == self.etag:
+                store.put(key, data)
+        self._first_byte()
+        write_chunked(self.connection, data, head)
+        return None
+
+    # Per-request reply, chunked while it is still being generated
+    def _send_reply_head(self, reply):
+        self.etag = reply.etag
+        if self._etag_matches():
+            self.send_response(304)
+            self.end_headers()
+            return None
+        head = self._send_chunked_head()
+        if self.command == 'GET':
+            reply.stream(self, head)
+        else:
+            self.connection.sendall(head)
+        return None
+
     def _set_headers(self, length):
         self.send_response(200)
         if length > 0:
@@ -50,6 +705,8 @@ class Handler(SimpleHTTPServer.SimpleHTTPRequestHandler):
             sample_rates = self.headers.get('x-audio-sample-rates', '').lower()
 
             print("Audio information, sample rates: {}, bits: {}, channel(s): {}".format(sample_rates, bits, channel))
+            recognizer = Recognizer(int(sample_rates or 0), int(bits or 0),
+                                    int(channel or 0))
             # https://stackoverflow.com/questions/24500752/how-can-i-read-exactly-one-response-chunk-with-pythons-http-client
             while True:
                 chunk_size = self._get_chunk_size()
@@ -61,17 +718,96 @@ class Handler(SimpleHTTPServer.SimpleHTTPRequestHandler):
                 else:
                     chunk_data = self._get_chunk_data(chunk_size)
                     data += chunk_data
+                    if (recognizer.feed(chunk_size) and
+                        not ctrl_end_of_utterance(self.client_address[0],
+                                                  recognizer.audio_ms())):
+                        print('Final after {} ms, no control channel from {}'
+                              .format(recognizer.audio_ms(),
+                                      self.client_address[0]))
 
             filename = self._write_wav(data, int(sample_rates), int(bits), int(channel))
-            body = 'File {} was written, size {}'.format(filename, total_bytes)
+            reply = new_reply()
+            body = 'File {} was written, size {}\nreply_id: {}\n'.format(filename, total_bytes, reply.id)
             self._set_headers(len(body))
             self.wfile.write(body)
             self.wfile.close()
+        elif request_file_path == TLS_PATH:
+            global tls_resume
+            length = int(self.headers.get('Content-Length', 0))
+            tls_resume = self.rfile.read(length).strip() != '0'
+            body = 'resume {}\n'.format('on' if tls_resume else 'off')
+            print('tls: ' + body.strip())
+            self._set_headers(len(body))
+            self.wfile.write(body)
+        elif request_file_path.startswith(CTRL_PATH + '/'):
+            length = int(self.headers.get('Content-Length', 0))
+            body = self.rfile.read(length).strip()
+            if not CTRL_TOKEN:
+                self.send_error(403, 'Set CTRL_TOKEN to allow pushes')
+                return
+            if not ctrl_authorized(self.headers.get('Authorization', '')):
+                self.send_error(401, 'Wrong or missing bearer token')
+                return
+            try:
+                pushed = ctrl_push(request_file_path[len(CTRL_PATH) + 1:],
+                                   body)
+            except ValueError as e:
+                self.send_error(400, str(e))
+                return
+            if pushed is None:
+                self.send_error(404, 'Unknown control command')
+                return
+            body = ''.join(line + '\n' for line in pushed) or 'No device\n'
+            self._set_headers(len(body))
+            self.wfile.write(body)
         else:
             return SimpleHTTPServer.SimpleHTTPRequestHandler.do_GET(self)
 
-httpd = BaseHTTPServer.HTTPServer((HOST, PORT), Handler)
+class ThreadingServer(SocketServer.ThreadingMixIn, BaseHTTPServer.HTTPServer):
+    daemon_threads = True
+    # Connections from many devices at once wait here instead of being
+    # dropped and retried a second later with the default backlog of 5
+    request_queue_size = 128
+
+class TLSServer(ThreadingServer):
+    def __init__(self, address, handler):
+        self.context = tls_context()
+        ThreadingServer.__init__(self, address, handler)
+
+    def get_request(self):
+        sock, addr = self.socket.accept()
+        # A new context has an empty session cache and new ticket keys.
+        # The handshake happens on the first read, in the request's thread.
+        ctx = self.context if tls_resume else tls_context()
+        return ctx.wrap_socket(sock, server_side=True,
+                               do_handshake_on_connect=False), addr
+
+    def shutdown_request(self, request):
+        # OpenSSL drops the session from its cache unless close_notify
+        # was sent
+        try:
+            request.settimeout(1)
+            request = request.unwrap()
+        except (ssl.SSLError, socket.error, ValueError):
+            pass
+        ThreadingServer.shutdown_request(self, request)
+
+httpd = ThreadingServer((HOST, PORT), Handler)
+sync_thread = threading.Thread(target=sync_serve)
+sync_thread.daemon = True
+sync_thread.start()
+
+if os.path.exists(TLS_CERT) and os.path.exists(TLS_KEY):
+    tlsd = TLSServer((HOST, TLS_PORT), Handler)
+    tls_thread = threading.Thread(target=tlsd.serve_forever)
+    tls_thread.daemon = True
+    tls_thread.start()
+    print("Serving HTTPS on {} port {}, resumption {}".format(
+        HOST, TLS_PORT, 'on' if tls_resume else 'off'))
+else:
+    print("No HTTPS: {} missing, run tools/tls/mkcerts.sh".format(TLS_CERT))
 
-print("Serving HTTP on {} port {}".format(HOST, PORT));
+print("Serving HTTP on {} port {}, group clock on UDP {}".format(
+    HOST, PORT, SYNC_PORT));
 httpd.serve_forever()
 
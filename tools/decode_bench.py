@@ -0,0 +1,261 @@
+#!/usr/bin/env python
+# Playback decode benchmark: prepare the SD card and check the DECODE_BENCH
+# lines the device prints (CONFIG_DECODE_BENCH_ENABLE, see
+# main/m_decode_bench.h) against stored golden outputs.
+#
+# Usage:
+#   python decode_bench.py prepare ./card --reply reply.mp3 \
+#       --server http://192.168.0.174:8000 --server-root .
+#       copy ./card/BENCH to the SD card root; replies are served by
+#       server.py from <server-root>/ai/bench/
+#   python decode_bench.py report console.log -o bench.json
+#   python decode_bench.py report console.log --update-golden
+#       after a change that is meant to alter the decoded PCM
+#
+# report exits non-zero when a checksum differs from the golden one, a
+# source failed or decoded differently between runs, a golden source is
+# missing, or chain time per frame or the real-time factor of the local
+# chains got worse by more than --tolerance. Chain time is the wall time
+# of the whole chain, reader to sink, per MP3 frame.
+#
+# tools/decode_golden.json is committed empty: the goldens come from the
+# first known-good device run with --update-golden. Until then report
+# only checks that every source decoded, the same on every run. The mp3 decoder only exists
+# as an ESP32 library, so the device decodes and this script compares.
+#
+# prepare also lists every sample rate of the sources for the output
+# resampler, the same prebuilt ESP32 library. The device runs a tone at
+# each rate through every complexity; report prints SNR and CPU load per
+# rate and complexity and fails when the SNR drops by more than
+# --snr-tolerance dB or the time per second of output grows by more than
+# --tolerance against the golden ones.
+import os, sys, json, shutil, argparse
+
+TOOLS = os.path.dirname(os.path.abspath(__file__))
+GOLDEN = os.path.join(TOOLS, 'decode_golden.json')
+PROMPTS = ['enwozai', 'youshenmefenfu', 'zainenishuo', 'wlydkqcxlj']
+TIMED_CHAINS = ('sd', 'prompt')  # http timing depends on the network
+MPEG_RATES = {3: (44100, 48000, 32000), 2: (22050, 24000, 16000),
+              0: (11025, 12000, 8000)}
+
+
+def mp3_format(path):
+    """(rate, channels) of the first MPEG audio frame, None without one"""
+    with open(path, 'rb') as f:
+        data = bytearray(f.read(65536))
+    at = 0
+    if data[:3] == b'ID3':
+        at = 10 + ((data[6] & 0x7F) << 21 | (data[7] & 0x7F) << 14 |
+                   (data[8] & 0x7F) << 7 | (data[9] & 0x7F))
+    for i in range(at, len(data) - 3):
+        h = data[i:i + 4]
+        version = (h[1] >> 3) & 3
+        rate = (h[2] >> 2) & 3
+        if (h[0] == 0xFF and (h[1] & 0xE0) == 0xE0 and version in MPEG_RATES
+                and rate != 3 and (h[2] >> 4) not in (0, 15)):
+            return MPEG_RATES[version][rate], 1 if h[3] >> 6 == 3 else 2
+    return None
+
+
+# The card has no long file names
+def short_name(i, path):
+    base = os.path.splitext(os.path.basename(path))[0]
+    base = ''.join(c for c in base.upper() if c.isalnum())[:6] or 'SRC'
+    return '{}{:02d}.MP3'.format(base, i)
+
+
+def prepare(args):
+    out = os.path.join(args.out, 'BENCH')
+    if not os.path.isdir(out):
+        os.makedirs(out)
+    rows = []
+    files = args.file or [os.path.join(TOOLS, n + '.mp3')
+                          for n in ['zale'] + PROMPTS]
+    formats = set()
+    for path in (files + [os.path.join(TOOLS, n + '.mp3') for n in PROMPTS] +
+                 (args.reply or [])):
+        fmt = mp3_format(path)
+        if fmt:
+            formats.add(fmt)
+    for i, path in enumerate(files):
+        name = short_name(i, path)
+        shutil.copyfile(path, os.path.join(out, name))
+        rows.append(('sd', name))
+    for name in PROMPTS:
+        rows.append(('prompt', '/spiffs/{}.mp3'.format(name)))
+    if args.reply:
+        if not args.server:
+            raise SystemExit('--reply needs --server')
+        bench = os.path.join(args.server_root, 'ai', 'bench')
+        if not os.path.isdir(bench):
+            os.makedirs(bench)
+        for i, path in enumerate(args.reply):
+            name = 'r{}.mp3'.format(i)
+            shutil.copyfile(path, os.path.join(bench, name))
+            rows.append(('http', '{}/ai/bench/{}'.format(
+                args.server.rstrip('/'), name)))
+    for fmt in args.rsp:
+        rate, _, channels = fmt.partition('/')
+        formats.add((int(rate), int(channels or 2)))
+    for rate, channels in sorted(formats):
+        rows.append(('rsp', '{} {}'.format(rate, channels)))
+    with open(os.path.join(out, 'INDEX.TXT'), 'w') as f:
+        for chain, source in rows:
+            f.write('{} {}\n'.format(chain, source))
+    for chain, source in rows:
+        print('  {:6} {}'.format(chain, source))
+    print('{} sources in {}'.format(len(rows), out))
+
+
+def read_log(path):
+    records = []
+    with open(path) as f:
+        for line in f:
+            pos = line.find('DECODE_BENCH {')
+            if pos >= 0:
+                records.append(json.loads(line[pos + len('DECODE_BENCH '):]))
+    return records
+
+
+# The PCM depends on the output format the build resamples to, so that is
+# part of the key; URLs are keyed by path, the server address changes
+def source_key(r):
+    if r['type'] == 'resample':
+        return 'rsp|{}/{}->{}|c{}|{}Hz'.format(
+            r['rate'], r['channels'], r['out_rate'], r['complexity'],
+            r['tone_hz'])
+    source = r['source']
+    if r['chain'] == 'http':
+        source = '/' + source.split('://', 1)[-1].partition('/')[2]
+    key = '{}|{}'.format(r['chain'], source)
+    if r.get('ok'):
+        key += '|{}/{}'.format(r['out_rate'], r['out_channels'])
+    return key
+
+
+def check(results, golden, args):
+    failed = []
+    for key, r in sorted(results.items()):
+        if not r['ok']:
+            failed.append('{}: failed on the device'.format(key))
+        elif r['type'] == 'resample':
+            continue
+        elif not r['stable']:
+            failed.append('{}: PCM differs between runs'.format(key))
+    for key, g in sorted(golden.items()):
+        r = results.get(key)
+        if r is None or not r['ok']:
+            if r is None:
+                failed.append('{}: missing'.format(key))
+            continue
+        if r['type'] == 'resample':
+            if r['snr_db'] < g['snr_db'] - args.snr_tolerance:
+                failed.append('{}: snr_db {} -> {}'.format(key, g['snr_db'],
+                                                          r['snr_db']))
+            if r['us_per_s'] > g['us_per_s'] * (1 + args.tolerance):
+                failed.append('{}: us_per_s {} -> {}'.format(
+                    key, g['us_per_s'], r['us_per_s']))
+            continue
+        if r['crc32'] != g['crc32'] or r['bytes'] != g['bytes']:
+            failed.append('{}: PCM {} ({} bytes) -> {} ({} bytes)'.format(
+                key, g['crc32'], g['bytes'], r['crc32'], r['bytes']))
+        if r['chain'] not in TIMED_CHAINS:
+            continue
+        for name in ('chain_us_per_frame', 'rtf'):
+            if r[name] > g[name] * (1 + args.tolerance):
+                failed.append('{}: {} {} -> {}'.format(key, name, g[name],
+                                                       r[name]))
+    return failed
+
+
+def report(args):
+    records = read_log(args.log)
+    start = [r for r in records if r['type'] == 'start']
+    if not start:
+        raise SystemExit('no DECODE_BENCH lines in {}'.format(args.log))
+    if not [r for r in records if r['type'] == 'end']:
+        sys.stderr.write('warning: log ends before the benchmark did\n')
+    results = dict((source_key(r), r) for r in records
+                   if r['type'] in ('source', 'resample'))
+    text = json.dumps({'cpu_mhz': start[-1]['cpu_mhz'],
+                       'sources': results}, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+    for key, r in sorted(results.items()):
+        if r['ok'] and r['type'] == 'resample':
+            # us of resampler time per second of output is a load in 1e-4
+            sys.stderr.write('{:48} snr {:6.1f} dB  load {:5.2f} %\n'.format(
+                key, r['snr_db'], r['us_per_s'] / 1e4))
+        elif r['ok']:
+            sys.stderr.write('{:48} {:8.1f} chain us/frame  rtf {:.4f}\n'
+                             .format(key, r['chain_us_per_frame'], r['rtf']))
+    if args.update_golden:
+        golden = {}
+        for k, r in results.items():
+            if r['ok'] and r['type'] == 'resample':
+                golden[k] = dict((n, r[n]) for n in ('snr_db', 'us_per_s'))
+            elif r['ok'] and r['stable']:
+                golden[k] = dict((n, r[n]) for n in
+                                 ('bytes', 'crc32', 'chain_us_per_frame',
+                                  'rtf'))
+        with open(args.golden, 'w') as f:
+            json.dump(golden, f, indent=2, sort_keys=True)
+            f.write('\n')
+        print('{} sources written to {}'.format(len(golden), args.golden))
+        return
+    if not os.path.exists(args.golden):
+        raise SystemExit('no {}, record it with --update-golden'.format(
+            args.golden))
+    with open(args.golden) as f:
+        golden = json.load(f)
+    if not golden:
+        sys.stderr.write('warning: no goldens in {}, record them from a '
+                         'known-good run with --update-golden\n'.format(
+                             args.golden))
+    failed = check(results, golden, args)
+    for line in failed:
+        sys.stderr.write('regression {}\n'.format(line))
+    if failed:
+        sys.exit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Playback decode benchmark')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('prepare', help='write the sources for the SD card')
+    p.add_argument('out', help='directory that receives BENCH/')
+    p.add_argument('--file', action='append',
+                   help='MP3 for the sd chain, default the ones in tools/')
+    p.add_argument('--reply', action='append',
+                   help='MP3 the http chain fetches from the server')
+    p.add_argument('--server', help='server.py address as the device sees it')
+    p.add_argument('--server-root', default='.',
+                   help='directory server.py serves from')
+    p.add_argument('--rsp', action='append', default=['24000/1', '44100/2'],
+                   help='RATE/CHANNELS for the resampler besides the rates '
+                        'of the sources, default 24 kHz TTS, 44.1 kHz music')
+    p.set_defaults(func=prepare)
+    p = sub.add_parser('report', help='check a device console log')
+    p.add_argument('log', help='console log holding the DECODE_BENCH lines')
+    p.add_argument('-o', '--output', help='write the JSON report here')
+    p.add_argument('--golden', default=GOLDEN,
+                   help='golden outputs, default tools/decode_golden.json')
+    p.add_argument('--update-golden', action='store_true',
+                   help='record this log as the golden outputs')
+    p.add_argument('--tolerance', type=float, default=0.10,
+                   help='allowed slowdown of us/frame, rtf and resampler '
+                        'time')
+    p.add_argument('--snr-tolerance', type=float, default=1.0,
+                   help='allowed resampler SNR drop in dB')
+    p.set_defaults(func=report)
+    args = parser.parse_args()
+    if not hasattr(args, 'func'):
+        parser.error('prepare or report')
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,185 @@
+/*
+ * Host check of the Prometheus text writer in main/m_metrics_text.c.
+ *
+ * Writes a snapshot like the device's and compares it with the expected
+ * text, checks every line against the exposition format grammar, and
+ * fills buffers of every size up to the snapshot to see that a short one
+ * is reported and never written past.
+ *
+ *   ./build/metrics_text_test
+ */
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "m_metrics_text.h"
+
+static const uint32_t s_bounds[] = {1000, 2000, 5000};
+static const uint32_t s_counts[] = {3, 0, 2, 1};
+
+static const char s_expected[] =
+    "# TYPE wake_total counter\n"
+    "wake_total 7\n"
+    "# TYPE heap_bytes gauge\n"
+    "heap_bytes{pipeline=\"asr\"} 51234\n"
+    "heap_bytes{pipeline=\"play\"} 0\n"
+    "# TYPE wifi_rssi_dbm gauge\n"
+    "wifi_rssi_dbm -67\n"
+    "# TYPE wake_detect_chunk_us histogram\n"
+    "wake_detect_chunk_us_bucket{le=\"1000\"} 3\n"
+    "wake_detect_chunk_us_bucket{le=\"2000\"} 3\n"
+    "wake_detect_chunk_us_bucket{le=\"5000\"} 5\n"
+    "wake_detect_chunk_us_bucket{le=\"+Inf\"} 6\n"
+    "wake_detect_chunk_us_sum 9100\n"
+    "wake_detect_chunk_us_count 6\n";
+
+static void snapshot(metrics_text_t* t) {
+    metrics_text_type(t, "wake_total", "counter");
+    metrics_text_value(t, "wake_total", NULL, 7);
+    metrics_text_type(t, "heap_bytes", "gauge");
+    metrics_text_value(t, "heap_bytes", "pipeline=\"asr\"", 51234);
+    metrics_text_value(t, "heap_bytes", "pipeline=\"play\"", 0);
+    metrics_text_type(t, "wifi_rssi_dbm", "gauge");
+    metrics_text_value(t, "wifi_rssi_dbm", NULL, -67);
+    metrics_text_hist(t, "wake_detect_chunk_us", s_bounds, s_counts, 3, 9100);
+}
+
+static int is_name(const char** p) {
+    const char* s = *p;
+    if (!isalpha((unsigned char)*s) && *s != '_' && *s != ':') {
+        return 0;
+    }
+    while (isalnum((unsigned char)*s) || *s == '_' || *s == ':') {
+        s++;
+    }
+    *p = s;
+    return 1;
+}
+
+// name{key="value",...} value, or "# TYPE name type"
+static int valid_line(const char* line) {
+    const char* p = line;
+    if (strncmp(p, "# TYPE ", 7) == 0) {
+        p += 7;
+        if (!is_name(&p) || *p++ != ' ') {
+            return 0;
+        }
+        return strcmp(p, "counter") == 0 || strcmp(p, "gauge") == 0 ||
+               strcmp(p, "histogram") == 0;
+    }
+    if (!is_name(&p)) {
+        return 0;
+    }
+    if (*p == '{') {
+        do {
+            p++;
+            if (!is_name(&p) || *p++ != '=' || *p++ != '"') {
+                return 0;
+            }
+            while (*p && *p != '"' && *p != '\\' && *p != '\n') {
+                p++;
+            }
+            if (*p++ != '"') {
+                return 0;
+            }
+        } while (*p == ',');
+        if (*p++ != '}') {
+            return 0;
+        }
+    }
+    if (*p++ != ' ') {
+        return 0;
+    }
+    if (*p == '-') {
+        p++;
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    while (isdigit((unsigned char)*p)) {
+        p++;
+    }
+    return *p == '\0';
+}
+
+static int check_format(const char* text) {
+    char line[256];
+    int n = 0;
+    while (*text) {
+        const char* end = strchr(text, '\n');
+        if (end == NULL) {
+            printf("FAIL format: no newline after \"%s\"\n", text);
+            return 1;
+        }
+        int len = end - text;
+        if (len >= (int)sizeof(line)) {
+            len = sizeof(line) - 1;
+        }
+        memcpy(line, text, len);
+        line[len] = '\0';
+        if (!valid_line(line)) {
+            printf("FAIL format: line %d \"%s\"\n", n + 1, line);
+            return 1;
+        }
+        text = end + 1;
+        n++;
+    }
+    printf("ok   format, %d lines\n", n);
+    return 0;
+}
+
+static int check_snapshot(void) {
+    char buf[1024];
+    metrics_text_t t;
+    metrics_text_init(&t, buf, sizeof(buf));
+    snapshot(&t);
+    if (!metrics_text_ok(&t) || t.len != strlen(s_expected) ||
+        strcmp(buf, s_expected) != 0) {
+        printf("FAIL snapshot:\n%s", buf);
+        return 1;
+    }
+    printf("ok   snapshot, %u bytes\n", (unsigned)t.len);
+    return check_format(buf);
+}
+
+// Every short buffer must fail, stay terminated and keep its guard bytes
+static int check_overflow(void) {
+    size_t need = strlen(s_expected);
+    char buf[1024 + 16];
+    for (size_t size = 0; size <= need + 1; size++) {
+        memset(buf, 0x5a, sizeof(buf));
+        metrics_text_t t;
+        metrics_text_init(&t, buf, size);
+        snapshot(&t);
+        int fits = size > need;
+        if (metrics_text_ok(&t) != fits) {
+            printf("FAIL overflow: %u byte buffer reported %s\n",
+                   (unsigned)size, fits ? "short" : "ok");
+            return 1;
+        }
+        if (size && buf[strnlen(buf, size - 1)] != '\0') {
+            printf("FAIL overflow: %u byte buffer not terminated\n",
+                   (unsigned)size);
+            return 1;
+        }
+        for (size_t i = size; i < size + 16; i++) {
+            if (buf[i] != 0x5a) {
+                printf("FAIL overflow: %u byte buffer written at %u\n",
+                       (unsigned)size, (unsigned)i);
+                return 1;
+            }
+        }
+    }
+    printf("ok   overflow, buffers of 0 to %u bytes\n", (unsigned)need + 1);
+    return 0;
+}
+
+int main(void) {
+    int failed = check_snapshot() + check_overflow();
+    if (failed) {
+        printf("%d metrics text checks failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
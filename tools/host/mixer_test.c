@@ -0,0 +1,209 @@
+/*
+ * Host check and benchmark of the mixer kernels in main/m_mixer_dsp.c.
+ *
+ * The check mixes random blocks through every kernel path (unity gain,
+ * constant gain, ramp, mono upmix, odd lengths, full scale) and compares
+ * them bit for bit with a plain per-sample reference mix, and with a
+ * floating point mix within the rounding of one LSB per input.
+ *
+ *   ./build/mixer_test           check
+ *   ./build/mixer_test --bench   also time a block of the device's mix
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "m_mixer_dsp.h"
+
+#define MAX_FRAMES 1024
+#define MAX_CH 2
+#define INPUTS 3
+
+typedef struct {
+    int16_t pcm[MAX_FRAMES * MAX_CH];
+    int ch;
+    int32_t gain;
+    int32_t step;
+} input_t;
+
+static uint32_t s_seed = 1;
+
+static int16_t rand16(void) {
+    s_seed = s_seed * 1103515245 + 12345;
+    return (int16_t)(s_seed >> 16);
+}
+
+static void fill(input_t* in, int frames, int full_scale) {
+    for (int i = 0; i < frames * in->ch; i++) {
+        in->pcm[i] = full_scale ? (i & 1 ? INT16_MIN : INT16_MAX) : rand16();
+    }
+}
+
+// What the kernels must compute: one multiply and shift per sample
+static void reference_mix(int16_t* out, const input_t* in, int in_num,
+                          int frames, int out_ch) {
+    for (int f = 0; f < frames; f++) {
+        for (int c = 0; c < out_ch; c++) {
+            int64_t acc = 0;
+            for (int i = 0; i < in_num; i++) {
+                int32_t gain = in[i].gain + in[i].step * f;
+                int16_t s = in[i].pcm[f * in[i].ch + (in[i].ch == 1 ? 0 : c)];
+                acc += ((int32_t)s * gain) >> 15;
+            }
+            out[f * out_ch + c] =
+                acc > INT16_MAX ? INT16_MAX : acc < INT16_MIN ? INT16_MIN : acc;
+        }
+    }
+}
+
+static void kernel_mix(int16_t* out, int32_t* acc, const input_t* in,
+                       int in_num, int frames, int out_ch) {
+    memset(acc, 0, frames * out_ch * sizeof(int32_t));
+    for (int i = 0; i < in_num; i++) {
+        mixer_accumulate_q15(acc, in[i].pcm, frames, in[i].ch, out_ch,
+                             in[i].gain, in[i].step);
+    }
+    mixer_saturate_q15(out, acc, frames * out_ch);
+}
+
+static int check_case(const char* name, input_t* in, int in_num, int frames,
+                      int out_ch) {
+    static int16_t ref[MAX_FRAMES * MAX_CH], out[MAX_FRAMES * MAX_CH];
+    static int32_t acc[MAX_FRAMES * MAX_CH];
+    reference_mix(ref, in, in_num, frames, out_ch);
+    kernel_mix(out, acc, in, in_num, frames, out_ch);
+    for (int i = 0; i < frames * out_ch; i++) {
+        if (out[i] != ref[i]) {
+            printf("FAIL %s: sample %d is %d, reference %d\n", name, i, out[i],
+                   ref[i]);
+            return 1;
+        }
+        // Against the exact mix: each input rounds down by less than 1 LSB
+        double exact = 0;
+        for (int k = 0; k < in_num; k++) {
+            int f = i / out_ch;
+            int c = in[k].ch == 1 ? 0 : i % out_ch;
+            exact += in[k].pcm[f * in[k].ch + c] *
+                     (double)(in[k].gain + in[k].step * f) / MIXER_GAIN_UNITY;
+        }
+        exact = fmax(INT16_MIN, fmin(INT16_MAX, exact));
+        if (out[i] > exact + 0.5 || out[i] < exact - in_num - 0.5) {
+            printf("FAIL %s: sample %d is %d, exact mix %.2f\n", name, i,
+                   out[i], exact);
+            return 1;
+        }
+    }
+    printf("ok   %s\n", name);
+    return 0;
+}
+
+static int check(void) {
+    static input_t in[INPUTS];
+    int failed = 0;
+    const int lengths[] = {1, 3, 4, 5, 255, 256, 257, MAX_FRAMES};
+    for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int frames = lengths[l];
+        char name[64];
+        for (int i = 0; i < INPUTS; i++) {
+            in[i].ch = 2;
+            fill(&in[i], frames, 0);
+        }
+        in[0].gain = MIXER_GAIN_UNITY, in[0].step = 0;
+        in[1].gain = MIXER_GAIN_UNITY / 4, in[1].step = 0;
+        in[2].gain = 0, in[2].step = MIXER_GAIN_UNITY / MAX_FRAMES;
+        snprintf(name, sizeof(name), "unity+ducked+ramp up, %d frames",
+                 frames);
+        failed += check_case(name, in, INPUTS, frames, 2);
+
+        in[2].gain = MIXER_GAIN_UNITY, in[2].step = -MIXER_GAIN_UNITY / 1024;
+        in[1].ch = 1;
+        fill(&in[1], frames, 0);
+        snprintf(name, sizeof(name), "mono upmix+ramp down, %d frames",
+                 frames);
+        failed += check_case(name, in, INPUTS, frames, 2);
+
+        in[0].ch = 1, in[1].ch = 1, in[2].ch = 1;
+        fill(&in[0], frames, 0);
+        fill(&in[2], frames, 0);
+        snprintf(name, sizeof(name), "mono output, %d frames", frames);
+        failed += check_case(name, in, INPUTS, frames, 1);
+    }
+    // Three full scale inputs in phase: the sum must clip, not wrap
+    for (int i = 0; i < INPUTS; i++) {
+        in[i].ch = 2;
+        in[i].gain = MIXER_GAIN_UNITY;
+        in[i].step = 0;
+        fill(&in[i], 256, 1);
+    }
+    failed += check_case("full scale clip", in, INPUTS, 256, 2);
+    in[1].gain = MIXER_GAIN_UNITY - 1;
+    failed += check_case("full scale, gain just under unity", in, INPUTS,
+                         256, 2);
+    return failed;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The device's block: 256 stereo frames of music ducked under a reply, and
+// a prompt ramping in
+static void bench(void) {
+    static input_t in[INPUTS];
+    static int16_t out[MAX_FRAMES * MAX_CH];
+    static int32_t acc[MAX_FRAMES * MAX_CH];
+    const int frames = 256;
+    const int blocks = 200000;
+    struct {
+        const char* name;
+        int32_t gain[INPUTS];
+        int32_t step[INPUTS];
+    } cases[] = {
+        {"one input, unity", {MIXER_GAIN_UNITY, 0, 0}, {0, 0, 0}},
+        {"music ducked under a reply",
+         {MIXER_GAIN_UNITY / 4, MIXER_GAIN_UNITY, 0},
+         {0, 0, 0}},
+        {"prompt ramping in over both",
+         {MIXER_GAIN_UNITY / 4, MIXER_GAIN_UNITY / 4, 0},
+         {0, 0, 16}},
+    };
+    for (int i = 0; i < INPUTS; i++) {
+        in[i].ch = 2;
+        fill(&in[i], frames, 0);
+    }
+    for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int in_num = 0;
+        for (int i = 0; i < INPUTS; i++) {
+            in[i].gain = cases[c].gain[i];
+            in[i].step = cases[c].step[i];
+            if (in[i].gain || in[i].step) {
+                in_num = i + 1;
+            }
+        }
+        double start = now_ns();
+        for (int b = 0; b < blocks; b++) {
+            kernel_mix(out, acc, in, in_num, frames, 2);
+            __asm__ volatile("" : : "r"(out) : "memory");
+        }
+        double ns = (now_ns() - start) / blocks;
+        printf("bench %-28s %d inputs: %7.1f ns/block, %5.2f ns/frame\n",
+               cases[c].name, in_num, ns, ns / frames);
+    }
+}
+
+int main(int argc, char** argv) {
+    int failed = check();
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        bench();
+    }
+    if (failed) {
+        printf("%d mixer checks failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
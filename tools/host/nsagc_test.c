@@ -0,0 +1,258 @@
+/*
+ * Host check and benchmark of the noise suppression and AGC kernels in
+ * main/m_nsagc_dsp.c.
+ *
+ * The checks run 16 kHz mono test signals through the kernels:
+ * - with suppression at 0 dB the analysis and overlap-add must give back
+ *   the input one hop late;
+ * - voiced bursts in white noise must come out with a better SNR, and the
+ *   noise between bursts lower by most of the configured floor;
+ * - the AGC must bring quiet speech to its target, never clip loud speech
+ *   and leave noise alone;
+ * - every hop must cost about the same: silence skips a division per bin,
+ *   but no input may cost twice another, so the element's cycle budget,
+ *   once met on a device, holds for any input.
+ *
+ * The host times are not device cycles. The element logs the cycles per
+ * hop on the device when the pipeline closes.
+ *
+ *   ./build/nsagc_test           check
+ *   ./build/nsagc_test --bench   also time a hop
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "m_nsagc_dsp.h"
+
+#define RATE 16000
+#define SECONDS 6
+#define SAMPLES (RATE * SECONDS)
+#define HOPS (SAMPLES / NSAGC_HOP)
+#define SETTLE (RATE)
+
+static int16_t s_clean[SAMPLES];
+static int16_t s_noise[SAMPLES];
+static int16_t s_in[SAMPLES];
+static int16_t s_out[SAMPLES];
+static nsagc_dsp_t s_dsp;
+
+static uint32_t s_seed = 1;
+static int s_failed;
+
+static void expect(const char* name, int ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    s_failed += !ok;
+}
+
+static double gauss(void) {
+    double u = 0;
+    // Sum of uniforms, close enough to a normal distribution
+    for (int i = 0; i < 12; i++) {
+        s_seed = s_seed * 1103515245 + 12345;
+        u += (s_seed >> 8) / (double)(1 << 24);
+    }
+    return u - 6;
+}
+
+static int16_t clip16(double s) {
+    return s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : lrint(s);
+}
+
+// Voiced bursts: 160 Hz and its harmonics, 300 ms on, 300 ms off, at an
+// RMS of `dbfs`; the first second is silent so the noise floor settles
+static void make_speech(int16_t* x, double dbfs) {
+    double amp = pow(10, dbfs / 20) * 32768 / sqrt(0.5 * (1 + 0.25 + 0.11));
+    for (int i = 0; i < SAMPLES; i++) {
+        double t = (double)i / RATE;
+        double on = i >= SETTLE && fmod(t, 0.6) < 0.3;
+        double env = on ? sin(M_PI * fmod(t, 0.6) / 0.3) : 0;
+        double v = sin(2 * M_PI * 160 * t) + 0.5 * sin(2 * M_PI * 320 * t) +
+                   0.33 * sin(2 * M_PI * 480 * t + 1);
+        x[i] = clip16(amp * env * sqrt(2) * v);
+    }
+}
+
+static void make_noise(int16_t* x, double dbfs) {
+    double rms = pow(10, dbfs / 20) * 32768;
+    for (int i = 0; i < SAMPLES; i++) {
+        x[i] = clip16(rms * gauss());
+    }
+}
+
+static void mix(void) {
+    for (int i = 0; i < SAMPLES; i++) {
+        s_in[i] = clip16(s_clean[i] + s_noise[i]);
+    }
+}
+
+static void run(int floor_db, int target_dbfs, int ns, int agc) {
+    nsagc_dsp_cfg_t cfg;
+    nsagc_dsp_cfg_db(&cfg, floor_db, target_dbfs, 24);
+    nsagc_dsp_init(&s_dsp, &cfg);
+    memcpy(s_out, s_in, sizeof(s_out));
+    for (int h = 0; h < HOPS; h++) {
+        if (ns) {
+            nsagc_dsp_ns(&s_dsp, s_out + h * NSAGC_HOP);
+        }
+        if (agc) {
+            nsagc_dsp_agc(&s_dsp, s_out + h * NSAGC_HOP, NSAGC_HOP);
+        }
+    }
+}
+
+// Energy of x, or of x - ref, after the first second; ref is one hop ahead
+static double energy(const int16_t* x, const int16_t* ref, int delay) {
+    double e = 0;
+    for (int i = SETTLE + delay; i < SAMPLES; i++) {
+        double d = x[i] - (ref ? ref[i - delay] : 0);
+        e += d * d;
+    }
+    return e;
+}
+
+static double db(double ratio) {
+    return 10 * log10(ratio);
+}
+
+static void check_reconstruction(void) {
+    make_noise(s_in, -20);
+    run(0, -20, 1, 0);
+    int worst = 0;
+    for (int i = NSAGC_HOP; i < SAMPLES; i++) {
+        int d = abs(s_out[i] - s_in[i - NSAGC_HOP]);
+        worst = d > worst ? d : worst;
+    }
+    printf("     reconstruction: worst error %d LSB\n", worst);
+    expect("ns: 0 dB floor gives the input back one hop late", worst <= 4);
+}
+
+static void check_snr(void) {
+    make_speech(s_clean, -26);
+    make_noise(s_noise, -36);
+    mix();
+    double speech = energy(s_clean, NULL, 0);
+    double snr_in = db(speech / energy(s_noise, NULL, 0));
+    run(-15, -20, 1, 0);
+    double snr_out = db(energy(s_clean, NULL, 0) /
+                        energy(s_out, s_clean, NSAGC_HOP));
+    // Noise between bursts: the last 300 ms of every 600 ms
+    double before = 0, after = 0;
+    for (int i = SETTLE + NSAGC_HOP; i < SAMPLES; i++) {
+        if (fmod((double)(i - NSAGC_HOP) / RATE, 0.6) >= 0.3) {
+            before += (double)s_noise[i - NSAGC_HOP] * s_noise[i - NSAGC_HOP];
+            after += (double)s_out[i] * s_out[i];
+        }
+    }
+    double reduction = db(before / after);
+    printf("     snr: in %.1f dB, out %.1f dB, noise between bursts "
+           "-%.1f dB\n",
+           snr_in, snr_out, reduction);
+    expect("ns: SNR improves by 5 dB", snr_out >= snr_in + 5);
+    expect("ns: noise between bursts down 10 dB of the 15", reduction >= 10);
+}
+
+// Mean absolute level of the bursts' middle 100 ms, after `from` seconds
+static double burst_level(const int16_t* x, double from) {
+    double sum = 0;
+    int n = 0;
+    for (int i = from * RATE; i < SAMPLES; i++) {
+        double p = fmod((double)i / RATE, 0.6);
+        if (p >= 0.1 && p < 0.2) {
+            sum += abs(x[i]);
+            n++;
+        }
+    }
+    return n ? sum / n : 0;
+}
+
+static void check_agc(void) {
+    double target = pow(10, -20 / 20.0) * 32768;
+    make_speech(s_clean, -40);
+    make_noise(s_noise, -70);
+    mix();
+    run(-15, -20, 0, 1);
+    double level = 20 * log10(burst_level(s_out, 3) / target);
+    printf("     agc: quiet speech ends %+.1f dB from the target\n", level);
+    expect("agc: quiet speech reaches the target within 3 dB",
+           fabs(level) <= 3);
+
+    make_speech(s_clean, -3);
+    memset(s_noise, 0, sizeof(s_noise));
+    mix();
+    run(-15, -20, 0, 1);
+    int clipped = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        clipped += s_out[i] == INT16_MAX || s_out[i] == INT16_MIN;
+    }
+    expect("agc: loud speech is not clipped", clipped == 0);
+
+    make_noise(s_in, -60);
+    run(-15, -20, 0, 1);
+    double gain = db(energy(s_out, NULL, 0) / energy(s_in, NULL, 0));
+    printf("     agc: noise alone gains %+.1f dB\n", gain);
+    expect("agc: noise alone is not raised", gain <= 1);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fastest of a few passes over the signal, per hop of suppression and AGC
+static double time_hop(void) {
+    double best = 1e30;
+    for (int pass = 0; pass < 5; pass++) {
+        run(-15, -20, 0, 0);
+        double start = now_ns();
+        for (int h = 0; h < HOPS; h++) {
+            nsagc_dsp_ns(&s_dsp, s_out + h * NSAGC_HOP);
+            nsagc_dsp_agc(&s_dsp, s_out + h * NSAGC_HOP, NSAGC_HOP);
+        }
+        double t = (now_ns() - start) / HOPS;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+static void check_cost(int bench) {
+    static const char* names[] = {"silence", "noise", "speech in noise"};
+    double t[3];
+    memset(s_in, 0, sizeof(s_in));
+    t[0] = time_hop();
+    make_noise(s_in, -20);
+    t[1] = time_hop();
+    make_speech(s_clean, -26);
+    make_noise(s_noise, -36);
+    mix();
+    t[2] = time_hop();
+    double lo = t[0], hi = t[0];
+    for (int i = 0; i < 3; i++) {
+        lo = t[i] < lo ? t[i] : lo;
+        hi = t[i] > hi ? t[i] : hi;
+        if (bench) {
+            printf("bench %-16s %7.0f ns/hop, %5.2f%% of a %d ms hop\n",
+                   names[i], t[i], t[i] / (1e9 * NSAGC_HOP / RATE) * 100,
+                   1000 * NSAGC_HOP / RATE);
+        }
+    }
+    printf("     cost: %.0f..%.0f ns per hop on the host\n", lo, hi);
+    expect("cost: no input costs twice another per hop", hi < 2 * lo);
+}
+
+int main(int argc, char** argv) {
+    int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+    check_reconstruction();
+    check_snr();
+    check_agc();
+    check_cost(bench);
+    if (s_failed) {
+        printf("%d noise suppression and AGC checks failed\n", s_failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Host replay of the listening frequency policy in main/m_power_policy.c.
+ *
+ * A trace is the console log of m_power.c with CONFIG_DLOG_LEVEL=4: one
+ * "window <MHz> MHz busy <us> us budget <us> us" line per second of
+ * listening. Each window is turned into CPU cycles at the frequency it was
+ * recorded at and replayed through the policy, with the work scaled to the
+ * frequency the policy picked. Per trace it prints the time at each step,
+ * the switches, the windows over the step-up threshold and over real time,
+ * and the average frequency counting the minimum step between detections.
+ *
+ *   ./build/power_replay power_trace.log        check the policy and replay
+ *   ./build/power_replay -u 80 -d 40 trace.log  replay other thresholds
+ *
+ * With the device's thresholds the replay has to pick the frequency the
+ * device ran the next window at, a recording made with power management
+ * enabled is checked against itself.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m_power_policy.h"
+
+#define MAX_WINDOWS 100000
+
+// As in main/m_power.c
+static const int s_steps_mhz[] = {80, 160, 240};
+#define STEP_NUM (int)(sizeof(s_steps_mhz) / sizeof(s_steps_mhz[0]))
+#define DEVICE_UP_PCT 70
+#define DEVICE_DOWN_PCT 50
+
+typedef struct {
+    int mhz;
+    int64_t busy_us;
+    int64_t budget_us;
+} window_t;
+
+static window_t s_win[MAX_WINDOWS];
+
+static int check(const char* name, int got, int want) {
+    if (got != want) {
+        printf("FAIL %s: %d MHz, expected %d MHz\n", name, got, want);
+        return 1;
+    }
+    printf("ok   %s\n", name);
+    return 0;
+}
+
+// Decisions that do not need a trace
+static int check_policy(const power_policy_t* p) {
+    int failed = 0;
+    failed += check("step up to the lowest step under up_pct",
+                    power_policy_next_mhz(p, 80, 90), 160);
+    failed += check("skip a step when one is not enough",
+                    power_policy_next_mhz(p, 80, 150), 240);
+    failed += check("saturate at the top step",
+                    power_policy_next_mhz(p, 240, 95), 240);
+    failed += check("hold when the lower step would reach down_pct",
+                    power_policy_next_mhz(p, 160, 25), 160);
+    failed += check("step down below down_pct at the lower step",
+                    power_policy_next_mhz(p, 160, 24), 80);
+    failed += check("step down over two steps",
+                    power_policy_next_mhz(p, 240, 10), 80);
+    failed += check("hold between the thresholds",
+                    power_policy_next_mhz(p, 80, 60), 80);
+    failed += check("round an off-step frequency up",
+                    power_policy_next_mhz(p, 120, 60), 160);
+    return failed;
+}
+
+static int load_trace(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int n = 0;
+    while (fgets(line, sizeof(line), f) != NULL && n < MAX_WINDOWS) {
+        char* at = strstr(line, "window ");
+        long long busy, budget;
+        int mhz;
+        if (line[0] == '#' || at == NULL ||
+            sscanf(at, "window %d MHz busy %lld us budget %lld us", &mhz,
+                   &busy, &budget) != 3 ||
+            mhz <= 0 || budget <= 0) {
+            continue;
+        }
+        s_win[n].mhz = mhz;
+        s_win[n].busy_us = busy;
+        s_win[n].budget_us = budget;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static int step_index(int mhz) {
+    for (int i = 0; i < STEP_NUM; i++) {
+        if (s_steps_mhz[i] == mhz) {
+            return i;
+        }
+    }
+    return STEP_NUM - 1;
+}
+
+// Returns the windows where the replay and the recording disagree
+static int replay(const char* path, const power_policy_t* p, int n) {
+    int64_t step_us[STEP_NUM] = {0};
+    int64_t time_us = 0, mhz_us = 0;
+    int switches = 0, over_up = 0, over_rt = 0, mismatch = 0;
+    int cur = s_win[0].mhz;
+    for (int i = 0; i < n; i++) {
+        const window_t* w = &s_win[i];
+        int64_t cycles = w->busy_us * w->mhz;
+        int64_t busy = cycles / cur;
+        int load = busy * 100 / w->budget_us;
+        over_up += load > p->up_pct;
+        over_rt += load > 100;
+        step_us[step_index(cur)] += w->budget_us;
+        time_us += w->budget_us;
+        int64_t idle = busy < w->budget_us ? w->budget_us - busy : 0;
+        mhz_us += busy * cur + idle * s_steps_mhz[0];
+        int next = power_policy_next_mhz(p, cur, load);
+        if (i + 1 < n && next != s_win[i + 1].mhz) {
+            mismatch++;
+        }
+        switches += next != cur;
+        cur = next;
+    }
+    printf("%s: %d windows, %lld s, %d switches, %d over %d%%, %d over "
+           "real time, avg %lld MHz\n",
+           path, n, (long long)(time_us / 1000000), switches, over_up,
+           p->up_pct, over_rt, (long long)(mhz_us / time_us));
+    for (int i = 0; i < STEP_NUM; i++) {
+        printf("  %3d MHz %5.1f%%\n", s_steps_mhz[i],
+               step_us[i] * 100.0 / time_us);
+    }
+    return mismatch;
+}
+
+int main(int argc, char** argv) {
+    power_policy_t policy = {
+        .steps_mhz = s_steps_mhz,
+        .step_num = STEP_NUM,
+        .up_pct = DEVICE_UP_PCT,
+        .down_pct = DEVICE_DOWN_PCT,
+    };
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-u") == 0) {
+            policy.up_pct = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-d") == 0) {
+            policy.down_pct = atoi(argv[arg + 1]);
+        } else {
+            break;
+        }
+    }
+    if (arg >= argc) {
+        printf("usage: %s [-u up_pct] [-d down_pct] trace.log...\n", argv[0]);
+        return 2;
+    }
+    int device = policy.up_pct == DEVICE_UP_PCT &&
+                 policy.down_pct == DEVICE_DOWN_PCT;
+    int failed = device ? check_policy(&policy) : 0;
+    for (; arg < argc; arg++) {
+        int n = load_trace(argv[arg]);
+        if (n <= 0) {
+            printf("FAIL %s: no windows\n", argv[arg]);
+            failed++;
+            continue;
+        }
+        int mismatch = replay(argv[arg], &policy, n);
+        if (device && mismatch) {
+            printf("FAIL %s: %d windows ran at another frequency than the "
+                   "replay picked\n",
+                   argv[arg], mismatch);
+            failed++;
+        }
+    }
+    if (failed) {
+        printf("%d power checks failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
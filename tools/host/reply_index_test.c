@@ -0,0 +1,124 @@
+/*
+ * Host check of the reply cache index in main/m_reply_index.c.
+ *
+ * ETags are taken from response headers the way server.py and other
+ * servers send them and must be matched in full: two SHA-1 ETags that
+ * share the first 8 hex digits (the old key) are different replies. Then
+ * the LRU order, the entry and byte limits, and the If-None-Match list of
+ * the conditional GET, which must list every cached ETag or not fit.
+ *
+ *   ./build/reply_index_test
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "m_reply_index.h"
+
+#define MAX_ENTRIES 4
+
+static reply_index_entry_t s_entries[MAX_ENTRIES + 1];
+
+static int s_failed;
+
+static void expect(const char* name, int ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    s_failed += !ok;
+}
+
+static void check_etag(void) {
+    char etag[REPLY_INDEX_ETAG_MAX];
+    char long_tag[REPLY_INDEX_ETAG_MAX + 8];
+    expect("etag: strong kept as sent",
+           reply_index_etag("\"4e1243bd22c66e76c2ba9eddc1f91394e57f9f83\"",
+                            etag, sizeof(etag)) == 0 &&
+               strcmp(etag, "\"4e1243bd22c66e76c2ba9eddc1f91394e57f9f83\"") ==
+                   0);
+    expect("etag: weak prefix dropped",
+           reply_index_etag("W/\"abc\"", etag, sizeof(etag)) == 0 &&
+               strcmp(etag, "\"abc\"") == 0);
+    expect("etag: empty refused", reply_index_etag("", etag, sizeof(etag)));
+    memset(long_tag, 'a', sizeof(long_tag) - 1);
+    long_tag[sizeof(long_tag) - 1] = '\0';
+    expect("etag: too long refused",
+           reply_index_etag(long_tag, etag, sizeof(etag)));
+}
+
+static void check_full_match(reply_index_t* idx) {
+    const char* a = "\"4e1243bd22c66e76c2ba9eddc1f91394e57f9f83\"";
+    const char* b = "\"4e1243bd00000000000000000000000000000000\"";
+    reply_index_add(idx, a, 1000);
+    expect("match: same ETag found", reply_index_find(idx, a) != NULL);
+    expect("match: shared 8 digit prefix is another reply",
+           reply_index_find(idx, b) == NULL);
+    expect("match: file names differ",
+           reply_index_name(a) != reply_index_name(b));
+}
+
+static void check_lru(reply_index_t* idx) {
+    char etag[16];
+    for (int i = 1; i < MAX_ENTRIES; i++) {
+        snprintf(etag, sizeof(etag), "\"r%d\"", i);
+        reply_index_add(idx, etag, 1000);
+    }
+    expect("lru: within limits", reply_index_victim(idx) < 0);
+    // The first entry is used again, r1 is now the oldest
+    reply_index_touch(idx, &idx->entries[0]);
+    reply_index_add(idx, "\"r4\"", 1000);
+    int v = reply_index_victim(idx);
+    expect("lru: over the entry limit evicts the oldest",
+           v >= 0 && strcmp(idx->entries[v].etag, "\"r1\"") == 0);
+    reply_index_remove(idx, v);
+    expect("lru: back within limits",
+           reply_index_victim(idx) < 0 && idx->num == MAX_ENTRIES &&
+               idx->bytes == MAX_ENTRIES * 1000);
+    idx->max_bytes = 2500;
+    int evicted = 0;
+    while ((v = reply_index_victim(idx)) >= 0) {
+        reply_index_remove(idx, v);
+        evicted++;
+    }
+    // r2 and r3 go, the reply used again and r4 stay
+    expect("lru: over the byte limit evicts down to it",
+           evicted == 2 && idx->bytes == 2000 &&
+               reply_index_find(idx, "\"r2\"") == NULL &&
+               reply_index_find(idx, "\"r3\"") == NULL &&
+               reply_index_find(idx, "\"r4\"") != NULL);
+    idx->max_bytes = 100;
+    while ((v = reply_index_victim(idx)) >= 0) {
+        reply_index_remove(idx, v);
+    }
+    expect("lru: the last reply is kept even when too large",
+           idx->num == 1 && reply_index_find(idx, "\"r4\"") != NULL);
+}
+
+static void check_if_none_match(reply_index_t* idx) {
+    char buf[64];
+    idx->max_bytes = 1 << 20;
+    reply_index_add(idx, "\"r5\"", 10);
+    int n = reply_index_if_none_match(idx, buf, sizeof(buf));
+    expect("if-none-match: every ETag listed",
+           n == (int)strlen("\"r4\", \"r5\"") &&
+               strcmp(buf, "\"r4\", \"r5\"") == 0);
+    expect("if-none-match: too small refused",
+           reply_index_if_none_match(idx, buf, 8) < 0);
+    reply_index_t empty = {.entries = s_entries, .max = MAX_ENTRIES};
+    expect("if-none-match: empty index",
+           reply_index_if_none_match(&empty, buf, sizeof(buf)) == 0);
+}
+
+int main(void) {
+    reply_index_t idx = {
+        .entries = s_entries,
+        .max = MAX_ENTRIES,
+        .max_bytes = 1 << 20,
+    };
+    check_etag();
+    check_full_match(&idx);
+    check_lru(&idx);
+    check_if_none_match(&idx);
+    if (s_failed) {
+        printf("%d reply index checks failed\n", s_failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * Host check of the session recorder in main/m_session_rec.c, built on
+ * the pthread shim in shim/.
+ *
+ * Three threads write mic, upload and reply chunks and a fourth writes
+ * events, all at once, while the recorder task rotates through files in
+ * a scratch directory. Every chunk starts with its number and length and
+ * carries a pattern of both, so a record copied while the block was being
+ * written to the card, or mixed with another stream, shows up when the
+ * files are read back.
+ *
+ * First the writers are paced to a card that keeps up, and every copy
+ * into a block pauses half way: every chunk and event must come back
+ * whole and in order. Then they copy at full speed and write as fast as
+ * they can: chunks may be cut short or dropped, but what was recorded
+ * must still be in order and intact.
+ *
+ *   ./build/session_rec_test
+ */
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "m_session_rec.h"
+#include "shim.h"
+
+#define BLOCK_SIZE 1024
+#define BLOCK_NUM 64
+#define FILE_SIZE (32 * 1024)
+#define CHUNKS 2000
+#define CHUNK_MAX 600
+#define CHUNK_HDR 8
+#define CHUNK_MAGIC 0xa5
+#define STREAMS SESSION_REC_EVENT
+#define HDR_LEN 8
+
+typedef struct {
+    session_rec_type_t type;
+    int first;
+    int pace_us;
+} writer_t;
+
+typedef struct {
+    int seq;   /* Chunk being read back, -1 before the first */
+    int len;
+    int pos;
+    int whole; /* Chunks read back complete */
+    int cut;   /* Chunks cut short */
+    int bad;
+} stream_t;
+
+static char s_dir[32];
+static int s_first; /* Chunks and events of the current run */
+static stream_t s_stream[STREAMS];
+static int s_event_next;
+static int s_events;
+static int s_event_bad;
+static int s_failed;
+
+static void expect(const char* name, int ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    s_failed += !ok;
+}
+
+// Pattern bytes stay below the magic, so a record that starts a chunk is
+// told apart from one that continues it
+static uint8_t pattern(int seq, int i) {
+    return (seq * 31 + i) & 0x7f;
+}
+
+static void* writer_main(void* arg) {
+    const writer_t* w = arg;
+    static __thread uint8_t chunk[CHUNK_MAX];
+    uint32_t seed = w->type + 1;
+    for (int seq = w->first; seq < w->first + CHUNKS; seq++) {
+        seed = seed * 1103515245 + 12345;
+        int len = CHUNK_HDR + (seed >> 16) % (CHUNK_MAX - CHUNK_HDR);
+        chunk[0] = CHUNK_MAGIC;
+        chunk[1] = seq >> 16;
+        chunk[2] = seq >> 8;
+        chunk[3] = seq;
+        chunk[4] = len >> 8;
+        chunk[5] = len;
+        chunk[6] = chunk[7] = 0;
+        for (int i = CHUNK_HDR; i < len; i++) {
+            chunk[i] = pattern(seq, i);
+        }
+        session_rec_write(w->type, chunk, len);
+        if (w->pace_us) {
+            usleep(w->pace_us);
+        }
+    }
+    return NULL;
+}
+
+static void* event_main(void* arg) {
+    const writer_t* w = arg;
+    for (int i = w->first; i < w->first + CHUNKS; i++) {
+        session_rec_event("event %d", i);
+        if (w->pace_us) {
+            usleep(w->pace_us * 2);
+        }
+    }
+    return NULL;
+}
+
+static void stream_end_chunk(stream_t* s) {
+    if (s->seq >= s_first) {
+        if (s->pos == s->len) {
+            s->whole++;
+        } else {
+            s->cut++;
+        }
+    }
+}
+
+static void read_record(int type, const uint8_t* p, int len) {
+    if (type == SESSION_REC_EVENT) {
+        int n;
+        char text[32];
+        snprintf(text, sizeof(text), "%.*s", len, p);
+        if (sscanf(text, "event %d", &n) != 1 || n < s_event_next) {
+            fprintf(stderr, "DBG event [%s] next %d\n", text, s_event_next);
+            s_event_bad++;
+        }
+        s_event_next = n + 1;
+        s_events += n >= s_first;
+        return;
+    }
+    stream_t* s = &s_stream[type];
+    if (p[0] == CHUNK_MAGIC) {
+        int seq = p[1] << 16 | p[2] << 8 | p[3];
+        stream_end_chunk(s);
+        if (seq <= s->seq || len < CHUNK_HDR) {
+            s->bad++;
+        }
+        s->seq = seq;
+        s->len = p[4] << 8 | p[5];
+        s->pos = 0;
+    } else if (s->seq < 0) {
+        s->bad++;
+        return;
+    }
+    for (int i = 0; i < len; i++, s->pos++) {
+        if (s->pos >= s->len ||
+            (s->pos >= CHUNK_HDR && p[i] != pattern(s->seq, s->pos))) {
+            s->bad++;
+            return;
+        }
+    }
+}
+
+static int read_file(const char* path) {
+    static uint8_t block[BLOCK_SIZE];
+    FILE* f = fopen(path, "rb");
+    int bad = 0;
+    if (f == NULL) {
+        return 1;
+    }
+    while (fread(block, 1, BLOCK_SIZE, f) == BLOCK_SIZE) {
+        int pos = 0;
+        while (pos + HDR_LEN <= BLOCK_SIZE) {
+            int type = block[pos];
+            int len = block[pos + 2] | block[pos + 3] << 8;
+            if (type > SESSION_REC_PAD || pos + HDR_LEN + len > BLOCK_SIZE) {
+                bad++;
+                break;
+            }
+            if (type == SESSION_REC_PAD) {
+                break;
+            }
+            read_record(type, block + pos + HDR_LEN, len);
+            pos += (HDR_LEN + len + 7) & ~7;
+        }
+    }
+    bad += !feof(f);
+    fclose(f);
+    return bad;
+}
+
+static int compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Read every file in order, count what the run from s_first wrote
+static int read_files(int* files, int* too_big) {
+    s_event_next = 0;
+    s_events = 0;
+    s_event_bad = 0;
+    memset(s_stream, 0, sizeof(s_stream));
+    for (int t = 0; t < STREAMS; t++) {
+        s_stream[t].seq = -1;
+    }
+    char* names[256];
+    int n = 0, bad = 0;
+    DIR* d = opendir(s_dir);
+    struct dirent* de;
+    while (d && (de = readdir(d)) != NULL && n < 256) {
+        if (de->d_name[0] == 'S') {
+            names[n++] = strdup(de->d_name);
+        }
+    }
+    closedir(d);
+    qsort(names, n, sizeof(names[0]), compare);
+    *too_big = 0;
+    for (int i = 0; i < n; i++) {
+        char path[300];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", s_dir, names[i]);
+        stat(path, &st);
+        *too_big += st.st_size > FILE_SIZE || st.st_size % BLOCK_SIZE;
+        bad += read_file(path);
+        free(names[i]);
+    }
+    for (int t = 0; t < STREAMS; t++) {
+        stream_end_chunk(&s_stream[t]);
+    }
+    *files = n;
+    return bad;
+}
+
+// Write from every thread at once, then wait for the recorder to write
+// out its partial block
+static void run_writers(int first, int pace_us) {
+    pthread_t threads[STREAMS + 1];
+    writer_t w[STREAMS + 1];
+    for (int t = 0; t <= STREAMS; t++) {
+        w[t] = (writer_t){.type = t, .first = first, .pace_us = pace_us};
+        pthread_create(&threads[t], NULL,
+                       t == STREAMS ? event_main : writer_main, &w[t]);
+    }
+    for (int t = 0; t <= STREAMS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    sleep(2);
+}
+
+int main(void) {
+    snprintf(s_dir, sizeof(s_dir), "/tmp/srXXXXXX");
+    if (mkdtemp(s_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    session_rec_cfg_t cfg = {
+        .block_size = BLOCK_SIZE,
+        .block_num = BLOCK_NUM,
+        .file_size = FILE_SIZE,
+        .file_num = 256,
+    };
+    if (session_rec_start(s_dir, &cfg) != 0) {
+        printf("FAIL recorder did not start in %s\n", s_dir);
+        return 1;
+    }
+    shim_copy_pause_us = 20;
+    run_writers(0, 500);
+    int files, too_big;
+    int bad = read_files(&files, &too_big);
+    int whole = 0, cut = 0, wrong = 0;
+    for (int t = 0; t < STREAMS; t++) {
+        whole += s_stream[t].whole;
+        cut += s_stream[t].cut;
+        wrong += s_stream[t].bad;
+    }
+    printf("     paced: %d files, %d chunks whole, %d cut, %d events\n", files,
+           whole, cut, s_events);
+    expect("paced: files are whole blocks within the file size",
+           files > 1 && too_big == 0 && bad == 0);
+    expect("paced: every chunk and event back in order",
+           whole == STREAMS * CHUNKS && cut == 0 && wrong == 0 &&
+               s_events == CHUNKS && s_event_bad == 0);
+
+    s_first = CHUNKS;
+    shim_copy_pause_us = 0;
+    run_writers(s_first, 0);
+    bad = read_files(&files, &too_big);
+    whole = cut = wrong = 0;
+    for (int t = 0; t < STREAMS; t++) {
+        whole += s_stream[t].whole;
+        cut += s_stream[t].cut;
+        wrong += s_stream[t].bad;
+    }
+    printf("     burst: %d files, %d chunks whole, %d cut, %d dropped, %d "
+           "events\n",
+           files, whole, cut, STREAMS * CHUNKS - whole - cut, s_events);
+    expect("burst: files are whole blocks within the file size",
+           too_big == 0 && bad == 0);
+    expect("burst: what was recorded is intact and in order",
+           whole > 0 && wrong == 0 && s_event_bad == 0);
+
+    DIR* d = opendir(s_dir);
+    struct dirent* de;
+    while (d && (de = readdir(d)) != NULL) {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/%s", s_dir, de->d_name);
+        if (de->d_name[0] == 'S') {
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(s_dir);
+    if (s_failed) {
+        printf("%d session recorder checks failed\n", s_failed);
+        return 1;
+    }
+    return 0;
+}
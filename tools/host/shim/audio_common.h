@@ -0,0 +1,4 @@
+#ifndef _SHIM_AUDIO_COMMON_H_
+#define _SHIM_AUDIO_COMMON_H_
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _SHIM_AUDIO_ELEMENT_H_
+#define _SHIM_AUDIO_ELEMENT_H_
+
+#include <stdint.h>
+#include "audio_error.h"
+#include "esp_err.h"
+#include "ringbuf.h"
+
+typedef struct audio_element* audio_element_handle_t;
+
+typedef enum {
+    AEL_IO_OK = 0,
+    AEL_IO_FAIL = -1,
+    AEL_IO_DONE = -2,
+    AEL_IO_ABORT = -3,
+    AEL_IO_TIMEOUT = -4,
+} audio_element_err_t;
+
+typedef struct {
+    esp_err_t (*open)(audio_element_handle_t self);
+    int (*process)(audio_element_handle_t self, char* in_buffer, int in_len);
+    esp_err_t (*close)(audio_element_handle_t self);
+    esp_err_t (*destroy)(audio_element_handle_t self);
+    int buffer_len;
+    int task_stack;
+    int task_prio;
+    int task_core;
+    int out_rb_size;
+    const char* tag;
+} audio_element_cfg_t;
+
+#define DEFAULT_AUDIO_ELEMENT_CONFIG() \
+    { .buffer_len = 1024, .out_rb_size = 8 * 1024 }
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t* config);
+esp_err_t audio_element_deinit(audio_element_handle_t el);
+void* audio_element_getdata(audio_element_handle_t el);
+esp_err_t audio_element_setdata(audio_element_handle_t el, void* data);
+int audio_element_input(audio_element_handle_t el, char* buffer, int len);
+int audio_element_output(audio_element_handle_t el, char* buffer, int len);
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _SHIM_AUDIO_ERROR_H_
+#define _SHIM_AUDIO_ERROR_H_
+
+#include "esp_log.h"
+
+#define AUDIO_MEM_CHECK(tag, x, action)             \
+    if (!(x)) {                                     \
+        ESP_LOGE(tag, "Memory exhausted (%d)", __LINE__); \
+        action;                                     \
+    }
+
+#endif
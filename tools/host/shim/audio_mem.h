@@ -0,0 +1,10 @@
+#ifndef _SHIM_AUDIO_MEM_H_
+#define _SHIM_AUDIO_MEM_H_
+
+#include <stdlib.h>
+
+#define audio_malloc(size) malloc(size)
+#define audio_calloc(n, size) calloc(n, size)
+#define audio_free(p) free(p)
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _SHIM_ESP_HEAP_CAPS_H_
+#define _SHIM_ESP_HEAP_CAPS_H_
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+#define heap_caps_malloc(size, caps) malloc(size)
+#define heap_caps_free(p) free(p)
+
+#endif
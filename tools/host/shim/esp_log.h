@@ -0,0 +1,14 @@
+#ifndef _SHIM_ESP_LOG_H_
+#define _SHIM_ESP_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+uint32_t esp_log_timestamp(void);
+
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ((void)(tag))
+
+#endif
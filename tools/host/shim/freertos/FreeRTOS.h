@@ -0,0 +1,28 @@
+/*
+ * Host shim of the FreeRTOS and ESP-IDF calls the modules under test use,
+ * on pthreads; see shim.c.
+ */
+#ifndef _SHIM_FREERTOS_H_
+#define _SHIM_FREERTOS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 1
+
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {PTHREAD_MUTEX_INITIALIZER}
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(&(mux)->mutex)
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _SHIM_TASK_H_
+#define _SHIM_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct shim_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name,
+                                   uint32_t stack, void* arg, int prio,
+                                   TaskHandle_t* handle, int core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _SHIM_LWIP_NETDB_H_
+#define _SHIM_LWIP_NETDB_H_
+
+#include <netdb.h>
+
+#endif
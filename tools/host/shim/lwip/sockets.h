@@ -0,0 +1,22 @@
+/*
+ * Host sockets. Sends and receives go through shim.c, which holds each
+ * one back by a random network delay, see shim.h.
+ */
+#ifndef _SHIM_LWIP_SOCKETS_H_
+#define _SHIM_LWIP_SOCKETS_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+ssize_t shim_sendto(int sock, const void* data, size_t len, int flags,
+                    const struct sockaddr* to, socklen_t tolen);
+ssize_t shim_recv(int sock, void* data, size_t len, int flags);
+
+#define sendto shim_sendto
+#define recv shim_recv
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _SHIM_RINGBUF_H_
+#define _SHIM_RINGBUF_H_
+
+typedef struct ringbuf* ringbuf_handle_t;
+
+int rb_bytes_filled(ringbuf_handle_t rb);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Host shim of FreeRTOS tasks, task notifications, the ESP-IDF clocks and
+ * audio elements on pthreads, enough to build modules of main/ that are
+ * not plain C and drive them from a host test. Sockets are the host's.
+ * Metrics and task placements are accepted and ignored. Host-only
+ * controls are in shim.h.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_element.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "ringbuf.h"
+
+#include "m_metrics.h"
+#include "m_tasks.h"
+#include "shim.h"
+
+struct shim_task {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t notified;
+    TaskFunction_t fn;
+    void* arg;
+};
+
+struct ringbuf {
+    int filled;
+};
+
+struct audio_element {
+    audio_element_cfg_t cfg;
+    void* data;
+    shim_io_t in;
+    shim_io_t out;
+    void* ctx;
+    struct ringbuf rb;
+    char* buffer; /* Between shim_element_open and shim_element_close */
+};
+
+static __thread struct shim_task* s_self;
+
+volatile double shim_clock_ppm;
+volatile int64_t shim_clock_offset_us;
+volatile int shim_net_delay_us;
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    return shim_clock_offset_us + us + (int64_t)(us * shim_clock_ppm * 1e-6);
+}
+
+uint32_t esp_log_timestamp(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+static void* shim_task_main(void* arg) {
+    struct shim_task* t = arg;
+    s_self = t;
+    t->fn(t->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name,
+                                   uint32_t stack, void* arg, int prio,
+                                   TaskHandle_t* handle, int core) {
+    struct shim_task* t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return pdFALSE;
+    }
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->fn = fn;
+    t->arg = arg;
+    if (handle) {
+        *handle = t;
+    }
+    if (pthread_create(&t->thread, NULL, shim_task_main, t) != 0) {
+        free(t);
+        return pdFALSE;
+    }
+    pthread_detach(t->thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == s_self) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {ticks / 1000, (ticks % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    struct shim_task* t = s_self;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ticks / 1000;
+    until.tv_nsec += (ticks % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&t->mutex);
+    while (t->notified == 0 && ticks) {
+        if (ticks != portMAX_DELAY &&
+            pthread_cond_timedwait(&t->cond, &t->mutex, &until) == ETIMEDOUT) {
+            break;
+        } else if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&t->cond, &t->mutex);
+        }
+    }
+    uint32_t n = t->notified;
+    if (clear) {
+        t->notified = 0;
+    } else if (n) {
+        t->notified--;
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return n;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->mutex);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+static void shim_net_delay(void) {
+    if (shim_net_delay_us) {
+        usleep(random() % (shim_net_delay_us + 1));
+    }
+}
+
+// lwip/sockets.h maps sendto and recv here
+#undef sendto
+#undef recv
+
+ssize_t shim_sendto(int sock, const void* data, size_t len, int flags,
+                    const struct sockaddr* to, socklen_t tolen) {
+    shim_net_delay();
+    return sendto(sock, data, len, flags, to, tolen);
+}
+
+ssize_t shim_recv(int sock, void* data, size_t len, int flags) {
+    ssize_t r = recv(sock, data, len, flags);
+    if (r >= 0) {
+        shim_net_delay();
+    }
+    return r;
+}
+
+void metrics_add(metric_counter_t counter, uint32_t n) {}
+
+void metrics_observe(metric_hist_t hist, uint32_t value) {}
+
+const task_placement_t* task_placement_get(task_slot_t slot) {
+    static const task_placement_t any = {"shim", 0, 1, 4096};
+    return &any;
+}
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t* config) {
+    struct audio_element* el = calloc(1, sizeof(*el));
+    if (el) {
+        el->cfg = *config;
+    }
+    return el;
+}
+
+esp_err_t audio_element_deinit(audio_element_handle_t el) {
+    if (el->cfg.destroy) {
+        el->cfg.destroy(el);
+    }
+    free(el);
+    return ESP_OK;
+}
+
+void* audio_element_getdata(audio_element_handle_t el) {
+    return el->data;
+}
+
+esp_err_t audio_element_setdata(audio_element_handle_t el, void* data) {
+    el->data = data;
+    return ESP_OK;
+}
+
+int audio_element_input(audio_element_handle_t el, char* buffer, int len) {
+    return el->in ? el->in(el->ctx, buffer, len) : AEL_IO_DONE;
+}
+
+int audio_element_output(audio_element_handle_t el, char* buffer, int len) {
+    return el->out ? el->out(el->ctx, buffer, len) : len;
+}
+
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el) {
+    return &el->rb;
+}
+
+int rb_bytes_filled(ringbuf_handle_t rb) {
+    return rb->filled;
+}
+
+void shim_element_io(audio_element_handle_t el, shim_io_t in, shim_io_t out,
+                     void* ctx) {
+    el->in = in;
+    el->out = out;
+    el->ctx = ctx;
+}
+
+esp_err_t shim_element_open(audio_element_handle_t el) {
+    el->buffer = malloc(el->cfg.buffer_len);
+    if (el->buffer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (el->cfg.open && el->cfg.open(el) != ESP_OK) {
+        free(el->buffer);
+        el->buffer = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+int shim_element_process(audio_element_handle_t el) {
+    return el->cfg.process(el, el->buffer, el->cfg.buffer_len);
+}
+
+void shim_element_close(audio_element_handle_t el) {
+    if (el->cfg.close) {
+        el->cfg.close(el);
+    }
+    free(el->buffer);
+    el->buffer = NULL;
+}
+
+void shim_element_rb_fill(audio_element_handle_t el, int bytes) {
+    el->rb.filled = bytes;
+}
+
+int shim_element_run(audio_element_handle_t el) {
+    int r = AEL_IO_FAIL;
+    if (shim_element_open(el) == ESP_OK) {
+        while ((r = shim_element_process(el)) > 0) {
+        }
+        shim_element_close(el);
+    }
+    return r;
+}
+
+volatile int shim_copy_pause_us;
+
+void* shim_memcpy(void* dst, const void* src, size_t n) {
+    size_t half = n / 2;
+    __builtin_memcpy(dst, src, half);
+    if (n >= 64 && shim_copy_pause_us) {
+        usleep(shim_copy_pause_us);
+    }
+    __builtin_memcpy((char*)dst + half, (const char*)src + half, n - half);
+    return dst;
+}
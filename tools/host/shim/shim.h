@@ -0,0 +1,49 @@
+#ifndef _SHIM_H_
+#define _SHIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "audio_element.h"
+
+/*
+ * Host only: where an element reads its input and writes its output. By
+ * default the input is done at once and the output is discarded.
+ */
+typedef int (*shim_io_t)(void* ctx, char* buffer, int len);
+void shim_element_io(audio_element_handle_t el, shim_io_t in, shim_io_t out,
+                     void* ctx);
+
+/*
+ * Host only: open the element, call its process until the input is done,
+ * close it. Returns the last process result.
+ */
+int shim_element_run(audio_element_handle_t el);
+
+/*
+ * Host only: the same one step at a time, for a driver that models what
+ * the element's output feeds. shim_element_rb_fill sets what its output
+ * ringbuffer reports as filled.
+ */
+esp_err_t shim_element_open(audio_element_handle_t el);
+int shim_element_process(audio_element_handle_t el);
+void shim_element_close(audio_element_handle_t el);
+void shim_element_rb_fill(audio_element_handle_t el, int bytes);
+
+/*
+ * esp_timer_get_time() runs shim_clock_ppm fast and starts at
+ * shim_clock_offset_us, like the crystal of one device. Every sendto and
+ * recv is held back by up to shim_net_delay_us, a one-way network delay.
+ */
+extern volatile double shim_clock_ppm;
+extern volatile int64_t shim_clock_offset_us;
+extern volatile int shim_net_delay_us;
+
+/*
+ * Sources built with -Dmemcpy=shim_memcpy pause this long half way
+ * through every copy of 64 bytes or more, so that data handed to another
+ * task before its copy is done is caught. 0 copies at full speed.
+ */
+extern volatile int shim_copy_pause_us;
+void* shim_memcpy(void* dst, const void* src, size_t n);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Host build of the group clock in main/m_sync.c and the group playback
+ * stage in main/m_sync_play.c as a shared library, on the pthread shim in
+ * shim/. tools/sync_sim.py loads a copy per simulated device, so every
+ * device has its own clock and state, and drives the firmware code
+ * through the calls below.
+ *
+ * The clock task runs as on the device, against server.py's UDP port,
+ * with the shim's clock drift and network delay. Its reports go to the
+ * callback given to sync_sim_start instead of the control channel. The
+ * playback stage is stepped one buffer at a time by the caller, which
+ * models the ringbuffer and the DAC behind it.
+ *
+ *   make -C tools/host build/libsync_sim.so
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "m_ctrl.h"
+#include "m_sync.h"
+#include "m_sync_play.h"
+#include "shim.h"
+
+typedef void (*sync_sim_post_t)(int type, const void* payload, int len);
+
+static char s_host[64];
+static sync_sim_post_t s_post;
+static int s_out_bytes;
+
+esp_err_t ctrl_post(ctrl_msg_type_t type, const void* payload, int len) {
+    if (s_post == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_post(type, payload, len);
+    return ESP_OK;
+}
+
+void sync_sim_clock(double ppm, int64_t offset_us, int net_delay_us) {
+    shim_clock_ppm = ppm;
+    shim_clock_offset_us = offset_us;
+    shim_net_delay_us = net_delay_us;
+}
+
+int sync_sim_start(const char* host, int port, int period_s,
+                   sync_sim_post_t post) {
+    sync_cfg_t cfg = SYNC_CFG_DEFAULT();
+    snprintf(s_host, sizeof(s_host), "%s", host);
+    cfg.host = s_host;
+    cfg.port = port;
+    cfg.period_s = period_s;
+    s_post = post;
+    return sync_start(&cfg);
+}
+
+// The decoder's output: silence, as much as asked for
+static int sync_sim_in(void* ctx, char* buffer, int len) {
+    memset(buffer, 0, len);
+    return len;
+}
+
+static int sync_sim_out(void* ctx, char* buffer, int len) {
+    s_out_bytes += len;
+    return len;
+}
+
+audio_element_handle_t sync_sim_play_init(int dma_frames, int dma_rate) {
+    sync_play_cfg_t cfg = SYNC_PLAY_CFG_DEFAULT();
+    cfg.dma_frames = dma_frames;
+    cfg.dma_rate = dma_rate;
+    audio_element_handle_t el = sync_play_init(&cfg);
+    if (el) {
+        shim_element_io(el, sync_sim_in, sync_sim_out, NULL);
+    }
+    return el;
+}
+
+// Armed first, the decoder reports the format after its first frame
+int sync_sim_play_start(audio_element_handle_t el, int64_t start_us,
+                        int group, int rate, int channels) {
+    sync_play_arm(el, start_us, group);
+    sync_play_set_info(el, rate, channels);
+    return shim_element_open(el);
+}
+
+/*
+ * One buffer through the stage with rb_bytes in its output ringbuffer.
+ * Returns the bytes it wrote out, or the process result when it failed.
+ */
+int sync_sim_play_step(audio_element_handle_t el, int rb_bytes) {
+    shim_element_rb_fill(el, rb_bytes);
+    s_out_bytes = 0;
+    int r = shim_element_process(el);
+    return r < 0 ? r : s_out_bytes;
+}
+
+void sync_sim_play_stop(audio_element_handle_t el) {
+    shim_element_close(el);
+}
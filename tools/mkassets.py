@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+# Pack prompt files into a read-only asset image for the `storage` partition.
+#
+# Image layout (little endian, see main/m_assets.h):
+#   header  : magic 'APK1', u16 version, u16 count, u32 image_size,
+#             u32 generation (0 here, the updater numbers the packs it writes)
+#   entries : count * { char name[32], u32 offset, u32 size, u32 crc32, u32 reserved }
+#             sorted by name so the device can binary search them
+#   data    : each file starts on a 4 byte boundary
+#
+# A pack has to fit in half the `storage` partition so an update can be
+# written next to the one in use (main/m_assets.h).
+#
+# Usage: python mkassets.py -s 0x80000 ./tools ./tools/adf_assets.bin
+import os, sys, struct, binascii, argparse
+
+MAGIC = b'APK1'
+VERSION = 1
+NAME_LEN = 32
+HEADER_FMT = '<4sHHII'
+ENTRY_FMT = '<32sIIII'
+ALIGN = 4
+
+
+def align(n):
+    return (n + ALIGN - 1) & ~(ALIGN - 1)
+
+
+def pack(src_dir, exts):
+    names = sorted(f for f in os.listdir(src_dir)
+                   if os.path.splitext(f)[1].lower() in exts)
+    if not names:
+        raise SystemExit('no asset files found in {}'.format(src_dir))
+
+    offset = align(struct.calcsize(HEADER_FMT) +
+                   len(names) * struct.calcsize(ENTRY_FMT))
+    entries = []
+    blobs = []
+    for name in names:
+        if len(name.encode('utf-8')) >= NAME_LEN:
+            raise SystemExit('asset name too long: {}'.format(name))
+        with open(os.path.join(src_dir, name), 'rb') as f:
+            data = f.read()
+        crc = binascii.crc32(data) & 0xffffffff
+        entries.append(struct.pack(ENTRY_FMT, name.encode('utf-8'), offset,
+                                   len(data), crc, 0))
+        blobs.append((offset, data))
+        offset = align(offset + len(data))
+
+    image = bytearray(offset)
+    image[0:struct.calcsize(HEADER_FMT)] = struct.pack(
+        HEADER_FMT, MAGIC, VERSION, len(names), offset, 0)
+    pos = struct.calcsize(HEADER_FMT)
+    for e in entries:
+        image[pos:pos + len(e)] = e
+        pos += len(e)
+    for off, data in blobs:
+        image[off:off + len(data)] = data
+    return names, image
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a prompt asset pack')
+    parser.add_argument('-s', '--size', default='0x80000',
+                        help='half the partition size, the most a pack takes')
+    parser.add_argument('-e', '--ext', default='.mp3',
+                        help='comma separated file extensions to include')
+    parser.add_argument('src', help='directory holding the prompt files')
+    parser.add_argument('out', help='output image')
+    args = parser.parse_args()
+
+    size = int(args.size, 0)
+    exts = [e.strip().lower() for e in args.ext.split(',')]
+    names, image = pack(args.src, exts)
+    if len(image) > size:
+        raise SystemExit('image is {} bytes, partition is {}'.format(
+            len(image), size))
+    with open(args.out, 'wb') as f:
+        f.write(image)
+    for n in names:
+        print('  {}'.format(n))
+    print('{} assets packed into {}'.format(len(names), args.out))
+
+
+if __name__ == '__main__':
+    main()
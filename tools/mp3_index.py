@@ -0,0 +1,287 @@
+#!/usr/bin/env python
+# Frame index for long MP3 files on the SD card, see main/m_mp3_index.h.
+# The device builds a missing index in the background on first play; a
+# long file is quicker to index here before it is copied to the card.
+#
+# Usage:
+#   python mp3_index.py build card/BOOK.MP3 [...]
+#       writes card/BOOK.IDX next to each file
+#   python mp3_index.py seek card/BOOK.MP3 3723000
+#       frame to start from to play at 1:02:03
+#   python mp3_index.py bench --minutes 1 10 60 180 -o seek.json
+#       generates VBR files of each length and compares seeking through
+#       the index (binary search, what the device does) with scanning frame
+#       headers from the start (the best case without one)
+import os, json, time, zlib, struct, random, argparse, tempfile
+
+MAGIC = 0x3158504D  # "MPX1"
+VERSION = 1
+STEP_MS = 1000
+HEADER = struct.Struct('<IHHIIII8x')
+ENTRY = struct.Struct('<II')
+BUF = 4096
+PRINT_LEN = 4096
+RESYNC_MAX = 65536
+
+BITRATE_V1 = [0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+              320, 0]
+BITRATE_V2 = [0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160,
+              0]
+RATE = [[11025, 12000, 8000], None, [22050, 24000, 16000],
+        [44100, 48000, 32000]]
+
+
+def frame(h):
+    """Layer III frame at h: (length, samples, rate), length 0 otherwise"""
+    if len(h) < 3 or h[0] != 0xFF or (h[1] & 0xE0) != 0xE0:
+        return 0, 0, 0
+    version = (h[1] >> 3) & 3
+    layer = (h[1] >> 1) & 3
+    bitrate = h[2] >> 4
+    rate_index = (h[2] >> 2) & 3
+    if (version == 1 or layer != 1 or bitrate in (0, 15) or
+            rate_index == 3):
+        return 0, 0, 0
+    kbps = (BITRATE_V1 if version == 3 else BITRATE_V2)[bitrate]
+    rate = RATE[version][rate_index]
+    length = ((144000 if version == 3 else 72000) * kbps // rate +
+              ((h[2] >> 1) & 1))
+    return length, 1152 if version == 3 else 576, rate
+
+
+def id3_size(h):
+    if len(h) < 10 or h[:3] != b'ID3':
+        return 0
+    return (10 + ((h[6] & 0x7F) << 21 | (h[7] & 0x7F) << 14 |
+                  (h[8] & 0x7F) << 7 | (h[9] & 0x7F)) +
+            (10 if h[5] & 0x10 else 0))
+
+
+def fingerprint(f, size):
+    crc = 0
+    for at in (0, max(0, size - PRINT_LEN)):
+        f.seek(at)
+        crc = zlib.crc32(f.read(min(PRINT_LEN, size - at)), crc)
+    return crc & 0xffffffff
+
+
+def frames(f):
+    """(offset, start us, length us) of every frame, the way the device
+    scans: ID3v2 skipped, a header after garbage needs another behind it"""
+    base, buf, pos, skipped, us, first = 0, bytearray(), 0, 0, 0, True
+    while True:
+        if pos + 10 > base + len(buf):
+            f.seek(pos)
+            base, buf = pos, bytearray(f.read(BUF))
+            if len(buf) < 4:
+                return
+        h = buf[pos - base:pos - base + 10]
+        if first and len(h) == 10 and id3_size(h):
+            pos += id3_size(h)
+            continue
+        length, samples, rate = frame(h)
+        if length and skipped and pos + length + 4 <= base + len(buf):
+            if not frame(buf[pos - base + length:pos - base + length + 3])[0]:
+                length = 0
+        if not length:
+            skipped += 1
+            if skipped > RESYNC_MAX:
+                return
+            pos += 1
+            continue
+        skipped, first = 0, False
+        step = samples * 1000000 // rate
+        yield pos, us, step
+        us += step
+        pos += length
+
+
+def index_path(path):
+    root, ext = os.path.splitext(path)
+    return root + '.IDX'
+
+
+def build(path):
+    """Write the index next to path, as mp3_index_build() does"""
+    size = os.path.getsize(path)
+    entries, next_ms, end_us = [], 0, 0
+    with open(path, 'rb') as f:
+        print_ = fingerprint(f, size)
+        for pos, us, step in frames(f):
+            ms = us // 1000
+            if ms >= next_ms:
+                entries.append((ms, pos))
+                next_ms = (ms // STEP_MS + 1) * STEP_MS
+            end_us = us + step
+    if not entries:
+        raise SystemExit('{}: no MP3 frames'.format(path))
+    out = index_path(path)
+    with open(out, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, STEP_MS, size, print_,
+                            len(entries), end_us // 1000))
+        for e in entries:
+            f.write(ENTRY.pack(*e))
+    return out, entries, end_us // 1000
+
+
+class Index(object):
+    """The device's lookup: check the header, binary search the entries"""
+
+    def __init__(self, path):
+        self.reads = 0
+        size = os.path.getsize(path)
+        self.f = open(index_path(path), 'rb')
+        hdr = HEADER.unpack(self.f.read(HEADER.size))
+        magic, version, step, file_size, print_, self.count, self.ms = hdr
+        with open(path, 'rb') as mp3:
+            ok = fingerprint(mp3, size) == print_
+        if (magic != MAGIC or version != VERSION or file_size != size or
+                not self.count or not ok):
+            self.f.close()
+            raise ValueError('{}: no valid index'.format(path))
+
+    def entry(self, i):
+        self.reads += 1
+        self.f.seek(HEADER.size + i * ENTRY.size)
+        return ENTRY.unpack(self.f.read(ENTRY.size))
+
+    def seek(self, ms):
+        lo, hi, found = 0, self.count, self.entry(0)
+        while hi - lo > 1:
+            mid = lo + (hi - lo) // 2
+            e = self.entry(mid)
+            if e[0] <= ms:
+                lo, found = mid, e
+            else:
+                hi = mid
+        return found
+
+    def close(self):
+        self.f.close()
+
+
+def cmd_build(args):
+    for path in args.files:
+        out, entries, ms = build(path)
+        print('{}: {} entries, {} s of audio, {} bytes'.format(
+            out, len(entries), ms // 1000, os.path.getsize(out)))
+
+
+def cmd_seek(args):
+    idx = Index(args.file)
+    ms, offset = idx.seek(args.ms)
+    print('{} ms: frame at byte {} ({} ms), {} entry reads'.format(
+        args.ms, offset, ms, idx.reads))
+
+
+def synth(path, minutes, seed):
+    """VBR MPEG-1 Layer III at 44.1 kHz, 32 to 128 kbps, silent payload"""
+    rnd = random.Random(seed)
+    frames_needed = int(minutes * 60 * 44100 / 1152)
+    cache = {}
+    with open(path, 'wb') as f:
+        f.write(b'ID3\x03\x00\x00\x00\x00\x02\x00' + b'\x00' * 256)
+        for i in range(frames_needed):
+            bitrate = rnd.randint(1, 9)
+            pad = rnd.random() < 0.3
+            key = (bitrate, pad)
+            if key not in cache:
+                h = bytearray([0xFF, 0xFB, bitrate << 4 | (2 if pad else 0),
+                               0xC4])
+                length = frame(h)[0]
+                cache[key] = bytes(h) + b'\x00' * (length - 4)
+            f.write(cache[key])
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def cmd_bench(args):
+    rnd = random.Random(1)
+    tmp = tempfile.mkdtemp(prefix='mp3_index')
+    rows = []
+    try:
+        for minutes in args.minutes:
+            path = os.path.join(tmp, 'B{}.MP3'.format(int(minutes)))
+            synth(path, minutes, int(minutes))
+            start = time.time()
+            out, entries, ms = build(path)
+            build_s = time.time() - start
+            targets = [rnd.randrange(ms) for i in range(args.seeks)]
+            seek_us, reads = [], []
+            for t in targets:
+                start = time.time()
+                idx = Index(path)
+                found = idx.seek(t)
+                seek_us.append((time.time() - start) * 1e6)
+                reads.append(idx.reads)
+                idx.close()
+                assert found[0] <= t < found[0] + 2 * STEP_MS
+            # Without an index every seek reads the file up to the target
+            scan_ms, scan_bytes = [], []
+            for t in targets[:args.scans]:
+                start = time.time()
+                with open(path, 'rb') as f:
+                    for pos, us, step in frames(f):
+                        if us + step > t * 1000:
+                            break
+                scan_ms.append((time.time() - start) * 1e3)
+                scan_bytes.append(pos)
+            row = {
+                'minutes': minutes,
+                'mp3_bytes': os.path.getsize(path),
+                'index_bytes': os.path.getsize(out),
+                'entries': len(entries),
+                'build_s': round(build_s, 3),
+                'seek_us_mean': round(sum(seek_us) / len(seek_us), 1),
+                'seek_us_p99': round(percentile(seek_us, 0.99), 1),
+                'entry_reads_max': max(reads),
+                'scan_ms_mean': round(sum(scan_ms) / len(scan_ms), 1),
+                'scan_kb_mean': sum(scan_bytes) // len(scan_bytes) // 1024,
+            }
+            rows.append(row)
+            print('{minutes:>6} min  {mp3_bytes:>10} B  index {index_bytes:>7}'
+                  ' B  seek {seek_us_mean:>7} us p99 {seek_us_p99:>7} us  '
+                  '{entry_reads_max:>2} reads  scan {scan_ms_mean:>7} ms '
+                  '{scan_kb_mean:>6} KB  build {build_s} s'
+                  .format(**row))
+            os.unlink(path)
+            os.unlink(out)
+    finally:
+        for name in os.listdir(tmp):
+            os.unlink(os.path.join(tmp, name))
+        os.rmdir(tmp)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(json.dumps(rows, indent=2) + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='MP3 frame index')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('build', help='write the index next to each file')
+    p.add_argument('files', nargs='+')
+    p.set_defaults(func=cmd_build)
+    p = sub.add_parser('seek', help='look up a time in an index')
+    p.add_argument('file')
+    p.add_argument('ms', type=int)
+    p.set_defaults(func=cmd_seek)
+    p = sub.add_parser('bench', help='seek latency against file length')
+    p.add_argument('--minutes', type=float, nargs='+',
+                   default=[1, 10, 60, 180])
+    p.add_argument('--seeks', type=int, default=200,
+                   help='indexed seeks per file')
+    p.add_argument('--scans', type=int, default=5,
+                   help='seeks by scanning per file')
+    p.add_argument('-o', '--output', help='write the JSON result here')
+    p.set_defaults(func=cmd_bench)
+    args = parser.parse_args()
+    if not hasattr(args, 'func'):
+        parser.error('build, seek or bench')
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
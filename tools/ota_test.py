@@ -0,0 +1,275 @@
+#!/usr/bin/env python
+# Background update test: publish firmware and prompt pack updates for the
+# device to fetch from server.py (CONFIG_OTA_ENABLE, see main/m_ota.h) and
+# measure what a running update costs the audio.
+#
+# Usage:
+#   python ota_test.py publish . --app build/record_wav.bin \
+#       --assets tools/adf_assets.bin
+#       writes ai/ota/manifest.txt under the directory server.py serves,
+#       each image one version above the one published before; the device
+#       reads it from server.py's TLS port. The app image size is printed
+#       against the slot of partitions_ota.csv and must fit it
+#   python ota_test.py run 192.168.0.120:8080 --root . --app build/record_wav.bin \
+#       --play http://192.168.0.174:8000/ai/tts/output.mp3 -o ota.json
+#
+# run needs the metrics endpoint and the control channel on the device and
+# OTA_PERIOD_S short enough to wait for. It pushes --plays playbacks over
+# the control channel without an update, publishes the update and pushes
+# the same playbacks while it downloads, then compares wake detection time
+# per chunk, pipeline start latency, underruns and the audio the I2S reader
+# of the wake detection dropped (overrun_ms_total) in both windows. It
+# exits non-zero when the update fails or the audio got worse by more than
+# the tolerances. Pushes carry CTRL_TOKEN from the environment, the token
+# server.py was started with.
+import os, sys, json, time, shutil, hashlib, argparse
+
+try:
+    from urllib.request import urlopen, Request
+except ImportError:
+    from urllib2 import urlopen, Request
+
+OTA_DIR = os.path.join('ai', 'ota')
+KINDS = ('app', 'assets')
+PARTITIONS = os.path.join(os.path.dirname(os.path.dirname(
+    os.path.abspath(__file__))), 'partitions_ota.csv')
+
+
+def parse_size(text):
+    for suffix, scale in (('K', 1024), ('M', 1024 * 1024)):
+        if text.upper().endswith(suffix):
+            return int(text[:-1], 0) * scale
+    return int(text, 0)
+
+
+# Size of an app slot, both are the same
+def app_slot_size(path):
+    with open(path) as f:
+        for line in f:
+            fields = [x.strip() for x in line.split('#')[0].split(',')]
+            if len(fields) >= 5 and fields[0] == 'ota_0':
+                return parse_size(fields[4])
+    raise SystemExit('no ota_0 partition in {}'.format(path))
+
+
+def read_manifest(path):
+    items = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) == 5:
+                    items[fields[0]] = fields
+    return items
+
+
+def publish(args):
+    out = os.path.join(args.root, OTA_DIR)
+    if not os.path.isdir(out):
+        os.makedirs(out)
+    path = os.path.join(out, 'manifest.txt')
+    items = read_manifest(path)
+    published = 0
+    for kind in KINDS:
+        src = getattr(args, kind)
+        if not src:
+            continue
+        with open(src, 'rb') as f:
+            data = f.read()
+        if kind == 'app':
+            slot = app_slot_size(args.partitions)
+            print('  app image {} bytes of a {} byte slot, {:.1f}%'.format(
+                len(data), slot, 100.0 * len(data) / slot))
+            if len(data) > slot:
+                raise SystemExit('the app image does not fit its slot')
+        old = int(items[kind][1]) if kind in items else 0
+        version = args.version or old + 1
+        name = '{}.bin'.format(kind)
+        with open(os.path.join(out, name), 'wb') as f:
+            f.write(data)
+        items[kind] = [kind, str(version), str(len(data)),
+                       hashlib.sha256(data).hexdigest(),
+                       '/{}/{}'.format(OTA_DIR.replace(os.sep, '/'), name)]
+        print('  {} {} {} bytes'.format(kind, version, len(data)))
+        published += 1
+    if not published:
+        raise SystemExit('nothing to publish, give --app or --assets')
+    # The device may fetch the manifest at any time, replace it at once
+    with open(path + '.tmp', 'w') as f:
+        for kind in KINDS:
+            if kind in items:
+                f.write(' '.join(items[kind]) + '\n')
+    shutil.move(path + '.tmp', path)
+    print('manifest {}'.format(path))
+    return published
+
+
+def scrape(device):
+    text = urlopen('http://{}/metrics'.format(device), timeout=10).read()
+    values = {}
+    for line in text.decode('utf-8').splitlines():
+        if line and not line.startswith('#'):
+            key, _, value = line.rpartition(' ')
+            values[key] = float(value)
+    return values
+
+
+def delta(a, b):
+    return dict((k, b[k] - a.get(k, 0)) for k in b)
+
+
+# Mean and the bucket bound a share p of the observations stays under
+def hist(d, name, p):
+    count = d.get(name + '_count', 0)
+    if not count:
+        return {'count': 0, 'mean': None, 'p{}'.format(int(p * 100)): None}
+    buckets = []
+    prefix = name + '_bucket{le="'
+    for key, value in d.items():
+        if key.startswith(prefix):
+            le = key[len(prefix):-2]
+            buckets.append((float('inf') if le == '+Inf' else float(le),
+                            value))
+    bound = None
+    for le, cumulative in sorted(buckets):
+        if cumulative >= p * count:
+            bound = le if le != float('inf') else 'inf'
+            break
+    return {'count': int(count), 'mean': d[name + '_sum'] / count,
+            'p{}'.format(int(p * 100)): bound}
+
+
+def summary(d):
+    return {
+        'wake_detect_chunk_us': hist(d, 'wake_detect_chunk_us', 0.99),
+        'pipeline_start_ms': hist(d, 'pipeline_start_ms', 0.9),
+        'underruns': int(sum(v for k, v in d.items()
+                             if k.startswith('underrun_total'))),
+        'overrun_ms': int(sum(v for k, v in d.items()
+                              if k.startswith('overrun_ms_total'))),
+    }
+
+
+def push_plays(args):
+    for i in range(args.plays):
+        req = Request(args.server.rstrip('/') + '/ai/ctrl/play',
+                      data=args.play.encode('utf-8'),
+                      headers={'Authorization': 'Bearer ' +
+                               os.environ.get('CTRL_TOKEN', '')})
+        body = urlopen(req, timeout=10).read().decode('utf-8')
+        if 'seq' not in body:
+            raise SystemExit('play not pushed: {}'.format(body.strip()))
+        time.sleep(args.gap)
+
+
+def wait_for(args, test, what):
+    deadline = time.time() + args.timeout
+    while time.time() < deadline:
+        m = scrape(args.device)
+        if test(m):
+            return m
+        time.sleep(2)
+    raise SystemExit('timed out waiting for {}'.format(what))
+
+
+def run(args):
+    m0 = scrape(args.device)
+    print('baseline: {} plays'.format(args.plays))
+    push_plays(args)
+    m1 = scrape(args.device)
+
+    items = publish(args)
+    print('waiting for the device to start downloading')
+    m2 = wait_for(args, lambda m: m.get('ota_bytes_total', 0) >
+                  m1.get('ota_bytes_total', 0), 'the download')
+    start = time.time()
+    print('update: {} plays'.format(args.plays))
+    push_plays(args)
+    done = lambda m: (m.get('ota_update_total', 0) +
+                      m.get('ota_failure_total', 0) -
+                      m1.get('ota_update_total', 0) -
+                      m1.get('ota_failure_total', 0) >= items)
+    m3 = wait_for(args, done, 'the update to finish')
+
+    base = summary(delta(m0, m1))
+    during = summary(delta(m2, m3))
+    d = delta(m2, m3)
+    result = {
+        'baseline': base,
+        'update': during,
+        'ota': {
+            'seconds': round(time.time() - start, 1),
+            'bytes': int(delta(m1, m3).get('ota_bytes_total', 0)),
+            'paused_ms': int(d.get('ota_paused_ms_total', 0)),
+            'chunk_us': hist(d, 'ota_chunk_us', 0.99),
+            'failures': int(delta(m1, m3).get('ota_failure_total', 0)),
+        },
+    }
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    print(text)
+
+    failed = []
+    if result['ota']['failures']:
+        failed.append('update failed on the device, see its log')
+    checks = [('wake_detect_chunk_us', args.detect_tol),
+              ('pipeline_start_ms', args.start_tol)]
+    for name, tol in checks:
+        b, u = base[name]['mean'], during[name]['mean']
+        if b is not None and u is not None and u > b * (1 + tol):
+            failed.append('{} mean {:.0f} -> {:.0f}'.format(name, b, u))
+    if during['underruns'] > base['underruns']:
+        failed.append('underruns {} -> {}'.format(base['underruns'],
+                                                  during['underruns']))
+    if during['overrun_ms'] > base['overrun_ms'] + args.overrun_tol:
+        failed.append('overrun ms {} -> {}'.format(base['overrun_ms'],
+                                                   during['overrun_ms']))
+    for line in failed:
+        sys.stderr.write('regression {}\n'.format(line))
+    if failed:
+        sys.exit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Background update test')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('publish', help='publish images for the device')
+    p.add_argument('root', help='directory server.py serves from')
+    p.set_defaults(func=publish)
+    images = [p]
+    p = sub.add_parser('run', help='measure an update against a device')
+    p.add_argument('device', help='host:port of the metrics endpoint')
+    p.add_argument('--root', default='.',
+                   help='directory server.py serves from')
+    p.add_argument('--server', default='http://localhost:8000',
+                   help='server.py as seen from here')
+    p.add_argument('--play', required=True,
+                   help='MP3 URL as seen from the device')
+    p.add_argument('--plays', type=int, default=5)
+    p.add_argument('--gap', type=float, default=15,
+                   help='seconds between plays, longer than one play')
+    p.add_argument('--timeout', type=float, default=1800)
+    p.add_argument('-o', '--output', help='write the JSON result here')
+    p.add_argument('--detect-tol', type=float, default=0.10)
+    p.add_argument('--start-tol', type=float, default=0.20)
+    p.add_argument('--overrun-tol', type=int, default=50,
+                   help='ms of mic audio the update may drop on top')
+    p.set_defaults(func=run)
+    images.append(p)
+    for p in images:
+        p.add_argument('--app', help='firmware image, build/<project>.bin')
+        p.add_argument('--assets', help='prompt pack from mkassets.py')
+        p.add_argument('--version', type=int,
+                       help='version to publish, default one up')
+        p.add_argument('--partitions', default=PARTITIONS,
+                       help='partition table the device runs')
+    args = parser.parse_args()
+    if not hasattr(args, 'func'):
+        parser.error('publish or run')
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
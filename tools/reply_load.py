@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+# Load benchmark of reply serving in server.py: the in-memory reply store
+# against serving every request from disk (REPLY_STORE_BYTES=0).
+#
+# Usage:
+#   python3 reply_load.py --python python2 -c 16 -d 10 -o load.json
+#       writes --replies MP3s of --size-kb each to a scratch directory and
+#       starts server.py there once per mode on free ports. Two loads of
+#       -d seconds from -c connections each:
+#       files   GETs of the MP3s: a few most of the time (Zipf, --zipf) and
+#               a one-off for --one-off of the requests, like a server
+#               where most answers repeat. The store is kept smaller than
+#               all of them together (--store-kb) so eviction matters.
+#       replies the device's flow, an upload and a GET of its reply.
+#               Every reply has its own content, so the store cannot hit
+#               and the TTS stand-in sets the rate in both modes; the
+#               flow checks that the store costs the replies nothing.
+#
+# Each request is a new connection, as from the device. Reported per mode:
+# requests per second, client time to first body byte, throughput, and
+# the server's own hit rate and time to first byte from /ai/store. Exits
+# non-zero when a body differs from its file or a request failed.
+import os, sys, json, time, random, shutil, socket, argparse, tempfile
+import threading, subprocess
+from urllib.request import urlopen
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(ROOT, 'server.py')
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def make_replies(directory, args):
+    """name -> bytes; the source repeated to size, each with its own ID3v1
+    title so every reply has its own ETag"""
+    with open(args.source, 'rb') as f:
+        source = f.read()
+    body = source * (args.size_kb * 1024 // len(source) + 1)
+    body = body[:args.size_kb * 1024]
+    replies = {}
+    os.makedirs(os.path.join(directory, 'ai', 'tts'))
+    for i in range(args.replies + args.one_offs):
+        name = 'ai/tts/r{:05d}.mp3'.format(i)
+        tag = b'TAG' + 'reply {}'.format(i).encode('ascii').ljust(125, b'\0')
+        replies[name] = body + tag
+        with open(os.path.join(directory, name), 'wb') as f:
+            f.write(replies[name])
+    return replies
+
+
+def request(port, path, upload=None):
+    """Status, body and seconds to the first body byte; an upload is sent
+    as the device does, one chunk of 16 kHz mono"""
+    start = time.perf_counter()
+    sock = socket.create_connection(('127.0.0.1', port), timeout=30)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    if upload is None:
+        sock.sendall('GET /{} HTTP/1.1\r\nHost: localhost\r\n'
+                     'Connection: close\r\n\r\n'.format(path).encode('ascii'))
+    else:
+        sock.sendall('POST /{} HTTP/1.1\r\nHost: localhost\r\n'
+                     'Transfer-Encoding: chunked\r\n'
+                     'x-audio-sample-rates: 16000\r\nx-audio-bits: 16\r\n'
+                     'x-audio-channel: 1\r\n\r\n{:x}\r\n'.format(
+                         path, len(upload)).encode('ascii') +
+                     upload + b'\r\n0\r\n\r\n')
+    data, ttfb = b'', None
+    while True:
+        block = sock.recv(65536)
+        if not block:
+            break
+        data += block
+        if ttfb is None:
+            head = data.find(b'\r\n\r\n')
+            if head >= 0 and len(data) > head + 4:
+                ttfb = time.perf_counter() - start
+    sock.close()
+    head, _, body = data.partition(b'\r\n\r\n')
+    lines = head.decode('latin-1').split('\r\n')
+    status = int(lines[0].split(' ')[1])
+    if 'transfer-encoding: chunked' in head.decode('latin-1').lower():
+        out, at = [], 0
+        while True:
+            end = body.index(b'\r\n', at)
+            size = int(body[at:end], 16)
+            if not size:
+                break
+            out.append(body[end + 2:end + 2 + size])
+            at = end + 4 + size
+        body = b''.join(out)
+    return status, body, ttfb
+
+
+def get_reply(port):
+    """The device's flow: the reply named by the upload's response, and
+    its id"""
+    status, body, _ = request(port, 'upload', UPLOAD)
+    if status != 200:
+        return status, body, None, None
+    reply_id = body.decode('latin-1').split('reply_id: ')[1].split()[0]
+    return request(port, 'ai/reply/' + reply_id) + (reply_id,)
+
+
+def tts_stand_in(source, reply_id):
+    """What server.py says for an upload: its TTS source tagged with the
+    reply id"""
+    return source + b'TAG' + 'reply {}'.format(reply_id).encode(
+        'ascii').ljust(125, b'\0')
+
+UPLOAD = bytes(3200)
+
+
+def load(port, replies, args, flow):
+    names = sorted(replies)
+    hot, cold = names[:args.replies], names[args.replies:]
+    reply = replies[names[0]]
+    weights = [1.0 / (i + 1) ** args.zipf for i in range(len(hot))]
+    ttfbs, errors, byte_count = [], [], [0]
+    lock = threading.Lock()
+    cold_next = [0]
+    stop = time.time() + args.d
+
+    def worker(seed):
+        rnd = random.Random(seed)
+        while time.time() < stop:
+            name = None
+            if flow == 'replies':
+                name = 'reply'
+            elif cold and rnd.random() < args.one_off:
+                with lock:
+                    if cold_next[0] < len(cold):
+                        name = cold[cold_next[0]]
+                        cold_next[0] += 1
+            if name is None:
+                name = rnd.choices(hot, weights)[0]
+            try:
+                if name == 'reply':
+                    status, body, ttfb, reply_id = get_reply(port)
+                    want = tts_stand_in(reply, reply_id)
+                else:
+                    status, body, ttfb = request(port, name)
+                    want = replies[name]
+            except (OSError, ValueError, IndexError) as e:
+                with lock:
+                    errors.append('{}: {}'.format(name, e))
+                continue
+            with lock:
+                if status != 200 or body != want:
+                    errors.append('{}: status {}, {} bytes'.format(
+                        name, status, len(body)))
+                else:
+                    ttfbs.append(ttfb)
+                    byte_count[0] += len(body)
+
+    start = time.time()
+    threads = [threading.Thread(target=worker, args=(i,))
+               for i in range(args.c)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - start
+    ttfbs.sort()
+    pct = lambda p: round(ttfbs[min(len(ttfbs) - 1, int(len(ttfbs) * p))]
+                          * 1000, 3) if ttfbs else None
+    return {'requests': len(ttfbs), 'errors': len(errors),
+            'rps': round(len(ttfbs) / elapsed, 1),
+            'mb_s': round(byte_count[0] / elapsed / 1e6, 2),
+            'ttfb_ms_p50': pct(0.5), 'ttfb_ms_p90': pct(0.9),
+            'ttfb_ms_p99': pct(0.99)}, errors
+
+
+def cpu_s(pid):
+    """User and system time of a process, Linux only"""
+    try:
+        with open('/proc/{}/stat'.format(pid)) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+    except (OSError, IndexError):
+        return 0.0
+
+
+def run_mode(directory, replies, args, store_bytes, flow):
+    env = dict(os.environ, PORT=str(free_port()), SYNC_PORT=str(free_port()),
+               TLS_PORT=str(free_port()), REPLY_STORE_BYTES=str(store_bytes))
+    port = int(env['PORT'])
+    with open(os.path.join(directory, 'server.log'), 'ab') as log:
+        server = subprocess.Popen([args.python, '-u', SERVER], cwd=directory,
+                                  env=env, stdout=log, stderr=log)
+    try:
+        for i in range(50):
+            try:
+                socket.create_connection(('127.0.0.1', port), 0.2).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        else:
+            raise SystemExit('server.py did not start, see {}'.format(
+                os.path.join(directory, 'server.log')))
+        cpu = cpu_s(server.pid)
+        client, errors = load(port, replies, args, flow)
+        # Client and server may share cores, CPU per request is comparable
+        client['server_cpu_ms'] = round((cpu_s(server.pid) - cpu) * 1000 /
+                                        max(1, client['requests']), 3)
+        server_stats = json.loads(urlopen(
+            'http://127.0.0.1:{}/ai/store'.format(port), timeout=10).read())
+    finally:
+        server.terminate()
+        server.wait()
+    return {'client': client, 'server': server_stats}, errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description='reply serving load test')
+    parser.add_argument('--python', default='python2',
+                        help='interpreter for server.py')
+    parser.add_argument('--source', default=os.path.join(ROOT, 'tools',
+                                                         'wlydkqcxlj.mp3'))
+    parser.add_argument('--replies', type=int, default=32,
+                        help='replies that repeat')
+    parser.add_argument('--size-kb', type=int, default=48)
+    parser.add_argument('--zipf', type=float, default=1.1)
+    parser.add_argument('--one-off', type=float, default=0.1,
+                        help='share of requests for a reply never seen')
+    parser.add_argument('--one-offs', type=int, default=1000,
+                        help='one-off replies written')
+    parser.add_argument('--store-kb', type=int, default=1024)
+    parser.add_argument('-c', type=int, default=16, help='connections')
+    parser.add_argument('-d', type=float, default=10, help='seconds per mode')
+    parser.add_argument('-o', '--output', help='write the JSON result here')
+    args = parser.parse_args()
+
+    directory = tempfile.mkdtemp(prefix='reply_load')
+    try:
+        replies = make_replies(directory, args)
+        # server.py's TTS stand-in answers every upload with this, tagged
+        shutil.copy(os.path.join(directory, sorted(replies)[0]),
+                    os.path.join(directory, 'ai', 'tts', 'output.mp3'))
+        result, failed = {}, []
+        for flow in ('files', 'replies'):
+            result[flow] = {}
+            for mode, store_bytes in (('file', 0),
+                                      ('store', args.store_kb * 1024)):
+                result[flow][mode], errors = run_mode(
+                    directory, replies, args, store_bytes, flow)
+                failed += ['{} {}: {}'.format(flow, mode, e)
+                           for e in errors[:10]]
+            f = result[flow]['file']['client']
+            s = result[flow]['store']['client']
+            result[flow]['speedup'] = {
+                'rps': round(s['rps'] / f['rps'], 2) if f['rps'] else None,
+                'ttfb_p50': round(f['ttfb_ms_p50'] / s['ttfb_ms_p50'], 2)
+                            if f['ttfb_ms_p50'] and s['ttfb_ms_p50'] else None,
+            }
+            print('{:8} rps {} -> {}, ttfb p50 {} -> {} ms (server {} -> {} '
+                  'ms), hit rate {}'.format(
+                      flow, f['rps'], s['rps'], f['ttfb_ms_p50'],
+                      s['ttfb_ms_p50'],
+                      result[flow]['file']['server']['ttfb_ms_p50'],
+                      result[flow]['store']['server']['ttfb_ms_p50'],
+                      result[flow]['store']['server']['hit_rate']))
+    finally:
+        shutil.rmtree(directory)
+
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as out:
+            out.write(text + '\n')
+    print(text)
+    for line in failed:
+        sys.stderr.write('error {}\n'.format(line))
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
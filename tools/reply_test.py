@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+# Concurrency test of the per-upload replies in server.py.
+#
+# Usage:
+#   python3 reply_test.py --python python2 -c 16 -n 4
+#       starts server.py on a scratch directory and free ports, twice:
+#       fetch   -c devices upload -n times each, all at once, and GET their
+#               reply as soon as the upload returns. Every GET must find
+#               the reply (the id is never ahead of its file) and get that
+#               reply's own bytes, with the SHA-1 of them as its ETag; the
+#               ETag sent back in If-None-Match must give 304.
+#       evict   the same uploads against REPLY_KEEP=4 REPLY_KEEP_S=0,
+#               nobody fetching: replies are evicted while they are still
+#               being generated, and once the generators are done exactly
+#               the 4 newest files may be left in ai/reply.
+#
+# Exits non-zero on the first kind of failure, listing what went wrong.
+import os, sys, time, shutil, socket, hashlib, argparse, tempfile
+import threading, subprocess
+
+from reply_load import ROOT, SERVER, free_port, request
+
+UPLOAD = bytes(3200)
+
+
+def tts_stand_in(source, reply_id):
+    """What server.py says for an upload"""
+    return source + b'TAG' + 'reply {}'.format(reply_id).encode(
+        'ascii').ljust(125, b'\0')
+
+
+def head(port, path, etag):
+    sock = socket.create_connection(('127.0.0.1', port), timeout=30)
+    sock.sendall('GET /{} HTTP/1.1\r\nHost: localhost\r\nIf-None-Match: {}'
+                 '\r\nConnection: close\r\n\r\n'.format(path, etag).encode(
+                     'ascii'))
+    data = b''
+    while True:
+        block = sock.recv(65536)
+        if not block:
+            break
+        data += block
+    sock.close()
+    return int(data.split(b' ')[1])
+
+
+def etag_of(port, path):
+    sock = socket.create_connection(('127.0.0.1', port), timeout=30)
+    sock.sendall('HEAD /{} HTTP/1.1\r\nHost: localhost\r\n'
+                 'Connection: close\r\n\r\n'.format(path).encode('ascii'))
+    data = b''
+    while True:
+        block = sock.recv(65536)
+        if not block:
+            break
+        data += block
+    sock.close()
+    for line in data.decode('latin-1').split('\r\n'):
+        if line.lower().startswith('etag:'):
+            return line.split(':', 1)[1].strip()
+    return None
+
+
+def upload(port):
+    status, body, _ = request(port, 'upload', UPLOAD)
+    if status != 200:
+        raise ValueError('upload status {}'.format(status))
+    return body.decode('latin-1').split('reply_id: ')[1].split()[0]
+
+
+def start(directory, python, env):
+    port = free_port()
+    env = dict(os.environ, PORT=str(port), SYNC_PORT=str(free_port()),
+               TLS_PORT=str(free_port()), **env)
+    log = open(os.path.join(directory, 'server.log'), 'ab')
+    server = subprocess.Popen([python, '-u', SERVER], cwd=directory, env=env,
+                              stdout=log, stderr=log)
+    for i in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return server, port
+        except OSError:
+            time.sleep(0.1)
+    server.terminate()
+    raise SystemExit('server.py did not start, see {}'.format(
+        os.path.join(directory, 'server.log')))
+
+
+def run_clients(args, work):
+    errors, results = [], []
+    lock = threading.Lock()
+
+    def client():
+        for i in range(args.n):
+            try:
+                result = work()
+            except (OSError, ValueError, IndexError) as e:
+                result = None
+                with lock:
+                    errors.append(str(e))
+            with lock:
+                results.append(result)
+
+    threads = [threading.Thread(target=client) for i in range(args.c)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return results, errors
+
+
+def fetch(directory, source, args):
+    server, port = start(directory, args.python, {})
+    try:
+        def work():
+            reply_id = upload(port)
+            path = 'ai/reply/' + reply_id
+            status, body, _ = request(port, path)
+            want = tts_stand_in(source, reply_id)
+            if status != 200:
+                raise ValueError('{}: status {}'.format(reply_id, status))
+            if body != want:
+                raise ValueError('{}: {} bytes, not its own {}'.format(
+                    reply_id, len(body), len(want)))
+            etag = etag_of(port, path)
+            if etag != '"{}"'.format(hashlib.sha1(want).hexdigest()):
+                raise ValueError('{}: ETag {}'.format(reply_id, etag))
+            if head(port, path, etag) != 304:
+                raise ValueError('{}: If-None-Match not 304'.format(reply_id))
+            return etag
+
+        etags, errors = run_clients(args, work)
+    finally:
+        server.terminate()
+        server.wait()
+    etags = [e for e in etags if e]
+    if len(set(etags)) != len(etags):
+        errors.append('{} replies share {} ETags'.format(len(etags),
+                                                        len(set(etags))))
+    print('fetch: {} replies, {} errors'.format(len(etags), len(errors)))
+    return errors
+
+
+def evict(directory, source, args):
+    keep = 4
+    shutil.rmtree(os.path.join(directory, 'ai', 'reply'), True)
+    server, port = start(directory, args.python,
+                         {'REPLY_KEEP': str(keep), 'REPLY_KEEP_S': '0'})
+    try:
+        ids, errors = run_clients(args, lambda: upload(port))
+        # Every generator is done after the length of one reply
+        time.sleep(len(source) / (16 * 1024) + 2)
+        left = sorted(os.listdir(os.path.join(directory, 'ai', 'reply')))
+        status, _, _ = request(port, 'ai/reply/' + ids[0])
+    finally:
+        server.terminate()
+        server.wait()
+    if len(left) != keep:
+        errors.append('{} reply files left, {} kept: {}'.format(
+            len(left), keep, ' '.join(left)))
+    if status != 404:
+        errors.append('evicted {} gives {}'.format(ids[0], status))
+    print('evict: {} uploads, {} files left'.format(len(ids), len(left)))
+    return errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description='server.py reply test')
+    parser.add_argument('--python', default='python2',
+                        help='interpreter for server.py')
+    parser.add_argument('--source', default=os.path.join(ROOT, 'tools',
+                                                         'wlydkqcxlj.mp3'))
+    parser.add_argument('-c', type=int, default=16, help='devices')
+    parser.add_argument('-n', type=int, default=4, help='uploads each')
+    args = parser.parse_args()
+
+    with open(args.source, 'rb') as f:
+        source = f.read()
+    directory = tempfile.mkdtemp(prefix='reply_test')
+    try:
+        os.makedirs(os.path.join(directory, 'ai', 'tts'))
+        shutil.copy(args.source,
+                    os.path.join(directory, 'ai', 'tts', 'output.mp3'))
+        errors = fetch(directory, source, args)
+        errors += evict(directory, source, args)
+    finally:
+        shutil.rmtree(directory)
+    for line in errors[:20]:
+        sys.stderr.write('error {}\n'.format(line))
+    if errors:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
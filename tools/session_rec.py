@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+# Split a session recording (CONFIG_SESSION_REC_ENABLE, see
+# main/m_session_rec.h) into WAV files and an event list.
+#
+# Record layout (little endian), records never cross a block:
+#   u8 type, u8 reserved, u16 len, u32 time_ms, len bytes padded to 8
+#
+# Usage: python session_rec.py [-b 4096] S0000001.REC [S0000002.REC ...] out/
+#   out/mic.wav      16 kHz mono frames WakeNet saw
+#   out/upload.wav   bytes posted to the server (a WAV of its own)
+#   out/reply_<rate>_<ch>.wav
+#                    decoded replies, one file per format: a reply's PCM
+#                    goes to the format of its reply_info event
+#   out/events.txt   time_ms, event, plus a line per stream gap
+import os, re, sys, struct, wave, argparse
+
+HDR_FMT = '<BBHI'
+HDR_LEN = struct.calcsize(HDR_FMT)
+MIC, UPLOAD, REPLY, EVENT, PAD = range(5)
+STREAMS = {MIC: 'mic', UPLOAD: 'upload', REPLY: 'reply'}
+REPLY_DEFAULT = (44100, 2)  # PCM of a reply that never got its format
+
+
+def records(data, block_size):
+    for base in range(0, len(data) - block_size + 1, block_size):
+        pos = 0
+        while pos + HDR_LEN <= block_size:
+            rtype, _, length, time_ms = struct.unpack_from(
+                HDR_FMT, data, base + pos)
+            start = base + pos + HDR_LEN
+            if rtype > PAD or pos + HDR_LEN + length > block_size:
+                raise SystemExit('bad record at offset {}'.format(base + pos))
+            if rtype == PAD:
+                break
+            yield rtype, time_ms, data[start:start + length]
+            pos += (HDR_LEN + length + 7) & ~7
+
+
+def write_wav(path, pcm, rate, channels):
+    w = wave.open(path, 'wb')
+    w.setnchannels(channels)
+    w.setsampwidth(2)
+    w.setframerate(rate)
+    w.writeframes(bytes(pcm))
+    w.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Split session recordings')
+    parser.add_argument('-b', '--block', type=int, default=4096,
+                        help='CONFIG_SESSION_REC_BLOCK_KB * 1024')
+    parser.add_argument('files', nargs='+', help='.REC files, in order')
+    parser.add_argument('out', help='output directory')
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.out):
+        os.makedirs(args.out)
+    streams = dict((t, bytearray()) for t in STREAMS)
+    last_ms = dict((t, None) for t in STREAMS)
+    # The tap may record a reply's first PCM before its reply_info event
+    # is written, so it waits in `pending` until the format is known
+    replies = {}
+    reply_fmt = None
+    pending = bytearray()
+    events = []
+    for name in args.files:
+        with open(name, 'rb') as f:
+            data = f.read()
+        events.append((None, 'file {}'.format(name)))
+        for rtype, time_ms, payload in records(data, args.block):
+            if rtype == EVENT:
+                text = payload.decode('utf-8', 'replace')
+                events.append((time_ms, text))
+                m = re.match(r'reply_info rate=(\d+) bits=\d+ ch=(\d+)', text)
+                if m:
+                    reply_fmt = (int(m.group(1)), int(m.group(2)))
+                    replies.setdefault(reply_fmt, bytearray()).extend(pending)
+                    pending = bytearray()
+                elif text.startswith('reply '):
+                    if pending:
+                        replies.setdefault(REPLY_DEFAULT,
+                                           bytearray()).extend(pending)
+                        pending = bytearray()
+                    reply_fmt = None
+                continue
+            # The mic delivers a chunk every 30 ms, a longer silence means
+            # the stream stopped or data was dropped
+            prev = last_ms[rtype]
+            if rtype == MIC and prev is not None and time_ms - prev > 100:
+                events.append((time_ms, 'mic gap {} ms'.format(
+                    time_ms - prev)))
+            last_ms[rtype] = time_ms
+            streams[rtype] += payload
+            if rtype == REPLY:
+                if reply_fmt is None:
+                    pending += payload
+                else:
+                    replies[reply_fmt] += payload
+    if pending:
+        replies.setdefault(REPLY_DEFAULT, bytearray()).extend(pending)
+
+    write_wav(os.path.join(args.out, 'mic.wav'), streams[MIC], 16000, 1)
+    with open(os.path.join(args.out, 'upload.wav'), 'wb') as f:
+        f.write(bytes(streams[UPLOAD]))
+    for (rate, ch), pcm in sorted(replies.items()):
+        name = 'reply_{}_{}.wav'.format(rate, ch)
+        write_wav(os.path.join(args.out, name), pcm, rate, ch)
+        print('  {} {} bytes'.format(name, len(pcm)))
+    with open(os.path.join(args.out, 'events.txt'), 'w') as f:
+        for time_ms, text in events:
+            f.write('{:>10} {}\n'.format('' if time_ms is None else time_ms,
+                                         text))
+    for t, name in sorted(STREAMS.items()):
+        print('  {:<7} {} bytes'.format(name, len(streams[t])))
+    print('{} events, written to {}'.format(len(events), args.out))
+
+
+if __name__ == '__main__':
+    main()
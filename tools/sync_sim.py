@@ -0,0 +1,311 @@
+#!/usr/bin/env python
+# Simulated speakers for group playback (CONFIG_SYNC_ENABLE, see
+# main/m_sync.h and main/m_sync_play.h) against a running server.py.
+#
+# Every device runs the firmware's clock task and playback stage, built
+# for the host into tools/host/build/libsync_sim.so (make -C tools/host),
+# one copy of the library each. Each device has its own clock offset and
+# drift, set in the library's clock, and its clock samples see random
+# one-way network delays there. The devices connect to the control
+# channel and play a group reply through a model of the output ringbuffer
+# and the DAC, which runs off the same crystal. The firmware's reports go
+# out over the control channel, so server.py prints the group as the
+# devices see it.
+#
+# Usage: python sync_sim.py [-n 4] [--ppm 40] [--jitter-ms 5] [--seconds 30]
+#   prints, once a second, the true skew (from the simulated DACs) next to
+#   the skew the devices report, and a summary per device at the end;
+#   the group push carries CTRL_TOKEN from the environment, as server.py
+#   requires
+import os, sys, time, random, socket, struct, base64, threading, argparse
+import ctypes, itertools, shutil, tempfile
+
+try:
+    from urllib.request import urlopen, Request
+except ImportError:
+    from urllib2 import urlopen, Request
+
+CTRL_HELLO, CTRL_HEARTBEAT, CTRL_ACK, CTRL_PLAY, CTRL_VOLUME, CTRL_PLAY_AT, \
+    CTRL_SYNC_REPORT = range(1, 8)
+WS_BINARY, WS_CLOSE, WS_PING, WS_PONG = 0x2, 0x8, 0x9, 0xA
+
+# main/m_sync.h
+SYNC_REPORT_FORMAT = '<HiIiII'
+
+# Streaming profile of the reply pipeline: 2048 byte buffers of 16 bit
+# stereo, an 8 KB ringbuffer and 3 DMA buffers of 300 frames
+RATE = 44100
+CHANNELS = 2
+FRAME = CHANNELS * 2
+BLOCK = 512
+RB_FRAMES = 2048
+DMA_BUF_LEN = 300
+DMA_FRAMES = 3 * DMA_BUF_LEN - DMA_BUF_LEN // 2
+
+LIB = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'host',
+                   'build', 'libsync_sim.so')
+POST = ctypes.CFUNCTYPE(None, ctypes.c_int, ctypes.c_void_p, ctypes.c_int)
+
+
+def load_libs(path, n):
+    # dlopen returns the same library for the same path, so each device
+    # loads its own copy
+    if not os.path.exists(path):
+        raise SystemExit('{} not found, run make -C tools/host'.format(path))
+    tmp = tempfile.mkdtemp(prefix='sync_sim')
+    libs = []
+    try:
+        for i in range(n):
+            copy = os.path.join(tmp, 'libsync_sim{}.so'.format(i))
+            shutil.copy(path, copy)
+            lib = ctypes.CDLL(copy)
+            lib.sync_sim_clock.argtypes = [ctypes.c_double, ctypes.c_int64,
+                                           ctypes.c_int]
+            lib.sync_sim_start.argtypes = [ctypes.c_char_p, ctypes.c_int,
+                                           ctypes.c_int, POST]
+            lib.sync_now.argtypes = [ctypes.POINTER(ctypes.c_int64)]
+            lib.sync_now.restype = ctypes.c_bool
+            lib.sync_sim_play_init.argtypes = [ctypes.c_int, ctypes.c_int]
+            lib.sync_sim_play_init.restype = ctypes.c_void_p
+            lib.sync_sim_play_start.argtypes = [ctypes.c_void_p,
+                                                ctypes.c_int64, ctypes.c_int,
+                                                ctypes.c_int, ctypes.c_int]
+            lib.sync_sim_play_step.argtypes = [ctypes.c_void_p, ctypes.c_int]
+            lib.sync_sim_play_stop.argtypes = [ctypes.c_void_p]
+            libs.append(lib)
+    finally:
+        # Loaded libraries stay mapped
+        shutil.rmtree(tmp)
+    return libs
+
+
+class Device(object):
+    def __init__(self, index, args, lib):
+        self.index = index
+        self.args = args
+        self.lib = lib
+        self.name = 'sim{}'.format(index)
+        self.ppm = random.uniform(-args.ppm, args.ppm)
+        lib.sync_sim_clock(self.ppm, random.randint(10 ** 6, 10 ** 9),
+                           int(args.jitter_ms * 1000))
+        self.el = lib.sync_sim_play_init(DMA_FRAMES, 0)
+        if not self.el:
+            raise SystemExit('{}: no playback stage'.format(self.name))
+        self.lock = threading.Lock()
+        self.playing = False
+        self.report = None
+        self.true_error = None
+        self.errors = []
+
+    # sync_now() of the firmware
+    def sync_now(self):
+        shared = ctypes.c_int64()
+        valid = self.lib.sync_now(ctypes.byref(shared))
+        return valid, shared.value
+
+    def sync_start(self):
+        # Kept, the library calls it from its clock task
+        self.post = POST(self.on_post)
+        if self.lib.sync_sim_start(self.args.host.encode(),
+                                   self.args.sync_port, self.args.period,
+                                   self.post) != 0:
+            raise SystemExit('{}: clock task not started'.format(self.name))
+
+    # ctrl_post() of the firmware, which only sends reports
+    def on_post(self, msg_type, payload, length):
+        data = ctypes.string_at(payload, length)
+        if msg_type == CTRL_SYNC_REPORT:
+            with self.lock:
+                self.report = struct.unpack(SYNC_REPORT_FORMAT, data)
+        try:
+            self.ctrl_send(msg_type, next(self.seq) & 0xff, data)
+        except socket.error:
+            pass
+
+    # Control channel, the device side of main/m_ctrl.c
+    def ws_connect(self):
+        self.sock = socket.create_connection((self.args.host, self.args.port))
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.sock.sendall((
+            'GET /ai/ctrl HTTP/1.1\r\nHost: {}:{}\r\nUpgrade: websocket\r\n'
+            'Connection: Upgrade\r\nSec-WebSocket-Key: {}\r\n'
+            'Sec-WebSocket-Version: 13\r\n\r\n').format(
+                self.args.host, self.args.port, key).encode())
+        self.rx = b''
+        while b'\r\n\r\n' not in self.rx:
+            data = self.sock.recv(1024)
+            if not data:
+                raise SystemExit('{}: no upgrade response'.format(self.name))
+            self.rx += data
+        head, self.rx = self.rx.split(b'\r\n\r\n', 1)
+        if b' 101 ' not in head.split(b'\r\n')[0]:
+            raise SystemExit('{}: {}'.format(self.name, head.split(b'\r\n')[0]))
+        self.ws_lock = threading.Lock()
+        self.seq = itertools.count(1)
+
+    def ws_recv(self, n):
+        while len(self.rx) < n:
+            data = self.sock.recv(4096)
+            if not data:
+                raise EOFError
+            self.rx += data
+        data, self.rx = self.rx[:n], self.rx[n:]
+        return bytearray(data)
+
+    def ws_send(self, opcode, payload):
+        mask = bytearray(os.urandom(4))
+        data = bytearray(payload)
+        for i in range(len(data)):
+            data[i] ^= mask[i % 4]
+        with self.ws_lock:
+            self.sock.sendall(bytes(bytearray([0x80 | opcode,
+                                               0x80 | len(data)]) +
+                                    mask + data))
+
+    def ctrl_send(self, msg_type, seq, payload):
+        self.ws_send(WS_BINARY, struct.pack('BB', msg_type, seq) + payload)
+
+    def ctrl_task(self):
+        mac = bytearray([0x02, 0x00, 0x00, 0x00, 0x00, self.index])
+        self.ctrl_send(CTRL_HELLO, 0, bytes(mac))
+        while True:
+            b0, b1 = self.ws_recv(2)
+            length = b1 & 0x7f
+            if length == 126:
+                length, = struct.unpack('>H', bytes(self.ws_recv(2)))
+            data = self.ws_recv(length)
+            if b0 & 0x0f == WS_PING:
+                self.ws_send(WS_PONG, bytes(data))
+            if b0 & 0x0f != WS_BINARY or len(data) < 2:
+                continue
+            msg_type, seq = data[0], data[1]
+            if msg_type == CTRL_HEARTBEAT:
+                continue
+            if msg_type != CTRL_PLAY_AT or len(data) <= 12:
+                self.ctrl_send(CTRL_ACK, seq, b'\x02')
+                continue
+            start, group = struct.unpack('<QH', bytes(data[2:12]))
+            self.ctrl_send(CTRL_ACK, seq, b'\x00')
+            t = threading.Thread(target=self.play, args=(start, group))
+            t.daemon = True
+            t.start()
+
+    # self.fill is everything ahead of the DAC, which plays at the rate of
+    # this device's crystal. The I2S DMA ring keeps cycling, zeros when the
+    # ringbuffer runs dry, and holds 2 to 3 buffers. The stage sees the
+    # ringbuffer exactly and the ring as its average, DMA_FRAMES.
+    def dma(self):
+        return 3 * DMA_BUF_LEN - self.played % DMA_BUF_LEN
+
+    def drain(self):
+        now = time.time()
+        frames = (now - self.last) * RATE * (1 + self.ppm * 1e-6)
+        self.played += frames
+        self.fill = max(self.dma(), self.fill - frames)
+        self.last = now
+
+    def play(self, start, group):
+        # Fetch and decode until the first frames
+        time.sleep(random.uniform(0.1, 0.6))
+        self.played, self.last = random.uniform(0, DMA_BUF_LEN), time.time()
+        self.fill = self.dma()
+        self.pos = 0
+        if self.lib.sync_sim_play_start(self.el, start, group, RATE,
+                                        CHANNELS) != 0:
+            raise SystemExit('{}: playback stage not opened'.format(self.name))
+        self.playing = True
+        content = self.args.seconds * RATE
+        while self.pos < content:
+            self.drain()
+            if self.fill - self.dma() + BLOCK > RB_FRAMES:
+                time.sleep(BLOCK / float(RATE) / 4)
+                continue
+            n = self.lib.sync_sim_play_step(
+                self.el, int(self.fill - self.dma()) * FRAME)
+            if n < 0:
+                raise SystemExit('{}: playback stage failed'.format(self.name))
+            # Every buffer is taken whole, frames skipped or not
+            self.pos += BLOCK
+            self.fill += n // FRAME
+            # Against the coordinator's clock, which is this host's
+            true_due = (time.time() * 1e6 - start) * RATE / 1e6
+            with self.lock:
+                self.true_error = (self.pos - self.fill - true_due) * 1e6 / RATE
+        self.lib.sync_sim_play_stop(self.el)
+        self.playing = False
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Group playback simulation')
+    parser.add_argument('-n', '--devices', type=int, default=4)
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8000)
+    parser.add_argument('--sync-port', type=int, default=8001)
+    parser.add_argument('--ppm', type=float, default=40,
+                        help='largest clock drift of a device')
+    parser.add_argument('--jitter-ms', type=float, default=5,
+                        help='largest one-way network delay')
+    parser.add_argument('--period', type=int, default=16,
+                        help='CONFIG_SYNC_PERIOD_S')
+    parser.add_argument('--seconds', type=int, default=30,
+                        help='length of the group reply')
+    parser.add_argument('--settle', type=int, default=5,
+                        help='seconds left out of the summary')
+    parser.add_argument('--lib', default=LIB,
+                        help='host build of the firmware code')
+    args = parser.parse_args()
+
+    libs = load_libs(args.lib, args.devices)
+    devices = [Device(i + 1, args, lib) for i, lib in enumerate(libs)]
+    for d in devices:
+        d.ws_connect()
+        t = threading.Thread(target=d.ctrl_task)
+        t.daemon = True
+        t.start()
+        d.sync_start()
+    while not all(d.sync_now()[0] for d in devices):
+        time.sleep(0.1)
+    # A second burst so the drift estimate has started
+    time.sleep(1)
+    url = 'http://{}:{}/ai/ctrl/group'.format(args.host, args.port)
+    req = Request(url, b'http://sim/group.mp3', {
+        'Authorization': 'Bearer ' + os.environ.get('CTRL_TOKEN', '')})
+    print(urlopen(req).read().decode().strip())
+
+    t0 = time.time()
+    skews = []
+    while time.time() - t0 < 1 or any(d.playing for d in devices):
+        time.sleep(1)
+        with_error = [d for d in devices if d.playing and
+                      d.true_error is not None and d.report]
+        if not with_error:
+            continue
+        true = [d.true_error for d in with_error]
+        reported = [d.report[1] for d in with_error]
+        elapsed = time.time() - t0
+        if elapsed >= args.settle:
+            skews.append(max(true) - min(true))
+            for d in with_error:
+                d.errors.append(d.true_error)
+        print('{:5.1f} s  true skew {:6.0f} us  reported {:6d} us  '
+              'true error {}'.format(
+                  elapsed, max(true) - min(true),
+                  max(reported) - min(reported),
+                  ' '.join('{:+.0f}'.format(e) for e in true)))
+
+    print('\ndevice  ppm     clock us  mean us  max us  +frames  -frames')
+    for d in devices:
+        if not d.errors:
+            continue
+        inserted, dropped = d.report[4:6]
+        clock = d.sync_now()[1] - time.time() * 1e6
+        print('{:6}  {:+6.1f}  {:+8.0f}  {:+7.0f}  {:6.0f}  {:7d}  {:7d}'.format(
+            d.name, d.ppm, clock, sum(d.errors) / len(d.errors),
+            max(abs(e) for e in d.errors), inserted, dropped))
+    if skews:
+        print('true skew after {} s: mean {:.0f} us, max {:.0f} us'.format(
+            args.settle, sum(skews) / len(skews), max(skews)))
+
+
+if __name__ == '__main__':
+    main()
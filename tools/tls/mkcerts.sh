@@ -0,0 +1,33 @@
+#!/bin/sh
+# Lab certificates for the TLS streams (CONFIG_TLS_ENABLE, see main/m_tls.h):
+# a new CA, written to main/certs/server_ca.pem for the firmware to embed,
+# and a server certificate for server.py signed by it. The CA key is
+# thrown away, rerun the script to change the host. The output is made on
+# every machine that builds with TLS and is not committed (.gitignore).
+#
+# Usage: sh tools/tls/mkcerts.sh [host]    (default 192.168.0.174)
+set -e
+HOST=${1:-192.168.0.174}
+DIR=$(cd "$(dirname "$0")" && pwd)
+CA_OUT="$DIR/../../main/certs/server_ca.pem"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 3650 -sha256 \
+    -subj "/CN=record_wav lab CA" -keyout "$TMP/ca_key.pem" -out "$TMP/ca.pem"
+# mbedTLS compares the host against the CN and DNS names, so an IP host
+# goes in as a DNS name too
+printf 'subjectAltName=DNS:%s,DNS:localhost,IP:127.0.0.1\n' "$HOST" > "$TMP/ext"
+case "$HOST" in
+    *[!0-9.]*) ;;
+    *) printf 'subjectAltName=DNS:%s,IP:%s,DNS:localhost,IP:127.0.0.1\n' \
+           "$HOST" "$HOST" > "$TMP/ext" ;;
+esac
+openssl req -newkey rsa:2048 -nodes -sha256 -subj "/CN=$HOST" \
+    -keyout "$DIR/server_key.pem" -out "$TMP/server.csr"
+openssl x509 -req -in "$TMP/server.csr" -CA "$TMP/ca.pem" \
+    -CAkey "$TMP/ca_key.pem" -CAcreateserial -days 3650 -sha256 \
+    -extfile "$TMP/ext" -out "$DIR/server_cert.pem"
+cp "$TMP/ca.pem" "$CA_OUT"
+echo "CA $CA_OUT"
+echo "server $DIR/server_cert.pem $DIR/server_key.pem for $HOST"
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+# TLS handshake benchmark for the upload and reply streams
+# (CONFIG_TLS_ENABLE, see main/m_tls.h): full handshakes against resumed
+# ones, measured against server.py's TLS port.
+#
+# Usage:
+#   python3 tls_bench.py host localhost:8443 -n 50
+#       handshakes from here, each followed by a HEAD of the reply, with
+#       TLS 1.2 like the device: -n without a session, then -n offering
+#       the session of the first, by session ID and by ticket
+#   python3 tls_bench.py device 192.168.0.120:8080 \
+#       --play https://192.168.0.174:8443/ai/tts/output.mp3 -o tls.json
+#       turns resumption off in server.py, pushes --plays playbacks over the
+#       control channel, turns it on and pushes as many again, then reads
+#       the device's handshake times from its metrics endpoint; pushes
+#       carry CTRL_TOKEN from the environment, as server.py requires
+#
+# Python 3 for the client session API. Exits non-zero when the server
+# did not resume or a resumed handshake is not faster than a full one.
+import os, sys, json, time, socket, ssl, argparse
+from urllib.request import urlopen, Request
+
+REPLY_PATH = '/ai/tts/output.mp3'
+
+
+def context(args, tickets):
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    ctx.load_verify_locations(args.ca)
+    if not tickets:
+        ctx.options |= ssl.OP_NO_TICKET
+    return ctx
+
+
+def connect(args, ctx, session):
+    host, port = args.server.rsplit(':', 1)
+    sock = socket.create_connection((host, int(port)), timeout=10)
+    # As on the device: the request must not wait for the ACK of Finished
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    start = time.perf_counter()
+    tls = ctx.wrap_socket(sock, server_hostname=args.name or host,
+                          session=session)
+    handshake = (time.perf_counter() - start) * 1000
+    start = time.perf_counter()
+    tls.sendall('HEAD {} HTTP/1.0\r\nHost: {}\r\n\r\n'.format(
+        args.path, host).encode('ascii'))
+    status = tls.recv(64).split(b' ', 2)[1]
+    request = (time.perf_counter() - start) * 1000
+    while tls.recv(4096):
+        pass
+    reused = tls.session_reused
+    session = tls.session
+    tls.unwrap().close()
+    if status != b'200':
+        raise SystemExit('HEAD {} answered {}'.format(args.path, status))
+    return handshake, request, reused, session
+
+
+def stats(values):
+    values = sorted(values)
+    if not values:
+        return {'count': 0}
+    return {'count': len(values),
+            'mean': round(sum(values) / len(values), 2),
+            'p50': round(values[len(values) // 2], 2),
+            'p90': round(values[int(len(values) * 0.9)], 2)}
+
+
+def run_host(args):
+    result = {}
+    for mode, tickets in (('session_id', False), ('ticket', True)):
+        ctx = context(args, tickets)
+        full, resumed, request = [], [], []
+        refused = 0
+        for i in range(args.n):
+            hs, req, _, session = connect(args, ctx, None)
+            full.append(hs)
+            request.append(req)
+        for i in range(args.n):
+            hs, req, reused, session = connect(args, ctx, session)
+            (resumed if reused else full).append(hs)
+            refused += not reused
+            request.append(req)
+        result[mode] = {'full_ms': stats(full), 'resumed_ms': stats(resumed),
+                        'refused': refused, 'request_ms': stats(request)}
+    return result, [(m, r['full_ms'], r['resumed_ms'], r['refused'])
+                    for m, r in result.items()]
+
+
+def scrape(device):
+    text = urlopen('http://{}/metrics'.format(device), timeout=10).read()
+    values = {}
+    for line in text.decode('utf-8').splitlines():
+        if line and not line.startswith('#'):
+            key, _, value = line.rpartition(' ')
+            values[key] = float(value)
+    return values
+
+
+def hist(a, b, name):
+    count = b.get(name + '_count', 0) - a.get(name + '_count', 0)
+    if not count:
+        return {'count': 0}
+    total = b[name + '_sum'] - a.get(name + '_sum', 0)
+    return {'count': int(count), 'mean': round(total / count, 2)}
+
+
+def post(args, path, body):
+    # server.py refuses control pushes without its CTRL_TOKEN
+    req = Request(args.control.rstrip('/') + path, data=body.encode('utf-8'),
+                  headers={'Authorization': 'Bearer ' +
+                           os.environ.get('CTRL_TOKEN', '')})
+    return urlopen(req, timeout=10).read().decode('utf-8')
+
+
+def plays(args):
+    for i in range(args.plays):
+        if 'seq' not in post(args, '/ai/ctrl/play', args.play):
+            raise SystemExit('play not pushed, is the device connected?')
+        time.sleep(args.gap)
+
+
+def run_device(args):
+    m0 = scrape(args.device)
+    post(args, '/ai/tls/resume', '0')
+    try:
+        plays(args)
+    finally:
+        post(args, '/ai/tls/resume', '1')
+    m1 = scrape(args.device)
+    plays(args)
+    m2 = scrape(args.device)
+    failures = int(m2.get('tls_handshake_failure_total', 0) -
+                   m0.get('tls_handshake_failure_total', 0))
+    result = {
+        'resume_off': {'full_ms': hist(m0, m1, 'tls_full_handshake_ms')},
+        'resume_on': {'full_ms': hist(m1, m2, 'tls_full_handshake_ms'),
+                      'resumed_ms': hist(m1, m2, 'tls_resumed_handshake_ms')},
+        'failures': failures,
+    }
+    on = result['resume_on']
+    # The first connection after the switch cannot resume a session from
+    # a throwaway context, every later one should
+    refused = max(0, on['full_ms']['count'] - 1)
+    return result, [('device', result['resume_off']['full_ms'],
+                     on['resumed_ms'], refused + failures)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='TLS handshake benchmark')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('host', help='handshakes from this machine')
+    p.add_argument('server', help='host:port of the TLS server')
+    p.add_argument('-n', type=int, default=20,
+                   help='handshakes of each kind')
+    p.add_argument('--ca', default='main/certs/server_ca.pem',
+                   help='lab CA from tools/tls/mkcerts.sh')
+    p.add_argument('--name', help='name to check the certificate against')
+    p.add_argument('--path', default=REPLY_PATH)
+    p.set_defaults(func=run_host)
+    kinds = [p]
+    p = sub.add_parser('device', help='handshakes of a device')
+    p.add_argument('device', help='host:port of the metrics endpoint')
+    p.add_argument('--control', default='http://localhost:8000',
+                   help='server.py as seen from here')
+    p.add_argument('--play', required=True,
+                   help='https MP3 URL on the tunnel\'s server, as seen '
+                        'from the device')
+    p.add_argument('--plays', type=int, default=5)
+    p.add_argument('--gap', type=float, default=15,
+                   help='seconds between plays, longer than one play')
+    p.set_defaults(func=run_device)
+    kinds.append(p)
+    for p in kinds:
+        p.add_argument('-o', '--output', help='write the JSON result here')
+    args = parser.parse_args()
+    if not hasattr(args, 'func'):
+        parser.error('host or device')
+    result, checks = args.func(args)
+
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    print(text)
+
+    failed = []
+    for name, full, resumed, refused in checks:
+        if refused:
+            failed.append('{}: {} handshakes not resumed'.format(name,
+                                                                 refused))
+        if not resumed.get('count'):
+            failed.append('{}: no resumed handshake'.format(name))
+        elif full.get('count') and resumed['mean'] >= full['mean']:
+            failed.append('{}: resumed {} ms, full {} ms'.format(
+                name, resumed['mean'], full['mean']))
+    for line in failed:
+        sys.stderr.write('regression {}\n'.format(line))
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
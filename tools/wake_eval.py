@@ -0,0 +1,250 @@
+#!/usr/bin/env python
+# Wake word evaluation: prepare a labelled corpus for the SD card and score
+# the WAKE_EVAL lines the device prints (CONFIG_WAKE_EVAL_ENABLE, see
+# main/m_wake_eval.h).
+#
+# Corpus list, one WAV per line, keyword spans in seconds (none for
+# negative audio):
+#   positives/a.wav, 1.20:1.95 7.40:8.10
+#   negatives/tv.wav,
+#
+# Usage:
+#   python wake_eval.py prepare corpus.csv ./card
+#       copy ./card/WAKEEVAL to the SD card root, keep ./card/labels.json
+#   python wake_eval.py report ./card/labels.json console.log -o report.json
+#   python wake_eval.py report ./card/labels.json console.log \
+#       --baseline last_release.json
+#
+# WakeNet and the resampler only exist as ESP32 libraries, so the device
+# runs the chain and this script only converts audio and does the scoring.
+import os, sys, json, wave, argparse
+
+try:
+    import audioop
+except ImportError:
+    audioop = None
+
+DEVICE_RATE = 48000  # I2S reader of the ASR pipeline
+MERGE_S = 1.0  # detections closer than this are one wake
+
+
+def read_corpus(path):
+    base = os.path.dirname(os.path.abspath(path))
+    items = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+            name, _, spans = line.partition(',')
+            keywords = []
+            for span in spans.split():
+                start, end = span.split(':')
+                keywords.append([float(start), float(end)])
+            items.append((os.path.join(base, name.strip()), keywords))
+    return items
+
+
+# Any WAV to what the I2S reader delivers: 16 bit, 48 kHz, stereo
+def to_device_pcm(path):
+    w = wave.open(path, 'rb')
+    ch, width, rate = w.getnchannels(), w.getsampwidth(), w.getframerate()
+    data = w.readframes(w.getnframes())
+    w.close()
+    if width != 2:
+        data = audioop.lin2lin(data, width, 2)
+    if ch == 2:
+        data = audioop.tomono(data, 2, 0.5, 0.5)
+    elif ch != 1:
+        raise SystemExit('{}: {} channels not supported'.format(path, ch))
+    if rate != DEVICE_RATE:
+        data, _ = audioop.ratecv(data, 2, 1, rate, DEVICE_RATE, None)
+    seconds = float(len(data)) / 2 / DEVICE_RATE
+    return audioop.tostereo(data, 2, 1, 1), seconds
+
+
+def prepare(args):
+    if audioop is None:
+        raise SystemExit('audioop missing, pip install audioop-lts')
+    out = os.path.join(args.out, 'WAKEEVAL')
+    if not os.path.isdir(out):
+        os.makedirs(out)
+    labels = {}
+    names = []
+    for i, (path, keywords) in enumerate(read_corpus(args.corpus)):
+        name = '{:04d}.PCM'.format(i)  # the card has no long file names
+        pcm, seconds = to_device_pcm(path)
+        with open(os.path.join(out, name), 'wb') as f:
+            f.write(pcm)
+        labels[name] = {'source': path, 'seconds': seconds,
+                        'keywords': keywords}
+        names.append(name)
+        print('  {} {} {:.1f} s, {} keywords'.format(name, path, seconds,
+                                                    len(keywords)))
+    with open(os.path.join(out, 'INDEX.TXT'), 'w') as f:
+        f.write('\n'.join(names) + '\n')
+    with open(os.path.join(args.out, 'labels.json'), 'w') as f:
+        json.dump(labels, f, indent=2, sort_keys=True)
+    print('{} files in {}'.format(len(names), out))
+
+
+def read_log(path):
+    records = []
+    with open(path) as f:
+        for line in f:
+            pos = line.find('WAKE_EVAL {')
+            if pos >= 0:
+                records.append(json.loads(line[pos + len('WAKE_EVAL '):]))
+    return records
+
+
+def merge(times):
+    out = []
+    for t in sorted(times):
+        if not out or t - out[-1] >= MERGE_S:
+            out.append(t)
+    return out
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+# A detection inside [start, end + tolerance] of an unmatched keyword is a
+# hit, its delay counts from the keyword end; anything else is a false accept
+def score_file(label, detections, tolerance):
+    hits, delays, false_accepts = 0, [], 0
+    matched = [False] * len(label['keywords'])
+    for t in detections:
+        for k, (start, end) in enumerate(label['keywords']):
+            if not matched[k] and start <= t <= end + tolerance:
+                matched[k] = True
+                hits += 1
+                delays.append((t - end) * 1000.0)
+                break
+        else:
+            false_accepts += 1
+    return hits, delays, false_accepts
+
+
+def score(labels, records, tolerance):
+    modes = {}
+    for r in records:
+        if r['type'] == 'mode':
+            modes[r['mode']] = {'info': r, 'files': []}
+        elif r['type'] == 'file':
+            modes[r['mode']]['files'].append(r)
+
+    report = {}
+    for mode, m in sorted(modes.items()):
+        info = m['info']
+        rate, chunk = info['sample_rate'], info['chunk']
+        seconds, keywords, hits, false_accepts = 0.0, 0, 0, 0
+        delays, frames, us_sum, us_max = [], 0, 0, 0
+        for f in m['files']:
+            label = labels[f['file']]
+            dets = merge(float(s) / rate for s in f['detections'])
+            h, d, fa = score_file(label, dets, tolerance)
+            seconds += float(f['samples']) / rate
+            keywords += len(label['keywords'])
+            hits += h
+            delays += d
+            false_accepts += fa
+            frames += f['frames']
+            us_sum += f['detect_us_sum']
+            us_max = max(us_max, f['detect_us_max'])
+        hours = seconds / 3600.0
+        us_mean = float(us_sum) / frames if frames else 0.0
+        frame_us = chunk * 1e6 / rate
+        report[mode] = {
+            'threshold': info['threshold'],
+            'files': len(m['files']),
+            'hours': round(hours, 4),
+            'keywords': keywords,
+            'false_accepts': false_accepts,
+            'far_per_hour': round(false_accepts / hours, 3) if hours else None,
+            'frr': round(1.0 - float(hits) / keywords, 4) if keywords else None,
+            'delay_ms_mean': round(sum(delays) / len(delays), 1)
+                             if delays else None,
+            'delay_ms_p90': round(percentile(delays, 90), 1)
+                            if delays else None,
+            'frame_us_mean': round(us_mean, 1),
+            'frame_us_max': us_max,
+            'frame_cycles_mean': int(us_mean * info['cpu_mhz']),
+            'cpu_load': round(us_mean / frame_us, 4),
+        }
+    return report
+
+
+# Worse than the baseline: FAR by more than far_tol per hour, FRR by more
+# than frr_tol, mean frame time by more than cost_tol
+def compare(report, baseline, args):
+    failed = []
+    for mode, b in sorted(baseline.items()):
+        r = report.get(mode)
+        if r is None:
+            failed.append('{}: missing'.format(mode))
+            continue
+        checks = [('far_per_hour', args.far_tol, False),
+                  ('frr', args.frr_tol, False),
+                  ('frame_us_mean', args.cost_tol, True)]
+        for key, tol, relative in checks:
+            if r[key] is None or b[key] is None:
+                continue
+            limit = b[key] * (1 + tol) if relative else b[key] + tol
+            if r[key] > limit:
+                failed.append('{}: {} {} -> {}'.format(mode, key, b[key],
+                                                       r[key]))
+    return failed
+
+
+def report(args):
+    with open(args.labels) as f:
+        labels = json.load(f)
+    result = score(labels, read_log(args.log), args.tolerance)
+    if not result:
+        raise SystemExit('no WAKE_EVAL lines in {}'.format(args.log))
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+    if args.baseline:
+        with open(args.baseline) as f:
+            failed = compare(result, json.load(f), args)
+        for line in failed:
+            sys.stderr.write('regression {}\n'.format(line))
+        if failed:
+            sys.exit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Wake word evaluation')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('prepare', help='convert a corpus for the SD card')
+    p.add_argument('corpus', help='corpus list with keyword spans')
+    p.add_argument('out', help='directory that receives WAKEEVAL/')
+    p.set_defaults(func=prepare)
+    p = sub.add_parser('report', help='score a device console log')
+    p.add_argument('labels', help='labels.json written by prepare')
+    p.add_argument('log', help='console log holding the WAKE_EVAL lines')
+    p.add_argument('-o', '--output', help='write the JSON report here')
+    p.add_argument('-t', '--tolerance', type=float, default=1.0,
+                   help='seconds after a keyword a detection still counts')
+    p.add_argument('--baseline', help='report to compare against')
+    p.add_argument('--far-tol', type=float, default=0.5)
+    p.add_argument('--frr-tol', type=float, default=0.02)
+    p.add_argument('--cost-tol', type=float, default=0.10)
+    p.set_defaults(func=report)
+    args = parser.parse_args()
+    if not hasattr(args, 'func'):
+        parser.error('prepare or report')
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()